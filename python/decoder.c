@@ -39,12 +39,13 @@ Decoder_dealloc(Decoder *self)
 
 /* Decoder handlers */
 
-static void
+static lwpb_decoder_action_t
 msg_start_handler(
   struct lwpb_decoder *decoder,
   const struct lwpb_msg_desc *msg_desc,
   void *arg)
 {
+  return LWPB_DECODER_CONTINUE;
 }
 
 static void
@@ -59,13 +60,11 @@ msg_end_handler(
 
   /* Leaving a nested message, pop the top off the context stack. */
 
-  if (!decoder->packed) {
-    Py_ssize_t stacklen = PyList_Size(context->stack);
-    PyList_SetSlice(context->stack, stacklen-1, stacklen, NULL);
-  }
+  Py_ssize_t stacklen = PyList_Size(context->stack);
+  PyList_SetSlice(context->stack, stacklen-1, stacklen, NULL);
 }
 
-void
+lwpb_decoder_action_t
 field_handler(
   struct lwpb_decoder *decoder,
   const struct lwpb_msg_desc *msg_desc,
@@ -73,7 +72,7 @@ field_handler(
   union lwpb_value *value,
   void *arg)
 {
-  if (!arg) return;
+  if (!arg) return LWPB_DECODER_CONTINUE;
 
   DecoderContext* context = (DecoderContext*)arg;
 
@@ -103,7 +102,9 @@ field_handler(
     }
   }
 
-  if (pyval == NULL) return;
+  /* Stop decoding if the conversion raised an exception. */
+
+  if (pyval == NULL) return LWPB_DECODER_STOP;
 
   /* If this is a REPEATED field, always append to a list under the key. */
   /* If this is not REPEATED, store under key, overwriting any old value. */
@@ -130,6 +131,8 @@ field_handler(
     PyList_Append(context->stack, pyval);
 
   Py_DECREF(pyval);
+
+  return LWPB_DECODER_CONTINUE;
 }
 
 static PyObject *
@@ -173,6 +176,7 @@ Decoder_decode(Decoder *self, PyObject *args)
 
   /* On success, return the target dict object.
      On partial message error, return None.
+     On a failed value conversion, raise the conversion's exception.
      On any other error, throw an exception with the error code. */
 
   if (ret == LWPB_ERR_OK)
@@ -184,6 +188,10 @@ Decoder_decode(Decoder *self, PyObject *args)
     Py_INCREF(Py_None);
     return Py_None;
   }
+  else if (ret == LWPB_ERR_CANCEL && PyErr_Occurred()) {
+    /* A handler stopped decoding on a failed conversion, keep its exception. */
+    return NULL;
+  }
   else {
     // TODO define specific exception classes
     PyErr_Format(PyExc_RuntimeError, "decode error: %d", ret);
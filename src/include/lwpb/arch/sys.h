@@ -25,9 +25,11 @@
 #include <string.h>
 
 #define LWPB_MALLOC(size) malloc(size)
+#define LWPB_REALLOC(ptr, size) realloc(ptr, size)
 #define LWPB_FREE(ptr) free(ptr)
 #define LWPB_MEMCPY(dest, src, n) memcpy(dest, src, n)
 #define LWPB_MEMMOVE(dest, src, n) memmove(dest, src, n)
+#define LWPB_MEMSET(s, c, n) memset(s, c, n)
 #define LWPB_STRLEN(s) strlen(s)
 
 #define LWPB_DIAG_PRINTF(fmt, args...) printf(fmt, ##args)
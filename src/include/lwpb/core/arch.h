@@ -37,6 +37,14 @@
     } while (0)
 #endif
 
+#ifndef LWPB_REALLOC
+#define LWPB_REALLOC(ptr, size)                                             \
+    do {                                                                    \
+        LWPB_DIAG_PRINTF("No LWPB_REALLOC() implementation\n");             \
+        LWPB_ABORT();                                                       \
+    } while (0)
+#endif
+
 #ifndef LWPB_FREE
 #define LWPB_FREE(ptr)                                                      \
     do {                                                                    \
@@ -55,6 +63,11 @@ extern void *__lwpb_memmove(void *, const void *, size_t);
 #define LWPB_MEMMOVE(dest, src, n) __lwpb_memmove(dest, src, n)
 #endif
 
+#ifndef LWPB_MEMSET
+extern void *__lwpb_memset(void *, int, size_t);
+#define LWPB_MEMSET(s, c, n) __lwpb_memset(s, c, n)
+#endif
+
 #ifndef LWPB_MEMCMP
 extern int __lwpb_memcmp(const void *, const void *, size_t);
 #define LWPB_MEMCMP(s1, s2, n) __lwpb_memcmp(s1, s2, n)
@@ -26,13 +26,23 @@
 /* Forward declaration */
 struct lwpb_decoder;
 
+/** Actions returned by the decoder handlers */
+typedef enum {
+    LWPB_DECODER_CONTINUE,      /**< Continue decoding */
+    LWPB_DECODER_SKIP,          /**< Skip submessage or rest of message */
+    LWPB_DECODER_STOP,          /**< Stop decoding */
+} lwpb_decoder_action_t;
+
 /**
  * This handler is called when the decoder encountered a new message.
+ * Returning LWPB_DECODER_SKIP skips all fields of the message, returning
+ * LWPB_DECODER_STOP stops decoding.
  * @param decoder Decoder
  * @param msg_desc Message descriptor
  * @param arg User argument
+ * @return Returns the action the decoder should take.
  */
-typedef void (*lwpb_decoder_msg_start_handler_t)
+typedef lwpb_decoder_action_t (*lwpb_decoder_msg_start_handler_t)
     (struct lwpb_decoder *decoder,
      const struct lwpb_msg_desc *msg_desc, void *arg);
 
@@ -47,14 +57,20 @@ typedef void (*lwpb_decoder_msg_end_handler_t)
      const struct lwpb_msg_desc *msg_desc, void *arg);
 
 /**
- * This handler is called when the decoder has decoded a field.
+ * This handler is called when the decoder has decoded a field. For message
+ * fields, the handler is called with value set to NULL before the submessage
+ * is decoded, and returning LWPB_DECODER_SKIP skips the submessage without
+ * decoding it. For other fields, returning LWPB_DECODER_SKIP skips the
+ * remaining fields of the current message. Returning LWPB_DECODER_STOP stops
+ * decoding.
  * @param decoder Decoder
  * @param msg_desc Message descriptor of the message containing the field
  * @param field_desc Field descriptor
  * @param value Field value
  * @param arg User argument
+ * @return Returns the action the decoder should take.
  */
-typedef void (*lwpb_decoder_field_handler_t)
+typedef lwpb_decoder_action_t (*lwpb_decoder_field_handler_t)
     (struct lwpb_decoder *decoder,
      const struct lwpb_msg_desc *msg_desc,
      const struct lwpb_field_desc *field_desc,
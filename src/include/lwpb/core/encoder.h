@@ -22,6 +22,18 @@
 
 #include <lwpb/lwpb.h>
 
+/**
+ * This handler is called when the encoder runs out of buffer space. It
+ * returns a larger buffer holding the contents of the current one.
+ * @param data Current buffer
+ * @param len Size of the current buffer, returns the size of the new buffer
+ * @param need Minimum size of the new buffer
+ * @param arg User argument
+ * @return Returns the new buffer or NULL if the buffer cannot grow.
+ */
+typedef void *(*lwpb_encoder_grow_handler_t)(void *data, size_t *len,
+                                             size_t need, void *arg);
+
 /** Encoder stack frame */
 struct lwpb_encoder_stack_frame {
     struct lwpb_buf buf;
@@ -34,16 +46,24 @@ struct lwpb_encoder {
     struct lwpb_encoder_stack_frame stack[LWPB_MAX_DEPTH];
     int depth;
     lwpb_bool_t packed;
+    lwpb_encoder_grow_handler_t grow_handler;
+    void *grow_arg;
 };
 
 void lwpb_encoder_init(struct lwpb_encoder *encoder);
 
+void lwpb_encoder_grow_handler(struct lwpb_encoder *encoder,
+                               lwpb_encoder_grow_handler_t grow_handler,
+                               void *arg);
+
 void lwpb_encoder_start(struct lwpb_encoder *encoder,
                         const struct lwpb_msg_desc *msg_desc,
                         void *data, size_t len);
 
 size_t lwpb_encoder_finish(struct lwpb_encoder *encoder);
 
+void *lwpb_encoder_data(struct lwpb_encoder *encoder);
+
 lwpb_err_t lwpb_encoder_nested_start(struct lwpb_encoder *encoder,
                                      const struct lwpb_field_desc *field_desc);
 
@@ -0,0 +1,57 @@
+/** @file reader.h
+ * 
+ * Lightweight protocol buffers pull reader interface.
+ * 
+ * Copyright 2009 Simon Kallweit
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *     
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __LWPB_CORE_READER_H__
+#define __LWPB_CORE_READER_H__
+
+#include <lwpb/lwpb.h>
+
+
+/** Reader stack frame */
+struct lwpb_reader_stack_frame {
+    struct lwpb_buf buf;
+    const struct lwpb_msg_desc *msg_desc;
+    int field_hint;             /**< Index to start the next field lookup */
+};
+
+/**
+ * Protocol buffer pull reader. In contrast to the decoder, the reader does
+ * not use callbacks but returns one field at a time.
+ */
+struct lwpb_reader {
+    struct lwpb_reader_stack_frame stack[LWPB_MAX_DEPTH];
+    int depth;
+    const struct lwpb_field_desc *field_desc; /**< Last returned field */
+    struct lwpb_buf msg;        /**< Last returned message field */
+    struct lwpb_buf packed;     /**< Remaining packed repeated values */
+};
+
+void lwpb_reader_init(struct lwpb_reader *reader,
+                      const struct lwpb_msg_desc *msg_desc,
+                      void *data, size_t len);
+
+lwpb_err_t lwpb_reader_next(struct lwpb_reader *reader,
+                            const struct lwpb_field_desc **field_desc,
+                            union lwpb_value *value);
+
+lwpb_err_t lwpb_reader_enter(struct lwpb_reader *reader);
+
+void lwpb_reader_skip(struct lwpb_reader *reader);
+
+#endif // __LWPB_CORE_READER_H__
@@ -68,6 +68,7 @@ typedef enum {
     LWPB_ERR_MEM,               /**< Memory allocation failed */
     // Socket service error codes
     LWPB_ERR_NET_INIT,          /**< Network initialization failed */
+    LWPB_ERR_BUSY,              /**< Resource busy, try again later */
 } lwpb_err_t;
 
 /* Field labels */
@@ -195,6 +196,9 @@ typedef enum {
     LWPB_RPC_OK,                /**< Call was successfully processed on the server */
     LWPB_RPC_NOT_CONNECTED,     /**< Not connected to the server */
     LWPB_RPC_FAILED,            /**< Call failed to execute on the server */
+    LWPB_RPC_OVERLOADED,        /**< Server rejected the call due to overload */
+    LWPB_RPC_TIMEOUT,           /**< Call did not complete before its deadline */
+    LWPB_RPC_CANCELLED,         /**< Call was cancelled by the client */
 } lwpb_rpc_result_t;
 
 /** Simple memory buffer */
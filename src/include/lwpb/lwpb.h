@@ -130,10 +130,12 @@
  *     } info;
  * }
  * 
- * void msg_start_handler(struct lwpb_decoder *decoder,
- *                        const struct lwpb_msg_desc *msg_desc, void *arg)
+ * lwpb_decoder_action_t msg_start_handler(struct lwpb_decoder *decoder,
+ *                                         const struct lwpb_msg_desc *msg_desc,
+ *                                         void *arg)
  * {
  *     // We don't use the message start handler
+ *     return LWPB_DECODER_CONTINUE;
  * }
  * 
  * void msg_end_handler(struct lwpb_decoder *decoder,
@@ -142,10 +144,10 @@
  *     // We don't use the message end handler
  * }
  * 
- * void field_handler(struct lwpb_decoder *decoder,
- *                    const struct lwpb_msg_desc *msg_desc,
- *                    const struct lwpb_field_desc *field_desc,
- *                    union lwpb_value *value, void *arg)
+ * lwpb_decoder_action_t field_handler(struct lwpb_decoder *decoder,
+ *                                     const struct lwpb_msg_desc *msg_desc,
+ *                                     const struct lwpb_field_desc *field_desc,
+ *                                     union lwpb_value *value, void *arg)
  * {
  *     struct TestMessage *msg = arg;
  *     
@@ -159,6 +161,10 @@
  *         if (field_desc == test_Info_msg)
  *             strncpy(msg->info.msg, sizeof(msg->info.msg), value->string.str);
  *     }
+ *     
+ *     // Return LWPB_DECODER_SKIP to skip a submessage or LWPB_DECODER_STOP
+ *     // to stop decoding once all required fields are found
+ *     return LWPB_DECODER_CONTINUE;
  * }
  * 
  * void decode_example(void)
@@ -198,12 +204,15 @@
 #include <lwpb/core/debug.h>
 #include <lwpb/core/types.h>
 #include <lwpb/core/decoder.h>
+#include <lwpb/core/reader.h>
 #include <lwpb/core/encoder.h>
 #include <lwpb/core/misc.h>
 #include <lwpb/rpc/transport.h>
 #include <lwpb/rpc/client.h>
 #include <lwpb/rpc/server.h>
-#include <lwpb/utils/struct_decoder.h>
+#include <lwpb/utils/arena.h>
 #include <lwpb/utils/struct_map.h>
+#include <lwpb/utils/struct_decoder.h>
+#include <lwpb/utils/column_decoder.h>
 
 #endif // __LWPB_H__
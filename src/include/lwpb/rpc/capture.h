@@ -0,0 +1,111 @@
+/** @file capture.h
+ * 
+ * Capture and replay of the frames received by a socket server.
+ * 
+ * Copyright 2009 Simon Kallweit
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __LWPB_RPC_CAPTURE_H__
+#define __LWPB_RPC_CAPTURE_H__
+
+#include <stdio.h>
+
+#include <lwpb/lwpb.h>
+#include <lwpb/rpc/stats.h>
+
+
+/** Magic of capture files ("LWPC") */
+#define LWPB_CAPTURE_MAGIC 0x4c575043
+
+/** Version of the capture file format */
+#define LWPB_CAPTURE_VERSION 1
+
+/** Time the replay waits for outstanding responses after the last frame (ms) */
+#define LWPB_REPLAY_DRAIN_TIMEOUT 1000
+
+/** Maximum number of frames the replay sends before it reads responses */
+#define LWPB_REPLAY_BURST 64
+
+/** Header of a capture file (network byte order) */
+struct lwpb_capture_file_header {
+    u32_t magic;
+    u32_t version;
+};
+
+/**
+ * Header of a captured frame (network byte order), followed by the frame
+ * as received (pre-header, header and message).
+ */
+struct lwpb_capture_record_header {
+    u32_t conn;                 /**< Serial number of the connection */
+    u32_t time_sec;             /**< Arrival time since the capture started */
+    u32_t time_nsec;
+    u32_t len;                  /**< Length of the frame */
+};
+
+/** A captured frame */
+struct lwpb_capture_record {
+    u32_t conn;                 /**< Serial number of the connection */
+    u64_t time;                 /**< Arrival time since the capture started (ns) */
+    void *frame;                /**< Frame, valid until the next record is read */
+    size_t len;                 /**< Length of the frame */
+};
+
+/**
+ * Capture file, either written by a socket server or read by the replay.
+ * A capture is written by a single server thread, shards of a server group
+ * need a capture each.
+ */
+struct lwpb_capture {
+    FILE *file;
+    u64_t start;                /**< Time the capture started (ns) */
+    u64_t frames;               /**< Number of frames written or read */
+    u64_t bytes;                /**< Number of frame bytes written or read */
+    u8_t *buf;                  /**< Frame of the last record read */
+    size_t size;                /**< Allocated size of the frame buffer */
+};
+
+/** Results of a replay */
+struct lwpb_replay_result {
+    int conns;                  /**< Number of connections opened */
+    u64_t frames;               /**< Number of frames sent */
+    u64_t bytes;                /**< Number of frame bytes sent */
+    u64_t requests;             /**< Number of requests sent */
+    u64_t responses;            /**< Number of requests answered */
+    u64_t errors;               /**< Number of requests answered with an error */
+    u64_t cancelled;            /**< Number of requests cancelled by the client */
+    u64_t messages;             /**< Number of streamed messages received */
+    u64_t lost;                 /**< Number of requests never answered */
+    u64_t duration;             /**< Time from the first frame to the last response (ns) */
+    struct lwpb_histogram latency; /**< Time from sending a request to its response (ns) */
+};
+
+lwpb_err_t lwpb_capture_create(struct lwpb_capture *capture, const char *path);
+
+lwpb_err_t lwpb_capture_open(struct lwpb_capture *capture, const char *path);
+
+void lwpb_capture_close(struct lwpb_capture *capture);
+
+lwpb_err_t lwpb_capture_write(struct lwpb_capture *capture, u32_t conn,
+                              const void *frame, size_t len);
+
+lwpb_err_t lwpb_capture_read(struct lwpb_capture *capture,
+                             struct lwpb_capture_record *record);
+
+lwpb_err_t lwpb_replay_run(struct lwpb_capture *capture, const char *host,
+                           u16_t port, double speed,
+                           struct lwpb_replay_result *result);
+
+#endif // __LWPB_RPC_CAPTURE_H__
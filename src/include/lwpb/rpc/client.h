@@ -68,6 +68,21 @@ typedef void (*lwpb_client_done_handler_t)
      lwpb_rpc_result_t result, void *arg);
 
 
+/**
+ * Context of a single RPC call. Each asynchronous call has its own context
+ * with its own handlers and user argument, so any number of calls can be in
+ * flight on one client. The context must stay valid until the call is done.
+ */
+struct lwpb_client_call {
+    lwpb_client_request_handler_t request_handler;
+    lwpb_client_response_handler_t response_handler;
+    lwpb_client_done_handler_t done_handler; /**< Optional */
+    void *arg;                  /**< User argument passed to the handlers */
+    u32_t timeout;              /**< Timeout (ms), 0 for the client default */
+    lwpb_rpc_result_t result;   /**< Result code, valid when done */
+    int done;                   /**< Set when the call is done */
+};
+
 /** Protocol buffer RPC client */
 struct lwpb_client {
     lwpb_transport_t transport;
@@ -75,6 +90,8 @@ struct lwpb_client {
     lwpb_client_request_handler_t request_handler;
     lwpb_client_response_handler_t response_handler;
     lwpb_client_done_handler_t done_handler;
+    u32_t timeout;              /**< Default call timeout (ms), 0 = none */
+    struct lwpb_client_call call; /**< Context of calls using the client handlers */
 };
 
 void lwpb_client_init(struct lwpb_client *client, lwpb_transport_t transport);
@@ -91,4 +108,36 @@ lwpb_err_t lwpb_client_call(struct lwpb_client *client,
 
 void lwpb_client_cancel(struct lwpb_client *client);
 
+void lwpb_client_timeout(struct lwpb_client *client, u32_t timeout);
+
+void lwpb_client_batch_begin(struct lwpb_client *client);
+
+void lwpb_client_batch_end(struct lwpb_client *client);
+
+void lwpb_client_call_init(struct lwpb_client_call *call,
+                           lwpb_client_request_handler_t request_handler,
+                           lwpb_client_response_handler_t response_handler,
+                           lwpb_client_done_handler_t done_handler,
+                           void *arg);
+
+void lwpb_client_call_timeout(struct lwpb_client_call *call, u32_t timeout);
+
+lwpb_err_t lwpb_client_call_async(struct lwpb_client *client,
+                                  const struct lwpb_method_desc *method_desc,
+                                  struct lwpb_client_call *call);
+
+void lwpb_client_call_cancel(struct lwpb_client *client,
+                             struct lwpb_client_call *call);
+
+u32_t lwpb_client_get_timeout(struct lwpb_client *client,
+                              struct lwpb_client_call *call);
+
+lwpb_rpc_result_t lwpb_client_wait(struct lwpb_client *client,
+                                   struct lwpb_client_call *call);
+
+void lwpb_client_call_done(struct lwpb_client *client,
+                           const struct lwpb_method_desc *method_desc,
+                           struct lwpb_client_call *call,
+                           lwpb_rpc_result_t result);
+
 #endif // __LWPB_RPC_CLIENT_H__
@@ -23,13 +23,47 @@
 #include <lwpb/lwpb.h>
 
 
-/** Direct RPC transport implementation */
+/** Maximum number of servers registered with a direct transport */
+#define LWPB_TRANSPORT_DIRECT_SERVERS 8
+
+/** Number of nesting levels with scratch buffers kept by the transport */
+#define LWPB_TRANSPORT_DIRECT_DEPTH 4
+
+/** Request and response buffers of one nesting level of calls */
+struct lwpb_direct_scratch {
+    void *req_buf;
+    size_t req_len;
+    void *res_buf;
+    size_t res_len;
+};
+
+/**
+ * Direct RPC transport implementation. Calls of any number of clients are
+ * passed to the server providing the called service in the same thread.
+ * 
+ * The request and response buffers are allocated on the first call and
+ * reused afterwards. Call handlers may call other services through the same
+ * transport, each nesting level has its own buffers. As the buffers are
+ * shared by all clients, a direct transport must only be used from one
+ * thread.
+ */
 struct lwpb_transport_direct {
     struct lwpb_transport super;
-    struct lwpb_client *client;
-    struct lwpb_server *server;
+    struct lwpb_server *servers[LWPB_TRANSPORT_DIRECT_SERVERS];
+    int num_servers;
+    const struct lwpb_service_desc *last_service; /**< Last routed service */
+    struct lwpb_server *last_server; /**< Server of last routed service */
+    struct lwpb_direct_scratch scratch[LWPB_TRANSPORT_DIRECT_DEPTH];
+    int depth;                  /**< Nesting level of the current call */
 };
 
 lwpb_transport_t lwpb_transport_direct_init(struct lwpb_transport_direct *transport_direct);
 
+void lwpb_transport_direct_free(lwpb_transport_t transport);
+
+lwpb_rpc_result_t lwpb_transport_direct_invoke(lwpb_transport_t transport,
+                                               const struct lwpb_method_desc *method_desc,
+                                               void *req_buf, size_t req_len,
+                                               void *res_buf, size_t *res_len);
+
 #endif // __LWPB_RPC_DIRECT_H__
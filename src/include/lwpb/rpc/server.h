@@ -23,8 +23,10 @@
 #include <lwpb/lwpb.h>
 
 
-/* Forward declaration */
+/* Forward declarations */
 struct lwpb_server;
+struct lwpb_server_writer;
+struct lwpb_stats;
 
 /**
  * This handler is called when the server needs to process an RPC call.
@@ -45,12 +47,106 @@ typedef lwpb_err_t (*lwpb_server_call_handler_t)
      const struct lwpb_msg_desc *res_desc, void *res_buf, size_t *res_len,
      void *arg);
 
+/**
+ * This handler is called instead of the call handler when the server needs
+ * to process an RPC call and an encode handler is set. The handler encodes
+ * the response message with the given encoder, which is started on the
+ * response message and grows its buffer on demand, so responses don't need
+ * to fit a transport buffer. Responses still have to fit the maximum frame
+ * size of the transport.
+ * @param server Server
+ * @param method_desc Method descriptor
+ * @param req_desc Request message descriptor
+ * @param req_buf Request message buffer
+ * @param req_len Length of request message buffer
+ * @param encoder Encoder of the response message
+ * @param arg User argument
+ * @return Return LWPB_ERR_OK when message was successfully encoded.
+ */
+typedef lwpb_err_t (*lwpb_server_encode_handler_t)
+    (struct lwpb_server *server, const struct lwpb_method_desc *method_desc,
+     const struct lwpb_msg_desc *req_desc, void *req_buf, size_t req_len,
+     struct lwpb_encoder *encoder, void *arg);
+
+/**
+ * This handler is called when the server needs to process a server streaming
+ * RPC call. The handler encodes each response message into the buffer of the
+ * writer and passes it to lwpb_server_writer_write(). When the transport
+ * wants to flush the messages written so far, lwpb_server_writer_write()
+ * returns LWPB_ERR_BUSY and the handler returns LWPB_ERR_BUSY as well. It is
+ * called again with the same writer once the transport is ready for more
+ * messages, so the handler keeps its position in writer->state. When the
+ * call is cancelled, lwpb_server_writer_write() returns LWPB_ERR_CANCEL or the
+ * handler is entered with writer->cancelled set, and the handler releases
+ * its state and returns.
+ * @param server Server
+ * @param method_desc Method descriptor
+ * @param req_desc Request message descriptor
+ * @param req_buf Request message buffer
+ * @param req_len Length of request message buffer
+ * @param res_desc Response message descriptor
+ * @param writer Writer of the response messages
+ * @param arg User argument
+ * @return Return LWPB_ERR_OK when all messages were written, LWPB_ERR_BUSY
+ * to be called again later, or any other error to fail the call.
+ */
+typedef lwpb_err_t (*lwpb_server_stream_handler_t)
+    (struct lwpb_server *server, const struct lwpb_method_desc *method_desc,
+     const struct lwpb_msg_desc *req_desc, void *req_buf, size_t req_len,
+     const struct lwpb_msg_desc *res_desc, struct lwpb_server_writer *writer,
+     void *arg);
+
+/**
+ * This method is provided by the transport to send a response message of a
+ * streaming call.
+ * @param writer Writer
+ * @param buf Encoded response message
+ * @param len Length of response message
+ * @return Returns LWPB_ERR_OK if more messages can be written, LWPB_ERR_BUSY
+ * if the handler should yield after this message, LWPB_ERR_CANCEL if the call
+ * was cancelled or LWPB_ERR_MEM if the message could not be queued.
+ */
+typedef lwpb_err_t (*lwpb_server_write_t)
+    (struct lwpb_server_writer *writer, void *buf, size_t len);
+
+/** Writer of the response messages of a server streaming call */
+struct lwpb_server_writer {
+    const struct lwpb_method_desc *method_desc;
+    lwpb_server_write_t write;  /**< Transport method sending a message */
+    void *ctx;                  /**< Transport context */
+    void *buf;                  /**< Buffer for encoding a response message */
+    size_t len;                 /**< Size of the buffer */
+    void *state;                /**< Handler state between runs */
+    int cancelled;              /**< Set when the call was cancelled */
+    int runs;                   /**< Number of handler runs */
+    u32_t count;                /**< Number of messages written */
+    u64_t bytes;                /**< Number of message bytes written */
+    u64_t queue_time;           /**< Time queued before the first run (ns) */
+    u64_t handler_time;         /**< Time spent in the handler (ns) */
+};
+
+/**
+ * Timestamps of a call (ns, from lwpb_stats_now()). Transports which already
+ * took the time a call was queued or started pass it, so recording
+ * statistics does not read the clock again.
+ */
+struct lwpb_call_times {
+    u64_t queued;               /**< Time the call was queued or 0 */
+    u64_t start;                /**< Time the handler started or 0 */
+    u64_t end;                  /**< Returns the time the handler returned,
+                                     0 if the server keeps no statistics */
+};
+
 /** Protocol buffer RPC server */
 struct lwpb_server {
     const struct lwpb_service_desc **service_list;
     struct lwpb_transport *transport;
     void *arg;
     lwpb_server_call_handler_t call_handler;
+    lwpb_server_encode_handler_t encode_handler;
+    struct lwpb_stats *stats;   /**< Per-method statistics or NULL */
+    const struct lwpb_method_desc **stream_methods; /**< Streaming methods */
+    lwpb_server_stream_handler_t stream_handler;
 };
 
 void lwpb_server_init(struct lwpb_server *server,
@@ -62,4 +158,37 @@ void lwpb_server_arg(struct lwpb_server *server, void *arg);
 void lwpb_server_handler(struct lwpb_server *server,
                          lwpb_server_call_handler_t call_handler);
 
+void lwpb_server_encode_handler(struct lwpb_server *server,
+                                lwpb_server_encode_handler_t encode_handler);
+
+void lwpb_server_stats(struct lwpb_server *server, struct lwpb_stats *stats);
+
+void lwpb_server_stream_handler(struct lwpb_server *server,
+                                const struct lwpb_method_desc **stream_methods,
+                                lwpb_server_stream_handler_t stream_handler);
+
+int lwpb_server_is_stream(struct lwpb_server *server,
+                          const struct lwpb_method_desc *method_desc);
+
+lwpb_err_t lwpb_server_handle_call(struct lwpb_server *server,
+                                   const struct lwpb_method_desc *method_desc,
+                                   void *req_buf, size_t req_len,
+                                   void **res_buf, size_t *res_len,
+                                   struct lwpb_call_times *times);
+
+void lwpb_server_free_response(void *buf, void *res_buf);
+
+void lwpb_server_writer_init(struct lwpb_server_writer *writer,
+                             const struct lwpb_method_desc *method_desc,
+                             lwpb_server_write_t write, void *ctx,
+                             void *buf, size_t len);
+
+lwpb_err_t lwpb_server_writer_write(struct lwpb_server_writer *writer,
+                                    size_t len);
+
+lwpb_err_t lwpb_server_handle_stream(struct lwpb_server *server,
+                                     struct lwpb_server_writer *writer,
+                                     void *req_buf, size_t req_len,
+                                     u64_t queue_time);
+
 #endif // __LWPB_RPC_SERVER_H__
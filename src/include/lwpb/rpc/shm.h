@@ -0,0 +1,93 @@
+/** @file shm.h
+ * 
+ * Common definitions of the shared memory RPC transports.
+ * 
+ * Copyright 2009 Simon Kallweit
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __LWPB_RPC_SHM_H__
+#define __LWPB_RPC_SHM_H__
+
+#include <lwpb/lwpb.h>
+
+
+/** Default size of the data area of each ring (power of two) */
+#define LWPB_TRANSPORT_SHM_RING_SIZE (1024 * 1024)
+
+/** Default maximum size of a message in the rings */
+#define LWPB_TRANSPORT_SHM_MAX_MSG (64 * 1024)
+
+/** Maximum size of the HELLO message sent when a channel is set up */
+#define LWPB_TRANSPORT_SHM_HELLO_SIZE 4096
+
+/** Size of a cache line, keeps producer and consumer state apart */
+#define LWPB_SHM_CACHE_LINE 64
+
+/** Record length marking the unused end of a ring */
+#define LWPB_SHM_RECORD_WRAP 0xffffffff
+
+/**
+ * Single producer, single consumer ring buffer in shared memory. The
+ * producer owns the head, the consumer owns the tail. Both are free running
+ * byte counters, positions in the data area are taken modulo its size.
+ */
+struct lwpb_shm_ring {
+    volatile u64_t head;        /**< Write position (producer) */
+    u8_t pad1[LWPB_SHM_CACHE_LINE - 8];
+    volatile u64_t tail;        /**< Read position (consumer) */
+    volatile u32_t sleeping;    /**< Set while the consumer waits for the eventfd */
+    u8_t pad2[LWPB_SHM_CACHE_LINE - 12];
+    u32_t size;                 /**< Size of data area (power of two) */
+    u32_t max_msg;              /**< Maximum size of a message */
+    u8_t pad3[LWPB_SHM_CACHE_LINE - 8];
+    u8_t data[];                /**< Records */
+};
+
+/**
+ * Header of a record in a ring. The message follows the header, records are
+ * aligned to 8 bytes. A record never wraps around the end of the ring, the
+ * producer marks the unused end with LWPB_SHM_RECORD_WRAP instead.
+ */
+struct lwpb_shm_record {
+    u32_t len;                  /**< Length of message */
+    u32_t id;                   /**< Call ID */
+    u16_t service;              /**< Service index (requests) */
+    u16_t method;               /**< Method index (requests) */
+    u32_t status;               /**< Result code (responses) */
+    u32_t deadline;             /**< Deadline of requests, see shm_deadline() */
+    u32_t reserved;
+};
+
+/**
+ * Shared memory channel between a client and a server. The server creates
+ * the rings in a memfd and passes it together with the eventfds to the
+ * client over a Unix domain socket. The socket stays open, so both sides
+ * notice when the other one goes away. The ring sizes are kept in the
+ * channel, as the peer can change the shared memory at any time.
+ */
+struct lwpb_shm_channel {
+    int socket;                 /**< Unix domain socket */
+    void *mem;                  /**< Mapping of both rings */
+    size_t mem_size;            /**< Size of mapping */
+    struct lwpb_shm_ring *req;  /**< Requests (client to server) */
+    struct lwpb_shm_ring *res;  /**< Responses (server to client) */
+    int req_event;              /**< eventfd signalled on new requests */
+    int res_event;              /**< eventfd signalled on new responses */
+    u32_t size;                 /**< Size of data area of both rings */
+    u32_t mask;                 /**< Mask of positions in the data area */
+    u32_t max_msg;              /**< Maximum size of a message */
+};
+
+#endif // __LWPB_RPC_SHM_H__
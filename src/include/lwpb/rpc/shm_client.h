@@ -0,0 +1,95 @@
+/** @file shm_client.h
+ * 
+ * Shared memory client RPC transport implementation.
+ * 
+ * Copyright 2009 Simon Kallweit
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __LWPB_RPC_SHM_CLIENT_H__
+#define __LWPB_RPC_SHM_CLIENT_H__
+
+#include <lwpb/lwpb.h>
+#include <lwpb/rpc/shm.h>
+
+
+/** Initial size of the pending call queue (grows on demand) */
+#define LWPB_TRANSPORT_SHM_CLIENT_CALLS 16
+
+/** Number of services in the service index cache */
+#define LWPB_TRANSPORT_SHM_CLIENT_SERVICES 8
+
+/** An outstanding call of the shared memory client */
+struct lwpb_shm_client_call {
+    u32_t id;                   /**< Call ID */
+    const struct lwpb_method_desc *method_desc;
+    struct lwpb_client_call *call; /**< Call context, NULL once abandoned */
+    u64_t deadline;             /**< Time the call expires (ns), 0 for none */
+};
+
+/** Service index cache entry of the shared memory client */
+struct lwpb_shm_client_service {
+    const struct lwpb_service_desc *service_desc;
+    int index;                  /**< Index on the server or -1 if unknown */
+};
+
+/**
+ * Shared memory client RPC transport implementation. Connects to a shared
+ * memory server through a Unix domain socket, which passes the rings of
+ * the channel. Requests are encoded directly into the request ring and
+ * responses are decoded in place from the response ring.
+ * 
+ * The server answers requests in order, so outstanding calls are kept in a
+ * queue. When the request ring is full, calls wait for responses to free
+ * space. With busy polling, updates spin on the response ring before they
+ * sleep on the eventfd, which saves the wakeup syscalls on both sides while
+ * calls are flowing.
+ * 
+ * Calls which time out or are cancelled complete right away but stay in the
+ * queue until their response arrives, which is then discarded. Requests
+ * carry their deadline, so the server skips the call handler for requests
+ * it picks up too late. Cancelled calls still run on the server.
+ */
+struct lwpb_transport_shm_client {
+    struct lwpb_transport super;
+    struct lwpb_client *client;
+    struct lwpb_shm_channel channel;
+    struct lwpb_shm_client_call *calls; /**< Queue of outstanding calls */
+    int calls_head;             /**< Index of oldest outstanding call */
+    int calls_size;             /**< Size of call queue */
+    int num_calls;              /**< Number of outstanding calls */
+    u32_t seq;                  /**< Sequence number for call IDs */
+    void *hello;                /**< HELLO message received from the server */
+    size_t hello_len;
+    struct lwpb_shm_client_service services[LWPB_TRANSPORT_SHM_CLIENT_SERVICES];
+    int num_services;           /**< Number of cached service indices */
+    u32_t busy_poll;            /**< Time to spin before sleeping (us) */
+    u64_t next_deadline;        /**< Earliest deadline of a call (ns), 0 for none */
+};
+
+lwpb_transport_t lwpb_transport_shm_client_init(struct lwpb_transport_shm_client *shm_client);
+
+lwpb_err_t lwpb_transport_shm_client_open(lwpb_transport_t transport,
+                                          const char *path);
+
+void lwpb_transport_shm_client_busy_poll(lwpb_transport_t transport,
+                                         u32_t busy_poll);
+
+void lwpb_transport_shm_client_close(lwpb_transport_t transport);
+
+lwpb_err_t lwpb_transport_shm_client_update(lwpb_transport_t transport);
+
+int lwpb_transport_shm_client_pending(lwpb_transport_t transport);
+
+#endif // __LWPB_RPC_SHM_CLIENT_H__
@@ -0,0 +1,89 @@
+/** @file shm_server.h
+ * 
+ * Shared memory server RPC transport implementation.
+ * 
+ * Copyright 2009 Simon Kallweit
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __LWPB_RPC_SHM_SERVER_H__
+#define __LWPB_RPC_SHM_SERVER_H__
+
+#include <sys/un.h>
+
+#include <lwpb/lwpb.h>
+#include <lwpb/rpc/shm.h>
+
+
+/** Initial size of the connection table (grows on demand) */
+#define LWPB_TRANSPORT_SHM_SERVER_CONNS 4
+
+/** Maximum number of events handled per update */
+#define LWPB_TRANSPORT_SHM_SERVER_EVENTS 64
+
+/* Forward declaration */
+struct lwpb_socket_method_table;
+
+/** A single client connection in the shared memory server */
+struct lwpb_shm_server_conn {
+    int index;
+    struct lwpb_shm_channel channel;
+    int blocked;                /**< Set while the response ring is full */
+};
+
+/**
+ * Shared memory server RPC transport implementation. Listens on a Unix
+ * domain socket and sets up a channel with its own pair of rings for each
+ * client. Requests are decoded in place from the request ring and the call
+ * handler encodes the response directly into the response ring. Calls are
+ * handled on the thread running the updates, in order. Requests picked up
+ * after their deadline are answered with LWPB_RPC_TIMEOUT without running
+ * the call handler.
+ * 
+ * Clients are only woken up through their eventfd while they sleep, so
+ * there are no syscalls per call while both sides are busy. With busy
+ * polling, updates spin on the request rings before they sleep.
+ */
+struct lwpb_transport_shm_server {
+    struct lwpb_transport super;
+    struct lwpb_server *server;
+    int socket;                 /**< Listening Unix domain socket */
+    int epoll;                  /**< epoll instance */
+    struct lwpb_shm_server_conn **conns; /**< Connection table */
+    int conns_size;             /**< Size of connection table */
+    int num_conns;              /**< Number of open connections */
+    struct lwpb_socket_method_table *methods; /**< Method lookup table */
+    u32_t ring_size;            /**< Size of the data area of each ring */
+    u32_t max_msg;              /**< Maximum size of a message */
+    u32_t busy_poll;            /**< Time to spin before sleeping (us) */
+    u64_t expired;              /**< Number of requests dropped after their deadline */
+    char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+};
+
+lwpb_transport_t lwpb_transport_shm_server_init(struct lwpb_transport_shm_server *shm_server);
+
+lwpb_err_t lwpb_transport_shm_server_open(lwpb_transport_t transport,
+                                          const char *path);
+
+void lwpb_transport_shm_server_rings(lwpb_transport_t transport,
+                                     u32_t ring_size, u32_t max_msg);
+
+void lwpb_transport_shm_server_busy_poll(lwpb_transport_t transport,
+                                         u32_t busy_poll);
+
+void lwpb_transport_shm_server_close(lwpb_transport_t transport);
+
+lwpb_err_t lwpb_transport_shm_server_update(lwpb_transport_t transport);
+
+#endif // __LWPB_RPC_SHM_SERVER_H__
@@ -0,0 +1,80 @@
+/** @file socket.h
+ * 
+ * Common definitions of the socket RPC transports.
+ * 
+ * Copyright 2009 Simon Kallweit
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *     
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __LWPB_RPC_SOCKET_H__
+#define __LWPB_RPC_SOCKET_H__
+
+#include <lwpb/lwpb.h>
+
+
+/* Socket transport options */
+
+/** Disable Nagle's algorithm (TCP_NODELAY) */
+#define LWPB_TRANSPORT_SOCKET_NODELAY   (1 << 0)
+/** Queue outgoing frames and send them with one syscall per update */
+#define LWPB_TRANSPORT_SOCKET_BATCH     (1 << 1)
+/** Cork the socket (TCP_CORK) while flushing queued frames */
+#define LWPB_TRANSPORT_SOCKET_CORK      (1 << 2)
+/** Negotiate binary frame headers with numeric method IDs (client only) */
+#define LWPB_TRANSPORT_SOCKET_V2        (1 << 3)
+/** Run the socket on io_uring (Linux 6.0), falls back to epoll/select */
+#define LWPB_TRANSPORT_SOCKET_URING     (1 << 4)
+
+/* Events of the descriptor of a socket transport in an external event loop */
+
+/** Wait until the descriptor is readable */
+#define LWPB_TRANSPORT_SOCKET_READABLE  (1 << 0)
+/** Wait until the descriptor is writable */
+#define LWPB_TRANSPORT_SOCKET_WRITABLE  (1 << 1)
+
+/** Default socket transport options */
+#define LWPB_TRANSPORT_SOCKET_DEFAULT_OPTIONS \
+    (LWPB_TRANSPORT_SOCKET_NODELAY | LWPB_TRANSPORT_SOCKET_V2)
+
+/** Initial size of receive buffers */
+#define LWPB_TRANSPORT_SOCKET_BUF_SIZE 1024
+
+/** Receive buffers larger than this are released when they become empty */
+#define LWPB_TRANSPORT_SOCKET_BUF_KEEP (64 * 1024)
+
+/** Default maximum size of a frame (header and message) */
+#define LWPB_TRANSPORT_SOCKET_MAX_FRAME (1024 * 1024)
+
+/**
+ * Input queue of a socket connection. Holds received bytes until frames are
+ * complete. The buffer grows to the size of the frame announced in the
+ * frame header.
+ */
+struct lwpb_socket_inq {
+    u8_t *data;                 /**< Received bytes */
+    size_t len;                 /**< Number of received bytes */
+    size_t size;                /**< Allocated size */
+};
+
+/**
+ * Output queue of a socket connection. Holds the bytes of frames which could
+ * not be written to the socket yet (or were queued for batching).
+ */
+struct lwpb_socket_outq {
+    u8_t *data;                 /**< Queued bytes */
+    size_t len;                 /**< Number of queued bytes */
+    size_t size;                /**< Allocated size */
+};
+
+#endif // __LWPB_RPC_SOCKET_H__
@@ -21,17 +21,100 @@
 #define __LWPB_RPC_SOCKET_CLIENT_H__
 
 #include <lwpb/lwpb.h>
+#include <lwpb/rpc/socket.h>
+#include <lwpb/rpc/uring.h>
 
 
-/** Socket client RPC transport implementation */
+/** Initial size of the pending call table (grows on demand) */
+#define LWPB_TRANSPORT_SOCKET_CLIENT_CALLS 16
+
+/** Maximum number of outstanding calls (call IDs hold a 16 bit slot) */
+#define LWPB_TRANSPORT_SOCKET_CLIENT_MAX_CALLS 65536
+
+/** Default maximum number of calls in a batch */
+#define LWPB_TRANSPORT_SOCKET_CLIENT_BATCH_CALLS 64
+
+/** Default maximum size of a batch in bytes */
+#define LWPB_TRANSPORT_SOCKET_CLIENT_BATCH_SIZE (16 * 1024)
+
+/** Default maximum time a call is held back in a batch (us) */
+#define LWPB_TRANSPORT_SOCKET_CLIENT_BATCH_DELAY 1000
+
+/** Number of services in the service index cache */
+#define LWPB_TRANSPORT_SOCKET_CLIENT_SERVICES 8
+
+/** An outstanding call of the socket client */
+struct lwpb_socket_client_call {
+    u32_t id;                   /**< Call ID (sequence << 16 | slot) */
+    const struct lwpb_method_desc *method_desc; /**< NULL if slot is free */
+    struct lwpb_client_call *call; /**< Call context */
+    u64_t deadline;             /**< Time the call expires (ns), 0 for none */
+};
+
+/** Service index cache entry of the socket client */
+struct lwpb_socket_client_service {
+    const struct lwpb_service_desc *service_desc;
+    int index;                  /**< Index on the server or -1 if unknown */
+};
+
+/**
+ * Socket client RPC transport implementation. Any number of calls can be
+ * outstanding on the connection. Each request carries a call ID, which the
+ * server echoes in the response, so responses are matched to their calls
+ * even when they arrive out of order.
+ * 
+ * With LWPB_TRANSPORT_SOCKET_V2, the client sends a HELLO frame when the
+ * connection is opened. Servers supporting v2 answer with their list of
+ * services, after which requests are sent with a fixed size binary header
+ * holding the service and method index. Until then, and with servers not
+ * answering the HELLO, the name based v1 header is used.
+ * 
+ * Between lwpb_client_batch_begin() and lwpb_client_batch_end(), requests
+ * to a v2 server are collected and sent as a single BATCH frame when the
+ * batch holds enough calls or bytes, when its oldest call has waited long
+ * enough (checked on calls and updates) or when the batch ends.
+ * 
+ * Calls with a timeout are completed with LWPB_RPC_TIMEOUT by the update
+ * once their deadline has passed. Requests carry the timeout, so the server
+ * can drop calls it cannot start in time, and v2 servers are sent a CANCEL
+ * frame for calls which timed out or were cancelled by the client.
+ * 
+ * With LWPB_TRANSPORT_SOCKET_URING, requests are always queued and each
+ * update sends them and waits for responses with a single io_uring_enter()
+ * call, receiving through a multishot receive into provided buffers. If
+ * io_uring cannot be set up, the client uses select().
+ */
 struct lwpb_transport_socket_client {
     struct lwpb_transport super;
     struct lwpb_client *client;
     int socket;
-    void *buf;
-    void *pos;
-    size_t len;
-    const struct lwpb_method_desc *last_method;
+    struct lwpb_socket_inq inq; /**< Received data */
+    size_t max_frame;           /**< Maximum size of a response frame */
+    struct lwpb_socket_client_call *calls; /**< Pending call table */
+    int *free_slots;            /**< Stack of free pending call table slots */
+    int num_free_slots;         /**< Number of free pending call table slots */
+    int calls_size;             /**< Size of pending call table */
+    int num_calls;              /**< Number of outstanding calls */
+    u16_t seq;                  /**< Sequence number for call IDs */
+    unsigned int options;       /**< Socket transport options */
+    struct lwpb_socket_outq outq; /**< Unsent request data */
+    int version;                /**< Negotiated protocol version */
+    void *hello;                /**< HELLO message received from the server */
+    size_t hello_len;
+    struct lwpb_socket_client_service services[LWPB_TRANSPORT_SOCKET_CLIENT_SERVICES];
+    int num_services;           /**< Number of cached service indices */
+    struct lwpb_socket_outq batch; /**< Request frames of the current batch */
+    int batching;               /**< Set while calls are batched */
+    int batch_calls;            /**< Number of calls in the batch */
+    u64_t batch_time;           /**< Time the first call was batched (ns) */
+    int batch_max_calls;        /**< Maximum number of calls in a batch */
+    size_t batch_max_size;      /**< Maximum size of a batch */
+    u32_t batch_max_delay;      /**< Maximum time a call is held back (us) */
+    u64_t next_deadline;        /**< Earliest deadline of a call (ns), 0 for none */
+    struct lwpb_uring uring;    /**< io_uring instance, fd is -1 with select() */
+    int receiving;              /**< Set while the multishot receive is armed */
+    struct lwpb_socket_outq sending; /**< Data of the send in flight */
+    size_t sent;                /**< Bytes of the send buffer written so far */
 };
 
 lwpb_transport_t lwpb_transport_socket_client_init(struct lwpb_transport_socket_client *socket_client);
@@ -39,8 +122,30 @@ lwpb_transport_t lwpb_transport_socket_client_init(struct lwpb_transport_socket_
 lwpb_err_t lwpb_transport_socket_client_open(lwpb_transport_t transport,
                                              const char *host, u16_t port);
 
+void lwpb_transport_socket_client_options(lwpb_transport_t transport,
+                                          unsigned int options);
+
+void lwpb_transport_socket_client_max_frame(lwpb_transport_t transport,
+                                            size_t max_frame);
+
+void lwpb_transport_socket_client_batch(lwpb_transport_t transport,
+                                        int max_calls, size_t max_size,
+                                        u32_t max_delay);
+
 void lwpb_transport_socket_client_close(lwpb_transport_t transport);
 
+lwpb_err_t lwpb_transport_socket_client_flush(lwpb_transport_t transport);
+
 lwpb_err_t lwpb_transport_socket_client_update(lwpb_transport_t transport);
 
+int lwpb_transport_socket_client_fd(lwpb_transport_t transport,
+                                    unsigned int *events);
+
+int lwpb_transport_socket_client_timeout(lwpb_transport_t transport);
+
+lwpb_err_t lwpb_transport_socket_client_process(lwpb_transport_t transport,
+                                                unsigned int events);
+
+int lwpb_transport_socket_client_pending(lwpb_transport_t transport);
+
 #endif // __LWPB_RPC_SOCKET_CLIENT_H__
@@ -21,27 +21,148 @@
 #define __LWPB_RPC_SOCKET_SERVER_H__
 
 #include <lwpb/lwpb.h>
+#include <lwpb/rpc/capture.h>
+#include <lwpb/rpc/socket.h>
+#include <lwpb/rpc/uring.h>
+#include <lwpb/rpc/worker_pool.h>
 
 
-#define LWPB_TRANSPORT_SOCKET_SERVER_CONNS 4
+/** Initial size of the connection table (grows on demand) */
+#define LWPB_TRANSPORT_SOCKET_SERVER_CONNS 16
+
+/** Maximum number of events handled per update */
+#define LWPB_TRANSPORT_SOCKET_SERVER_EVENTS 64
+
+/** Default depth of the worker pool job queue */
+#define LWPB_TRANSPORT_SOCKET_SERVER_QUEUE 256
+
+/** Bytes of response messages a stream handler writes before it yields */
+#define LWPB_TRANSPORT_SOCKET_SERVER_STREAM_CHUNK (16 * 1024)
+
+/** Unsent bytes of a connection up to which suspended streams are resumed */
+#define LWPB_TRANSPORT_SOCKET_SERVER_STREAM_WINDOW (64 * 1024)
+
+/* Admission control policies */
+
+/** Stop reading from connections over a limit, relying on TCP backpressure */
+#define LWPB_TRANSPORT_SOCKET_SERVER_PAUSE  0
+/** Answer requests over a limit right away with LWPB_RPC_OVERLOADED */
+#define LWPB_TRANSPORT_SOCKET_SERVER_REJECT 1
+
+/**
+ * Admission control limits of the socket server, 0 disables a limit. The
+ * in-flight limits only apply with a worker pool, as inline calls complete
+ * before the next request is read. Connections with too many unsent
+ * response bytes are always paused, as rejecting would only add output.
+ */
+struct lwpb_socket_server_limits {
+    int max_pending;            /**< Requests in the worker pool per connection */
+    int max_inflight;           /**< Requests in the worker pool in total */
+    size_t max_buffered;        /**< Unsent response bytes per connection */
+    u32_t rate;                 /**< Requests per second per connection */
+    u32_t burst;                /**< Requests a connection may send at once */
+    int policy;                 /**< Policy for requests over a limit */
+};
+
+/* Forward declarations */
+struct lwpb_socket_method_table;
+struct socket_server_job;
 
 /** A single client connection in the socket server */
 struct lwpb_socket_server_conn {
     int index;
     int socket;
     struct lwpb_client client;
-    void *buf;
-    void *pos;
-    size_t len;
+    struct lwpb_socket_inq inq; /**< Received data */
+    int pending;                /**< Number of requests in the worker pool and streams */
+    int closed;                 /**< Set when closed with pending requests */
+    int stalled;                /**< Set while waiting for worker queue space */
+    struct lwpb_socket_server_conn *next_stalled;
+    struct lwpb_socket_outq outq; /**< Unsent response data */
+    int queued;                 /**< Set while on the flush list */
+    struct lwpb_socket_server_conn *next_queued;
+    int batching;               /**< Set while handling a BATCH frame */
+    size_t batch_pos;           /**< Position in a BATCH frame to resume at */
+    int paused;                 /**< Set while paused by admission control */
+    u64_t resume_time;          /**< Time to resume (ns), 0 when output drained */
+    struct lwpb_socket_server_conn *next_paused;
+    u64_t rate_time;            /**< Earliest time of the next request (ns) */
+    struct socket_server_job *jobs; /**< Requests in the worker pool and streams */
+    int uring_ops;              /**< Outstanding io_uring requests */
+    int receiving;              /**< Set while a multishot receive is armed */
+    struct lwpb_socket_outq sending; /**< Data of the send in flight */
+    size_t sent;                /**< Bytes of the send buffer written so far */
+    u32_t serial;               /**< Serial number of the connection */
+    int captured;               /**< Set if the first received frame is captured */
 };
 
-/** Socket server RPC transport implementation */
+/**
+ * Socket server RPC transport implementation.
+ * 
+ * With LWPB_TRANSPORT_SOCKET_URING, the server runs on io_uring instead of
+ * epoll. New connections are accepted by a multishot accept and data is
+ * received by a multishot receive per connection into a shared ring of
+ * provided buffers. Responses are always batched, each connection has at
+ * most one send in flight while further responses are queued. All requests
+ * queued during an update are submitted with the wait for the next
+ * completions in a single io_uring_enter() call. If io_uring cannot be set
+ * up, the server uses epoll.
+ * 
+ * Server streaming calls always run as jobs, on the worker pool or inline.
+ * The stream handler yields after writing a chunk of messages, which are
+ * then sent. The stream is resumed once the unsent data of its connection
+ * drops below the stream window, so a slow client only holds a bounded
+ * amount of response data.
+ */
 struct lwpb_transport_socket_server {
     struct lwpb_transport super;
     struct lwpb_server *server;
     int socket;
-    int num_conns;
-    struct lwpb_socket_server_conn conns[LWPB_TRANSPORT_SOCKET_SERVER_CONNS];
+    int epoll;                  /**< epoll instance */
+    int num_conns;              /**< Number of open connections */
+    struct lwpb_socket_server_conn **conns; /**< Connection table */
+    int *free_slots;            /**< Stack of free connection table slots */
+    int num_free_slots;         /**< Number of free connection table slots */
+    int conns_size;             /**< Size of connection table */
+    int num_workers;            /**< Number of worker threads (0 = inline) */
+    size_t queue_size;          /**< Depth of the worker job queue */
+    struct lwpb_worker_pool pool; /**< Worker pool running the call handler */
+    struct lwpb_socket_server_conn *stalled; /**< Connections waiting for queue space */
+    unsigned int options;       /**< Socket transport options */
+    struct lwpb_socket_server_conn *queued; /**< Connections with output to flush */
+    int reuseport;              /**< Bind listen socket with SO_REUSEPORT */
+    int wakeup;                 /**< Optional eventfd interrupting update */
+    struct lwpb_socket_method_table *methods; /**< Method lookup table */
+    size_t max_frame;           /**< Maximum size of a request frame */
+    struct lwpb_socket_server_limits limits; /**< Admission control limits */
+    int inflight;               /**< Number of requests in the worker pool */
+    struct lwpb_socket_server_conn *paused; /**< Connections paused by admission control */
+    u64_t rejected;             /**< Number of requests answered as overloaded */
+    u64_t pauses;               /**< Number of times a connection was paused */
+    u64_t expired;              /**< Number of requests dropped after their deadline */
+    u64_t cancelled;            /**< Number of requests dropped on CANCEL */
+    struct lwpb_uring uring;    /**< io_uring instance, fd is -1 with epoll */
+    int uring_ops;              /**< Outstanding accept, receive and send requests */
+    struct socket_server_job *streams; /**< Suspended streaming calls */
+    struct lwpb_capture *capture; /**< Capture of received frames or NULL */
+    u32_t next_serial;          /**< Serial number of the next connection */
+};
+
+/**
+ * Group of independent socket servers (shards) listening on the same port.
+ * Each shard runs on its own reactor thread with its own listen socket bound
+ * using SO_REUSEPORT, its own epoll instance, connection table and transport
+ * allocator. The kernel distributes incoming connections among the shards.
+ * Shards only share the read-only service list, call handler and user
+ * argument, so the call handler must be thread-safe.
+ */
+struct lwpb_socket_server_group {
+    struct lwpb_transport_socket_server *shards; /**< Shard transports */
+    struct lwpb_server *servers;    /**< Per-shard servers */
+    pthread_t *threads;             /**< Reactor threads */
+    int num_shards;                 /**< Number of shards */
+    int num_threads;                /**< Number of running reactor threads */
+    int wakeup;                     /**< eventfd to stop the reactors */
 };
 
 lwpb_transport_t lwpb_transport_socket_server_init(struct lwpb_transport_socket_server *socket_server);
@@ -49,8 +170,47 @@ lwpb_transport_t lwpb_transport_socket_server_init(struct lwpb_transport_socket_
 lwpb_err_t lwpb_transport_socket_server_open(lwpb_transport_t transport,
                                              const char *host, u16_t port);
 
+void lwpb_transport_socket_server_options(lwpb_transport_t transport,
+                                          unsigned int options);
+
+void lwpb_transport_socket_server_max_frame(lwpb_transport_t transport,
+                                            size_t max_frame);
+
+void lwpb_transport_socket_server_workers(lwpb_transport_t transport,
+                                          int num_workers, size_t queue_size);
+
+void lwpb_transport_socket_server_limits(lwpb_transport_t transport,
+                                         const struct lwpb_socket_server_limits *limits);
+
+void lwpb_transport_socket_server_capture(lwpb_transport_t transport,
+                                          struct lwpb_capture *capture);
+
 void lwpb_transport_socket_server_close(lwpb_transport_t transport);
 
+u16_t lwpb_transport_socket_server_port(lwpb_transport_t transport);
+
 lwpb_err_t lwpb_transport_socket_server_update(lwpb_transport_t transport);
 
+int lwpb_transport_socket_server_fd(lwpb_transport_t transport,
+                                    unsigned int *events);
+
+int lwpb_transport_socket_server_timeout(lwpb_transport_t transport);
+
+lwpb_err_t lwpb_transport_socket_server_process(lwpb_transport_t transport,
+                                                unsigned int events);
+
+lwpb_err_t lwpb_socket_server_group_init(struct lwpb_socket_server_group *group,
+                                         int num_shards,
+                                         const struct lwpb_service_desc **service_list,
+                                         lwpb_server_call_handler_t call_handler,
+                                         void *arg);
+
+lwpb_transport_t lwpb_socket_server_group_shard(struct lwpb_socket_server_group *group,
+                                                int index);
+
+lwpb_err_t lwpb_socket_server_group_open(struct lwpb_socket_server_group *group,
+                                         const char *host, u16_t port);
+
+void lwpb_socket_server_group_close(struct lwpb_socket_server_group *group);
+
 #endif // __LWPB_RPC_SOCKET_SERVER_H__
@@ -0,0 +1,121 @@
+/** @file stats.h
+ * 
+ * Per-method RPC server statistics.
+ * 
+ * Copyright 2009 Simon Kallweit
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __LWPB_RPC_STATS_H__
+#define __LWPB_RPC_STATS_H__
+
+#include <pthread.h>
+
+#include <lwpb/lwpb.h>
+
+
+/** Number of bits of linear sub-buckets per power of two */
+#define LWPB_STATS_SUB_BITS 3
+#define LWPB_STATS_SUB_BUCKETS (1 << LWPB_STATS_SUB_BITS)
+
+/** Values from 2^LWPB_STATS_MAX_BITS ns (~18 minutes) go to the last bucket */
+#define LWPB_STATS_MAX_BITS 40
+
+/** Number of histogram buckets */
+#define LWPB_STATS_BUCKETS \
+    ((LWPB_STATS_MAX_BITS - LWPB_STATS_SUB_BITS + 1) * LWPB_STATS_SUB_BUCKETS)
+
+/**
+ * Log-linear latency histogram in nanoseconds. Values below
+ * LWPB_STATS_SUB_BUCKETS have a bucket each, above that every power of two
+ * is split into LWPB_STATS_SUB_BUCKETS linear buckets, which bounds the
+ * relative error of a bucket to 1 / LWPB_STATS_SUB_BUCKETS.
+ */
+struct lwpb_histogram {
+    u64_t count;                /**< Number of recorded values */
+    u64_t sum;                  /**< Sum of recorded values */
+    u64_t max;                  /**< Maximum recorded value */
+    u64_t buckets[LWPB_STATS_BUCKETS];
+};
+
+/** Statistics of a single method */
+struct lwpb_method_stats {
+    u64_t calls;                /**< Number of handled calls */
+    u64_t errors;               /**< Number of calls failed by the handler */
+    u64_t req_bytes;            /**< Total size of request messages */
+    u64_t res_bytes;            /**< Total size of response messages */
+    struct lwpb_histogram queue; /**< Time queued before the handler ran */
+    struct lwpb_histogram handler; /**< Time spent in the handler */
+    struct lwpb_histogram send; /**< Time spent sending the response */
+};
+
+/** Statistics recorded by a single thread */
+struct lwpb_stats_shard {
+    struct lwpb_stats_shard *next;
+    struct lwpb_method_stats methods[];
+};
+
+/**
+ * Per-method statistics of a server. Every thread recording calls gets its
+ * own shard on first use, so recording takes no locks and shares no cache
+ * lines between threads. Snapshots sum up all shards while recording goes
+ * on, and can be merged with snapshots of other servers.
+ * 
+ * Methods are numbered in the order of the service list, so method i of
+ * service s has the index of the first method of s plus i.
+ */
+struct lwpb_stats {
+    const struct lwpb_service_desc **service_list;
+    int num_services;
+    int *method_base;           /**< Index of the first method per service */
+    int num_methods;            /**< Total number of methods */
+    pthread_key_t key;          /**< Shard of the calling thread */
+    pthread_mutex_t lock;       /**< Protects the shard list */
+    struct lwpb_stats_shard *shards;
+};
+
+lwpb_err_t lwpb_stats_init(struct lwpb_stats *stats,
+                           const struct lwpb_service_desc **service_list);
+
+void lwpb_stats_destroy(struct lwpb_stats *stats);
+
+u64_t lwpb_stats_now(void);
+
+int lwpb_stats_method_index(struct lwpb_stats *stats,
+                            const struct lwpb_method_desc *method_desc);
+
+void lwpb_stats_record_call(struct lwpb_stats *stats,
+                            const struct lwpb_method_desc *method_desc,
+                            int failed, size_t req_len, size_t res_len,
+                            u64_t queue_time, u64_t handler_time);
+
+void lwpb_stats_record_send(struct lwpb_stats *stats,
+                            const struct lwpb_method_desc *method_desc,
+                            u64_t send_time);
+
+void lwpb_stats_snapshot(struct lwpb_stats *stats,
+                         struct lwpb_method_stats *methods);
+
+void lwpb_stats_merge(struct lwpb_method_stats *dst,
+                      const struct lwpb_method_stats *src, int num_methods);
+
+void lwpb_histogram_record(struct lwpb_histogram *histogram, u64_t value);
+
+void lwpb_histogram_merge(struct lwpb_histogram *dst,
+                          const struct lwpb_histogram *src);
+
+u64_t lwpb_histogram_percentile(const struct lwpb_histogram *histogram,
+                                double percentile);
+
+#endif // __LWPB_RPC_STATS_H__
@@ -25,6 +25,7 @@
 
 /* Forward declaration */
 struct lwpb_client;
+struct lwpb_client_call;
 struct lwpb_server;
 struct lwpb_transport;
 
@@ -61,23 +62,32 @@ struct lwpb_transport_funs {
      */
     void (*register_client)(lwpb_transport_t transport, struct lwpb_client *client);
     /**
-     * This method is called from the client to start an RPC call.
+     * This method is called from the client to start an RPC call. The
+     * transport calls the handlers of the call context and completes the
+     * call with lwpb_client_call_done().
      * @param transport Transport implementation
      * @param client Client
      * @param method_desc Method descriptor
+     * @param call Call context
      * @return Returns LWPB_ERR_OK if successful.
      */
     lwpb_err_t (*call)(lwpb_transport_t transport,
                        struct lwpb_client *client,
-                       const struct lwpb_method_desc *method_desc);
+                       const struct lwpb_method_desc *method_desc,
+                       struct lwpb_client_call *call);
     /**
-     * This method is called from the client when the current RPC call should
-     * be cancelled.
+     * This method is called from the client when an outstanding RPC call
+     * should be cancelled. The transport completes the call with
+     * LWPB_RPC_CANCELLED and tells the server, if it can, so the server
+     * does not run the call anymore. Calls which are already done are
+     * left alone.
      * @param transport Transport implementation
      * @param client Client
+     * @param call Call context
      */
     void (*cancel)(lwpb_transport_t transport,
-                   struct lwpb_client *client);
+                   struct lwpb_client *client,
+                   struct lwpb_client_call *call);
     /**
      * This method is called from the server when it is registered with the
      * transport.
@@ -85,6 +95,23 @@ struct lwpb_transport_funs {
      * @param server Server
      */
     void (*register_server)(lwpb_transport_t transport, struct lwpb_server *server);
+    /**
+     * This method is called from the client to wait for outstanding calls.
+     * It processes pending I/O once and returns. Transports completing calls
+     * synchronously leave this NULL.
+     * @param transport Transport implementation
+     * @return Returns LWPB_ERR_OK if successful.
+     */
+    lwpb_err_t (*update)(lwpb_transport_t transport);
+    /**
+     * This method is called from the client to start or end a batch of
+     * calls. While batching, the transport may hold back requests and send
+     * them together. Ending a batch sends the held back requests. Transports
+     * not supporting batches leave this NULL.
+     * @param transport Transport implementation
+     * @param enable Set to start a batch, zero to end it
+     */
+    void (*batch)(lwpb_transport_t transport, int enable);
 };
 
 /** RPC transport base structure */
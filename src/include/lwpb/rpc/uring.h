@@ -0,0 +1,68 @@
+/** @file uring.h
+ * 
+ * io_uring instance used by the socket transports.
+ * 
+ * Copyright 2009 Simon Kallweit
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __LWPB_RPC_URING_H__
+#define __LWPB_RPC_URING_H__
+
+#include <stddef.h>
+
+#include <lwpb/lwpb.h>
+
+
+/** Number of submission queue entries */
+#define LWPB_URING_ENTRIES 256
+
+/** Number of receive buffers in the provided buffer ring (power of two) */
+#define LWPB_URING_BUFS 256
+
+/** Size of a receive buffer */
+#define LWPB_URING_BUF_SIZE 4096
+
+/**
+ * io_uring instance with its submission and completion rings mapped, and a
+ * ring of receive buffers the kernel picks from when data arrives, so
+ * multishot receives need no buffer per connection. The kernel structures
+ * are kept opaque, so this header does not depend on the kernel headers.
+ */
+struct lwpb_uring {
+    int fd;                     /**< io_uring file descriptor, -1 if unused */
+    unsigned int *sq_head;      /**< Submission ring head (kernel) */
+    unsigned int *sq_tail;      /**< Submission ring tail (user) */
+    unsigned int *sq_array;     /**< Submission ring index array */
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int sq_local_tail; /**< Tail including unpublished entries */
+    unsigned int sq_submitted;  /**< Tail at the last submission */
+    void *sqes;                 /**< Submission queue entries */
+    unsigned int *cq_head;      /**< Completion ring head (user) */
+    unsigned int *cq_tail;      /**< Completion ring tail (kernel) */
+    unsigned int cq_mask;
+    void *cqes;                 /**< Completion queue entries */
+    void *ring_mem;             /**< Mapping of the rings */
+    size_t ring_size;
+    void *sqe_mem;              /**< Mapping of the submission queue entries */
+    size_t sqe_size;
+    void *buf_ring;             /**< Provided buffer ring, NULL if not set up */
+    u8_t *buf_data;             /**< Memory of the receive buffers */
+    unsigned int buf_count;     /**< Number of receive buffers */
+    unsigned int buf_size;      /**< Size of a receive buffer */
+    u16_t buf_tail;             /**< Tail of the provided buffer ring */
+};
+
+#endif // __LWPB_RPC_URING_H__
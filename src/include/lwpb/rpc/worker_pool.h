@@ -0,0 +1,93 @@
+/** @file worker_pool.h
+ * 
+ * Worker thread pool for RPC transports.
+ * 
+ * Copyright 2009 Simon Kallweit
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __LWPB_RPC_WORKER_POOL_H__
+#define __LWPB_RPC_WORKER_POOL_H__
+
+#include <pthread.h>
+
+#include <lwpb/lwpb.h>
+
+
+/* Forward declaration */
+struct lwpb_worker_job;
+
+/**
+ * This method is called from a worker thread to run a job.
+ * @param job Job
+ */
+typedef void (*lwpb_worker_job_fun_t)(struct lwpb_worker_job *job);
+
+/**
+ * A job of the worker pool. Transports embed this structure as the first
+ * member of their own job structure.
+ */
+struct lwpb_worker_job {
+    lwpb_worker_job_fun_t fun;  /**< Job function */
+    struct lwpb_worker_job *next; /**< Next job in completion list */
+    u64_t submit_time;          /**< Time the job was submitted (ns) */
+    u64_t start_time;           /**< Time a worker started the job (ns) */
+};
+
+/** Worker pool metrics */
+struct lwpb_worker_pool_stats {
+    u64_t submitted;            /**< Number of submitted jobs */
+    u64_t rejected;             /**< Number of jobs rejected (queue full) */
+    u64_t completed;            /**< Number of completed jobs */
+    u64_t wait_total;           /**< Total queue wait time (ns) */
+    u64_t wait_max;             /**< Maximum queue wait time (ns) */
+    size_t queue_max;           /**< Maximum queue depth seen */
+};
+
+/**
+ * Fixed size pool of worker threads fed by a bounded job queue. Jobs are
+ * submitted by the I/O thread and can be picked up by any worker. Completed
+ * jobs are handed back to the I/O thread through a completion list and an
+ * eventfd, which can be watched with select/poll/epoll.
+ */
+struct lwpb_worker_pool {
+    pthread_t *threads;         /**< Worker threads */
+    int num_threads;            /**< Number of worker threads */
+    pthread_mutex_t lock;       /**< Protects the queues and metrics */
+    pthread_cond_t cond;        /**< Signalled when jobs are queued */
+    struct lwpb_worker_job **queue; /**< Job ring buffer */
+    size_t queue_size;          /**< Size of job ring buffer */
+    size_t queue_head;          /**< Index of next job to run */
+    size_t queue_len;           /**< Number of queued jobs */
+    struct lwpb_worker_job *done_head; /**< Completed jobs */
+    struct lwpb_worker_job *done_tail;
+    int event;                  /**< eventfd signalled on completion */
+    int stop;                   /**< Set to stop the worker threads */
+    struct lwpb_worker_pool_stats stats;
+};
+
+lwpb_err_t lwpb_worker_pool_init(struct lwpb_worker_pool *pool,
+                                 int num_threads, size_t queue_size);
+
+struct lwpb_worker_job *lwpb_worker_pool_destroy(struct lwpb_worker_pool *pool);
+
+lwpb_err_t lwpb_worker_pool_submit(struct lwpb_worker_pool *pool,
+                                   struct lwpb_worker_job *job);
+
+struct lwpb_worker_job *lwpb_worker_pool_completed(struct lwpb_worker_pool *pool);
+
+void lwpb_worker_pool_get_stats(struct lwpb_worker_pool *pool,
+                                struct lwpb_worker_pool_stats *stats);
+
+#endif // __LWPB_RPC_WORKER_POOL_H__
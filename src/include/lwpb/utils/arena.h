@@ -0,0 +1,45 @@
+/** @file arena.h
+ * 
+ * Lightweight protocol buffers arena allocator interface.
+ * 
+ * Copyright 2009 Simon Kallweit
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *     
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __LWPB_UTILS_ARENA_H__
+#define __LWPB_UTILS_ARENA_H__
+
+#include <lwpb/lwpb.h>
+
+
+/** Alignment of arena allocations */
+#define LWPB_ARENA_ALIGN 8
+
+/**
+ * Simple arena allocator working on a user supplied memory block. Memory is
+ * only released all at once by resetting the arena.
+ */
+struct lwpb_arena {
+    u8_t *base;     /**< Memory block */
+    size_t size;    /**< Size of memory block */
+    size_t used;    /**< Number of used bytes */
+};
+
+void lwpb_arena_init(struct lwpb_arena *arena, void *data, size_t size);
+
+void *lwpb_arena_alloc(struct lwpb_arena *arena, size_t size);
+
+void lwpb_arena_reset(struct lwpb_arena *arena);
+
+#endif // __LWPB_UTILS_ARENA_H__
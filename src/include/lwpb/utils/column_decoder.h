@@ -0,0 +1,103 @@
+/** @file column_decoder.h
+ * 
+ * Lightweight protocol buffers columnar (struct-of-arrays) decoder interface.
+ * 
+ * Copyright 2009 Simon Kallweit
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __LWPB_UTILS_COLUMN_DECODER_H__
+#define __LWPB_UTILS_COLUMN_DECODER_H__
+
+#include <lwpb/lwpb.h>
+
+
+/** Checks if a row of a column holds at least one value */
+#define LWPB_COLUMN_IS_VALID(_column_, _row_)                               \
+    (((_column_)->valid[(_row_) >> 3] >> ((_row_) & 7)) & 1)
+
+/**
+ * A single column of the columnar decoder. Each decoded message appends one
+ * row to every column.
+ * 
+ * The values of a column are stored contiguously in 'values', using the
+ * native type of the leaf field (s32_t, u64_t, double, ...). Columns of type
+ * 'string' and 'bytes' store their data in 'data' and 'values' holds
+ * num_values + 1 u32_t offsets into it (value i spans values[i] to
+ * values[i + 1]).
+ * 
+ * Columns without a repeated field on their path hold exactly one value per
+ * row (zero if the field is missing). Columns with a repeated field on their
+ * path hold any number of values per row and 'offsets' holds num_rows + 1
+ * u32_t offsets into the values (row i spans offsets[i] to offsets[i + 1]).
+ */
+struct lwpb_column {
+    const struct lwpb_field_desc *path[LWPB_MAX_DEPTH]; /**< Field path */
+    int path_len;               /**< Number of fields in path */
+    int repeated;               /**< Set if there is a repeated field on the path */
+    size_t value_size;          /**< Size of a single value */
+    size_t num_rows;            /**< Number of rows */
+    size_t num_values;          /**< Number of values */
+    void *values;               /**< Values or string/bytes offsets */
+    u8_t *valid;                /**< Presence bitmap, one bit per row */
+    u32_t *offsets;             /**< Row offsets into values (repeated only) */
+    u8_t *data;                 /**< String and bytes data */
+    size_t data_len;            /**< Length of string and bytes data */
+    size_t values_size;         /**< Allocated number of values */
+    size_t rows_size;           /**< Allocated number of rows */
+    size_t data_size;           /**< Allocated size of data */
+    size_t row_values;          /**< Number of values when the row started */
+    size_t row_data_len;        /**< Data length when the row started */
+};
+
+/** Protocol buffer columnar decoder */
+struct lwpb_column_decoder {
+    struct lwpb_decoder decoder;
+    const struct lwpb_msg_desc *msg_desc;
+    struct lwpb_column *columns;
+    int num_columns;
+    const struct lwpb_field_desc *path[LWPB_MAX_DEPTH];
+    int depth;
+    lwpb_err_t err;
+};
+
+lwpb_err_t lwpb_column_init(struct lwpb_column *column,
+                            const struct lwpb_field_desc **path, int path_len);
+
+#if LWPB_FIELD_NAMES
+lwpb_err_t lwpb_column_init_name(struct lwpb_column *column,
+                                 const struct lwpb_msg_desc *msg_desc,
+                                 const char *name);
+#endif
+
+void lwpb_column_clear(struct lwpb_column *column);
+
+void lwpb_column_free(struct lwpb_column *column);
+
+void lwpb_column_decoder_init(struct lwpb_column_decoder *cdecoder,
+                              const struct lwpb_msg_desc *msg_desc,
+                              struct lwpb_column *columns, int num_columns);
+
+lwpb_err_t lwpb_column_decoder_decode(struct lwpb_column_decoder *cdecoder,
+                                      void *data, size_t len);
+
+lwpb_err_t lwpb_column_decoder_decode_array(struct lwpb_column_decoder *cdecoder,
+                                            void **data, size_t *len,
+                                            size_t count);
+
+lwpb_err_t lwpb_column_decoder_decode_stream(struct lwpb_column_decoder *cdecoder,
+                                             void *data, size_t len,
+                                             size_t *used);
+
+#endif // __LWPB_UTILS_COLUMN_DECODER_H__
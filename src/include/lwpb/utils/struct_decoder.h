@@ -65,6 +65,7 @@ struct lwpb_struct_decoder_stack_frame {
     const struct lwpb_struct_map *map;
     void *base;
     const struct lwpb_struct_map_field *last_field;
+    const struct lwpb_struct_map_field *msg_field;
     int field_index;
 };
 
@@ -95,5 +96,8 @@ lwpb_err_t lwpb_struct_decoder_decode(struct lwpb_struct_decoder *sdecoder,
                                       void *struct_base,
                                       void *data, size_t len, size_t *used);
 
+lwpb_err_t lwpb_struct_lazy_get(struct lwpb_struct_lazy *lazy,
+                                struct lwpb_arena *arena, void **value);
+
 
 #endif // __LWPB_UTILS_STRUCT_DECODER_H__
@@ -33,7 +33,7 @@ const struct lwpb_struct_map _name_ = {                                     \
     LWPB_STRUCT_MAP_FIELD(_field_desc_, _struct_, _field_, sizeof(double), _count_)
 
 #define LWPB_STRUCT_MAP_FLOAT(_field_desc_, _struct_, _field_, _count_)     \
-    LWPB_STRUCT_MAP_FIELD(_field_desc_, _struct_, _field_, sizeof(float)), _count_)
+    LWPB_STRUCT_MAP_FIELD(_field_desc_, _struct_, _field_, sizeof(float), _count_)
 
 #define LWPB_STRUCT_MAP_INT32(_field_desc_, _struct_, _field_, _count_)     \
     LWPB_STRUCT_MAP_FIELD(_field_desc_, _struct_, _field_, sizeof(s32_t), _count_)
@@ -59,16 +59,32 @@ const struct lwpb_struct_map _name_ = {                                     \
 #define LWPB_STRUCT_MAP_BYTES(_field_desc_, _struct_, _field_, _len_, _count_) \
     LWPB_STRUCT_MAP_FIELD(_field_desc_, _struct_, _field_, _len_, _count_)
 
+#define LWPB_STRUCT_MAP_STRING_VIEW(_field_desc_, _struct_, _field_, _count_) \
+    LWPB_STRUCT_MAP_FIELD_FLAGS(_field_desc_, _struct_, _field_,            \
+        sizeof(struct lwpb_string_view), _count_, LWPB_STRUCT_MAP_VIEW)
+
+#define LWPB_STRUCT_MAP_BYTES_VIEW(_field_desc_, _struct_, _field_, _count_) \
+    LWPB_STRUCT_MAP_FIELD_FLAGS(_field_desc_, _struct_, _field_,            \
+        sizeof(struct lwpb_bytes_view), _count_, LWPB_STRUCT_MAP_VIEW)
+
 #define LWPB_STRUCT_MAP_MESSAGE(_field_desc_, _struct_, _field_, _struct_map_, _count_) \
     LWPB_STRUCT_MAP_FIELD(_field_desc_, _struct_, _field_, (size_t) (_struct_map_), _count_)
 
+#define LWPB_STRUCT_MAP_MESSAGE_LAZY(_field_desc_, _struct_, _field_, _struct_map_, _count_) \
+    LWPB_STRUCT_MAP_FIELD_FLAGS(_field_desc_, _struct_, _field_,            \
+        (size_t) (_struct_map_), _count_, LWPB_STRUCT_MAP_LAZY)
+
     
 #define LWPB_STRUCT_MAP_FIELD(_field_desc_, _struct_, _field_, _len_, _count_) \
+    LWPB_STRUCT_MAP_FIELD_FLAGS(_field_desc_, _struct_, _field_, _len_, _count_, 0)
+
+#define LWPB_STRUCT_MAP_FIELD_FLAGS(_field_desc_, _struct_, _field_, _len_, _count_, _flags_) \
         {                                                                   \
             .field_desc = _field_desc_,                                     \
             .ofs = (unsigned int) &((_struct_ *) 0)->_field_,               \
             .len = _len_,                                                   \
             .count = _count_,                                               \
+            .flags = _flags_,                                               \
         },
 
 #define LWPB_STRUCT_MAP_END                                                 \
@@ -79,11 +95,55 @@ const struct lwpb_struct_map _name_ = {                                     \
 };
 
 
+/* Struct map field flags */
+#define LWPB_STRUCT_MAP_VIEW    (1 << 0)    /**< Field is a view into the input buffer */
+#define LWPB_STRUCT_MAP_LAZY    (1 << 1)    /**< Message field is decoded on access */
+
+/**
+ * String view stored by LWPB_STRUCT_MAP_STRING_VIEW() fields. The view points
+ * into the decoded buffer, which must be kept alive as long as the view is
+ * used. The string is not null-terminated.
+ */
+struct lwpb_string_view {
+    const char *str;
+    size_t len;
+};
+
+/**
+ * Bytes view stored by LWPB_STRUCT_MAP_BYTES_VIEW() fields. The view points
+ * into the decoded buffer, which must be kept alive as long as the view is
+ * used.
+ */
+struct lwpb_bytes_view {
+    const u8_t *data;
+    size_t len;
+};
+
+/* Forward declaration */
+struct lwpb_struct_map;
+
+/**
+ * Lazy submessage stored by LWPB_STRUCT_MAP_MESSAGE_LAZY() fields. The struct
+ * decoder only records the encoded span of the submessage, which is decoded
+ * by lwpb_struct_lazy_get() on first access. The span points into the decoded
+ * buffer, which must be kept alive until the submessage has been accessed.
+ * Like all other fields, lazy submessages missing from the input are left
+ * untouched by the decoder. If the struct is zeroed before decoding,
+ * lwpb_struct_lazy_get() returns a NULL struct for them.
+ */
+struct lwpb_struct_lazy {
+    void *data;                         /**< Encoded submessage */
+    size_t len;                         /**< Length of encoded submessage */
+    const struct lwpb_struct_map *map;  /**< Struct map of the submessage */
+    void *value;                        /**< Decoded struct or NULL */
+};
+
 struct lwpb_struct_map_field {
     const struct lwpb_field_desc *field_desc;
     unsigned int ofs;
     size_t len;
     size_t count;
+    unsigned int flags;
 };
 
 struct lwpb_struct_map {
@@ -34,9 +34,9 @@ static void debug_print_indent(void)
         LWPB_DIAG_PRINTF("  ");
 }
 
-static void debug_msg_start_handler(struct lwpb_decoder *decoder,
-                                    const struct lwpb_msg_desc *msg_desc,
-                                    void *arg)
+static lwpb_decoder_action_t debug_msg_start_handler(struct lwpb_decoder *decoder,
+                                                     const struct lwpb_msg_desc *msg_desc,
+                                                     void *arg)
 {
     const char *name;
 
@@ -49,6 +49,8 @@ static void debug_msg_start_handler(struct lwpb_decoder *decoder,
     debug_print_indent();
     LWPB_DIAG_PRINTF("%s:\n", name);
     debug_indent++;
+    
+    return LWPB_DECODER_CONTINUE;
 }
 
 static void debug_msg_end_handler(struct lwpb_decoder *decoder,
@@ -58,10 +60,10 @@ static void debug_msg_end_handler(struct lwpb_decoder *decoder,
     debug_indent--;
 }
 
-static void debug_field_handler(struct lwpb_decoder *decoder,
-                                const struct lwpb_msg_desc *msg_desc,
-                                const struct lwpb_field_desc *field_desc,
-                                union lwpb_value *value, void *arg)
+static lwpb_decoder_action_t debug_field_handler(struct lwpb_decoder *decoder,
+                                                 const struct lwpb_msg_desc *msg_desc,
+                                                 const struct lwpb_field_desc *field_desc,
+                                                 union lwpb_value *value, void *arg)
 {
     static char *typ_names[] = {
         "(double)",
@@ -138,6 +140,8 @@ static void debug_field_handler(struct lwpb_decoder *decoder,
     }
     
     LWPB_DIAG_PRINTF("\n");
+    
+    return LWPB_DECODER_CONTINUE;
 }
 
 // Decoder utilities
@@ -208,7 +212,12 @@ lwpb_err_t lwpb_decode_64bit(struct lwpb_buf *buf, u64_t *value)
     return LWPB_ERR_OK;
 }
 
-static enum wire_type field_wire_type(const struct lwpb_field_desc *field_desc)
+/**
+ * Returns the wire type used to encode a field.
+ * @param field_desc Field descriptor
+ * @return Returns the wire type of the field.
+ */
+enum wire_type lwpb_field_wire_type(const struct lwpb_field_desc *field_desc)
 {
     switch (field_desc->opts.typ) {
     case LWPB_DOUBLE:
@@ -236,10 +245,115 @@ static enum wire_type field_wire_type(const struct lwpb_field_desc *field_desc)
     case LWPB_STRING:
     case LWPB_BYTES:
     case LWPB_MESSAGE:
+    default:
         return WT_STRING;
     }
 }
 
+/**
+ * Decodes a wire value.
+ * @param buf Memory buffer
+ * @param wire_type Wire type of the value
+ * @param wire_value Buffer to decode into
+ * @return Returns LWPB_ERR_OK if successful, LWPB_ERR_END_OF_BUF if there
+ * were not enough bytes in the memory buffer or LWPB_ERR_INVALID_FIELD if the
+ * wire type is not supported.
+ */
+lwpb_err_t lwpb_decode_wire_value(struct lwpb_buf *buf,
+                                  enum wire_type wire_type,
+                                  union wire_value *wire_value)
+{
+    lwpb_err_t ret;
+    
+    switch (wire_type) {
+    case WT_VARINT:
+        return lwpb_decode_varint(buf, &wire_value->varint);
+    case WT_64BIT:
+        return lwpb_decode_64bit(buf, &wire_value->int64);
+    case WT_STRING:
+        ret = lwpb_decode_varint(buf, &wire_value->string.len);
+        if (ret != LWPB_ERR_OK)
+            return ret;
+        if (wire_value->string.len > lwpb_buf_left(buf))
+            return LWPB_ERR_END_OF_BUF;
+        wire_value->string.data = buf->pos;
+        buf->pos += wire_value->string.len;
+        return LWPB_ERR_OK;
+    case WT_32BIT:
+        return lwpb_decode_32bit(buf, &wire_value->int32);
+    default:
+        return LWPB_ERR_INVALID_FIELD;
+    }
+}
+
+/**
+ * Converts a wire value to the value of a field. Must not be used for
+ * message fields.
+ * @param field_desc Field descriptor
+ * @param wire_value Wire value
+ * @param value Buffer to convert into
+ */
+void lwpb_wire_value_to_value(const struct lwpb_field_desc *field_desc,
+                              union wire_value *wire_value,
+                              union lwpb_value *value)
+{
+    switch (field_desc->opts.typ) {
+    case LWPB_DOUBLE:
+        LWPB_MEMCPY(&value->double_, &wire_value->int64, sizeof(double));
+        break;
+    case LWPB_FLOAT:
+        LWPB_MEMCPY(&value->float_, &wire_value->int32, sizeof(float));
+        break;
+    case LWPB_INT32:
+        value->int32 = wire_value->varint;
+        break;
+    case LWPB_INT64:
+        value->int64 = wire_value->varint;
+        break;
+    case LWPB_UINT32:
+        value->uint32 = wire_value->varint;
+        break;
+    case LWPB_UINT64:
+        value->uint64 = wire_value->varint;
+        break;
+    case LWPB_SINT32:
+        // Zig-zag encoding
+        value->int32 = (wire_value->varint >> 1) ^ -((s32_t) (wire_value->varint & 1));
+        break;
+    case LWPB_SINT64:
+        // Zig-zag encoding
+        value->int64 = (wire_value->varint >> 1) ^ -((s64_t) (wire_value->varint & 1));
+        break;
+    case LWPB_FIXED32:
+        value->uint32 = wire_value->int32;
+        break;
+    case LWPB_FIXED64:
+        value->uint64 = wire_value->int64;
+        break;
+    case LWPB_SFIXED32:
+        value->int32 = wire_value->int32;
+        break;
+    case LWPB_SFIXED64:
+        value->int64 = wire_value->int64;
+        break;
+    case LWPB_BOOL:
+        value->bool = wire_value->varint;
+        break;
+    case LWPB_ENUM:
+        value->enum_ = wire_value->varint;
+        break;
+    case LWPB_STRING:
+        value->string.len = wire_value->string.len;
+        value->string.str = wire_value->string.data;
+        break;
+    case LWPB_BYTES:
+    case LWPB_MESSAGE:
+        value->bytes.len = wire_value->string.len;
+        value->bytes.data = wire_value->string.data;
+        break;
+    }
+}
+
 /**
  * Pushes the decoder stack.
  * @param decoder Dncoder
@@ -320,7 +434,8 @@ void lwpb_decoder_use_debug_handlers(struct lwpb_decoder *decoder)
  * @param data Data to decode
  * @param len Length of data to decode
  * @param used Returns the number of decoded bytes when not NULL.
- * @return Returns LWPB_ERR_OK when data was successfully decoded.
+ * @return Returns LWPB_ERR_OK when data was successfully decoded or
+ * LWPB_ERR_CANCEL when decoding was stopped by a handler.
  */
 lwpb_err_t lwpb_decoder_decode(struct lwpb_decoder *decoder,
                                const struct lwpb_msg_desc *msg_desc,
@@ -335,6 +450,7 @@ lwpb_err_t lwpb_decoder_decode(struct lwpb_decoder *decoder,
     union wire_value wire_value;
     union lwpb_value value;
     struct lwpb_decoder_stack_frame *frame, *new_frame;
+    lwpb_decoder_action_t action;
     
     // Setup initial stack frame
     decoder->depth = 1;
@@ -350,15 +466,20 @@ decode_nested:
         frame = &decoder->stack[decoder->depth - 1];
         
         // Notify start message
-        if (frame->msg_desc && lwpb_buf_used(&frame->buf) == 0)
-            if (decoder->msg_start_handler)
-                decoder->msg_start_handler(decoder, frame->msg_desc, decoder->arg);
+        if (!decoder->packed && lwpb_buf_used(&frame->buf) == 0 &&
+            decoder->msg_start_handler) {
+            action = decoder->msg_start_handler(decoder, frame->msg_desc, decoder->arg);
+            if (action == LWPB_DECODER_STOP)
+                return LWPB_ERR_CANCEL;
+            if (action == LWPB_DECODER_SKIP)
+                frame->buf.pos = frame->buf.end;
+        }
 
         // Process buffer
         while (lwpb_buf_left(&frame->buf) > 0) {
             
             if (decoder->packed) {
-                wire_type = field_wire_type(field_desc);
+                wire_type = lwpb_field_wire_type(field_desc);
             } else {
                 // Decode the field key
                 ret = lwpb_decode_varint(&frame->buf, &key);
@@ -369,6 +490,7 @@ decode_nested:
                 wire_type = key & 0x07;
             
                 // Find the field descriptor
+                field_desc = NULL;
                 for (i = 0; i < frame->msg_desc->num_fields; i++)
                     if (frame->msg_desc->fields[i].number == number) {
                         field_desc = &frame->msg_desc->fields[i];
@@ -377,35 +499,9 @@ decode_nested:
             }
             
             // Decode field's wire value
-            switch(wire_type) {
-            case WT_VARINT:
-                ret = lwpb_decode_varint(&frame->buf, &wire_value.varint);
-                if (ret != LWPB_ERR_OK)
-                    return ret;
-                break;
-            case WT_64BIT:
-                ret = lwpb_decode_64bit(&frame->buf, &wire_value.int64);
-                if (ret != LWPB_ERR_OK)
-                    return ret;
-                break;
-            case WT_STRING:
-                ret = lwpb_decode_varint(&frame->buf, &wire_value.string.len);
-                if (ret != LWPB_ERR_OK)
-                    return ret;
-                if (wire_value.string.len > lwpb_buf_left(&frame->buf))
-                    return LWPB_ERR_END_OF_BUF;
-                wire_value.string.data = frame->buf.pos;
-                frame->buf.pos += wire_value.string.len;
-                break;
-            case WT_32BIT:
-                ret = lwpb_decode_32bit(&frame->buf, &wire_value.int32);
-                if (ret != LWPB_ERR_OK)
-                    return ret;
-                break;
-            default:
-                LWPB_ASSERT(1, "Unknown wire type");
-                break;
-            }
+            ret = lwpb_decode_wire_value(&frame->buf, wire_type, &wire_value);
+            if (ret != LWPB_ERR_OK)
+                return ret;
             
             // Skip unknown fields
             if (!field_desc)
@@ -426,63 +522,14 @@ decode_nested:
                 goto decode_nested;
             }
             
-            switch (field_desc->opts.typ) {
-            case LWPB_DOUBLE:
-                LWPB_MEMCPY(&value.double_, &wire_value.int64, sizeof(double));
-                break;
-            case LWPB_FLOAT:
-                LWPB_MEMCPY(&value.float_, &wire_value.int32, sizeof(float));
-                break;
-            case LWPB_INT32:
-                value.int32 = wire_value.varint;
-                break;
-            case LWPB_INT64:
-                value.int64 = wire_value.varint;
-                break;
-            case LWPB_UINT32:
-                value.uint32 = wire_value.varint;
-                break;
-            case LWPB_UINT64:
-                value.uint64 = wire_value.varint;
-                break;
-            case LWPB_SINT32:
-                // Zig-zag encoding
-                value.int32 = (wire_value.varint >> 1) ^ -((s32_t) (wire_value.varint & 1));
-                break;
-            case LWPB_SINT64:
-                // Zig-zag encoding
-                value.int64 = (wire_value.varint >> 1) ^ -((s64_t) (wire_value.varint & 1));
-                break;
-            case LWPB_FIXED32:
-                value.uint32 = wire_value.int32;
-                break;
-            case LWPB_FIXED64:
-                value.uint64 = wire_value.int64;
-                break;
-            case LWPB_SFIXED32:
-                value.int32 = wire_value.int32;
-                break;
-            case LWPB_SFIXED64:
-                value.int64 = wire_value.int64;
-                break;
-            case LWPB_BOOL:
-                value.bool = wire_value.varint;
-                break;
-            case LWPB_ENUM:
-                value.enum_ = wire_value.varint;
-                break;
-            case LWPB_STRING:
-                value.string.len = wire_value.string.len;
-                value.string.str = wire_value.string.data;
-                break;
-            case LWPB_BYTES:
-                value.bytes.len = wire_value.string.len;
-                value.bytes.data = wire_value.string.data;
-                break;
-            case LWPB_MESSAGE:
-            default:
-                if (decoder->field_handler)
-                    decoder->field_handler(decoder, msg_desc, field_desc, NULL, decoder->arg);
+            if (field_desc->opts.typ == LWPB_MESSAGE) {
+                if (decoder->field_handler) {
+                    action = decoder->field_handler(decoder, frame->msg_desc, field_desc, NULL, decoder->arg);
+                    if (action == LWPB_DECODER_STOP)
+                        return LWPB_ERR_CANCEL;
+                    if (action == LWPB_DECODER_SKIP)
+                        continue;
+                }
                 
                 // Create new stack frame
                 new_frame = push_stack_frame(decoder);
@@ -492,14 +539,25 @@ decode_nested:
                 goto decode_nested;
             }
             
-            if (decoder->field_handler)
-                decoder->field_handler(decoder, frame->msg_desc, field_desc, &value, decoder->arg);
+            lwpb_wire_value_to_value(field_desc, &wire_value, &value);
+            
+            if (decoder->field_handler) {
+                action = decoder->field_handler(decoder, frame->msg_desc, field_desc, &value, decoder->arg);
+                if (action == LWPB_DECODER_STOP)
+                    return LWPB_ERR_CANCEL;
+                if (action == LWPB_DECODER_SKIP) {
+                    // Skip the rest of the message containing the field
+                    frame->buf.pos = frame->buf.end;
+                    if (decoder->packed)
+                        decoder->stack[decoder->depth - 2].buf.pos =
+                            decoder->stack[decoder->depth - 2].buf.end;
+                }
+            }
         }
         
         // Notify end message
-        if (frame->msg_desc)
-            if (decoder->msg_end_handler)
-                decoder->msg_end_handler(decoder, frame->msg_desc, decoder->arg);
+        if (!decoder->packed && decoder->msg_end_handler)
+            decoder->msg_end_handler(decoder, frame->msg_desc, decoder->arg);
         
         // Pop the stack
         decoder->depth--;
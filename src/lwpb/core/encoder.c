@@ -99,6 +99,103 @@ static lwpb_err_t encode_64bit(struct lwpb_buf *buf, u64_t value)
     return LWPB_ERR_OK;
 }
 
+/**
+ * Encodes the key and wire value of a field.
+ * @param buf Memory buffer
+ * @param key Field key or NULL for values of packed repeated fields
+ * @param wire_type Wire type
+ * @param wire_value Wire value
+ * @param overlap Set if a string value may overlap the buffer (nested
+ * messages and packed repeated fields)
+ * @return Returns LWPB_ERR_OK if successful or LWPB_ERR_END_OF_BUF if there
+ * was not enough space left in the memory buffer.
+ */
+static lwpb_err_t encode_wire(struct lwpb_buf *buf, u64_t *key,
+                              enum wire_type wire_type,
+                              union wire_value *wire_value, int overlap)
+{
+    lwpb_err_t ret;
+    
+    if (key) {
+        ret = encode_varint(buf, *key);
+        if (ret != LWPB_ERR_OK)
+            return ret;
+    }
+    
+    switch (wire_type) {
+    case WT_VARINT:
+        return encode_varint(buf, wire_value->varint);
+    case WT_64BIT:
+        return encode_64bit(buf, wire_value->int64);
+    case WT_STRING:
+        ret = encode_varint(buf, wire_value->string.len);
+        if (ret != LWPB_ERR_OK)
+            return ret;
+        if (lwpb_buf_left(buf) < wire_value->string.len)
+            return LWPB_ERR_END_OF_BUF;
+        // Use memmove() when writing a message or packed repeated field as the
+        // memory areas are overlapping.
+        if (overlap) {
+            LWPB_MEMMOVE(buf->pos, wire_value->string.data, wire_value->string.len);
+        } else {
+            LWPB_MEMCPY(buf->pos, wire_value->string.data, wire_value->string.len);
+        }
+        buf->pos += wire_value->string.len;
+        break;
+    case WT_32BIT:
+        return encode_32bit(buf, wire_value->int32);
+    default:
+        LWPB_ASSERT(1, "Unknown wire type");
+        break;
+    }
+    
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Grows the buffer of the encoder with the grow handler and moves all stack
+ * frames to the new buffer. Nested frames share the end of the buffer, so
+ * they all get the added space.
+ * @param encoder Encoder
+ * @param need Number of bytes needed after the position of the top frame
+ * @param wire_value Wire value which may point into the buffer or NULL
+ * @return Returns LWPB_ERR_OK if successful or LWPB_ERR_END_OF_BUF if the
+ * buffer cannot grow.
+ */
+static lwpb_err_t grow_buffer(struct lwpb_encoder *encoder, size_t need,
+                              union wire_value *wire_value)
+{
+    struct lwpb_buf *buf;
+    u8_t *old = encoder->stack[0].buf.base;
+    size_t old_len = encoder->stack[0].buf.end - old;
+    size_t len = old_len;
+    size_t used;
+    u8_t *data;
+    int i;
+    
+    if (!encoder->grow_handler)
+        return LWPB_ERR_END_OF_BUF;
+    
+    used = encoder->stack[encoder->depth - 1].buf.pos - old;
+    data = encoder->grow_handler(old, &len, used + need, encoder->grow_arg);
+    if (!data)
+        return LWPB_ERR_END_OF_BUF;
+    
+    for (i = 0; i < encoder->depth; i++) {
+        buf = &encoder->stack[i].buf;
+        buf->pos = data + (buf->pos - old);
+        buf->base = data + (buf->base - old);
+        buf->end = data + len;
+    }
+    
+    // Nested messages are copied from the buffer into their parent frame
+    if (wire_value && (u8_t *) wire_value->string.data >= old &&
+        (u8_t *) wire_value->string.data < old + old_len)
+        wire_value->string.data = data + ((u8_t *) wire_value->string.data - old);
+    
+    return LWPB_ERR_OK;
+}
+
 /**
  * Pushes the encoder stack.
  * @param encoder Encoder
@@ -132,6 +229,25 @@ static struct lwpb_encoder_stack_frame *pop_stack_frame(struct lwpb_encoder *enc
 void lwpb_encoder_init(struct lwpb_encoder *encoder)
 {
     encoder->depth = 0;
+    encoder->grow_handler = NULL;
+    encoder->grow_arg = NULL;
+}
+
+/**
+ * Sets the handler growing the buffer when it runs out of space. Without a
+ * grow handler, fields which don't fit fail with LWPB_ERR_END_OF_BUF. Since
+ * the buffer may move, the encoded message has to be taken from
+ * lwpb_encoder_data() when finished.
+ * @param encoder Encoder
+ * @param grow_handler Grow handler or NULL
+ * @param arg User argument passed to the grow handler
+ */
+void lwpb_encoder_grow_handler(struct lwpb_encoder *encoder,
+                               lwpb_encoder_grow_handler_t grow_handler,
+                               void *arg)
+{
+    encoder->grow_handler = grow_handler;
+    encoder->grow_arg = arg;
 }
 
 /**
@@ -165,6 +281,17 @@ size_t lwpb_encoder_finish(struct lwpb_encoder *encoder)
     return lwpb_buf_used(&encoder->stack[0].buf);
 }
 
+/**
+ * Returns the buffer holding the encoded message. This is the buffer passed
+ * to lwpb_encoder_start() unless the grow handler replaced it.
+ * @param encoder Encoder
+ * @return Returns the buffer of the message.
+ */
+void *lwpb_encoder_data(struct lwpb_encoder *encoder)
+{
+    return encoder->stack[0].buf.base;
+}
+
 /**
  * Starts encoding a nested message.
  * @param encoder Encoder
@@ -181,16 +308,17 @@ lwpb_err_t lwpb_encoder_nested_start(struct lwpb_encoder *encoder,
     // Get parent frame
     frame = &encoder->stack[encoder->depth - 1];
 
-    // Create a new frame
-    new_frame = push_stack_frame(encoder);
-    new_frame->field_desc = field_desc;
-    new_frame->msg_desc = field_desc->msg_desc;
-    
     // Reserve a few bytes for the field on the parent frame. This is where
     // the field key (message) and the message length will be stored, once it
     // is known.
-    if (lwpb_buf_left(&frame->buf) < MSG_RESERVE_BYTES)
+    if (lwpb_buf_left(&frame->buf) < MSG_RESERVE_BYTES &&
+        grow_buffer(encoder, MSG_RESERVE_BYTES, NULL) != LWPB_ERR_OK)
         return LWPB_ERR_END_OF_BUF;
+
+    // Create a new frame
+    new_frame = push_stack_frame(encoder);
+    new_frame->field_desc = field_desc;
+    new_frame->msg_desc = field_desc->msg_desc;
     lwpb_buf_init(&new_frame->buf, frame->buf.pos + MSG_RESERVE_BYTES,
                   lwpb_buf_left(&frame->buf) - MSG_RESERVE_BYTES);
     
@@ -237,16 +365,17 @@ lwpb_err_t lwpb_encoder_packed_repeated_start(struct lwpb_encoder *encoder,
     // Get parent frame
     frame = &encoder->stack[encoder->depth - 1];
 
-    // Create a new frame
-    new_frame = push_stack_frame(encoder);
-    new_frame->field_desc = field_desc;
-    new_frame->msg_desc = NULL;
-    
     // Reserve a few bytes for the field on the parent frame. This is where
     // the field key (type) and the message length will be stored, once it
     // is known.
-    if (lwpb_buf_left(&frame->buf) < MSG_RESERVE_BYTES)
+    if (lwpb_buf_left(&frame->buf) < MSG_RESERVE_BYTES &&
+        grow_buffer(encoder, MSG_RESERVE_BYTES, NULL) != LWPB_ERR_OK)
         return LWPB_ERR_END_OF_BUF;
+
+    // Create a new frame
+    new_frame = push_stack_frame(encoder);
+    new_frame->field_desc = field_desc;
+    new_frame->msg_desc = NULL;
     lwpb_buf_init(&new_frame->buf, frame->buf.pos + MSG_RESERVE_BYTES,
                   lwpb_buf_left(&frame->buf) - MSG_RESERVE_BYTES);
     
@@ -301,6 +430,7 @@ lwpb_err_t lwpb_encoder_add_field(struct lwpb_encoder *encoder,
     u64_t key;
     enum wire_type wire_type = 0;
     union wire_value wire_value;
+    u8_t *pos;
     
     LWPB_ASSERT(encoder->depth > 0, "Fields can only be added inside a message");
     
@@ -400,59 +530,31 @@ lwpb_err_t lwpb_encoder_add_field(struct lwpb_encoder *encoder,
         break;
     }
     
-    // Do not encode field key for packed repeated fields
-    if (!encoder->packed) {
-        // Override wire value if this is a packed repeated field
-        if (LWPB_IS_PACKED_REPEATED(field_desc)) {
-            wire_type = WT_STRING;
-            wire_value.string.data = value->message.data;
-            wire_value.string.len = value->message.len;
-        }
-        
-        key = wire_type | (field_desc->number << 3);
-        ret = encode_varint(&frame->buf, key);
-        if (ret != LWPB_ERR_OK)
-            return ret;
+    // Override wire value if this is a packed repeated field
+    if (!encoder->packed && LWPB_IS_PACKED_REPEATED(field_desc)) {
+        wire_type = WT_STRING;
+        wire_value.string.data = value->message.data;
+        wire_value.string.len = value->message.len;
     }
+    key = wire_type | (field_desc->number << 3);
     
-    switch (wire_type) {
-    case WT_VARINT:
-        ret = encode_varint(&frame->buf, wire_value.varint);
-        if (ret != LWPB_ERR_OK)
-            return ret;
-        break;
-    case WT_64BIT:
-        ret = encode_64bit(&frame->buf, wire_value.int64);
-        if (ret != LWPB_ERR_OK)
+    // Retry with a larger buffer if the field does not fit
+    pos = frame->buf.pos;
+    for (;;) {
+        ret = encode_wire(&frame->buf, encoder->packed ? NULL : &key,
+                          wire_type, &wire_value,
+                          (field_desc->opts.typ == LWPB_MESSAGE) ||
+                          LWPB_IS_PACKED_REPEATED(field_desc));
+        if (ret != LWPB_ERR_END_OF_BUF)
             return ret;
-        break;
-    case WT_STRING:
-        ret = encode_varint(&frame->buf, wire_value.string.len);
+        frame->buf.pos = pos;
+        ret = grow_buffer(encoder, 2 * MSG_RESERVE_BYTES +
+                          (wire_type == WT_STRING ? wire_value.string.len : 0),
+                          wire_type == WT_STRING ? &wire_value : NULL);
         if (ret != LWPB_ERR_OK)
             return ret;
-        if (lwpb_buf_left(&frame->buf) < wire_value.string.len)
-            return LWPB_ERR_END_OF_BUF;
-        // Use memmove() when writing a message or packed repeated field as the
-        // memory areas are overlapping.
-        if ((field_desc->opts.typ == LWPB_MESSAGE) ||
-            LWPB_IS_PACKED_REPEATED(field_desc)) {
-            LWPB_MEMMOVE(frame->buf.pos, wire_value.string.data, wire_value.string.len);
-        } else {
-            LWPB_MEMCPY(frame->buf.pos, wire_value.string.data, wire_value.string.len);
-        }
-        frame->buf.pos += wire_value.string.len;
-        break;
-    case WT_32BIT:
-        ret = encode_32bit(&frame->buf, wire_value.int32);
-        if (ret != LWPB_ERR_OK)
-            return ret;
-        break;
-    default:
-        LWPB_ASSERT(1, "Unknown wire type");
-        break;
+        pos = frame->buf.pos;
     }
-    
-    return LWPB_ERR_OK;
 }
 
 /**
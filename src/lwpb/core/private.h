@@ -48,4 +48,14 @@ size_t lwpb_buf_used(struct lwpb_buf *buf);
 
 size_t lwpb_buf_left(struct lwpb_buf *buf);
 
+enum wire_type lwpb_field_wire_type(const struct lwpb_field_desc *field_desc);
+
+lwpb_err_t lwpb_decode_wire_value(struct lwpb_buf *buf,
+                                  enum wire_type wire_type,
+                                  union wire_value *wire_value);
+
+void lwpb_wire_value_to_value(const struct lwpb_field_desc *field_desc,
+                              union wire_value *wire_value,
+                              union lwpb_value *value);
+
 #endif // __LWPB_CORE_PRIVATE_H__
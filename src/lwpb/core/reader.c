@@ -0,0 +1,203 @@
+/** @file reader.c
+ * 
+ * Implementation of the protocol buffers pull reader.
+ * 
+ * Copyright 2009 Simon Kallweit
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *     
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <lwpb/lwpb.h>
+
+#include "private.h"
+
+
+/**
+ * Finds a field descriptor by its number. The lookup starts at the field
+ * following the previously found one, as fields are usually encoded in
+ * order.
+ * @param frame Reader stack frame
+ * @param number Field number
+ * @return Returns the field descriptor or NULL if the field is unknown.
+ */
+static const struct lwpb_field_desc *find_field(struct lwpb_reader_stack_frame *frame,
+                                                u32_t number)
+{
+    const struct lwpb_msg_desc *msg_desc = frame->msg_desc;
+    int i, index;
+    
+    for (i = 0; i < msg_desc->num_fields; i++) {
+        index = frame->field_hint + i;
+        if (index >= msg_desc->num_fields)
+            index -= msg_desc->num_fields;
+        if (msg_desc->fields[index].number == number) {
+            frame->field_hint = index + 1 < msg_desc->num_fields ? index + 1 : 0;
+            return &msg_desc->fields[index];
+        }
+    }
+    
+    return NULL;
+}
+
+/**
+ * Initializes the reader.
+ * @param reader Reader
+ * @param msg_desc Root message descriptor of the protocol buffer
+ * @param data Data to read
+ * @param len Length of data to read
+ */
+void lwpb_reader_init(struct lwpb_reader *reader,
+                      const struct lwpb_msg_desc *msg_desc,
+                      void *data, size_t len)
+{
+    reader->depth = 1;
+    lwpb_buf_init(&reader->stack[0].buf, data, len);
+    reader->stack[0].msg_desc = msg_desc;
+    reader->stack[0].field_hint = 0;
+    reader->field_desc = NULL;
+    lwpb_buf_init(&reader->packed, NULL, 0);
+}
+
+/**
+ * Reads the next field of the current message. Unknown fields are skipped.
+ * The values of packed repeated fields are returned one by one, like
+ * non-packed repeated fields.
+ * 
+ * For message fields, the value contains the encoded submessage in
+ * value->bytes. Call lwpb_reader_enter() to read the fields of the
+ * submessage.
+ * 
+ * When the end of the current message is reached, field_desc is set to NULL
+ * and the reader returns to the parent message, if there is one.
+ * @param reader Reader
+ * @param field_desc Returns the field descriptor or NULL at the end of the
+ * current message.
+ * @param value Returns the field value
+ * @return Returns LWPB_ERR_OK if successful, LWPB_ERR_END_OF_BUF if the
+ * protocol buffer is truncated or LWPB_ERR_INVALID_FIELD if it contains an
+ * unsupported wire type.
+ */
+lwpb_err_t lwpb_reader_next(struct lwpb_reader *reader,
+                            const struct lwpb_field_desc **field_desc,
+                            union lwpb_value *value)
+{
+    lwpb_err_t ret;
+    struct lwpb_reader_stack_frame *frame;
+    u64_t key;
+    enum wire_type wire_type;
+    union wire_value wire_value;
+    
+    // Return next value of a packed repeated field
+    if (lwpb_buf_left(&reader->packed) > 0) {
+        ret = lwpb_decode_wire_value(&reader->packed,
+                lwpb_field_wire_type(reader->field_desc), &wire_value);
+        if (ret != LWPB_ERR_OK)
+            return ret;
+        lwpb_wire_value_to_value(reader->field_desc, &wire_value, value);
+        *field_desc = reader->field_desc;
+        return LWPB_ERR_OK;
+    }
+    
+    frame = &reader->stack[reader->depth - 1];
+    
+    while (lwpb_buf_left(&frame->buf) > 0) {
+        // Decode the field key
+        ret = lwpb_decode_varint(&frame->buf, &key);
+        if (ret != LWPB_ERR_OK)
+            return ret;
+        
+        wire_type = key & 0x07;
+        
+        // Decode field's wire value
+        ret = lwpb_decode_wire_value(&frame->buf, wire_type, &wire_value);
+        if (ret != LWPB_ERR_OK)
+            return ret;
+        
+        // Skip unknown fields
+        reader->field_desc = find_field(frame, key >> 3);
+        if (!reader->field_desc)
+            continue;
+        
+        // Handle packed repeated fields
+        if (wire_type == WT_STRING &&
+            LWPB_IS_PACKED_REPEATED(reader->field_desc)) {
+            lwpb_buf_init(&reader->packed, wire_value.string.data,
+                          wire_value.string.len);
+            if (lwpb_buf_left(&reader->packed) == 0)
+                continue;
+            return lwpb_reader_next(reader, field_desc, value);
+        }
+        
+        if (wire_type != lwpb_field_wire_type(reader->field_desc))
+            return LWPB_ERR_INVALID_FIELD;
+        
+        // Remember submessage to enter
+        if (reader->field_desc->opts.typ == LWPB_MESSAGE)
+            lwpb_buf_init(&reader->msg, wire_value.string.data,
+                          wire_value.string.len);
+        
+        lwpb_wire_value_to_value(reader->field_desc, &wire_value, value);
+        *field_desc = reader->field_desc;
+        return LWPB_ERR_OK;
+    }
+    
+    // End of message, return to parent message
+    if (reader->depth > 1)
+        reader->depth--;
+    
+    reader->field_desc = NULL;
+    *field_desc = NULL;
+    
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Enters the submessage of the message field last returned by
+ * lwpb_reader_next(). The following calls to lwpb_reader_next() return the
+ * fields of the submessage.
+ * @param reader Reader
+ * @return Returns LWPB_ERR_OK if successful or LWPB_ERR_INVALID_FIELD if the
+ * last returned field is not a message field.
+ */
+lwpb_err_t lwpb_reader_enter(struct lwpb_reader *reader)
+{
+    struct lwpb_reader_stack_frame *frame;
+    
+    if (!reader->field_desc || reader->field_desc->opts.typ != LWPB_MESSAGE)
+        return LWPB_ERR_INVALID_FIELD;
+    
+    reader->depth++;
+    LWPB_ASSERT(reader->depth <= LWPB_MAX_DEPTH, "Message nesting too deep");
+    
+    frame = &reader->stack[reader->depth - 1];
+    frame->buf = reader->msg;
+    frame->msg_desc = reader->field_desc->msg_desc;
+    frame->field_hint = 0;
+    reader->field_desc = NULL;
+    
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Skips the remaining fields of the current message. The next call to
+ * lwpb_reader_next() signals the end of the message.
+ * @param reader Reader
+ */
+void lwpb_reader_skip(struct lwpb_reader *reader)
+{
+    struct lwpb_reader_stack_frame *frame;
+    
+    frame = &reader->stack[reader->depth - 1];
+    frame->buf.pos = frame->buf.end;
+    lwpb_buf_init(&reader->packed, NULL, 0);
+}
@@ -0,0 +1,677 @@
+/** @file capture.c
+ * 
+ * Capture and replay of the frames received by a socket server.
+ * 
+ * Copyright 2009 Simon Kallweit
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+
+#include <lwpb/lwpb.h>
+#include <lwpb/rpc/capture.h>
+#include <lwpb/rpc/socket.h>
+
+#include "socket_helper.h"
+
+
+/** Initial number of outstanding requests per replay connection */
+#define REPLAY_PENDING 16
+
+/** A replayed request waiting for its response */
+struct replay_request {
+    u32_t id;
+    u64_t time;                 /**< Time the request was sent (ns) */
+};
+
+/** Connection of the replay, one per captured connection */
+struct replay_conn {
+    int socket;
+    struct lwpb_socket_inq inq; /**< Received data */
+    struct lwpb_socket_outq outq; /**< Unsent frames */
+    struct replay_request *pending; /**< Requests waiting for a response */
+    int num_pending;
+    int pending_size;
+};
+
+/** State of a replay */
+struct replay {
+    struct addrinfo *addr;      /**< Address of the server */
+    struct replay_conn **by_serial; /**< Connections by captured serial number */
+    u32_t by_serial_size;
+    struct replay_conn **conns; /**< Opened connections */
+    struct pollfd *pfds;        /**< Poll set of the opened connections */
+    int num_conns;
+    int conns_size;
+    struct lwpb_replay_result *result;
+};
+
+
+/**
+ * Creates a capture file and writes its header. Frames are added with
+ * lwpb_capture_write(), usually by a socket server the capture is set on
+ * with lwpb_transport_socket_server_capture().
+ * @param capture Capture
+ * @param path Path of the capture file
+ * @return Returns LWPB_ERR_OK if successful or LWPB_ERR_NET_INIT if the
+ * file cannot be written.
+ */
+lwpb_err_t lwpb_capture_create(struct lwpb_capture *capture, const char *path)
+{
+    struct lwpb_capture_file_header header;
+
+    capture->start = lwpb_stats_now();
+    capture->frames = 0;
+    capture->bytes = 0;
+    capture->buf = NULL;
+    capture->size = 0;
+
+    capture->file = fopen(path, "wb");
+    if (!capture->file) {
+        LWPB_ERR("Cannot create capture file '%s' (errno: %d)", path, errno);
+        return LWPB_ERR_NET_INIT;
+    }
+
+    header.magic = htonl(LWPB_CAPTURE_MAGIC);
+    header.version = htonl(LWPB_CAPTURE_VERSION);
+    if (fwrite(&header, sizeof(header), 1, capture->file) != 1) {
+        LWPB_ERR("Cannot write capture file '%s'", path);
+        lwpb_capture_close(capture);
+        return LWPB_ERR_NET_INIT;
+    }
+
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Opens a capture file for reading its frames with lwpb_capture_read().
+ * @param capture Capture
+ * @param path Path of the capture file
+ * @return Returns LWPB_ERR_OK if successful, LWPB_ERR_NET_INIT if the file
+ * cannot be read or LWPB_ERR_INVALID_FIELD if it is no capture file.
+ */
+lwpb_err_t lwpb_capture_open(struct lwpb_capture *capture, const char *path)
+{
+    struct lwpb_capture_file_header header;
+
+    capture->start = 0;
+    capture->frames = 0;
+    capture->bytes = 0;
+    capture->buf = NULL;
+    capture->size = 0;
+
+    capture->file = fopen(path, "rb");
+    if (!capture->file) {
+        LWPB_ERR("Cannot open capture file '%s' (errno: %d)", path, errno);
+        return LWPB_ERR_NET_INIT;
+    }
+
+    if (fread(&header, sizeof(header), 1, capture->file) != 1 ||
+        ntohl(header.magic) != LWPB_CAPTURE_MAGIC ||
+        ntohl(header.version) != LWPB_CAPTURE_VERSION) {
+        LWPB_ERR("'%s' is no capture file", path);
+        lwpb_capture_close(capture);
+        return LWPB_ERR_INVALID_FIELD;
+    }
+
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Closes a capture file. A capture which is written must be removed from
+ * the socket server first.
+ * @param capture Capture
+ */
+void lwpb_capture_close(struct lwpb_capture *capture)
+{
+    if (capture->file)
+        fclose(capture->file);
+    capture->file = NULL;
+    LWPB_FREE(capture->buf);
+    capture->buf = NULL;
+    capture->size = 0;
+}
+
+/**
+ * Adds a frame to a capture file. The arrival time is the time since the
+ * capture was created.
+ * @param capture Capture
+ * @param conn Serial number of the connection the frame was received on
+ * @param frame Frame (pre-header, header and message)
+ * @param len Length of the frame
+ * @return Returns LWPB_ERR_OK if successful or LWPB_ERR_NET_INIT if the
+ * file cannot be written.
+ */
+lwpb_err_t lwpb_capture_write(struct lwpb_capture *capture, u32_t conn,
+                              const void *frame, size_t len)
+{
+    struct lwpb_capture_record_header header;
+    u64_t time = lwpb_stats_now() - capture->start;
+
+    header.conn = htonl(conn);
+    header.time_sec = htonl((u32_t) (time / 1000000000));
+    header.time_nsec = htonl((u32_t) (time % 1000000000));
+    header.len = htonl((u32_t) len);
+    if (fwrite(&header, sizeof(header), 1, capture->file) != 1 ||
+        fwrite(frame, 1, len, capture->file) != len)
+        return LWPB_ERR_NET_INIT;
+
+    capture->frames++;
+    capture->bytes += len;
+
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Reads the next frame of a capture file.
+ * @param capture Capture
+ * @param record Returns the frame, which is valid until the next frame is
+ * read
+ * @return Returns LWPB_ERR_OK if successful, LWPB_ERR_END_OF_BUF at the end
+ * of the file, LWPB_ERR_INVALID_FIELD if the file is truncated or
+ * LWPB_ERR_MEM if memory could not be allocated.
+ */
+lwpb_err_t lwpb_capture_read(struct lwpb_capture *capture,
+                             struct lwpb_capture_record *record)
+{
+    struct lwpb_capture_record_header header;
+    size_t len;
+    u8_t *tmp;
+
+    if (fread(&header, sizeof(header), 1, capture->file) != 1)
+        return feof(capture->file) && !ferror(capture->file) ?
+               LWPB_ERR_END_OF_BUF : LWPB_ERR_INVALID_FIELD;
+
+    len = ntohl(header.len);
+    if (len > capture->size) {
+        tmp = LWPB_REALLOC(capture->buf, len);
+        if (!tmp)
+            return LWPB_ERR_MEM;
+        capture->buf = tmp;
+        capture->size = len;
+    }
+    if (fread(capture->buf, 1, len, capture->file) != len)
+        return LWPB_ERR_INVALID_FIELD;
+
+    record->conn = ntohl(header.conn);
+    record->time = ntohl(header.time_sec) * 1000000000ULL + ntohl(header.time_nsec);
+    record->frame = capture->buf;
+    record->len = len;
+
+    capture->frames++;
+    capture->bytes += len;
+
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Returns the replay connection of a captured connection. The connection
+ * to the server is opened when the first frame of a captured connection is
+ * replayed.
+ * @param replay Replay
+ * @param serial Serial number of the captured connection
+ * @return Returns the connection or NULL if it cannot be opened.
+ */
+static struct replay_conn *get_conn(struct replay *replay, u32_t serial)
+{
+    struct replay_conn *conn;
+    void *tmp;
+    u32_t size;
+    int opts;
+
+    if (serial < replay->by_serial_size && replay->by_serial[serial])
+        return replay->by_serial[serial];
+
+    // Grow the connection tables
+    if (serial >= replay->by_serial_size) {
+        size = replay->by_serial_size ? replay->by_serial_size : 16;
+        while (size <= serial)
+            size *= 2;
+        tmp = LWPB_REALLOC(replay->by_serial, size * sizeof(*replay->by_serial));
+        if (!tmp)
+            return NULL;
+        replay->by_serial = tmp;
+        LWPB_MEMSET(replay->by_serial + replay->by_serial_size, 0,
+                    (size - replay->by_serial_size) * sizeof(*replay->by_serial));
+        replay->by_serial_size = size;
+    }
+    if (replay->num_conns == replay->conns_size) {
+        size = replay->conns_size ? replay->conns_size * 2 : 16;
+        tmp = LWPB_REALLOC(replay->conns, size * sizeof(*replay->conns));
+        if (!tmp)
+            return NULL;
+        replay->conns = tmp;
+        tmp = LWPB_REALLOC(replay->pfds, size * sizeof(*replay->pfds));
+        if (!tmp)
+            return NULL;
+        replay->pfds = tmp;
+        replay->conns_size = size;
+    }
+
+    conn = LWPB_MALLOC(sizeof(*conn));
+    if (!conn)
+        return NULL;
+    LWPB_MEMSET(conn, 0, sizeof(*conn));
+
+    conn->socket = socket(replay->addr->ai_family, replay->addr->ai_socktype,
+                          replay->addr->ai_protocol);
+    if (conn->socket == -1 ||
+        connect(conn->socket, replay->addr->ai_addr, replay->addr->ai_addrlen) == -1) {
+        LWPB_ERR("Cannot open connection (errno: %d)", errno);
+        if (conn->socket != -1)
+            close(conn->socket);
+        LWPB_FREE(conn);
+        return NULL;
+    }
+    opts = fcntl(conn->socket, F_GETFL);
+    fcntl(conn->socket, F_SETFL, opts | O_NONBLOCK);
+    set_socket_options(conn->socket, LWPB_TRANSPORT_SOCKET_NODELAY);
+
+    replay->by_serial[serial] = conn;
+    replay->conns[replay->num_conns++] = conn;
+    replay->result->conns++;
+
+    return conn;
+}
+
+/**
+ * Frees a replay connection.
+ * @param conn Replay connection
+ */
+static void free_conn(struct replay_conn *conn)
+{
+    close(conn->socket);
+    inq_free(&conn->inq);
+    outq_free(&conn->outq);
+    LWPB_FREE(conn->pending);
+    LWPB_FREE(conn);
+}
+
+/**
+ * Adds a request to the requests waiting for a response.
+ * @param conn Replay connection
+ * @param id Request ID
+ * @param t Time the request is sent (ns)
+ * @return Returns 0 if successful or -1 if memory could not be allocated.
+ */
+static int add_pending(struct replay_conn *conn, u32_t id, u64_t t)
+{
+    struct replay_request *tmp;
+    int size;
+
+    if (conn->num_pending == conn->pending_size) {
+        size = conn->pending_size ? conn->pending_size * 2 : REPLAY_PENDING;
+        tmp = LWPB_REALLOC(conn->pending, size * sizeof(*tmp));
+        if (!tmp)
+            return -1;
+        conn->pending = tmp;
+        conn->pending_size = size;
+    }
+
+    conn->pending[conn->num_pending].id = id;
+    conn->pending[conn->num_pending].time = t;
+    conn->num_pending++;
+
+    return 0;
+}
+
+/**
+ * Removes a request from the requests waiting for a response. Responses
+ * mostly arrive in order, so the oldest requests are searched first.
+ * @param conn Replay connection
+ * @param id Request ID
+ * @param t Returns the time the request was sent (ns)
+ * @return Returns 0 if successful or -1 if the request was not found.
+ */
+static int remove_pending(struct replay_conn *conn, u32_t id, u64_t *t)
+{
+    int i;
+
+    for (i = 0; i < conn->num_pending; i++) {
+        if (conn->pending[i].id != id)
+            continue;
+        *t = conn->pending[i].time;
+        conn->num_pending--;
+        LWPB_MEMMOVE(&conn->pending[i], &conn->pending[i + 1],
+                     (conn->num_pending - i) * sizeof(*conn->pending));
+        return 0;
+    }
+
+    return -1;
+}
+
+/**
+ * Tracks the requests of a frame which is sent to the server. Requests in
+ * BATCH frames are tracked one by one, CANCEL frames stop waiting for the
+ * cancelled request, as the server drops it without a response.
+ * @param replay Replay
+ * @param conn Replay connection
+ * @param frame Frame
+ * @param len Length of the frame
+ * @param t Time the frame is sent (ns)
+ * @return Returns 0 if successful or -1 if the frame is invalid.
+ */
+static int track_frame(struct replay *replay, struct replay_conn *conn,
+                       u8_t *frame, size_t len, u64_t t)
+{
+    struct protocol_header_info info;
+    struct protocol_header_info sub;
+    u8_t *msg;
+    size_t pos;
+    u64_t sent;
+
+    if (parse_request(frame, len, &info, NULL) != PARSE_ERR_OK)
+        return -1;
+
+    switch (info.msg_type) {
+    case MSG_TYPE_REQUEST:
+        replay->result->requests++;
+        return add_pending(conn, info.id, t);
+    case MSG_TYPE_BATCH:
+        msg = frame + info.header_len;
+        for (pos = 0; pos < info.msg_len; pos += sub.header_len + sub.msg_len) {
+            if (parse_request(msg + pos, info.msg_len - pos, &sub, NULL) !=
+                PARSE_ERR_OK)
+                return -1;
+            replay->result->requests++;
+            if (add_pending(conn, sub.id, t) != 0)
+                return -1;
+        }
+        return 0;
+    case MSG_TYPE_CANCEL:
+        if (remove_pending(conn, info.id, &sent) == 0)
+            replay->result->cancelled++;
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Handles the complete frames received from the server. Responses and the
+ * ends of streams complete their request, the HELLO answer is ignored.
+ * @param replay Replay
+ * @param conn Replay connection
+ * @param t Current time (ns)
+ * @return Returns 0 if successful or -1 if the server sent an invalid frame.
+ */
+static int handle_frames(struct replay *replay, struct replay_conn *conn, u64_t t)
+{
+    struct lwpb_replay_result *result = replay->result;
+    struct protocol_header_info info;
+    protocol_parse_err_t ret;
+    size_t pos = 0;
+    u64_t sent;
+
+    for (;;) {
+        ret = parse_request(conn->inq.data + pos, conn->inq.len - pos, &info,
+                            NULL);
+        if (ret == PARSE_ERR_END_OF_BUF)
+            break;
+        if (ret != PARSE_ERR_OK)
+            return -1;
+        pos += info.header_len + info.msg_len;
+
+        if (info.msg_type == MSG_TYPE_STREAM) {
+            result->messages++;
+            continue;
+        }
+        if (info.msg_type != MSG_TYPE_RESPONSE &&
+            info.msg_type != MSG_TYPE_STREAM_END)
+            continue;
+        if (remove_pending(conn, info.id, &sent) != 0)
+            continue;
+
+        result->responses++;
+        if (info.status != LWPB_RPC_OK)
+            result->errors++;
+        lwpb_histogram_record(&result->latency, t - sent);
+        result->duration = t;
+    }
+
+    inq_consume(&conn->inq, pos);
+
+    return inq_reserve(&conn->inq, info.header_len + info.msg_len);
+}
+
+/**
+ * Reads the data the server sent on a replay connection.
+ * @param replay Replay
+ * @param conn Replay connection
+ * @param t Current time (ns)
+ * @return Returns 0 if successful or -1 if the connection failed.
+ */
+static int read_conn(struct replay *replay, struct replay_conn *conn, u64_t t)
+{
+    ssize_t len;
+
+    for (;;) {
+        if (handle_frames(replay, conn, t) != 0) {
+            LWPB_ERR("Server sent invalid frame");
+            return -1;
+        }
+
+        len = recv(conn->socket, conn->inq.data + conn->inq.len,
+                   conn->inq.size - conn->inq.len, 0);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (len <= 0) {
+            LWPB_ERR("Server closed connection");
+            return -1;
+        }
+        conn->inq.len += len;
+    }
+}
+
+/**
+ * Returns the number of requests waiting for a response.
+ * @param replay Replay
+ * @return Returns the number of outstanding requests.
+ */
+static u64_t num_pending(struct replay *replay)
+{
+    u64_t n = 0;
+    int i;
+
+    for (i = 0; i < replay->num_conns; i++)
+        n += replay->conns[i]->num_pending;
+
+    return n;
+}
+
+/**
+ * Waits for the connections of a replay to get ready, sends their queued
+ * frames and reads the responses.
+ * @param replay Replay
+ * @param timeout Maximum time to wait (ms)
+ * @param last Returns the time a response was last received (ns)
+ * @return Returns 0 if successful or -1 if a connection failed.
+ */
+static int poll_conns(struct replay *replay, int timeout, u64_t *last)
+{
+    struct replay_conn *conn;
+    u64_t responses = replay->result->responses;
+    u64_t t;
+    int i;
+
+    for (i = 0; i < replay->num_conns; i++) {
+        replay->pfds[i].fd = replay->conns[i]->socket;
+        replay->pfds[i].events = POLLIN;
+        if (replay->conns[i]->outq.len)
+            replay->pfds[i].events |= POLLOUT;
+        replay->pfds[i].revents = 0;
+    }
+
+    if (poll(replay->pfds, replay->num_conns, timeout) < 0 && errno != EINTR)
+        return -1;
+
+    t = lwpb_stats_now();
+    for (i = 0; i < replay->num_conns; i++) {
+        conn = replay->conns[i];
+        if ((replay->pfds[i].revents & POLLOUT) &&
+            outq_flush(conn->socket, &conn->outq, 0) < 0) {
+            LWPB_ERR("Cannot send data to server (errno: %d)", errno);
+            return -1;
+        }
+        if ((replay->pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) &&
+            read_conn(replay, conn, t) != 0)
+            return -1;
+    }
+
+    if (replay->result->responses != responses)
+        *last = t;
+
+    return 0;
+}
+
+/**
+ * Replays a capture against a server. Every captured connection gets its
+ * own connection to the server, on which its frames are sent in the
+ * captured order. Frames are either sent at their captured arrival time,
+ * scaled by the speed, or as fast as possible. The latency of a request is
+ * the time from sending it to its response. Once all frames are sent, the
+ * replay waits up to LWPB_REPLAY_DRAIN_TIMEOUT for outstanding responses,
+ * as requests which expired in the server are never answered.
+ * 
+ * Frames are replayed as captured, so v2 frames need a server with the same
+ * service list. Requests are answered by the server, but the responses are
+ * not decoded.
+ * @param capture Capture opened for reading
+ * @param host Host of the server
+ * @param port Port of the server
+ * @param speed Factor the captured timing is sped up by, 0 to send as fast
+ * as possible
+ * @param result Returns the results of the replay
+ * @return Returns LWPB_ERR_OK if successful, LWPB_ERR_NET_INIT if the
+ * server cannot be reached, LWPB_ERR_INVALID_FIELD if the capture or the
+ * responses hold invalid frames or LWPB_ERR_MEM if memory could not be
+ * allocated.
+ */
+lwpb_err_t lwpb_replay_run(struct lwpb_capture *capture, const char *host,
+                           u16_t port, double speed,
+                           struct lwpb_replay_result *result)
+{
+    struct replay replay;
+    struct lwpb_capture_record record;
+    struct lwpb_socket_outq frame;
+    struct addrinfo hints;
+    struct replay_conn *conn;
+    lwpb_err_t ret;
+    lwpb_err_t err = LWPB_ERR_OK;
+    char tmp[16];
+    u64_t start;
+    u64_t last;
+    u64_t due = 0;
+    u64_t t;
+    int timeout;
+    int status;
+    int i, n;
+
+    LWPB_MEMSET(result, 0, sizeof(*result));
+    LWPB_MEMSET(&replay, 0, sizeof(replay));
+    replay.result = result;
+
+    // Resolve hostname
+    LWPB_MEMSET(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(tmp, sizeof(tmp), "%d", port);
+    if ((status = getaddrinfo(host, tmp, &hints, &replay.addr)) != 0) {
+        LWPB_ERR("getaddrinfo error: %s", gai_strerror(status));
+        return LWPB_ERR_NET_INIT;
+    }
+
+    ret = lwpb_capture_read(capture, &record);
+    start = lwpb_stats_now();
+    last = start;
+    for (;;) {
+        // Send the frames which are due, a burst at a time
+        t = lwpb_stats_now();
+        for (n = 0; ret == LWPB_ERR_OK && n < LWPB_REPLAY_BURST; n++) {
+            if (speed > 0) {
+                due = start + (u64_t) (record.time / speed);
+                if (due > t)
+                    break;
+            }
+            conn = get_conn(&replay, record.conn);
+            if (!conn) {
+                err = LWPB_ERR_NET_INIT;
+                goto out;
+            }
+            if (track_frame(&replay, conn, record.frame, record.len, t) != 0) {
+                LWPB_ERR("Capture holds invalid frame");
+                err = LWPB_ERR_INVALID_FIELD;
+                goto out;
+            }
+            frame.data = record.frame;
+            frame.len = record.len;
+            frame.size = record.len;
+            if (send_frames(conn->socket, &conn->outq, 0, &frame) != 0) {
+                LWPB_ERR("Cannot send data to server (errno: %d)", errno);
+                err = LWPB_ERR_NET_INIT;
+                goto out;
+            }
+            result->frames++;
+            result->bytes += record.len;
+            last = t;
+            ret = lwpb_capture_read(capture, &record);
+        }
+        if (ret != LWPB_ERR_OK && ret != LWPB_ERR_END_OF_BUF) {
+            err = ret;
+            goto out;
+        }
+
+        // Wait for the next frame, or for the outstanding responses until
+        // none arrived for a while
+        if (ret == LWPB_ERR_OK) {
+            timeout = speed > 0 && due > t ? (int) ((due - t + 999999) / 1000000) : 0;
+        } else {
+            if (!num_pending(&replay) ||
+                t - last >= LWPB_REPLAY_DRAIN_TIMEOUT * 1000000ULL)
+                break;
+            timeout = LWPB_REPLAY_DRAIN_TIMEOUT - (int) ((t - last) / 1000000);
+        }
+        if (poll_conns(&replay, timeout, &last) != 0) {
+            err = LWPB_ERR_NET_INIT;
+            goto out;
+        }
+    }
+
+out:
+    result->lost = num_pending(&replay);
+    if (result->duration)
+        result->duration -= start;
+
+    for (i = 0; i < replay.num_conns; i++)
+        free_conn(replay.conns[i]);
+    LWPB_FREE(replay.conns);
+    LWPB_FREE(replay.pfds);
+    LWPB_FREE(replay.by_serial);
+    freeaddrinfo(replay.addr);
+
+    return err;
+}
@@ -34,6 +34,8 @@ void lwpb_client_init(struct lwpb_client *client, lwpb_transport_t transport)
     client->request_handler = NULL;
     client->response_handler = NULL;
     client->done_handler = NULL;
+    client->timeout = 0;
+    lwpb_client_call_init(&client->call, NULL, NULL, NULL, NULL);
     
     // Register the client in the transport implementation
     client->transport->transport_funs->register_client(client->transport, client);
@@ -80,8 +82,17 @@ lwpb_err_t lwpb_client_call(struct lwpb_client *client,
     LWPB_ASSERT(client->response_handler, "Response handler missing");
     LWPB_ASSERT(client->done_handler, "Call done handler missing");
     
+    // Calls share the client's context, as they use the client handlers
+    client->call.request_handler = client->request_handler;
+    client->call.response_handler = client->response_handler;
+    client->call.done_handler = client->done_handler;
+    client->call.arg = client->arg;
+    client->call.result = LWPB_RPC_OK;
+    client->call.done = 0;
+    
     // Forward the call to the transport implementation
-    return client->transport->transport_funs->call(client->transport, client, method_desc);
+    return client->transport->transport_funs->call(client->transport, client,
+                                                   method_desc, &client->call);
 }
 
 /**
@@ -90,6 +101,168 @@ lwpb_err_t lwpb_client_call(struct lwpb_client *client,
  */
 void lwpb_client_cancel(struct lwpb_client *client)
 {
+    lwpb_client_call_cancel(client, &client->call);
+}
+
+/**
+ * Sets the default timeout of calls. Calls which are not done when their
+ * timeout expires complete with LWPB_RPC_TIMEOUT. The remaining time is
+ * passed on to the server, which drops requests it cannot start in time.
+ * @param client Client
+ * @param timeout Timeout (ms), 0 for no timeout
+ */
+void lwpb_client_timeout(struct lwpb_client *client, u32_t timeout)
+{
+    client->timeout = timeout;
+}
+
+/**
+ * Starts a batch of calls. Until lwpb_client_batch_end() is called, the
+ * transport may collect the requests of the following calls and send them
+ * together. Each call is still completed on its own.
+ * @param client Client
+ */
+void lwpb_client_batch_begin(struct lwpb_client *client)
+{
+    if (client->transport->transport_funs->batch)
+        client->transport->transport_funs->batch(client->transport, 1);
+}
+
+/**
+ * Ends a batch of calls and sends the collected requests.
+ * @param client Client
+ */
+void lwpb_client_batch_end(struct lwpb_client *client)
+{
+    if (client->transport->transport_funs->batch)
+        client->transport->transport_funs->batch(client->transport, 0);
+}
+
+/**
+ * Initializes the context of an asynchronous call.
+ * @param call Call context
+ * @param request_handler Request message handler
+ * @param response_handler Response message handler
+ * @param done_handler Call done handler (optional if the call is waited for
+ * with lwpb_client_wait())
+ * @param arg User argument passed to the handlers
+ */
+void lwpb_client_call_init(struct lwpb_client_call *call,
+                           lwpb_client_request_handler_t request_handler,
+                           lwpb_client_response_handler_t response_handler,
+                           lwpb_client_done_handler_t done_handler,
+                           void *arg)
+{
+    call->request_handler = request_handler;
+    call->response_handler = response_handler;
+    call->done_handler = done_handler;
+    call->arg = arg;
+    call->timeout = 0;
+    call->result = LWPB_RPC_OK;
+    call->done = 0;
+}
+
+/**
+ * Sets the timeout of an asynchronous call, overriding the default timeout
+ * of the client.
+ * @param call Call context
+ * @param timeout Timeout (ms), 0 for the client default
+ */
+void lwpb_client_call_timeout(struct lwpb_client_call *call, u32_t timeout)
+{
+    call->timeout = timeout;
+}
+
+/**
+ * Starts an asynchronous RPC call with its own call context. The call is
+ * completed when the transport receives the response, which may be before
+ * this method returns.
+ * @param client Client
+ * @param method_desc Method descriptor
+ * @param call Call context, which must stay valid until the call is done
+ * @return Returns LWPB_ERR_OK if successful.
+ */
+lwpb_err_t lwpb_client_call_async(struct lwpb_client *client,
+                                  const struct lwpb_method_desc *method_desc,
+                                  struct lwpb_client_call *call)
+{
+    LWPB_ASSERT(client->transport, "Transport implementation missing");
+    LWPB_ASSERT(call->request_handler, "Request handler missing");
+    LWPB_ASSERT(call->response_handler, "Response handler missing");
+    
+    call->result = LWPB_RPC_OK;
+    call->done = 0;
+    
+    // Forward the call to the transport implementation
+    return client->transport->transport_funs->call(client->transport, client,
+                                                   method_desc, call);
+}
+
+/**
+ * Cancels an outstanding asynchronous call. The call completes with
+ * LWPB_RPC_CANCELLED, unless it is already done.
+ * @param client Client
+ * @param call Call context
+ */
+void lwpb_client_call_cancel(struct lwpb_client *client,
+                             struct lwpb_client_call *call)
+{
+    if (call->done)
+        return;
+    
     // Forward the request to the transport implementation
-    client->transport->transport_funs->cancel(client->transport, client);
+    client->transport->transport_funs->cancel(client->transport, client, call);
+}
+
+/**
+ * Returns the timeout of a call. This method is called from the transport
+ * implementation when a call is started.
+ * @param client Client
+ * @param call Call context
+ * @return Returns the timeout (ms) or 0 if the call has no timeout.
+ */
+u32_t lwpb_client_get_timeout(struct lwpb_client *client,
+                              struct lwpb_client_call *call)
+{
+    return call->timeout ? call->timeout : client->timeout;
+}
+
+/**
+ * Waits until an asynchronous call is done. While waiting, the transport is
+ * updated, so other calls complete as well.
+ * @param client Client
+ * @param call Call context
+ * @return Returns the result code of the call.
+ */
+lwpb_rpc_result_t lwpb_client_wait(struct lwpb_client *client,
+                                   struct lwpb_client_call *call)
+{
+    const struct lwpb_transport_funs *funs = client->transport->transport_funs;
+    
+    while (!call->done) {
+        LWPB_ASSERT(funs->update, "Transport cannot wait for calls");
+        if (funs->update(client->transport) != LWPB_ERR_OK)
+            return LWPB_RPC_FAILED;
+    }
+    
+    return call->result;
+}
+
+/**
+ * Completes a call. This method is called from the transport implementation
+ * when a call is done.
+ * @param client Client
+ * @param method_desc Method descriptor
+ * @param call Call context
+ * @param result Result code
+ */
+void lwpb_client_call_done(struct lwpb_client *client,
+                           const struct lwpb_method_desc *method_desc,
+                           struct lwpb_client_call *call,
+                           lwpb_rpc_result_t result)
+{
+    call->result = result;
+    call->done = 1;
+    if (call->done_handler)
+        call->done_handler(client, method_desc, result, call->arg);
 }
@@ -21,6 +21,146 @@
 #include <lwpb/rpc/direct.h>
 
 
+/**
+ * Returns the server providing a service. The last routed service is cached,
+ * so repeated calls of a service don't scan the service lists.
+ * @param direct Direct transport
+ * @param service_desc Service descriptor
+ * @return Returns the server or NULL if no server provides the service.
+ */
+static struct lwpb_server *find_server(struct lwpb_transport_direct *direct,
+                                       const struct lwpb_service_desc *service_desc)
+{
+    const struct lwpb_service_desc **service;
+    int i;
+    
+    if (service_desc == direct->last_service)
+        return direct->last_server;
+    
+    for (i = 0; i < direct->num_servers; i++) {
+        for (service = direct->servers[i]->service_list; *service; service++) {
+            if (*service == service_desc) {
+                direct->last_service = service_desc;
+                direct->last_server = direct->servers[i];
+                return direct->servers[i];
+            }
+        }
+    }
+    
+    return NULL;
+}
+
+/**
+ * Allocates the request and response buffers of a nesting level.
+ * @param transport Transport implementation
+ * @param scratch Scratch buffers
+ * @return Returns LWPB_ERR_OK if successful or LWPB_ERR_MEM if memory could
+ * not be allocated.
+ */
+static lwpb_err_t alloc_scratch(lwpb_transport_t transport,
+                                struct lwpb_direct_scratch *scratch)
+{
+    lwpb_err_t ret;
+    
+    ret = lwpb_transport_alloc_buf(transport, &scratch->req_buf, &scratch->req_len);
+    if (ret != LWPB_ERR_OK)
+        return ret;
+    
+    ret = lwpb_transport_alloc_buf(transport, &scratch->res_buf, &scratch->res_len);
+    if (ret != LWPB_ERR_OK) {
+        lwpb_transport_free_buf(transport, scratch->req_buf);
+        scratch->req_buf = NULL;
+    }
+    
+    return ret;
+}
+
+/**
+ * Frees the request and response buffers of a nesting level.
+ * @param transport Transport implementation
+ * @param scratch Scratch buffers
+ */
+static void free_scratch(lwpb_transport_t transport,
+                         struct lwpb_direct_scratch *scratch)
+{
+    if (!scratch->req_buf)
+        return;
+    
+    lwpb_transport_free_buf(transport, scratch->req_buf);
+    lwpb_transport_free_buf(transport, scratch->res_buf);
+    scratch->req_buf = NULL;
+    scratch->res_buf = NULL;
+}
+
+/** Client side of a streaming call on the direct transport */
+struct direct_stream {
+    struct lwpb_client *client;
+    struct lwpb_client_call *call;
+};
+
+/**
+ * Passes a response message of a streaming call to the response handler of
+ * the client.
+ * @param writer Writer
+ * @param buf Encoded response message
+ * @param len Length of response message
+ * @return Returns LWPB_ERR_OK if successful or LWPB_ERR_CANCEL if the
+ * response handler failed.
+ */
+static lwpb_err_t direct_write(struct lwpb_server_writer *writer,
+                               void *buf, size_t len)
+{
+    struct direct_stream *stream = writer->ctx;
+    
+    if (stream->call->response_handler(stream->client, writer->method_desc,
+                                       writer->method_desc->res_desc,
+                                       buf, len, stream->call->arg) != LWPB_ERR_OK)
+        return LWPB_ERR_CANCEL;
+    
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Processes a streaming call on the server. The response messages are
+ * passed to the client as they are written, so the handler never needs to
+ * yield; it is called again right away if it does.
+ * @param server Server
+ * @param client Client
+ * @param method_desc Method descriptor
+ * @param call Call context
+ * @param scratch Buffers of the call
+ * @param req_len Length of request message
+ * @return Returns the result of the call.
+ */
+static lwpb_rpc_result_t stream_call(struct lwpb_server *server,
+                                     struct lwpb_client *client,
+                                     const struct lwpb_method_desc *method_desc,
+                                     struct lwpb_client_call *call,
+                                     struct lwpb_direct_scratch *scratch,
+                                     size_t req_len)
+{
+    struct direct_stream stream;
+    struct lwpb_server_writer writer;
+    lwpb_err_t ret;
+    
+    stream.client = client;
+    stream.call = call;
+    lwpb_server_writer_init(&writer, method_desc, direct_write, &stream,
+                            scratch->res_buf, scratch->res_len);
+    
+    do {
+        ret = lwpb_server_handle_stream(server, &writer, scratch->req_buf,
+                                        req_len, 0);
+    } while (ret == LWPB_ERR_BUSY && !writer.cancelled);
+    
+    // Let the handler release its state if it yielded before noticing
+    if (ret == LWPB_ERR_BUSY)
+        lwpb_server_handle_stream(server, &writer, scratch->req_buf,
+                                  req_len, 0);
+    
+    return ret == LWPB_ERR_OK && !writer.cancelled ? LWPB_RPC_OK : LWPB_RPC_FAILED;
+}
+
 /**
  * This method is called from the client when it is registered with the
  * transport.
@@ -30,11 +170,7 @@
 static void transport_register_client(lwpb_transport_t transport,
                                     struct lwpb_client *client)
 {
-    struct lwpb_transport_direct *direct = (struct lwpb_transport_direct *) transport;
-    
-    LWPB_ASSERT(!direct->client, "Only one client can be registered");
-    
-    direct->client = client;
+    // Any number of clients can use the transport.
 }
 
 /**
@@ -42,80 +178,98 @@ static void transport_register_client(lwpb_transport_t transport,
  * @param transport Transport implementation
  * @param client Client
  * @param method_desc Method descriptor
+ * @param call Call context
  * @return Returns LWPB_ERR_OK if successful.
  */
 static lwpb_err_t transport_call(lwpb_transport_t transport,
                                struct lwpb_client *client,
-                               const struct lwpb_method_desc *method_desc)
+                               const struct lwpb_method_desc *method_desc,
+                               struct lwpb_client_call *call)
 {
     struct lwpb_transport_direct *direct = (struct lwpb_transport_direct *) transport;
     lwpb_err_t ret = LWPB_ERR_OK;
-    void *req_buf = NULL;
+    struct lwpb_direct_scratch *scratch;
+    struct lwpb_direct_scratch temp;
+    struct lwpb_server *server;
+    lwpb_rpc_result_t result;
     size_t req_len;
-    void *res_buf = NULL;
+    void *res = NULL;
     size_t res_len;
     
-    // Allocate a buffer for the request message
-    ret = lwpb_transport_alloc_buf(transport, &req_buf, &req_len);
+    // Use the buffers of this nesting level, calls nested too deep get
+    // temporary buffers
+    if (direct->depth < LWPB_TRANSPORT_DIRECT_DEPTH) {
+        scratch = &direct->scratch[direct->depth];
+        if (!scratch->req_buf)
+            ret = alloc_scratch(transport, scratch);
+    } else {
+        scratch = &temp;
+        ret = alloc_scratch(transport, scratch);
+    }
     if (ret != LWPB_ERR_OK)
-        goto out;
+        return ret;
+    direct->depth++;
     
-    // Allocate a buffer for the response message
-    ret = lwpb_transport_alloc_buf(transport, &res_buf, &res_len);
-    if (ret != LWPB_ERR_OK)
-        goto out;
-
     // Encode the request message
-    ret = client->request_handler(client, method_desc, method_desc->req_desc,
-                                  req_buf, &req_len, client->arg);
+    req_len = scratch->req_len;
+    ret = call->request_handler(client, method_desc, method_desc->req_desc,
+                                scratch->req_buf, &req_len, call->arg);
     if (ret != LWPB_ERR_OK)
         goto out;
     
-    // We need a registered server to continue
-    if (!direct->server) {
-        client->done_handler(client, method_desc,
-                             LWPB_RPC_NOT_CONNECTED, client->arg);
+    // Streaming calls pass their messages to the client as they are written
+    server = find_server(direct, method_desc->service);
+    if (server && server->stream_methods &&
+        lwpb_server_is_stream(server, method_desc)) {
+        result = stream_call(server, client, method_desc, call, scratch,
+                             req_len);
+        lwpb_client_call_done(client, method_desc, call, result);
         goto out;
     }
     
-    // Process the call on the server
-    ret = direct->server->call_handler(direct->server, method_desc,
-                                       method_desc->req_desc, req_buf, req_len,
-                                       method_desc->res_desc, res_buf, &res_len,
-                                       direct->server->arg);
-    if (ret != LWPB_ERR_OK) {
-        client->done_handler(client, method_desc,
-                             LWPB_RPC_FAILED, client->arg);
-        goto out;
+    // Process the call on the server, an encode handler may return the
+    // response in a larger buffer
+    result = LWPB_RPC_NOT_CONNECTED;
+    if (server) {
+        res = scratch->res_buf;
+        res_len = scratch->res_len;
+        result = lwpb_server_handle_call(server, method_desc,
+                                         scratch->req_buf, req_len,
+                                         &res, &res_len, NULL) == LWPB_ERR_OK ?
+                 LWPB_RPC_OK : LWPB_RPC_FAILED;
     }
     
     // Process the response in the client
-    ret = client->response_handler(client, method_desc,
-                                   method_desc->res_desc, res_buf, res_len,
-                                   client->arg);
+    if (result == LWPB_RPC_OK) {
+        ret = call->response_handler(client, method_desc,
+                                     method_desc->res_desc,
+                                     res, res_len, call->arg);
+        lwpb_server_free_response(scratch->res_buf, res);
+    }
     
-    client->done_handler(client, method_desc, LWPB_RPC_OK, client->arg);
+    lwpb_client_call_done(client, method_desc, call, result);
     
 out:
-    // Free allocated message buffers
-    if (req_buf)
-        lwpb_transport_free_buf(transport, req_buf);
-    if (res_buf)
-        lwpb_transport_free_buf(transport, res_buf);
+    direct->depth--;
+    if (scratch == &temp)
+        free_scratch(transport, scratch);
     
     return ret;
 }
 
 /**
- * This method is called from the client when the current RPC call should
+ * This method is called from the client when an outstanding RPC call should
  * be cancelled.
  * @param transport Transport implementation
  * @param client Client
+ * @param call Call context
  */
 static void transport_cancel(lwpb_transport_t transport,
-                           struct lwpb_client *client)
+                             struct lwpb_client *client,
+                             struct lwpb_client_call *call)
 {
-    // Cancel is not supported in this transport implementation.
+    // Calls are done before transport_call() returns, so there is never an
+    // outstanding call to cancel.
 }
 
 /**
@@ -129,9 +283,11 @@ static void transport_register_server(lwpb_transport_t transport,
 {
     struct lwpb_transport_direct *direct = (struct lwpb_transport_direct *) transport;
     
-    LWPB_ASSERT(!direct->server, "Only one server can be registered");
+    LWPB_ASSERT(direct->num_servers < LWPB_TRANSPORT_DIRECT_SERVERS,
+                "Too many servers registered");
     
-    direct->server = server;
+    direct->servers[direct->num_servers++] = server;
+    direct->last_service = NULL;
 }
 
 /** Direct transport functions */
@@ -149,10 +305,74 @@ static const struct lwpb_transport_funs transport_funs = {
  */
 lwpb_transport_t lwpb_transport_direct_init(struct lwpb_transport_direct *transport_direct)
 {
+    int i;
+    
     lwpb_transport_init(&transport_direct->super, &transport_funs);
     
-    transport_direct->client = NULL;
-    transport_direct->server = NULL;
+    transport_direct->num_servers = 0;
+    transport_direct->last_service = NULL;
+    transport_direct->last_server = NULL;
+    for (i = 0; i < LWPB_TRANSPORT_DIRECT_DEPTH; i++) {
+        transport_direct->scratch[i].req_buf = NULL;
+        transport_direct->scratch[i].res_buf = NULL;
+    }
+    transport_direct->depth = 0;
     
     return &transport_direct->super;
 }
+
+/**
+ * Frees the buffers kept by the direct transport.
+ * @param transport Transport handle
+ */
+void lwpb_transport_direct_free(lwpb_transport_t transport)
+{
+    struct lwpb_transport_direct *direct = (struct lwpb_transport_direct *) transport;
+    int i;
+    
+    LWPB_ASSERT(direct->depth == 0, "Cannot free transport during a call");
+    
+    for (i = 0; i < LWPB_TRANSPORT_DIRECT_DEPTH; i++)
+        free_scratch(transport, &direct->scratch[i]);
+}
+
+/**
+ * Processes a call on the server providing the service with buffers of the
+ * caller. The request buffer is passed to the server as is, without
+ * running any client handlers.
+ * @param transport Transport handle
+ * @param method_desc Method descriptor
+ * @param req_buf Encoded request message
+ * @param req_len Length of request message
+ * @param res_buf Buffer for the response message
+ * @param res_len Size of response buffer, returns the length of the response
+ * message
+ * @return Returns LWPB_RPC_OK if successful, LWPB_RPC_NOT_CONNECTED if no
+ * server provides the service or LWPB_RPC_FAILED if the server failed or
+ * the response does not fit the response buffer.
+ */
+lwpb_rpc_result_t lwpb_transport_direct_invoke(lwpb_transport_t transport,
+                                               const struct lwpb_method_desc *method_desc,
+                                               void *req_buf, size_t req_len,
+                                               void *res_buf, size_t *res_len)
+{
+    struct lwpb_transport_direct *direct = (struct lwpb_transport_direct *) transport;
+    struct lwpb_server *server;
+    void *res = res_buf;
+    
+    server = find_server(direct, method_desc->service);
+    if (!server)
+        return LWPB_RPC_NOT_CONNECTED;
+    
+    if (lwpb_server_handle_call(server, method_desc, req_buf, req_len,
+                                &res, res_len, NULL) != LWPB_ERR_OK)
+        return LWPB_RPC_FAILED;
+    
+    // Responses grown by an encode handler don't fit the caller's buffer
+    if (res != res_buf) {
+        lwpb_server_free_response(res_buf, res);
+        return LWPB_RPC_FAILED;
+    }
+    
+    return LWPB_RPC_OK;
+}
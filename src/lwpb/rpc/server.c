@@ -18,6 +18,7 @@
  */
 
 #include <lwpb/lwpb.h>
+#include <lwpb/rpc/stats.h>
 
 
 /**
@@ -36,6 +37,10 @@ void lwpb_server_init(struct lwpb_server *server,
     server->transport = transport;
     server->arg = NULL;
     server->call_handler = NULL;
+    server->encode_handler = NULL;
+    server->stats = NULL;
+    server->stream_methods = NULL;
+    server->stream_handler = NULL;
     
     // Register the server in the transport implementation
     transport->transport_funs->register_server(transport, server);
@@ -61,3 +66,305 @@ void lwpb_server_handler(struct lwpb_server *server,
 {
     server->call_handler = call_handler;
 }
+
+/**
+ * Sets the handler encoding responses into a growing buffer. If set, it is
+ * used instead of the call handler.
+ * @param server Server
+ * @param encode_handler RPC call handler with response encoder or NULL
+ */
+void lwpb_server_encode_handler(struct lwpb_server *server,
+                                lwpb_server_encode_handler_t encode_handler)
+{
+    server->encode_handler = encode_handler;
+}
+
+/**
+ * Enables recording of per-method statistics. The statistics must be
+ * initialized with the service list of the server and outlive it. Must be
+ * set before the transport starts handling calls.
+ * @param server Server
+ * @param stats Statistics or NULL to disable recording
+ */
+void lwpb_server_stats(struct lwpb_server *server, struct lwpb_stats *stats)
+{
+    server->stats = stats;
+}
+
+/**
+ * Sets the server streaming methods and their handler. Calls of these
+ * methods are passed to the stream handler instead of the call handler.
+ * Transports without support for streaming calls fail them.
+ * @param server Server
+ * @param stream_methods Null-terminated list of streaming methods
+ * @param stream_handler Streaming call handler
+ */
+void lwpb_server_stream_handler(struct lwpb_server *server,
+                                const struct lwpb_method_desc **stream_methods,
+                                lwpb_server_stream_handler_t stream_handler)
+{
+    server->stream_methods = stream_methods;
+    server->stream_handler = stream_handler;
+}
+
+/**
+ * Checks if a method is a server streaming method.
+ * @param server Server
+ * @param method_desc Method descriptor
+ * @return Returns 1 if the method is a streaming method, 0 otherwise.
+ */
+int lwpb_server_is_stream(struct lwpb_server *server,
+                          const struct lwpb_method_desc *method_desc)
+{
+    const struct lwpb_method_desc **method;
+
+    if (!server->stream_methods)
+        return 0;
+
+    for (method = server->stream_methods; *method; method++)
+        if (*method == method_desc)
+            return 1;
+
+    return 0;
+}
+
+/**
+ * Grows the response buffer of an encode handler. The first time, the
+ * buffer of the transport is copied to the heap, later the heap buffer is
+ * reallocated.
+ * @param data Current buffer
+ * @param len Size of the current buffer, returns the size of the new buffer
+ * @param need Minimum size of the new buffer
+ * @param arg Buffer of the transport
+ * @return Returns the new buffer or NULL if memory could not be allocated.
+ */
+static void *grow_response(void *data, size_t *len, size_t need, void *arg)
+{
+    size_t size = *len ? *len * 2 : 1024;
+    void *buf;
+
+    while (size < need)
+        size *= 2;
+
+    if (data != arg)
+        buf = LWPB_REALLOC(data, size);
+    else if ((buf = LWPB_MALLOC(size)))
+        LWPB_MEMCPY(buf, data, *len);
+    if (!buf)
+        return NULL;
+
+    *len = size;
+
+    return buf;
+}
+
+/**
+ * Runs the encode handler or the call handler for a call.
+ * @param server Server
+ * @param method_desc Method descriptor
+ * @param req_buf Request message buffer
+ * @param req_len Length of request message
+ * @param res_buf Response message buffer, returns the buffer holding the
+ * response message
+ * @param res_len Size of response buffer, returns the length of the response
+ * message
+ * @return Returns the result of the handler.
+ */
+static lwpb_err_t run_handler(struct lwpb_server *server,
+                              const struct lwpb_method_desc *method_desc,
+                              void *req_buf, size_t req_len,
+                              void **res_buf, size_t *res_len)
+{
+    struct lwpb_encoder encoder;
+    lwpb_err_t ret;
+
+    if (!server->encode_handler)
+        return server->call_handler(server, method_desc,
+                                    method_desc->req_desc, req_buf, req_len,
+                                    method_desc->res_desc, *res_buf, res_len,
+                                    server->arg);
+
+    lwpb_encoder_init(&encoder);
+    lwpb_encoder_grow_handler(&encoder, grow_response, *res_buf);
+    lwpb_encoder_start(&encoder, method_desc->res_desc, *res_buf, *res_len);
+    ret = server->encode_handler(server, method_desc, method_desc->req_desc,
+                                 req_buf, req_len, &encoder, server->arg);
+    if (ret != LWPB_ERR_OK) {
+        lwpb_server_free_response(*res_buf, lwpb_encoder_data(&encoder));
+        return ret;
+    }
+
+    *res_len = lwpb_encoder_finish(&encoder);
+    *res_buf = lwpb_encoder_data(&encoder);
+
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Runs the call handler for a call. Transports use this method instead of
+ * calling the handler directly, so calls are recorded in the statistics.
+ * May be called from any thread if the call handler is thread-safe.
+ * @param server Server
+ * @param method_desc Method descriptor
+ * @param req_buf Request message buffer
+ * @param req_len Length of request message
+ * @param res_buf Response message buffer, returns the buffer holding the
+ * response message. An encode handler may replace the buffer by a larger
+ * one, which is released with lwpb_server_free_response().
+ * @param res_len Size of response buffer, returns the length of the response
+ * message
+ * @param times Timestamps of the call or NULL if the transport took none
+ * @return Returns the result of the call handler or LWPB_ERR_INVALID_FIELD
+ * for streaming methods, which need a transport supporting them.
+ */
+lwpb_err_t lwpb_server_handle_call(struct lwpb_server *server,
+                                   const struct lwpb_method_desc *method_desc,
+                                   void *req_buf, size_t req_len,
+                                   void **res_buf, size_t *res_len,
+                                   struct lwpb_call_times *times)
+{
+    lwpb_err_t ret;
+    u64_t queued = 0;
+    u64_t start = 0;
+    u64_t end;
+
+    if (times) {
+        queued = times->queued;
+        start = times->start;
+        times->end = 0;
+    }
+
+    if (server->stream_methods && lwpb_server_is_stream(server, method_desc))
+        return LWPB_ERR_INVALID_FIELD;
+
+    if (!server->stats)
+        return run_handler(server, method_desc, req_buf, req_len,
+                           res_buf, res_len);
+
+    if (!start)
+        start = lwpb_stats_now();
+    ret = run_handler(server, method_desc, req_buf, req_len, res_buf, res_len);
+    end = lwpb_stats_now();
+    lwpb_stats_record_call(server->stats, method_desc, ret != LWPB_ERR_OK,
+                           req_len, ret == LWPB_ERR_OK ? *res_len : 0,
+                           queued ? start - queued : 0, end - start);
+    if (times)
+        times->end = end;
+
+    return ret;
+}
+
+/**
+ * Frees the response buffer returned by lwpb_server_handle_call() if the
+ * encode handler replaced the buffer of the transport.
+ * @param buf Response buffer passed to lwpb_server_handle_call()
+ * @param res_buf Response buffer returned by lwpb_server_handle_call()
+ */
+void lwpb_server_free_response(void *buf, void *res_buf)
+{
+    if (res_buf && res_buf != buf)
+        LWPB_FREE(res_buf);
+}
+
+/**
+ * Initializes the writer of a streaming call. Used by the transports.
+ * @param writer Writer
+ * @param method_desc Method descriptor
+ * @param write Transport method sending a message
+ * @param ctx Transport context
+ * @param buf Buffer for encoding a response message
+ * @param len Size of the buffer
+ */
+void lwpb_server_writer_init(struct lwpb_server_writer *writer,
+                             const struct lwpb_method_desc *method_desc,
+                             lwpb_server_write_t write, void *ctx,
+                             void *buf, size_t len)
+{
+    writer->method_desc = method_desc;
+    writer->write = write;
+    writer->ctx = ctx;
+    writer->buf = buf;
+    writer->len = len;
+    writer->state = NULL;
+    writer->cancelled = 0;
+    writer->runs = 0;
+    writer->count = 0;
+    writer->bytes = 0;
+    writer->queue_time = 0;
+    writer->handler_time = 0;
+}
+
+/**
+ * Sends a response message of a streaming call. The message has been encoded
+ * into the buffer of the writer, which can be reused after this method
+ * returns.
+ * @param writer Writer
+ * @param len Length of the encoded message
+ * @return Returns LWPB_ERR_OK if more messages can be written, LWPB_ERR_BUSY
+ * if the message was sent and the handler should return LWPB_ERR_BUSY,
+ * LWPB_ERR_CANCEL if the call was cancelled or LWPB_ERR_MEM if the message
+ * could not be queued.
+ */
+lwpb_err_t lwpb_server_writer_write(struct lwpb_server_writer *writer,
+                                    size_t len)
+{
+    lwpb_err_t ret;
+
+    if (writer->cancelled)
+        return LWPB_ERR_CANCEL;
+
+    ret = writer->write(writer, writer->buf, len);
+    if (ret == LWPB_ERR_OK || ret == LWPB_ERR_BUSY) {
+        writer->count++;
+        writer->bytes += len;
+    } else if (ret == LWPB_ERR_CANCEL) {
+        writer->cancelled = 1;
+    }
+
+    return ret;
+}
+
+/**
+ * Runs the stream handler for a streaming call. Transports call this method
+ * again with the same writer while it returns LWPB_ERR_BUSY, and once more
+ * with writer->cancelled set if the call is cancelled in between. The call
+ * is recorded in the statistics when the stream ends.
+ * May be called from any thread if the stream handler is thread-safe.
+ * @param server Server
+ * @param writer Writer of the call
+ * @param req_buf Request message buffer
+ * @param req_len Length of request message
+ * @param queue_time Time the call was queued before it was handled (ns)
+ * @return Returns the result of the stream handler.
+ */
+lwpb_err_t lwpb_server_handle_stream(struct lwpb_server *server,
+                                     struct lwpb_server_writer *writer,
+                                     void *req_buf, size_t req_len,
+                                     u64_t queue_time)
+{
+    const struct lwpb_method_desc *method_desc = writer->method_desc;
+    lwpb_err_t ret;
+    u64_t start;
+
+    if (writer->runs++ == 0)
+        writer->queue_time = queue_time;
+
+    if (!server->stats)
+        return server->stream_handler(server, method_desc,
+                                      method_desc->req_desc, req_buf, req_len,
+                                      method_desc->res_desc, writer,
+                                      server->arg);
+
+    start = lwpb_stats_now();
+    ret = server->stream_handler(server, method_desc,
+                                 method_desc->req_desc, req_buf, req_len,
+                                 method_desc->res_desc, writer, server->arg);
+    writer->handler_time += lwpb_stats_now() - start;
+    if (ret != LWPB_ERR_BUSY || writer->cancelled)
+        lwpb_stats_record_call(server->stats, method_desc,
+                               ret != LWPB_ERR_OK && ret != LWPB_ERR_BUSY,
+                               req_len, writer->bytes, writer->queue_time,
+                               writer->handler_time);
+
+    return ret;
+}
@@ -0,0 +1,591 @@
+/** @file shm_client.c
+ * 
+ * Shared memory client RPC transport implementation.
+ * 
+ * Copyright 2009 Simon Kallweit
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <lwpb/lwpb.h>
+#include <lwpb/rpc/shm_client.h>
+
+#include "shm_helper.h"
+#include "socket_helper.h"
+
+
+/**
+ * Appends a call to the queue of outstanding calls, growing the queue if
+ * it is full.
+ * @param shm_client Shared memory client
+ * @param method_desc Method descriptor
+ * @param call Call context
+ * @param id Call ID
+ * @param deadline Time the call expires (ns), 0 for none
+ * @return Returns LWPB_ERR_OK if successful or LWPB_ERR_MEM if the queue
+ * cannot grow.
+ */
+static lwpb_err_t push_call(struct lwpb_transport_shm_client *shm_client,
+                            const struct lwpb_method_desc *method_desc,
+                            struct lwpb_client_call *call, u32_t id,
+                            u64_t deadline)
+{
+    struct lwpb_shm_client_call *calls;
+    struct lwpb_shm_client_call *entry;
+    int size;
+    int i;
+
+    if (shm_client->num_calls == shm_client->calls_size) {
+        size = shm_client->calls_size ? shm_client->calls_size * 2 :
+                                        LWPB_TRANSPORT_SHM_CLIENT_CALLS;
+        calls = LWPB_MALLOC(size * sizeof(struct lwpb_shm_client_call));
+        if (!calls)
+            return LWPB_ERR_MEM;
+        for (i = 0; i < shm_client->num_calls; i++)
+            calls[i] = shm_client->calls[(shm_client->calls_head + i) %
+                                         shm_client->calls_size];
+        LWPB_FREE(shm_client->calls);
+        shm_client->calls = calls;
+        shm_client->calls_head = 0;
+        shm_client->calls_size = size;
+    }
+
+    entry = &shm_client->calls[(shm_client->calls_head + shm_client->num_calls) %
+                               shm_client->calls_size];
+    entry->id = id;
+    entry->method_desc = method_desc;
+    entry->call = call;
+    entry->deadline = deadline;
+    shm_client->num_calls++;
+
+    if (deadline && (!shm_client->next_deadline ||
+                     deadline < shm_client->next_deadline))
+        shm_client->next_deadline = deadline;
+
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Removes the oldest call from the queue of outstanding calls.
+ * @param shm_client Shared memory client
+ * @return Returns the call.
+ */
+static struct lwpb_shm_client_call pop_call(struct lwpb_transport_shm_client *shm_client)
+{
+    struct lwpb_shm_client_call entry = shm_client->calls[shm_client->calls_head];
+
+    shm_client->calls_head = (shm_client->calls_head + 1) % shm_client->calls_size;
+    shm_client->num_calls--;
+
+    return entry;
+}
+
+/**
+ * Completes the outstanding calls whose deadline has passed with
+ * LWPB_RPC_TIMEOUT and finds the next deadline. The queue is only scanned
+ * once the earliest deadline has passed.
+ * @param shm_client Shared memory client
+ */
+static void expire_calls(struct lwpb_transport_shm_client *shm_client)
+{
+    struct lwpb_shm_client_call *entry;
+    struct lwpb_client_call *call;
+    u64_t current;
+    u64_t next = 0;
+    int i;
+
+    if (!shm_client->next_deadline)
+        return;
+    current = lwpb_stats_now();
+    if (current < shm_client->next_deadline)
+        return;
+
+    for (i = 0; i < shm_client->num_calls; i++) {
+        entry = &shm_client->calls[(shm_client->calls_head + i) %
+                                   shm_client->calls_size];
+        if (!entry->call || !entry->deadline)
+            continue;
+        if (entry->deadline <= current) {
+            LWPB_DEBUG("Call %u timed out", entry->id);
+            call = entry->call;
+            entry->call = NULL;
+            lwpb_client_call_done(shm_client->client, entry->method_desc,
+                                  call, LWPB_RPC_TIMEOUT);
+        } else if (!next || entry->deadline < next) {
+            next = entry->deadline;
+        }
+    }
+
+    shm_client->next_deadline = next;
+}
+
+/**
+ * Returns the index of a service on the server. Indices are looked up in the
+ * HELLO message of the server and cached.
+ * @param shm_client Shared memory client
+ * @param service_desc Service descriptor
+ * @return Returns the service index or -1 if the server does not provide
+ * the service.
+ */
+static int service_index(struct lwpb_transport_shm_client *shm_client,
+                         const struct lwpb_service_desc *service_desc)
+{
+    int index;
+    int i;
+
+    for (i = 0; i < shm_client->num_services; i++)
+        if (shm_client->services[i].service_desc == service_desc)
+            return shm_client->services[i].index;
+
+    index = hello_service_index(shm_client->hello, shm_client->hello_len,
+                                service_desc);
+
+    if (shm_client->num_services < LWPB_TRANSPORT_SHM_CLIENT_SERVICES) {
+        shm_client->services[shm_client->num_services].service_desc = service_desc;
+        shm_client->services[shm_client->num_services].index = index;
+        shm_client->num_services++;
+    }
+
+    return index;
+}
+
+/**
+ * Handles all responses in the response ring. Responses are decoded in
+ * place and their space is released afterwards.
+ * @param shm_client Shared memory client
+ * @return Returns the number of handled responses or -1 if the server sent
+ * an invalid response.
+ */
+static int handle_responses(struct lwpb_transport_shm_client *shm_client)
+{
+    struct lwpb_shm_channel *channel = &shm_client->channel;
+    struct lwpb_shm_record record;
+    struct lwpb_shm_client_call entry;
+    lwpb_rpc_result_t result;
+    lwpb_err_t err;
+    void *data;
+    int ret;
+    int n = 0;
+
+    while ((ret = ring_peek(channel, channel->res, &record, &data)) > 0) {
+        if (!shm_client->num_calls ||
+            record.id != shm_client->calls[shm_client->calls_head].id)
+            return -1;
+        entry = pop_call(shm_client);
+
+        // Calls which timed out or were cancelled are already done
+        if (!entry.call) {
+            ring_release(channel->res, &record);
+            n++;
+            continue;
+        }
+
+        result = record.status;
+        if (result == LWPB_RPC_OK) {
+            err = entry.call->response_handler(shm_client->client, entry.method_desc,
+                                               entry.method_desc->res_desc,
+                                               data, record.len,
+                                               entry.call->arg);
+            if (err != LWPB_ERR_OK)
+                result = LWPB_RPC_FAILED;
+        } else if (result != LWPB_RPC_NOT_CONNECTED &&
+                   result != LWPB_RPC_OVERLOADED &&
+                   result != LWPB_RPC_TIMEOUT) {
+            result = LWPB_RPC_FAILED;
+        }
+        ring_release(channel->res, &record);
+
+        lwpb_client_call_done(shm_client->client, entry.method_desc,
+                              entry.call, result);
+        n++;
+
+        // The done handler may have closed the client
+        if (channel->socket == -1)
+            break;
+    }
+
+    return ret < 0 ? -1 : n;
+}
+
+/**
+ * This method is called from the client when it is registered with the
+ * transport.
+ * @param transport Transport implementation
+ * @param client Client
+ */
+static void transport_register_client(lwpb_transport_t transport,
+                                      struct lwpb_client *client)
+{
+    struct lwpb_transport_shm_client *shm_client =
+        (struct lwpb_transport_shm_client *) transport;
+
+    LWPB_ASSERT(!shm_client->client, "Only one client can be registered");
+
+    shm_client->client = client;
+}
+
+/**
+ * This method is called from the client to start an RPC call. The request
+ * is encoded directly into the request ring.
+ * @param transport Transport implementation
+ * @param client Client
+ * @param method_desc Method descriptor
+ * @param call Call context
+ * @return Returns LWPB_ERR_OK if successful.
+ */
+static lwpb_err_t transport_call(lwpb_transport_t transport,
+                                 struct lwpb_client *client,
+                                 const struct lwpb_method_desc *method_desc,
+                                 struct lwpb_client_call *call)
+{
+    struct lwpb_transport_shm_client *shm_client =
+        (struct lwpb_transport_shm_client *) transport;
+    struct lwpb_shm_channel *channel;
+    struct lwpb_shm_record *record;
+    lwpb_err_t ret;
+    size_t req_len;
+    u32_t timeout;
+    u64_t deadline = 0;
+    int reserved;
+    int index;
+
+    // Only continue if connected to server
+    if (shm_client->channel.socket == -1) {
+        lwpb_client_call_done(client, method_desc, call, LWPB_RPC_NOT_CONNECTED);
+        return LWPB_ERR_OK;
+    }
+
+    index = service_index(shm_client, method_desc->service);
+    if (index < 0) {
+        LWPB_ERR("Server does not provide service '%s'", method_desc->service->name);
+        lwpb_client_call_done(client, method_desc, call, LWPB_RPC_FAILED);
+        return LWPB_ERR_OK;
+    }
+
+    // Wait for responses to free space in the request ring
+    channel = &shm_client->channel;
+    while ((reserved = ring_reserve(channel, channel->req, &record)) == 0) {
+        lwpb_transport_shm_client_update(transport);
+        if (channel->socket == -1)
+            break;
+    }
+    if (reserved < 0) {
+        LWPB_ERR("Server corrupted the request ring");
+        lwpb_transport_shm_client_close(transport);
+    }
+    if (reserved <= 0) {
+        lwpb_client_call_done(client, method_desc, call, LWPB_RPC_NOT_CONNECTED);
+        return LWPB_ERR_OK;
+    }
+
+    // Encode the request message into the ring
+    req_len = channel->max_msg;
+    ret = call->request_handler(client, method_desc, method_desc->req_desc,
+                                record + 1, &req_len, call->arg);
+    if (ret != LWPB_ERR_OK)
+        return ret;
+
+    timeout = lwpb_client_get_timeout(client, call);
+    if (timeout)
+        deadline = lwpb_stats_now() + timeout * 1000000ULL;
+
+    ret = push_call(shm_client, method_desc, call, shm_client->seq, deadline);
+    if (ret != LWPB_ERR_OK)
+        return ret;
+
+    record->id = shm_client->seq++;
+    record->service = index;
+    record->method = method_desc - method_desc->service->methods;
+    record->status = LWPB_RPC_OK;
+    record->deadline = shm_deadline(deadline);
+    record->reserved = 0;
+    ring_commit(channel->req, record, req_len, channel->req_event);
+
+    return LWPB_ERR_OK;
+}
+
+/**
+ * This method is called from the client when an outstanding RPC call should
+ * be cancelled. Requests cannot be taken back from the ring, so the server
+ * still handles the call and its response is discarded.
+ * @param transport Transport implementation
+ * @param client Client
+ * @param call Call context
+ */
+static void transport_cancel(lwpb_transport_t transport,
+                             struct lwpb_client *client,
+                             struct lwpb_client_call *call)
+{
+    struct lwpb_transport_shm_client *shm_client =
+        (struct lwpb_transport_shm_client *) transport;
+    struct lwpb_shm_client_call *entry;
+    int i;
+
+    for (i = 0; i < shm_client->num_calls; i++) {
+        entry = &shm_client->calls[(shm_client->calls_head + i) %
+                                   shm_client->calls_size];
+        if (entry->call == call) {
+            entry->call = NULL;
+            lwpb_client_call_done(client, entry->method_desc, call,
+                                  LWPB_RPC_CANCELLED);
+            return;
+        }
+    }
+}
+
+/**
+ * This method is called from the server when it is registered with the
+ * transport.
+ * @param transport Transport implementation
+ * @param server Server
+ */
+static void transport_register_server(lwpb_transport_t transport,
+                                      struct lwpb_server *server)
+{
+    LWPB_FAIL("No servers can be registered");
+}
+
+/** Shared memory client transport functions */
+static const struct lwpb_transport_funs transport_funs = {
+    .register_client = transport_register_client,
+    .call = transport_call,
+    .cancel = transport_cancel,
+    .register_server = transport_register_server,
+    .update = lwpb_transport_shm_client_update,
+};
+
+/**
+ * Initializes the shared memory client transport.
+ * @param shm_client Shared memory client data
+ * @return Returns the transport implementation handle.
+ */
+lwpb_transport_t lwpb_transport_shm_client_init(
+        struct lwpb_transport_shm_client *shm_client)
+{
+    LWPB_DEBUG("Initializing shared memory client");
+
+    lwpb_transport_init(&shm_client->super, &transport_funs);
+
+    shm_client->client = NULL;
+    shm_channel_init(&shm_client->channel);
+    shm_client->calls = NULL;
+    shm_client->calls_head = 0;
+    shm_client->calls_size = 0;
+    shm_client->num_calls = 0;
+    shm_client->seq = 0;
+    shm_client->hello = NULL;
+    shm_client->hello_len = 0;
+    shm_client->num_services = 0;
+    shm_client->busy_poll = 0;
+    shm_client->next_deadline = 0;
+
+    return &shm_client->super;
+}
+
+/**
+ * Sets the time updates spin on the response ring before they sleep. Busy
+ * polling trades CPU time for latency.
+ * @param transport Transport handle
+ * @param busy_poll Time to spin (us), 0 to sleep right away
+ */
+void lwpb_transport_shm_client_busy_poll(lwpb_transport_t transport,
+                                         u32_t busy_poll)
+{
+    struct lwpb_transport_shm_client *shm_client =
+        (struct lwpb_transport_shm_client *) transport;
+
+    shm_client->busy_poll = busy_poll;
+}
+
+/**
+ * Opens the shared memory client. Connects to the server and maps the
+ * rings passed by the server.
+ * @param transport Transport handle
+ * @param path Path of the server's Unix domain socket
+ * @return Returns LWPB_ERR_OK if successful.
+ */
+lwpb_err_t lwpb_transport_shm_client_open(lwpb_transport_t transport,
+                                          const char *path)
+{
+    struct lwpb_transport_shm_client *shm_client =
+        (struct lwpb_transport_shm_client *) transport;
+    struct sockaddr_un addr;
+    u8_t hello[LWPB_TRANSPORT_SHM_HELLO_SIZE];
+    size_t hello_len;
+
+    if (shm_client->channel.socket != -1) {
+        LWPB_INFO("Shared memory client already opened");
+        return LWPB_ERR_OK;
+    }
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        LWPB_ERR("Socket path too long");
+        return LWPB_ERR_NET_INIT;
+    }
+
+    // Connect to server
+    LWPB_DEBUG("Connecting to %s", path);
+    shm_client->channel.socket = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (shm_client->channel.socket == -1) {
+        LWPB_ERR("Cannot create client socket");
+        return LWPB_ERR_NET_INIT;
+    }
+    LWPB_MEMSET(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(shm_client->channel.socket, (struct sockaddr *) &addr,
+                sizeof(addr)) == -1) {
+        LWPB_ERR("Cannot open connection (errno: %d)", errno);
+        shm_channel_free(&shm_client->channel);
+        return LWPB_ERR_NET_INIT;
+    }
+
+    // Map the rings and keep the list of services
+    if (shm_channel_receive(&shm_client->channel, hello, &hello_len) != 0)
+        return LWPB_ERR_NET_INIT;
+    shm_client->hello = LWPB_MALLOC(hello_len);
+    if (!shm_client->hello) {
+        shm_channel_free(&shm_client->channel);
+        return LWPB_ERR_MEM;
+    }
+    LWPB_MEMCPY(shm_client->hello, hello, hello_len);
+    shm_client->hello_len = hello_len;
+
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Closes the shared memory client. Outstanding calls fail.
+ * @param transport Transport handle
+ */
+void lwpb_transport_shm_client_close(lwpb_transport_t transport)
+{
+    struct lwpb_transport_shm_client *shm_client =
+        (struct lwpb_transport_shm_client *) transport;
+    struct lwpb_shm_client_call entry;
+
+    if (shm_client->channel.socket == -1)
+        return;
+
+    shm_channel_free(&shm_client->channel);
+
+    // Forget the services of the server
+    LWPB_FREE(shm_client->hello);
+    shm_client->hello = NULL;
+    shm_client->hello_len = 0;
+    shm_client->num_services = 0;
+
+    // Fail outstanding calls
+    while (shm_client->num_calls) {
+        entry = pop_call(shm_client);
+        if (entry.call)
+            lwpb_client_call_done(shm_client->client, entry.method_desc,
+                                  entry.call, LWPB_RPC_NOT_CONNECTED);
+    }
+
+    LWPB_FREE(shm_client->calls);
+    shm_client->calls = NULL;
+    shm_client->calls_head = 0;
+    shm_client->calls_size = 0;
+    shm_client->next_deadline = 0;
+}
+
+/**
+ * Returns the number of outstanding calls.
+ * @param transport Transport handle
+ * @return Returns the number of calls waiting for a response.
+ */
+int lwpb_transport_shm_client_pending(lwpb_transport_t transport)
+{
+    struct lwpb_transport_shm_client *shm_client =
+        (struct lwpb_transport_shm_client *) transport;
+
+    return shm_client->num_calls;
+}
+
+/**
+ * Updates the shared memory client. Handles the responses in the response
+ * ring or waits up to a second, or until the next call deadline, for new
+ * ones. This method needs to be called
+ * periodically.
+ * @param transport Transport handle
+ */
+lwpb_err_t lwpb_transport_shm_client_update(lwpb_transport_t transport)
+{
+    struct lwpb_transport_shm_client *shm_client =
+        (struct lwpb_transport_shm_client *) transport;
+    struct lwpb_shm_channel *channel = &shm_client->channel;
+    struct pollfd fds[2];
+    u64_t start;
+    u64_t current;
+    int timeout = 1000;
+    int n;
+
+    if (channel->socket == -1)
+        return LWPB_ERR_OK;
+
+    // Complete calls which timed out, otherwise wake up at the next deadline
+    expire_calls(shm_client);
+    if (shm_client->next_deadline) {
+        current = lwpb_stats_now();
+        if (shm_client->next_deadline <= current)
+            timeout = 0;
+        else if (shm_client->next_deadline - current < 1000000000ULL)
+            timeout = (shm_client->next_deadline - current) / 1000000 + 1;
+    }
+
+    // Spin for new responses before sleeping
+    if (!ring_pending(channel->res) && shm_client->busy_poll) {
+        start = lwpb_stats_now();
+        while (!ring_pending(channel->res) &&
+               lwpb_stats_now() - start < shm_client->busy_poll * 1000ULL)
+            ;
+    }
+
+    // Sleep until the server signals new responses or goes away
+    if (!ring_sleep(channel->res)) {
+        fds[0].fd = channel->res_event;
+        fds[0].events = POLLIN;
+        fds[1].fd = channel->socket;
+        fds[1].events = POLLIN;
+        n = poll(fds, 2, timeout);
+        if (n < 0 && errno != EINTR)
+            LWPB_FAIL("poll() failed");
+        if (n > 0 && fds[0].revents)
+            drain_event(channel->res_event);
+        if (n > 0 && fds[1].revents) {
+            LWPB_DEBUG("Server closed connection");
+            ring_wake(channel->res);
+            handle_responses(shm_client);
+            lwpb_transport_shm_client_close(transport);
+            return LWPB_ERR_OK;
+        }
+    }
+    ring_wake(channel->res);
+
+    if (handle_responses(shm_client) < 0) {
+        LWPB_ERR("Server sent invalid response");
+        lwpb_transport_shm_client_close(transport);
+    }
+
+    return LWPB_ERR_OK;
+}
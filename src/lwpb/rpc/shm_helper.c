@@ -0,0 +1,488 @@
+/** @file shm_helper.c
+ * 
+ * Helper functions for the shared memory RPC transports.
+ * 
+ * Copyright 2009 Simon Kallweit
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include <lwpb/lwpb.h>
+
+#include "shm_helper.h"
+
+
+/** Number of file descriptors passed when a channel is set up */
+#define SHM_CHANNEL_FDS 3
+
+/**
+ * Converts a time into the deadline of a request record. Both processes take
+ * their time from lwpb_stats_now(), which is CLOCK_MONOTONIC, so deadlines
+ * are absolute milliseconds, which wrap around every 49 days.
+ * @param time Time (ns) from lwpb_stats_now() or 0 for no deadline
+ * @return Returns the deadline, 0 for no deadline.
+ */
+u32_t shm_deadline(u64_t time)
+{
+    u32_t deadline;
+
+    if (!time)
+        return 0;
+    deadline = (u32_t) (time / 1000000);
+
+    return deadline ? deadline : 1;
+}
+
+/**
+ * Checks if the deadline of a request record has passed.
+ * @param deadline Deadline from shm_deadline()
+ * @param time Current time (ns) from lwpb_stats_now()
+ * @return Returns 1 if the deadline has passed.
+ */
+int shm_expired(u32_t deadline, u64_t time)
+{
+    return deadline && (s32_t) (shm_deadline(time) - deadline) > 0;
+}
+
+/**
+ * Reserves space for a record holding a message of the maximum size. The
+ * caller encodes the message directly behind the record header and commits
+ * the record with ring_commit(). If the space before the end of the ring is
+ * too small, the end is marked unused and the record starts at the beginning
+ * of the ring.
+ * @param channel Channel of the ring
+ * @param ring Ring (producer side)
+ * @param record Returns the record
+ * @return Returns 1 if a record was reserved, 0 if the ring is full or -1 if
+ * the peer corrupted the ring.
+ */
+int ring_reserve(const struct lwpb_shm_channel *channel,
+                 struct lwpb_shm_ring *ring, struct lwpb_shm_record **record)
+{
+    u64_t head = ring->head;
+    u64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t pos = head & channel->mask;
+    size_t need = SHM_RECORD_SIZE(channel->max_msg);
+    size_t space;
+
+    // Records are aligned, so a wrap marker always fits before the end
+    if (head - tail > channel->size || (head & 7))
+        return -1;
+    space = channel->size - (head - tail);
+
+    if (channel->size - pos < need) {
+        if (space < channel->size - pos + need)
+            return 0;
+        // Skip the end of the ring, the consumer follows the marker
+        ((struct lwpb_shm_record *) (ring->data + pos))->len = LWPB_SHM_RECORD_WRAP;
+        head += channel->size - pos;
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+        pos = 0;
+    } else if (space < need) {
+        return 0;
+    }
+
+    *record = (struct lwpb_shm_record *) (ring->data + pos);
+
+    return 1;
+}
+
+/**
+ * Commits a record reserved with ring_reserve(). The consumer is woken up
+ * through the eventfd if it sleeps.
+ * @param ring Ring (producer side)
+ * @param record Record
+ * @param len Length of message
+ * @param event eventfd of the consumer
+ */
+void ring_commit(struct lwpb_shm_ring *ring, struct lwpb_shm_record *record,
+                 size_t len, int event)
+{
+    u64_t one = 1;
+
+    record->len = len;
+    __atomic_store_n(&ring->head, ring->head + SHM_RECORD_SIZE(len),
+                     __ATOMIC_RELEASE);
+
+    // Publish the head before looking at the sleeping flag, which pairs with
+    // the consumer setting the flag before looking at the head
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->sleeping, __ATOMIC_RELAXED) &&
+        write(event, &one, sizeof(one)) != sizeof(one))
+        LWPB_ERR("Cannot signal ring (errno: %d)", errno);
+}
+
+/**
+ * Returns the next record of a ring. The header is copied and checked, as
+ * the peer can change the shared memory at any time, while the message is
+ * decoded in place. The record is released with ring_release() afterwards.
+ * @param channel Channel of the ring
+ * @param ring Ring (consumer side)
+ * @param header Returns a copy of the record header
+ * @param msg Returns the message
+ * @return Returns 1 if a record was returned, 0 if the ring is empty or -1
+ * if the peer corrupted the ring.
+ */
+int ring_peek(const struct lwpb_shm_channel *channel, struct lwpb_shm_ring *ring,
+              struct lwpb_shm_record *header, void **msg)
+{
+    u64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    u64_t tail = ring->tail;
+    size_t pos;
+    u32_t len;
+    struct lwpb_shm_record *record;
+
+    while (tail != head) {
+        if (head - tail > channel->size || (tail & 7))
+            return -1;
+        pos = tail & channel->mask;
+        record = (struct lwpb_shm_record *) (ring->data + pos);
+        len = record->len;
+        if (len != LWPB_SHM_RECORD_WRAP) {
+            if (len > channel->max_msg ||
+                pos + SHM_RECORD_SIZE(len) > channel->size ||
+                SHM_RECORD_SIZE(len) > head - tail)
+                return -1;
+            LWPB_MEMCPY(header, record, sizeof(*header));
+            header->len = len;
+            *msg = record + 1;
+            return 1;
+        }
+        tail += channel->size - pos;
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+/**
+ * Releases the record returned by ring_peek(), so the producer can reuse
+ * its space.
+ * @param ring Ring (consumer side)
+ * @param header Record header returned by ring_peek()
+ */
+void ring_release(struct lwpb_shm_ring *ring,
+                  const struct lwpb_shm_record *header)
+{
+    __atomic_store_n(&ring->tail, ring->tail + SHM_RECORD_SIZE(header->len),
+                     __ATOMIC_RELEASE);
+}
+
+/**
+ * Checks if a ring holds records.
+ * @param ring Ring
+ * @return Returns 1 if the ring holds records, 0 if it is empty.
+ */
+int ring_pending(struct lwpb_shm_ring *ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail;
+}
+
+/**
+ * Asks the producer to signal the eventfd on new records. Must be called
+ * before the consumer waits for the eventfd and undone with ring_wake().
+ * @param ring Ring (consumer side)
+ * @return Returns 1 if the ring already holds records, so the consumer must
+ * not wait.
+ */
+int ring_sleep(struct lwpb_shm_ring *ring)
+{
+    __atomic_store_n(&ring->sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return ring_pending(ring);
+}
+
+/**
+ * Stops the producer from signalling the eventfd.
+ * @param ring Ring (consumer side)
+ */
+void ring_wake(struct lwpb_shm_ring *ring)
+{
+    __atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * Resets the counter of an eventfd.
+ * @param event eventfd
+ */
+void drain_event(int event)
+{
+    u64_t count;
+
+    while (read(event, &count, sizeof(count)) < 0 && errno == EINTR)
+        ;
+}
+
+/**
+ * Initializes a channel, which is not connected.
+ * @param channel Channel
+ */
+void shm_channel_init(struct lwpb_shm_channel *channel)
+{
+    channel->socket = -1;
+    channel->mem = NULL;
+    channel->mem_size = 0;
+    channel->req = NULL;
+    channel->res = NULL;
+    channel->req_event = -1;
+    channel->res_event = -1;
+    channel->size = 0;
+    channel->mask = 0;
+    channel->max_msg = 0;
+}
+
+/**
+ * Sets up the rings of a channel in the mapping of a shared memory file.
+ * @param channel Channel
+ * @param req_size Size of the data area of the request ring
+ * @return Returns 0 if successful or -1 if the rings don't fit the mapping.
+ */
+static int map_rings(struct lwpb_shm_channel *channel, size_t req_size)
+{
+    size_t ring_len = sizeof(struct lwpb_shm_ring) + req_size;
+
+    if (channel->mem_size < ring_len + sizeof(struct lwpb_shm_ring))
+        return -1;
+    channel->req = channel->mem;
+    channel->res = (struct lwpb_shm_ring *) ((u8_t *) channel->mem + ring_len);
+
+    return 0;
+}
+
+/**
+ * Creates the shared memory and the eventfds of a new channel (server side).
+ * @param channel Channel
+ * @param ring_size Size of the data area of each ring (power of two)
+ * @param max_msg Maximum size of a message
+ * @param memfd Returns the shared memory file, which is passed to the client
+ * with shm_channel_send() and closed afterwards
+ * @return Returns 0 if successful or -1 on failure.
+ */
+int shm_channel_create(struct lwpb_shm_channel *channel,
+                       u32_t ring_size, u32_t max_msg, int *memfd)
+{
+    size_t ring_len = sizeof(struct lwpb_shm_ring) + ring_size;
+
+    shm_channel_init(channel);
+
+    *memfd = memfd_create("lwpb-shm", MFD_CLOEXEC);
+    if (*memfd == -1) {
+        LWPB_ERR("Cannot create shared memory (errno: %d)", errno);
+        return -1;
+    }
+    if (ftruncate(*memfd, 2 * ring_len) == -1) {
+        LWPB_ERR("Cannot size shared memory (errno: %d)", errno);
+        goto err;
+    }
+
+    channel->mem_size = 2 * ring_len;
+    channel->mem = mmap(NULL, channel->mem_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, *memfd, 0);
+    if (channel->mem == MAP_FAILED) {
+        LWPB_ERR("Cannot map shared memory (errno: %d)", errno);
+        channel->mem = NULL;
+        goto err;
+    }
+
+    // The memfd is zero filled, so only the sizes need to be set
+    map_rings(channel, ring_size);
+    channel->req->size = ring_size;
+    channel->req->max_msg = max_msg;
+    channel->res->size = ring_size;
+    channel->res->max_msg = max_msg;
+    channel->size = ring_size;
+    channel->mask = ring_size - 1;
+    channel->max_msg = max_msg;
+
+    channel->req_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    channel->res_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (channel->req_event == -1 || channel->res_event == -1) {
+        LWPB_ERR("Cannot create eventfd (errno: %d)", errno);
+        goto err;
+    }
+
+    return 0;
+
+err:
+    close(*memfd);
+    *memfd = -1;
+    shm_channel_free(channel);
+    return -1;
+}
+
+/**
+ * Passes the shared memory and the eventfds of a channel to the client,
+ * together with the HELLO message of the server.
+ * @param channel Channel (with connected socket)
+ * @param memfd Shared memory file
+ * @param hello HELLO message
+ * @param hello_len Length of HELLO message
+ * @return Returns 0 if successful or -1 if the socket failed.
+ */
+int shm_channel_send(struct lwpb_shm_channel *channel, int memfd,
+                     const void *hello, size_t hello_len)
+{
+    union {
+        struct cmsghdr hdr;
+        u8_t buf[CMSG_SPACE(SHM_CHANNEL_FDS * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    int fds[SHM_CHANNEL_FDS];
+    ssize_t ret;
+
+    fds[0] = memfd;
+    fds[1] = channel->req_event;
+    fds[2] = channel->res_event;
+
+    iov.iov_base = (void *) hello;
+    iov.iov_len = hello_len;
+    LWPB_MEMSET(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    LWPB_MEMCPY(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    do {
+        ret = sendmsg(channel->socket, &msg, MSG_NOSIGNAL);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret == (ssize_t) hello_len ? 0 : -1;
+}
+
+/**
+ * Receives the shared memory and the eventfds of a channel from the server
+ * and maps the rings (client side).
+ * @param channel Channel (with connected socket)
+ * @param hello Buffer for the HELLO message (LWPB_TRANSPORT_SHM_HELLO_SIZE)
+ * @param hello_len Returns the length of the HELLO message
+ * @return Returns 0 if successful or -1 on failure.
+ */
+int shm_channel_receive(struct lwpb_shm_channel *channel,
+                        void *hello, size_t *hello_len)
+{
+    union {
+        struct cmsghdr hdr;
+        u8_t buf[CMSG_SPACE(SHM_CHANNEL_FDS * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    struct stat st;
+    int fds[SHM_CHANNEL_FDS];
+    ssize_t ret;
+    u32_t size;
+    u32_t max_msg;
+    void *mem;
+
+    iov.iov_base = hello;
+    iov.iov_len = LWPB_TRANSPORT_SHM_HELLO_SIZE;
+    LWPB_MEMSET(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    do {
+        ret = recvmsg(channel->socket, &msg, MSG_CMSG_CLOEXEC);
+    } while (ret < 0 && errno == EINTR);
+    if (ret <= 0 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        LWPB_ERR("Cannot receive channel from server (errno: %d)", errno);
+        return -1;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        LWPB_ERR("Server did not pass the channel");
+        return -1;
+    }
+    LWPB_MEMCPY(fds, CMSG_DATA(cmsg), sizeof(fds));
+    *hello_len = ret;
+    channel->req_event = fds[1];
+    channel->res_event = fds[2];
+
+    // Map the rings, the mapping stays valid when the memfd is closed
+    if (fstat(fds[0], &st) == -1)
+        goto err;
+    mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (mem == MAP_FAILED)
+        goto err;
+    close(fds[0]);
+    channel->mem = mem;
+    channel->mem_size = st.st_size;
+
+    // Check that both rings fit the mapping. The sizes are read once and
+    // only the private copies in the channel are used from here on.
+    size = 0;
+    max_msg = 0;
+    if (channel->mem_size >= sizeof(struct lwpb_shm_ring)) {
+        size = ((struct lwpb_shm_ring *) mem)->size;
+        max_msg = ((struct lwpb_shm_ring *) mem)->max_msg;
+    }
+    if (size == 0 || (size & (size - 1)) || map_rings(channel, size) != 0 ||
+        channel->mem_size != 2 * (sizeof(struct lwpb_shm_ring) + size) ||
+        channel->res->size != size || channel->res->max_msg != max_msg ||
+        2 * SHM_RECORD_SIZE(max_msg) > size) {
+        LWPB_ERR("Server passed invalid rings");
+        shm_channel_free(channel);
+        return -1;
+    }
+    channel->size = size;
+    channel->mask = size - 1;
+    channel->max_msg = max_msg;
+
+    return 0;
+
+err:
+    LWPB_ERR("Cannot map shared memory (errno: %d)", errno);
+    close(fds[0]);
+    shm_channel_free(channel);
+    return -1;
+}
+
+/**
+ * Unmaps the rings and closes the eventfds and the socket of a channel.
+ * @param channel Channel
+ */
+void shm_channel_free(struct lwpb_shm_channel *channel)
+{
+    if (channel->mem)
+        munmap(channel->mem, channel->mem_size);
+    if (channel->req_event != -1)
+        close(channel->req_event);
+    if (channel->res_event != -1)
+        close(channel->res_event);
+    if (channel->socket != -1)
+        close(channel->socket);
+    shm_channel_init(channel);
+}
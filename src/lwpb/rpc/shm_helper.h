@@ -0,0 +1,69 @@
+/** @file shm_helper.h
+ * 
+ * Helper functions for the shared memory RPC transports.
+ * 
+ * Copyright 2009 Simon Kallweit
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __LWPB_RPC_SHM_HELPER_H__
+#define __LWPB_RPC_SHM_HELPER_H__
+
+#include <lwpb/lwpb.h>
+#include <lwpb/rpc/shm.h>
+#include <lwpb/rpc/stats.h>
+
+
+/** Size of a record holding a message of the given length */
+#define SHM_RECORD_SIZE(_len_) \
+    ((sizeof(struct lwpb_shm_record) + (_len_) + 7) & ~((size_t) 7))
+
+int ring_reserve(const struct lwpb_shm_channel *channel,
+                 struct lwpb_shm_ring *ring, struct lwpb_shm_record **record);
+
+void ring_commit(struct lwpb_shm_ring *ring, struct lwpb_shm_record *record,
+                 size_t len, int event);
+
+int ring_peek(const struct lwpb_shm_channel *channel, struct lwpb_shm_ring *ring,
+              struct lwpb_shm_record *header, void **msg);
+
+void ring_release(struct lwpb_shm_ring *ring,
+                  const struct lwpb_shm_record *header);
+
+int ring_pending(struct lwpb_shm_ring *ring);
+
+int ring_sleep(struct lwpb_shm_ring *ring);
+
+void ring_wake(struct lwpb_shm_ring *ring);
+
+void drain_event(int event);
+
+u32_t shm_deadline(u64_t time);
+
+int shm_expired(u32_t deadline, u64_t time);
+
+void shm_channel_init(struct lwpb_shm_channel *channel);
+
+int shm_channel_create(struct lwpb_shm_channel *channel,
+                       u32_t ring_size, u32_t max_msg, int *memfd);
+
+int shm_channel_send(struct lwpb_shm_channel *channel, int memfd,
+                     const void *hello, size_t hello_len);
+
+int shm_channel_receive(struct lwpb_shm_channel *channel,
+                        void *hello, size_t *hello_len);
+
+void shm_channel_free(struct lwpb_shm_channel *channel);
+
+#endif // __LWPB_RPC_SHM_HELPER_H__
@@ -0,0 +1,611 @@
+/** @file shm_server.c
+ * 
+ * Shared memory server RPC transport implementation.
+ * 
+ * Copyright 2009 Simon Kallweit
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#include <lwpb/lwpb.h>
+#include <lwpb/rpc/shm_server.h>
+
+#include "shm_helper.h"
+#include "socket_helper.h"
+
+
+/** epoll event data of the listen socket */
+#define EVENT_LISTEN ((u64_t) -1)
+
+/** epoll event data of a connection's eventfd or socket */
+#define EVENT_CONN(_index_, _socket_) (((u64_t) (_index_) << 1) | (_socket_))
+
+/**
+ * Gets a free slot in the connection table, growing the table if it is full.
+ * @param shm_server Shared memory server
+ * @return Returns the index of the slot or -1 if the table cannot grow.
+ */
+static int get_slot(struct lwpb_transport_shm_server *shm_server)
+{
+    struct lwpb_shm_server_conn **conns;
+    int size;
+    int i;
+
+    for (i = 0; i < shm_server->conns_size; i++)
+        if (!shm_server->conns[i])
+            return i;
+
+    size = shm_server->conns_size ? shm_server->conns_size * 2 :
+                                    LWPB_TRANSPORT_SHM_SERVER_CONNS;
+    conns = LWPB_REALLOC(shm_server->conns, size * sizeof(*conns));
+    if (!conns)
+        return -1;
+    for (i = shm_server->conns_size; i < size; i++)
+        conns[i] = NULL;
+    shm_server->conns = conns;
+    i = shm_server->conns_size;
+    shm_server->conns_size = size;
+
+    return i;
+}
+
+/**
+ * Closes a client connection.
+ * @param shm_server Shared memory server
+ * @param conn Connection
+ */
+static void close_connection(struct lwpb_transport_shm_server *shm_server,
+                             struct lwpb_shm_server_conn *conn)
+{
+    LWPB_DEBUG("Client(%d) closed connection", conn->index);
+
+    // The client holds the eventfd as well, so it must be removed from
+    // epoll explicitly
+    epoll_ctl(shm_server->epoll, EPOLL_CTL_DEL, conn->channel.req_event, NULL);
+    epoll_ctl(shm_server->epoll, EPOLL_CTL_DEL, conn->channel.socket, NULL);
+
+    shm_server->conns[conn->index] = NULL;
+    shm_server->num_conns--;
+    shm_channel_free(&conn->channel);
+    LWPB_FREE(conn);
+}
+
+/**
+ * Accepts new client connections and sets up their channels.
+ * @param shm_server Shared memory server
+ */
+static void handle_new_connection(struct lwpb_transport_shm_server *shm_server)
+{
+    struct lwpb_shm_server_conn *conn;
+    struct epoll_event event;
+    int socket;
+    int memfd;
+    int index;
+    int ret;
+
+    for (;;) {
+        socket = accept4(shm_server->socket, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (socket < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                LWPB_ERR("Accepting new socket failed (errno: %d)", errno);
+            return;
+        }
+
+        index = get_slot(shm_server);
+        conn = index >= 0 ? LWPB_MALLOC(sizeof(*conn)) : NULL;
+        if (!conn) {
+            LWPB_ERR("Cannot allocate connection");
+            close(socket);
+            continue;
+        }
+        conn->index = index;
+        conn->blocked = 0;
+
+        // Create the rings and pass them to the client
+        if (shm_channel_create(&conn->channel, shm_server->ring_size,
+                               shm_server->max_msg, &memfd) != 0) {
+            LWPB_FREE(conn);
+            close(socket);
+            continue;
+        }
+        conn->channel.socket = socket;
+        ret = shm_channel_send(&conn->channel, memfd, shm_server->methods->hello,
+                               shm_server->methods->hello_len);
+        close(memfd);
+        if (ret != 0) {
+            LWPB_ERR("Cannot pass channel to client (errno: %d)", errno);
+            shm_channel_free(&conn->channel);
+            LWPB_FREE(conn);
+            continue;
+        }
+
+        event.events = EPOLLIN;
+        event.data.u64 = EVENT_CONN(index, 0);
+        if (epoll_ctl(shm_server->epoll, EPOLL_CTL_ADD,
+                      conn->channel.req_event, &event) == -1) {
+            LWPB_ERR("Cannot add eventfd to epoll (errno: %d)", errno);
+            shm_channel_free(&conn->channel);
+            LWPB_FREE(conn);
+            continue;
+        }
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.u64 = EVENT_CONN(index, 1);
+        if (epoll_ctl(shm_server->epoll, EPOLL_CTL_ADD, socket, &event) == -1) {
+            LWPB_ERR("Cannot add socket to epoll (errno: %d)", errno);
+            epoll_ctl(shm_server->epoll, EPOLL_CTL_DEL, conn->channel.req_event, NULL);
+            shm_channel_free(&conn->channel);
+            LWPB_FREE(conn);
+            continue;
+        }
+
+        shm_server->conns[index] = conn;
+        shm_server->num_conns++;
+
+        LWPB_DEBUG("Client(%d) accepted connection", index);
+    }
+}
+
+/**
+ * Handles the requests in the request ring of a connection. Requests are
+ * decoded in place and responses are encoded directly into the response
+ * ring. Stops when the response ring is full.
+ * @param shm_server Shared memory server
+ * @param conn Connection
+ * @return Returns the number of handled requests or -1 if the client sent
+ * an invalid request or corrupted the rings.
+ */
+static int handle_requests(struct lwpb_transport_shm_server *shm_server,
+                           struct lwpb_shm_server_conn *conn)
+{
+    struct lwpb_server *server = shm_server->server;
+    struct lwpb_shm_channel *channel = &conn->channel;
+    struct lwpb_shm_record req;
+    struct lwpb_shm_record *res;
+    const struct lwpb_service_desc *service_desc;
+    const struct lwpb_method_desc *method_desc;
+    void *req_data;
+    void *res_data;
+    size_t res_len;
+    int ret;
+    int n = 0;
+
+    conn->blocked = 0;
+
+    while ((ret = ring_peek(channel, channel->req, &req, &req_data)) > 0) {
+        ret = ring_reserve(channel, channel->res, &res);
+        if (ret < 0)
+            return -1;
+        if (ret == 0) {
+            conn->blocked = 1;
+            break;
+        }
+
+        // Resolve the method by index
+        method_desc = NULL;
+        if (req.service < shm_server->methods->num_services) {
+            service_desc = shm_server->methods->service_list[req.service];
+            if (req.method < service_desc->num_methods)
+                method_desc = &service_desc->methods[req.method];
+        }
+
+        res->id = req.id;
+        res->service = req.service;
+        res->method = req.method;
+        res->status = LWPB_RPC_FAILED;
+        res->deadline = 0;
+        res->reserved = 0;
+        res_len = 0;
+        if (!method_desc) {
+            LWPB_ERR("Client(%d) called unknown method %d.%d", conn->index,
+                     req.service, req.method);
+        } else if (req.deadline && shm_expired(req.deadline, lwpb_stats_now())) {
+            LWPB_DEBUG("Client(%d) dropped call %u", conn->index, req.id);
+            res->status = LWPB_RPC_TIMEOUT;
+            shm_server->expired++;
+        } else {
+            // Responses have to fit the ring slot, grown ones are dropped
+            res_data = res + 1;
+            res_len = channel->max_msg;
+            if (lwpb_server_handle_call(server, method_desc, req_data, req.len,
+                                        &res_data, &res_len, NULL) == LWPB_ERR_OK &&
+                res_data == res + 1)
+                res->status = LWPB_RPC_OK;
+            else
+                res_len = 0;
+            lwpb_server_free_response(res + 1, res_data);
+        }
+
+        ring_release(channel->req, &req);
+        ring_commit(channel->res, res, res_len, channel->res_event);
+        n++;
+    }
+
+    return ret < 0 ? -1 : n;
+}
+
+/**
+ * Checks if any connection has requests which can be handled.
+ * @param shm_server Shared memory server
+ * @return Returns 1 if requests are pending.
+ */
+static int requests_pending(struct lwpb_transport_shm_server *shm_server)
+{
+    struct lwpb_shm_server_conn *conn;
+    int i;
+
+    for (i = 0; i < shm_server->conns_size; i++) {
+        conn = shm_server->conns[i];
+        if (conn && !conn->blocked && ring_pending(conn->channel.req))
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * This method is called from the client when it is registered with the
+ * transport.
+ * @param transport Transport implementation
+ * @param client Client
+ */
+static void transport_register_client(lwpb_transport_t transport,
+                                      struct lwpb_client *client)
+{
+    LWPB_FAIL("No clients can be registered");
+}
+
+/**
+ * This method is called from the client to start an RPC call.
+ * @param transport Transport implementation
+ * @param client Client
+ * @param method_desc Method descriptor
+ * @param call Call context
+ * @return Returns LWPB_ERR_OK if successful.
+ */
+static lwpb_err_t transport_call(lwpb_transport_t transport,
+                                 struct lwpb_client *client,
+                                 const struct lwpb_method_desc *method_desc,
+                                 struct lwpb_client_call *call)
+{
+    lwpb_client_call_done(client, method_desc, call, LWPB_RPC_NOT_CONNECTED);
+
+    return LWPB_ERR_OK;
+}
+
+/**
+ * This method is called from the client when an outstanding RPC call should
+ * be cancelled.
+ * @param transport Transport implementation
+ * @param client Client
+ * @param call Call context
+ */
+static void transport_cancel(lwpb_transport_t transport,
+                             struct lwpb_client *client,
+                             struct lwpb_client_call *call)
+{
+    // Cancel is not supported in this transport implementation.
+}
+
+/**
+ * This method is called from the server when it is registered with the
+ * transport.
+ * @param transport Transport implementation
+ * @param server Server
+ */
+static void transport_register_server(lwpb_transport_t transport,
+                                      struct lwpb_server *server)
+{
+    struct lwpb_transport_shm_server *shm_server =
+        (struct lwpb_transport_shm_server *) transport;
+
+    LWPB_ASSERT(!shm_server->server, "Only one server can be registered");
+
+    shm_server->server = server;
+}
+
+/** Shared memory server transport functions */
+static const struct lwpb_transport_funs transport_funs = {
+    .register_client = transport_register_client,
+    .call = transport_call,
+    .cancel = transport_cancel,
+    .register_server = transport_register_server,
+};
+
+/**
+ * Initializes the shared memory server transport.
+ * @param shm_server Shared memory server data
+ * @return Returns the transport implementation handle.
+ */
+lwpb_transport_t lwpb_transport_shm_server_init(
+        struct lwpb_transport_shm_server *shm_server)
+{
+    LWPB_DEBUG("Initializing shared memory server");
+
+    lwpb_transport_init(&shm_server->super, &transport_funs);
+
+    shm_server->server = NULL;
+    shm_server->socket = -1;
+    shm_server->epoll = -1;
+    shm_server->conns = NULL;
+    shm_server->conns_size = 0;
+    shm_server->num_conns = 0;
+    shm_server->methods = NULL;
+    shm_server->ring_size = LWPB_TRANSPORT_SHM_RING_SIZE;
+    shm_server->max_msg = LWPB_TRANSPORT_SHM_MAX_MSG;
+    shm_server->busy_poll = 0;
+    shm_server->expired = 0;
+    shm_server->path[0] = '\0';
+
+    return &shm_server->super;
+}
+
+/**
+ * Sets the size of the rings created for new connections. Each ring must
+ * hold at least two messages of the maximum size.
+ * @param transport Transport handle
+ * @param ring_size Size of the data area of each ring (power of two)
+ * @param max_msg Maximum size of a request or response message
+ */
+void lwpb_transport_shm_server_rings(lwpb_transport_t transport,
+                                     u32_t ring_size, u32_t max_msg)
+{
+    struct lwpb_transport_shm_server *shm_server =
+        (struct lwpb_transport_shm_server *) transport;
+
+    LWPB_ASSERT(ring_size && !(ring_size & (ring_size - 1)),
+                "Ring size must be a power of two");
+    LWPB_ASSERT(2 * SHM_RECORD_SIZE(max_msg) <= ring_size,
+                "Ring must hold two messages of the maximum size");
+
+    shm_server->ring_size = ring_size;
+    shm_server->max_msg = max_msg;
+}
+
+/**
+ * Sets the time updates spin on the request rings before they sleep. Busy
+ * polling trades CPU time for latency.
+ * @param transport Transport handle
+ * @param busy_poll Time to spin (us), 0 to sleep right away
+ */
+void lwpb_transport_shm_server_busy_poll(lwpb_transport_t transport,
+                                         u32_t busy_poll)
+{
+    struct lwpb_transport_shm_server *shm_server =
+        (struct lwpb_transport_shm_server *) transport;
+
+    shm_server->busy_poll = busy_poll;
+}
+
+/**
+ * Opens the shared memory server. A stale socket file at the path is
+ * replaced.
+ * @param transport Transport handle
+ * @param path Path of the Unix domain socket to listen on
+ * @return Returns LWPB_ERR_OK if successful.
+ */
+lwpb_err_t lwpb_transport_shm_server_open(lwpb_transport_t transport,
+                                          const char *path)
+{
+    struct lwpb_transport_shm_server *shm_server =
+        (struct lwpb_transport_shm_server *) transport;
+    lwpb_err_t ret = LWPB_ERR_OK;
+    struct sockaddr_un addr;
+    struct epoll_event event;
+
+    LWPB_ASSERT(shm_server->server, "Server must be registered before opening");
+
+    if (shm_server->socket != -1) {
+        LWPB_INFO("Shared memory server already opened");
+        return LWPB_ERR_OK;
+    }
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        LWPB_ERR("Socket path too long");
+        return LWPB_ERR_NET_INIT;
+    }
+
+    // Clients get the list of services when they connect
+    shm_server->methods = method_table_create(shm_server->server->service_list);
+    if (!shm_server->methods)
+        return LWPB_ERR_MEM;
+    if (shm_server->methods->hello_len > LWPB_TRANSPORT_SHM_HELLO_SIZE) {
+        LWPB_ERR("Service list too long");
+        ret = LWPB_ERR_NET_INIT;
+        goto out;
+    }
+
+    // Create server socket
+    LWPB_DEBUG("Creating server socket");
+    shm_server->socket = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (shm_server->socket == -1) {
+        LWPB_ERR("Cannot create server socket");
+        ret = LWPB_ERR_NET_INIT;
+        goto out;
+    }
+
+    // Bind listen socket
+    LWPB_DEBUG("Binding server socket to %s", path);
+    LWPB_MEMSET(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(shm_server->socket, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        LWPB_ERR("Cannot bind server socket (errno: %d)", errno);
+        ret = LWPB_ERR_NET_INIT;
+        goto out;
+    }
+    strcpy(shm_server->path, path);
+
+    // Start listening
+    LWPB_DEBUG("Start listening on server socket");
+    if (listen(shm_server->socket, SOMAXCONN) == -1) {
+        LWPB_ERR("Cannot listen on server socket (errno: %d)", errno);
+        ret = LWPB_ERR_NET_INIT;
+        goto out;
+    }
+
+    // Create epoll instance and register listen socket
+    shm_server->epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (shm_server->epoll == -1) {
+        LWPB_ERR("Cannot create epoll instance (errno: %d)", errno);
+        ret = LWPB_ERR_NET_INIT;
+        goto out;
+    }
+    event.events = EPOLLIN;
+    event.data.u64 = EVENT_LISTEN;
+    if (epoll_ctl(shm_server->epoll, EPOLL_CTL_ADD, shm_server->socket, &event) == -1) {
+        LWPB_ERR("Cannot add server socket to epoll (errno: %d)", errno);
+        ret = LWPB_ERR_NET_INIT;
+        goto out;
+    }
+
+out:
+    if (ret != LWPB_ERR_OK) {
+        if (shm_server->epoll != -1)
+            close(shm_server->epoll);
+        if (shm_server->socket != -1)
+            close(shm_server->socket);
+        if (shm_server->path[0])
+            unlink(shm_server->path);
+        method_table_free(shm_server->methods);
+        shm_server->epoll = -1;
+        shm_server->socket = -1;
+        shm_server->path[0] = '\0';
+        shm_server->methods = NULL;
+    }
+
+    return ret;
+}
+
+/**
+ * Closes the shared memory server and removes its socket file.
+ * @param transport Transport handle
+ */
+void lwpb_transport_shm_server_close(lwpb_transport_t transport)
+{
+    struct lwpb_transport_shm_server *shm_server =
+        (struct lwpb_transport_shm_server *) transport;
+    int i;
+
+    if (shm_server->socket == -1)
+        return;
+
+    // Close active connections
+    for (i = 0; i < shm_server->conns_size; i++)
+        if (shm_server->conns[i])
+            close_connection(shm_server, shm_server->conns[i]);
+
+    LWPB_FREE(shm_server->conns);
+    shm_server->conns = NULL;
+    shm_server->conns_size = 0;
+
+    method_table_free(shm_server->methods);
+    shm_server->methods = NULL;
+
+    // Close listen socket
+    close(shm_server->epoll);
+    close(shm_server->socket);
+    unlink(shm_server->path);
+    shm_server->epoll = -1;
+    shm_server->socket = -1;
+    shm_server->path[0] = '\0';
+}
+
+/**
+ * Updates the shared memory server. Handles new connections and the
+ * requests of all clients, waiting up to a second for them. This method
+ * needs to be called periodically.
+ * @param transport Transport handle
+ */
+lwpb_err_t lwpb_transport_shm_server_update(lwpb_transport_t transport)
+{
+    struct lwpb_transport_shm_server *shm_server =
+        (struct lwpb_transport_shm_server *) transport;
+    struct epoll_event events[LWPB_TRANSPORT_SHM_SERVER_EVENTS];
+    struct lwpb_shm_server_conn *conn;
+    int timeout = 1000;
+    u64_t start;
+    int i, n;
+
+    if (shm_server->socket == -1)
+        return LWPB_ERR_OK;
+
+    // Spin for new requests before sleeping
+    if (shm_server->busy_poll && shm_server->num_conns &&
+        !requests_pending(shm_server)) {
+        start = lwpb_stats_now();
+        while (!requests_pending(shm_server) &&
+               lwpb_stats_now() - start < shm_server->busy_poll * 1000ULL)
+            ;
+    }
+
+    // Ask clients to signal new requests, unless requests are pending. While
+    // a response ring is full, poll for the client to make space.
+    for (i = 0; i < shm_server->conns_size; i++) {
+        conn = shm_server->conns[i];
+        if (!conn)
+            continue;
+        if (conn->blocked)
+            timeout = timeout ? 1 : 0;
+        else if (ring_sleep(conn->channel.req))
+            timeout = 0;
+    }
+
+    n = epoll_wait(shm_server->epoll, events, LWPB_TRANSPORT_SHM_SERVER_EVENTS,
+                   timeout);
+    if (n < 0 && errno != EINTR)
+        LWPB_FAIL("epoll_wait() failed");
+
+    for (i = 0; i < shm_server->conns_size; i++)
+        if (shm_server->conns[i])
+            ring_wake(shm_server->conns[i]->channel.req);
+
+    for (i = 0; i < n; i++) {
+        if (events[i].data.u64 == EVENT_LISTEN) {
+            handle_new_connection(shm_server);
+            continue;
+        }
+        conn = shm_server->conns[events[i].data.u64 >> 1];
+        if (!conn)
+            continue;
+        if (events[i].data.u64 & 1)
+            close_connection(shm_server, conn);
+        else
+            drain_event(conn->channel.req_event);
+    }
+
+    // Handle requests of all clients
+    for (i = 0; i < shm_server->conns_size; i++) {
+        conn = shm_server->conns[i];
+        if (conn && handle_requests(shm_server, conn) < 0) {
+            LWPB_ERR("Client(%d) sent invalid request", conn->index);
+            close_connection(shm_server, conn);
+        }
+    }
+
+    return LWPB_ERR_OK;
+}
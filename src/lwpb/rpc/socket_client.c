@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -29,8 +30,11 @@
 
 #include <lwpb/lwpb.h>
 #include <lwpb/rpc/socket_client.h>
+#include <lwpb/rpc/stats.h>
 
 #include "socket_helper.h"
+#include "socket_protocol_pb2.h"
+#include "uring_helper.h"
 
 
 /**
@@ -49,55 +53,747 @@ static void make_nonblock(int sock)
         LWPB_FAIL("fcntl(F_SETFL)");
 }
 
-static void handle_data(struct lwpb_transport_socket_client *socket_client)
+/**
+ * Grows the pending call table.
+ * @param socket_client Socket client
+ * @return Returns LWPB_ERR_OK if successful, LWPB_ERR_MEM if the table could
+ * not be grown or LWPB_ERR_BUSY if the maximum number of outstanding calls
+ * is reached.
+ */
+static lwpb_err_t grow_calls(struct lwpb_transport_socket_client *socket_client)
 {
-    ssize_t len;
-    size_t used;
-    struct protocol_header_info info;
+    struct lwpb_socket_client_call *calls;
+    int *free_slots;
+    int size;
+    int i;
+    
+    if (socket_client->calls_size == LWPB_TRANSPORT_SOCKET_CLIENT_MAX_CALLS)
+        return LWPB_ERR_BUSY;
+    size = socket_client->calls_size ? socket_client->calls_size * 2 :
+                                       LWPB_TRANSPORT_SOCKET_CLIENT_CALLS;
+    
+    calls = LWPB_REALLOC(socket_client->calls, size * sizeof(*calls));
+    if (!calls)
+        return LWPB_ERR_MEM;
+    socket_client->calls = calls;
+    
+    free_slots = LWPB_REALLOC(socket_client->free_slots, size * sizeof(*free_slots));
+    if (!free_slots)
+        return LWPB_ERR_MEM;
+    socket_client->free_slots = free_slots;
+    
+    // Push new slots in reverse order, so lower slots are used first
+    for (i = size - 1; i >= socket_client->calls_size; i--) {
+        calls[i].method_desc = NULL;
+        free_slots[socket_client->num_free_slots++] = i;
+    }
+    socket_client->calls_size = size;
+    
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Adds a call to the pending call table.
+ * @param socket_client Socket client
+ * @param method_desc Method descriptor
+ * @param call Call context
+ * @param deadline Time the call expires (ns), 0 for none
+ * @param id Pointer to call ID
+ * @return Returns LWPB_ERR_OK if successful.
+ */
+static lwpb_err_t add_call(struct lwpb_transport_socket_client *socket_client,
+                           const struct lwpb_method_desc *method_desc,
+                           struct lwpb_client_call *call_ctx, u64_t deadline,
+                           u32_t *id)
+{
+    struct lwpb_socket_client_call *call;
     lwpb_err_t ret;
+    int slot;
+    
+    if (socket_client->num_free_slots == 0) {
+        ret = grow_calls(socket_client);
+        if (ret != LWPB_ERR_OK)
+            return ret;
+    }
+    
+    slot = socket_client->free_slots[--socket_client->num_free_slots];
+    call = &socket_client->calls[slot];
+    call->id = ((u32_t) ++socket_client->seq << 16) | slot;
+    call->method_desc = method_desc;
+    call->call = call_ctx;
+    call->deadline = deadline;
+    socket_client->num_calls++;
     
-    used = socket_client->pos - socket_client->buf;
+    if (deadline && (!socket_client->next_deadline ||
+                     deadline < socket_client->next_deadline))
+        socket_client->next_deadline = deadline;
     
-    len = recv(socket_client->socket, socket_client->pos,
-               socket_client->len - used, 0);
-    if (len <= 0) {
-        // Server closed connection TODO
-        LWPB_FAIL("Server closed connection");
+    *id = call->id;
+    
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Looks up a call in the pending call table.
+ * @param socket_client Socket client
+ * @param id Call ID
+ * @return Returns the slot of the call or -1 if there is no pending call with
+ * the given ID.
+ */
+static int find_call(struct lwpb_transport_socket_client *socket_client,
+                     u32_t id)
+{
+    struct lwpb_socket_client_call *call;
+    int slot = id & 0xffff;
+    
+    if (slot >= socket_client->calls_size)
+        return -1;
+    call = &socket_client->calls[slot];
+    if (!call->method_desc || call->id != id)
+        return -1;
+    
+    return slot;
+}
+
+/**
+ * Removes a call from the pending call table.
+ * @param socket_client Socket client
+ * @param id Call ID
+ * @param call_ctx Returns the call context
+ * @return Returns the method descriptor of the call or NULL if there is no
+ * pending call with the given ID.
+ */
+static const struct lwpb_method_desc *remove_call(
+        struct lwpb_transport_socket_client *socket_client, u32_t id,
+        struct lwpb_client_call **call_ctx)
+{
+    struct lwpb_socket_client_call *call;
+    const struct lwpb_method_desc *method_desc;
+    int slot = find_call(socket_client, id);
+    
+    if (slot < 0)
+        return NULL;
+    call = &socket_client->calls[slot];
+    
+    method_desc = call->method_desc;
+    *call_ctx = call->call;
+    call->method_desc = NULL;
+    socket_client->free_slots[socket_client->num_free_slots++] = slot;
+    socket_client->num_calls--;
+    
+    return method_desc;
+}
+
+/**
+ * Handles the HELLO message of the server. If the server supports v2, the
+ * message is kept to look up service indices.
+ * @param socket_client Socket client
+ * @param buf HELLO message
+ * @param len Length of HELLO message
+ */
+static void handle_hello(struct lwpb_transport_socket_client *socket_client,
+                         void *buf, size_t len)
+{
+    struct lwpb_reader reader;
+    const struct lwpb_field_desc *field_desc;
+    union lwpb_value value;
+    u32_t version = 1;
+    
+    lwpb_reader_init(&reader, socket_protocol_Hello, buf, len);
+    while (lwpb_reader_next(&reader, &field_desc, &value) == LWPB_ERR_OK && field_desc)
+        if (field_desc == socket_protocol_Hello_version)
+            version = value.uint32;
+    
+    LWPB_DEBUG("Server speaks protocol version %u", version);
+    if (version < PROTOCOL_VERSION || socket_client->hello)
+        return;
+    
+    socket_client->hello = LWPB_MALLOC(len);
+    if (!socket_client->hello)
+        return;
+    LWPB_MEMCPY(socket_client->hello, buf, len);
+    socket_client->hello_len = len;
+    socket_client->version = PROTOCOL_VERSION;
+}
+
+/**
+ * Returns the index of a service on the server. Indices are looked up in the
+ * HELLO message of the server and cached.
+ * @param socket_client Socket client
+ * @param service_desc Service descriptor
+ * @return Returns the service index or -1 if v1 headers have to be used.
+ */
+static int service_index(struct lwpb_transport_socket_client *socket_client,
+                         const struct lwpb_service_desc *service_desc)
+{
+    int index;
+    int i;
+    
+    if (socket_client->version < PROTOCOL_VERSION)
+        return -1;
+    
+    for (i = 0; i < socket_client->num_services; i++)
+        if (socket_client->services[i].service_desc == service_desc)
+            return socket_client->services[i].index;
+    
+    index = hello_service_index(socket_client->hello, socket_client->hello_len,
+                                service_desc);
+    
+    if (socket_client->num_services < LWPB_TRANSPORT_SOCKET_CLIENT_SERVICES) {
+        socket_client->services[socket_client->num_services].service_desc = service_desc;
+        socket_client->services[socket_client->num_services].index = index;
+        socket_client->num_services++;
+    }
+    
+    return index;
+}
+
+/**
+ * Sends the requests of the current batch in a single BATCH frame.
+ * @param socket_client Socket client
+ */
+static void flush_batch(struct lwpb_transport_socket_client *socket_client)
+{
+    if (socket_client->batch.len == 0)
         return;
+    
+    LWPB_DEBUG("Sending batch of %d calls", socket_client->batch_calls);
+    if (send_batch(socket_client->socket, &socket_client->outq,
+                   socket_client->options, &socket_client->batch) != 0)
+        LWPB_ERR("Cannot send batch (errno: %d)", errno);
+    socket_client->batch_calls = 0;
+}
+
+/**
+ * Removes an outstanding call which will not be waited for anymore and
+ * completes it. v2 servers are told to drop the call, older servers still
+ * handle it and the response is discarded.
+ * @param socket_client Socket client
+ * @param slot Slot of the call in the pending call table
+ * @param result Result of the call
+ */
+static void abort_call(struct lwpb_transport_socket_client *socket_client,
+                       int slot, lwpb_rpc_result_t result)
+{
+    const struct lwpb_method_desc *method_desc;
+    struct lwpb_client_call *call;
+    u32_t id = socket_client->calls[slot].id;
+    
+    method_desc = remove_call(socket_client, id, &call);
+    
+    if (socket_client->version >= PROTOCOL_VERSION) {
+        // The request must reach the server before the CANCEL frame
+        flush_batch(socket_client);
+        if (send_cancel(socket_client->socket, &socket_client->outq,
+                        socket_client->options, id) != 0)
+            LWPB_ERR("Cannot send cancel (errno: %d)", errno);
+    }
+    
+    lwpb_client_call_done(socket_client->client, method_desc, call, result);
+}
+
+/**
+ * Handles all complete response frames in the receive buffer and moves the
+ * remaining partial frame to the start of the buffer.
+ * @param socket_client Socket client
+ * @param need Returns the size of the partial frame if known from its header
+ * or 0
+ * @return Returns 0 if successful or -1 if the server sent an invalid frame
+ * or a handler closed the client.
+ */
+static int handle_frames(struct lwpb_transport_socket_client *socket_client,
+                         size_t *need)
+{
+    struct protocol_header_info info;
+    protocol_parse_err_t ret;
+    const struct lwpb_method_desc *method_desc;
+    struct lwpb_client_call *call;
+    lwpb_err_t err;
+    size_t pos = 0;
+    void *frame;
+    int slot;
+    
+    for (;;) {
+        frame = socket_client->inq.data + pos;
+        ret = parse_request(frame, socket_client->inq.len - pos, &info, NULL);
+        if (ret == PARSE_ERR_END_OF_BUF)
+            break;
+        if (ret != PARSE_ERR_OK)
+            return -1;
+        pos += info.header_len + info.msg_len;
+        
+        LWPB_DEBUG("Received response header");
+        LWPB_DEBUG("type = %d, id = %u, header_len = %d, msg_len = %d",
+                   info.msg_type, info.id, info.header_len, info.msg_len);
+        
+        if (info.msg_type == MSG_TYPE_HELLO) {
+            handle_hello(socket_client, frame + info.header_len, info.msg_len);
+            continue;
+        }
+        
+        // Messages of a streaming call leave the call pending
+        if (info.msg_type == MSG_TYPE_STREAM) {
+            slot = find_call(socket_client, info.id);
+            if (slot < 0) {
+                LWPB_DEBUG("Received stream message for unknown call %u", info.id);
+                continue;
+            }
+            method_desc = socket_client->calls[slot].method_desc;
+            call = socket_client->calls[slot].call;
+            err = call->response_handler(socket_client->client, method_desc,
+                                         method_desc->res_desc,
+                                         frame + info.header_len, info.msg_len,
+                                         call->arg);
+            // Handlers may close the client, which frees the receive buffer
+            if (socket_client->socket == -1)
+                return -1;
+            if (err != LWPB_ERR_OK) {
+                abort_call(socket_client, slot, LWPB_RPC_FAILED);
+                if (socket_client->socket == -1)
+                    return -1;
+            }
+            continue;
+        }
+        
+        // Match response to its call
+        method_desc = remove_call(socket_client, info.id, &call);
+        if (!method_desc) {
+            // Calls which timed out or were cancelled are already done
+            LWPB_DEBUG("Received response for unknown call %u", info.id);
+            continue;
+        }
+        
+        // Calls rejected by the server and ended streams carry no message
+        if (info.status != LWPB_RPC_OK || info.msg_type == MSG_TYPE_STREAM_END) {
+            lwpb_client_call_done(socket_client->client, method_desc, call,
+                                  info.status);
+            if (socket_client->socket == -1)
+                return -1;
+            continue;
+        }
+        
+        // Process response directly from the receive buffer
+        err = call->response_handler(socket_client->client, method_desc,
+                                     method_desc->res_desc,
+                                     frame + info.header_len, info.msg_len,
+                                     call->arg);
+        
+        lwpb_client_call_done(socket_client->client, method_desc, call,
+                              err == LWPB_ERR_OK ? LWPB_RPC_OK : LWPB_RPC_FAILED);
+        if (socket_client->socket == -1)
+            return -1;
     }
     
-    socket_client->pos += len;
-    used = socket_client->pos - socket_client->buf;
+    *need = info.header_len + info.msg_len;
+    
+    // Compact receive buffer
+    inq_consume(&socket_client->inq, pos);
+    
+    return 0;
+}
+
+/**
+ * Handles complete responses in the receive buffer and makes room for the
+ * rest of the partial frame. The client is closed if the server sent an
+ * invalid or too large frame.
+ * @param socket_client Socket client
+ * @return Returns 0 if successful or -1 if the client was closed.
+ */
+static int handle_input(struct lwpb_transport_socket_client *socket_client)
+{
+    size_t need;
+    
+    if (handle_frames(socket_client, &need) != 0) {
+        // A handler may have closed the client already
+        if (socket_client->socket != -1) {
+            LWPB_ERR("Server sent invalid frame");
+            lwpb_transport_socket_client_close(&socket_client->super);
+        }
+        return -1;
+    }
+    if (need > socket_client->max_frame) {
+        LWPB_ERR("Response frame of %u bytes exceeds maximum frame size",
+                 (unsigned int) need);
+        lwpb_transport_socket_client_close(&socket_client->super);
+        return -1;
+    }
     
-    LWPB_DEBUG("Received %d bytes", len);
+    // Grow the receive buffer to hold the partial frame
+    if (inq_reserve(&socket_client->inq, need) != 0) {
+        LWPB_ERR("Cannot allocate receive buffer");
+        lwpb_transport_socket_client_close(&socket_client->super);
+        return -1;
+    }
+    
+    return 0;
+}
+
+/**
+ * Reads data from the server and handles complete responses.
+ * @param socket_client Socket client
+ */
+static void handle_data(struct lwpb_transport_socket_client *socket_client)
+{
+    ssize_t len;
+    
+    for (;;) {
+        if (socket_client->socket == -1 || handle_input(socket_client) != 0)
+            return;
+        
+        len = recv(socket_client->socket, socket_client->inq.data + socket_client->inq.len,
+                   socket_client->inq.size - socket_client->inq.len, 0);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (len <= 0) {
+            LWPB_ERR("Server closed connection (errno: %d)", len ? errno : 0);
+            lwpb_transport_socket_client_close(&socket_client->super);
+            return;
+        }
+        
+        socket_client->inq.len += len;
+        
+        LWPB_DEBUG("Received %d bytes", len);
+    }
+}
+
+/**
+ * Arms the multishot receive from the server, unless it is armed.
+ * @param socket_client Socket client
+ * @return Returns 0 if successful or -1 if the receive cannot be queued.
+ */
+static int start_recv(struct lwpb_transport_socket_client *socket_client)
+{
+    if (socket_client->receiving)
+        return 0;
+    
+    if (uring_recv(&socket_client->uring, socket_client->socket,
+                   URING_DATA(NULL, URING_RECV)) != 0)
+        return -1;
+    socket_client->receiving = 1;
+    
+    return 0;
+}
+
+/**
+ * Sends the rest of the send buffer on io_uring. If the send cannot be
+ * queued, the send buffer is dropped, as no send is in flight.
+ * @param socket_client Socket client
+ * @return Returns 0 if successful or -1 if the send cannot be queued.
+ */
+static int send_more(struct lwpb_transport_socket_client *socket_client)
+{
+    if (uring_send(&socket_client->uring, socket_client->socket,
+                   socket_client->sending.data + socket_client->sent,
+                   socket_client->sending.len - socket_client->sent,
+                   URING_DATA(NULL, URING_SEND)) != 0) {
+        socket_client->sending.len = 0;
+        return -1;
+    }
+    
+    return 0;
+}
+
+/**
+ * Starts sending the queued requests on io_uring. The output queue becomes
+ * the send buffer, so requests are queued while the send is in flight. If a
+ * send is already in flight, the queued requests are sent once it completes.
+ * @param socket_client Socket client
+ * @return Returns 0 if successful or -1 if the send cannot be queued.
+ */
+static int start_send(struct lwpb_transport_socket_client *socket_client)
+{
+    struct lwpb_socket_outq tmp;
     
-    // Try to decode the request
-    ret = parse_request(socket_client->buf, used, &info, NULL);
-    if (ret != PARSE_ERR_OK)
+    if (socket_client->sending.len || !socket_client->outq.len)
+        return 0;
+    
+    tmp = socket_client->sending;
+    socket_client->sending = socket_client->outq;
+    socket_client->outq = tmp;
+    socket_client->sent = 0;
+    
+    return send_more(socket_client);
+}
+
+/**
+ * Handles a completion of the multishot receive. The data is appended to
+ * the receive buffer and the provided buffer is given back right away.
+ * @param socket_client Socket client
+ * @param res Number of received bytes or negative error code
+ * @param flags Completion flags
+ */
+static void handle_recv(struct lwpb_transport_socket_client *socket_client,
+                        int res, unsigned int flags)
+{
+    struct lwpb_uring *uring = &socket_client->uring;
+    unsigned int bid;
+    int err = 0;
+    
+    if (!(flags & IORING_CQE_F_MORE))
+        socket_client->receiving = 0;
+    
+    // The receive buffer is gone once a handler closed the client
+    if (socket_client->socket == -1)
+        return;
+    
+    if (flags & IORING_CQE_F_BUFFER) {
+        bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res > 0)
+            err = inq_reserve(&socket_client->inq, socket_client->inq.len + res);
+        if (res > 0 && !err) {
+            LWPB_MEMCPY(socket_client->inq.data + socket_client->inq.len,
+                        uring_buf(uring, bid), res);
+            socket_client->inq.len += res;
+            LWPB_DEBUG("Received %d bytes", res);
+        }
+        uring_recycle_buf(uring, bid);
+        if (err) {
+            LWPB_ERR("Cannot allocate receive buffer");
+            lwpb_transport_socket_client_close(&socket_client->super);
+            return;
+        }
+    }
+    
+    // Running out of provided buffers is no error, the receive is armed again
+    if (res == 0 || (res < 0 && res != -ENOBUFS)) {
+        LWPB_ERR("Server closed connection (errno: %d)", -res);
+        lwpb_transport_socket_client_close(&socket_client->super);
+        return;
+    }
+    
+    if (handle_input(socket_client) != 0)
         return;
     
-    LWPB_DEBUG("Received request header");
-    LWPB_DEBUG("type = %d, service = %p, method = %p, header_len = %d, msg_len = %d",
-               info.msg_type, info.service_desc, info.method_desc,
-               info.header_len, info.msg_len);
+    if (start_recv(socket_client) != 0) {
+        LWPB_ERR("Cannot queue receive");
+        lwpb_transport_socket_client_close(&socket_client->super);
+    }
+}
+
+/**
+ * Handles the completion of a send. The rest of a short send is sent again,
+ * otherwise the requests queued in the meantime are sent.
+ * @param socket_client Socket client
+ * @param res Number of sent bytes or negative error code
+ */
+static void handle_send(struct lwpb_transport_socket_client *socket_client, int res)
+{
+    int ret;
     
-    if (!info.service_desc) {
-        // TODO unknown service
+    if (res <= 0) {
+        LWPB_ERR("Cannot send data to server (errno: %d)", -res);
+        socket_client->sending.len = 0;
+        lwpb_transport_socket_client_close(&socket_client->super);
+        return;
     }
     
-    if (!info.method_desc) {
-        // TODO unknown method
+    socket_client->sent += res;
+    if (socket_client->sent < socket_client->sending.len) {
+        ret = send_more(socket_client);
+    } else {
+        socket_client->sending.len = 0;
+        ret = start_send(socket_client);
+    }
+    if (ret != 0) {
+        LWPB_ERR("Cannot queue send");
+        lwpb_transport_socket_client_close(&socket_client->super);
     }
+}
+
+/**
+ * Handles all io_uring completions.
+ * @param socket_client Socket client
+ */
+static void handle_completions(struct lwpb_transport_socket_client *socket_client)
+{
+    struct io_uring_cqe *cqe;
+    u64_t user_data;
+    unsigned int flags;
+    int res;
     
-    // Process response
-    ret = socket_client->client->response_handler(
-        socket_client->client, socket_client->last_method,
-        socket_client->last_method->res_desc,
-        socket_client->buf + info.header_len, info.msg_len,
-        socket_client->client->arg);
-    if (ret != LWPB_ERR_OK) {
+    while (socket_client->socket != -1 &&
+           (cqe = uring_peek(&socket_client->uring))) {
+        user_data = cqe->user_data;
+        res = cqe->res;
+        flags = cqe->flags;
+        uring_advance(&socket_client->uring);
         
+        if ((user_data & URING_TYPE_MASK) == URING_RECV)
+            handle_recv(socket_client, res, flags);
+        else if ((user_data & URING_TYPE_MASK) == URING_SEND)
+            handle_send(socket_client, res);
+    }
+}
+
+/**
+ * Shuts down the socket and waits for the outstanding io_uring requests,
+ * which refer to the send buffer until they complete.
+ * @param socket_client Socket client
+ */
+static void drain_uring(struct lwpb_transport_socket_client *socket_client)
+{
+    struct lwpb_uring *uring = &socket_client->uring;
+    struct io_uring_cqe *cqe;
+    int tries;
+    
+    shutdown(socket_client->socket, SHUT_RDWR);
+    
+    for (tries = 0; tries < 100; tries++) {
+        if (!socket_client->receiving && !socket_client->sending.len)
+            return;
+        if (uring_submit(uring, 10) < 0)
+            break;
+        while ((cqe = uring_peek(uring))) {
+            if ((cqe->user_data & URING_TYPE_MASK) == URING_RECV &&
+                !(cqe->flags & IORING_CQE_F_MORE))
+                socket_client->receiving = 0;
+            if ((cqe->user_data & URING_TYPE_MASK) == URING_SEND)
+                socket_client->sending.len = 0;
+            uring_advance(uring);
+        }
+    }
+    
+    LWPB_ERR("Closing with outstanding io_uring requests");
+}
+
+/**
+ * Sets up io_uring for the socket client. Requests are always queued, so
+ * they are sent by io_uring on the next update.
+ * @param socket_client Socket client
+ * @return Returns 0 if successful or -1 if io_uring is not available.
+ */
+static int open_uring(struct lwpb_transport_socket_client *socket_client)
+{
+    struct lwpb_uring *uring = &socket_client->uring;
+    
+    if (uring_init(uring, LWPB_URING_ENTRIES) != 0)
+        return -1;
+    
+    if (uring_setup_bufs(uring, LWPB_URING_BUFS, LWPB_URING_BUF_SIZE) != 0) {
+        uring_free(uring);
+        return -1;
     }
+    
+    if (start_recv(socket_client) != 0) {
+        uring_free(uring);
+        return -1;
+    }
+    socket_client->options |= LWPB_TRANSPORT_SOCKET_BATCH;
+    
+    return 0;
+}
+
+/**
+ * Adds a request to the current batch and sends the batch if it is full.
+ * @param socket_client Socket client
+ * @param method_desc Method descriptor
+ * @param service_index Index of the service on the server
+ * @param id Call ID
+ * @param timeout Timeout of the call (ms), 0 for none
+ * @param req_buf Request message
+ * @param req_len Length of request message
+ * @return Returns 0 if successful or -1 if memory could not be allocated.
+ */
+static int batch_request(struct lwpb_transport_socket_client *socket_client,
+                         const struct lwpb_method_desc *method_desc,
+                         int service_index, u32_t id, u32_t timeout,
+                         void *req_buf, size_t req_len)
+{
+    if (append_request(&socket_client->batch, method_desc, service_index,
+                       id, timeout, req_buf, req_len) != 0)
+        return -1;
+    
+    if (socket_client->batch_calls++ == 0)
+        socket_client->batch_time = lwpb_stats_now();
+    
+    if (socket_client->batch_calls >= socket_client->batch_max_calls ||
+        socket_client->batch.len >= socket_client->batch_max_size ||
+        lwpb_stats_now() - socket_client->batch_time >= socket_client->batch_max_delay * 1000ULL)
+        flush_batch(socket_client);
+    
+    return 0;
+}
+
+/**
+ * Completes the calls whose deadline has passed with LWPB_RPC_TIMEOUT and
+ * finds the next deadline. The pending call table is only scanned once the
+ * earliest deadline has passed.
+ * @param socket_client Socket client
+ */
+static void expire_calls(struct lwpb_transport_socket_client *socket_client)
+{
+    struct lwpb_socket_client_call *call;
+    u64_t current;
+    u64_t next = 0;
+    int i;
+    
+    if (!socket_client->next_deadline)
+        return;
+    current = lwpb_stats_now();
+    if (current < socket_client->next_deadline)
+        return;
+    
+    for (i = 0; i < socket_client->calls_size; i++) {
+        call = &socket_client->calls[i];
+        if (!call->method_desc || !call->deadline)
+            continue;
+        if (call->deadline <= current) {
+            LWPB_DEBUG("Call %u timed out", call->id);
+            abort_call(socket_client, i, LWPB_RPC_TIMEOUT);
+        } else if (!next || call->deadline < next) {
+            next = call->deadline;
+        }
+    }
+    
+    socket_client->next_deadline = next;
+}
+
+/**
+ * Completes the calls which timed out and sends the batch once its oldest
+ * call has waited long enough.
+ * @param socket_client Socket client
+ */
+static void handle_timers(struct lwpb_transport_socket_client *socket_client)
+{
+    expire_calls(socket_client);
+    if (socket_client->batch.len &&
+        lwpb_stats_now() - socket_client->batch_time >=
+        socket_client->batch_max_delay * 1000ULL)
+        flush_batch(socket_client);
+}
+
+/**
+ * Returns how long to wait for the server, so calls expire and batches are
+ * sent in time.
+ * @param socket_client Socket client
+ * @param max Time to wait if no call or batch is waiting (us)
+ * @return Returns the time to wait (us).
+ */
+static u64_t wait_time(struct lwpb_transport_socket_client *socket_client,
+                       u64_t max)
+{
+    u64_t current = lwpb_stats_now();
+    u64_t wait = max;
+    u64_t age;
+    
+    if (socket_client->next_deadline) {
+        if (socket_client->next_deadline <= current)
+            return 0;
+        if ((socket_client->next_deadline - current) / 1000 + 1 < wait)
+            wait = (socket_client->next_deadline - current) / 1000 + 1;
+    }
+    
+    if (socket_client->batch.len) {
+        age = (current - socket_client->batch_time) / 1000;
+        if (age >= socket_client->batch_max_delay)
+            return 0;
+        if (socket_client->batch_max_delay - age < wait)
+            wait = socket_client->batch_max_delay - age;
+    }
+    
+    return wait;
 }
 
 /**
@@ -118,26 +814,34 @@ static void transport_register_client(lwpb_transport_t transport,
 }
 
 /**
- * This method is called from the client to start an RPC call.
+ * This method is called from the client to start an RPC call. The call is
+ * added to the pending call table and the request is sent without waiting
+ * for the responses of earlier calls.
  * @param transport Transport implementation
  * @param client Client
  * @param method_desc Method descriptor
+ * @param call Call context
  * @return Returns LWPB_ERR_OK if successful.
  */
 static lwpb_err_t transport_call(lwpb_transport_t transport,
                                  struct lwpb_client *client,
-                                 const struct lwpb_method_desc *method_desc)
+                                 const struct lwpb_method_desc *method_desc,
+                                 struct lwpb_client_call *call)
 {
     struct lwpb_transport_socket_client *socket_client =
         (struct lwpb_transport_socket_client *) transport;
     lwpb_err_t ret = LWPB_ERR_OK;
     void *req_buf = NULL;
     size_t req_len;
+    u32_t timeout;
+    u64_t deadline = 0;
+    u32_t id;
+    int index;
+    int err;
     
     // Only continue if connected to server
     if (socket_client->socket == -1) {
-        client->done_handler(client, method_desc,
-                             LWPB_RPC_NOT_CONNECTED, client->arg);
+        lwpb_client_call_done(client, method_desc, call, LWPB_RPC_NOT_CONNECTED);
         goto out;
     }
     
@@ -147,17 +851,33 @@ static lwpb_err_t transport_call(lwpb_transport_t transport,
         goto out;
     
     // Encode the request message
-    ret = client->request_handler(client, method_desc, method_desc->req_desc,
-                                  req_buf, &req_len, client->arg);
+    ret = call->request_handler(client, method_desc, method_desc->req_desc,
+                                req_buf, &req_len, call->arg);
     if (ret != LWPB_ERR_OK)
         goto out;
-
     
-    socket_client->last_method = method_desc;
+    timeout = lwpb_client_get_timeout(client, call);
+    if (timeout)
+        deadline = lwpb_stats_now() + timeout * 1000000ULL;
     
-    // Send the request to the server
-    // TODO check result
-    send_request(socket_client->socket, method_desc, req_buf, req_len);
+    ret = add_call(socket_client, method_desc, call, deadline, &id);
+    if (ret != LWPB_ERR_OK)
+        goto out;
+    
+    // Send the request to the server, batches need a v2 server
+    index = service_index(socket_client, method_desc->service);
+    if (socket_client->batching && index >= 0)
+        err = batch_request(socket_client, method_desc, index, id, timeout,
+                            req_buf, req_len);
+    else
+        err = send_request(socket_client->socket, &socket_client->outq,
+                           socket_client->options, method_desc, index, id,
+                           timeout, req_buf, req_len);
+    if (err != 0) {
+        LWPB_ERR("Cannot send request (errno: %d)", errno);
+        remove_call(socket_client, id, &call);
+        lwpb_client_call_done(client, method_desc, call, LWPB_RPC_FAILED);
+    }
     
 out:
     // Free allocated requiest message buffer
@@ -168,15 +888,27 @@ out:
 }
 
 /**
- * This method is called from the client when the current RPC call should
+ * This method is called from the client when an outstanding RPC call should
  * be cancelled.
  * @param transport Transport implementation
  * @param client Client
+ * @param call Call context
  */
 static void transport_cancel(lwpb_transport_t transport,
-                             struct lwpb_client *client)
+                             struct lwpb_client *client,
+                             struct lwpb_client_call *call)
 {
-    // Cancel is not supported in this transport implementation.
+    struct lwpb_transport_socket_client *socket_client =
+        (struct lwpb_transport_socket_client *) transport;
+    int i;
+    
+    for (i = 0; i < socket_client->calls_size; i++) {
+        if (socket_client->calls[i].method_desc &&
+            socket_client->calls[i].call == call) {
+            abort_call(socket_client, i, LWPB_RPC_CANCELLED);
+            return;
+        }
+    }
 }
 
 /**
@@ -191,11 +923,28 @@ static void transport_register_server(lwpb_transport_t transport,
     LWPB_FAIL("No servers can be registered");
 }
 
+/**
+ * This method is called from the client to start or end a batch of calls.
+ * @param transport Transport implementation
+ * @param enable Set to start a batch, zero to end it
+ */
+static void transport_batch(lwpb_transport_t transport, int enable)
+{
+    struct lwpb_transport_socket_client *socket_client =
+        (struct lwpb_transport_socket_client *) transport;
+    
+    socket_client->batching = enable;
+    if (!enable && socket_client->socket != -1)
+        flush_batch(socket_client);
+}
+
 static const struct lwpb_transport_funs transport_funs = {
     .register_client = transport_register_client,
     .call = transport_call,
     .cancel = transport_cancel,
     .register_server = transport_register_server,
+    .update = lwpb_transport_socket_client_update,
+    .batch = transport_batch,
 };
 
 
@@ -218,11 +967,99 @@ lwpb_transport_t lwpb_transport_socket_client_init(
     
     socket_client->client = NULL;
     socket_client->socket = -1;
-    socket_client->buf = NULL;
+    socket_client->inq.data = NULL;
+    socket_client->inq.len = 0;
+    socket_client->inq.size = 0;
+    socket_client->max_frame = LWPB_TRANSPORT_SOCKET_MAX_FRAME;
+    socket_client->calls = NULL;
+    socket_client->free_slots = NULL;
+    socket_client->num_free_slots = 0;
+    socket_client->calls_size = 0;
+    socket_client->num_calls = 0;
+    socket_client->seq = 0;
+    socket_client->options = LWPB_TRANSPORT_SOCKET_DEFAULT_OPTIONS;
+    socket_client->outq.data = NULL;
+    socket_client->outq.len = 0;
+    socket_client->outq.size = 0;
+    socket_client->version = 1;
+    socket_client->hello = NULL;
+    socket_client->hello_len = 0;
+    socket_client->num_services = 0;
+    socket_client->batch.data = NULL;
+    socket_client->batch.len = 0;
+    socket_client->batch.size = 0;
+    socket_client->batching = 0;
+    socket_client->batch_calls = 0;
+    socket_client->batch_max_calls = LWPB_TRANSPORT_SOCKET_CLIENT_BATCH_CALLS;
+    socket_client->batch_max_size = LWPB_TRANSPORT_SOCKET_CLIENT_BATCH_SIZE;
+    socket_client->batch_max_delay = LWPB_TRANSPORT_SOCKET_CLIENT_BATCH_DELAY;
+    socket_client->next_deadline = 0;
+    socket_client->uring.fd = -1;
+    socket_client->receiving = 0;
+    socket_client->sending.data = NULL;
+    socket_client->sending.len = 0;
+    socket_client->sending.size = 0;
+    socket_client->sent = 0;
     
     return &socket_client->super;
 }
 
+/**
+ * Sets the socket transport options (LWPB_TRANSPORT_SOCKET_xxx) of the
+ * socket client. With LWPB_TRANSPORT_SOCKET_BATCH, requests are queued and
+ * written with a single syscall on the next update or flush. With
+ * LWPB_TRANSPORT_SOCKET_URING, the client runs on io_uring if the kernel
+ * supports it. This method must be called before
+ * lwpb_transport_socket_client_open().
+ * @param transport Transport handle
+ * @param options Socket transport options
+ */
+void lwpb_transport_socket_client_options(lwpb_transport_t transport,
+                                          unsigned int options)
+{
+    struct lwpb_transport_socket_client *socket_client =
+        (struct lwpb_transport_socket_client *) transport;
+    
+    LWPB_ASSERT(socket_client->socket == -1,
+                "Options must be set before opening the client");
+    
+    socket_client->options = options;
+}
+
+/**
+ * Sets the maximum size of a response frame (header and message). The
+ * connection is closed if the server sends a larger frame.
+ * @param transport Transport handle
+ * @param max_frame Maximum frame size in bytes
+ */
+void lwpb_transport_socket_client_max_frame(lwpb_transport_t transport,
+                                            size_t max_frame)
+{
+    struct lwpb_transport_socket_client *socket_client =
+        (struct lwpb_transport_socket_client *) transport;
+    
+    socket_client->max_frame = max_frame;
+}
+
+/**
+ * Sets the thresholds at which a batch of calls is sent.
+ * @param transport Transport handle
+ * @param max_calls Maximum number of calls in a batch
+ * @param max_size Maximum size of a batch in bytes
+ * @param max_delay Maximum time a call is held back in a batch (us)
+ */
+void lwpb_transport_socket_client_batch(lwpb_transport_t transport,
+                                        int max_calls, size_t max_size,
+                                        u32_t max_delay)
+{
+    struct lwpb_transport_socket_client *socket_client =
+        (struct lwpb_transport_socket_client *) transport;
+    
+    socket_client->batch_max_calls = max_calls;
+    socket_client->batch_max_size = max_size;
+    socket_client->batch_max_delay = max_delay;
+}
+
 /**
  * Opens the socket client for communication.
  * @param transport Transport handle
@@ -248,13 +1085,6 @@ lwpb_err_t lwpb_transport_socket_client_open(lwpb_transport_t transport,
         return LWPB_ERR_OK;
     }
 
-    // Allocate receive buffer
-    ret = lwpb_transport_alloc_buf(&socket_client->super,
-                                   &socket_client->buf, &socket_client->len);
-    if (ret != LWPB_ERR_OK)
-        return ret;
-    socket_client->pos = socket_client->buf;
-
     // Resolve hostname
     LWPB_DEBUG("Resolving hostname '%s'", host);
     memset(&hints, 0, sizeof hints);
@@ -296,6 +1126,21 @@ lwpb_err_t lwpb_transport_socket_client_open(lwpb_transport_t transport,
     
     // Make non-blocking
     make_nonblock(socket_client->socket);
+    set_socket_options(socket_client->socket, socket_client->options);
+    
+    // Use io_uring if requested and available
+    if ((socket_client->options & LWPB_TRANSPORT_SOCKET_URING) &&
+        open_uring(socket_client) != 0)
+        LWPB_INFO("Cannot set up io_uring (errno: %d), using select()", errno);
+    
+    // Negotiate the protocol version
+    if ((socket_client->options & LWPB_TRANSPORT_SOCKET_V2) &&
+        send_hello(socket_client->socket, &socket_client->outq,
+                   socket_client->options, NULL) != 0) {
+        LWPB_ERR("Cannot send hello (errno: %d)", errno);
+        ret = LWPB_ERR_NET_INIT;
+        goto out;
+    }
     
 out:
     freeaddrinfo(res);
@@ -311,53 +1156,272 @@ void lwpb_transport_socket_client_close(lwpb_transport_t transport)
 {
     struct lwpb_transport_socket_client *socket_client =
         (struct lwpb_transport_socket_client *) transport;
+    const struct lwpb_method_desc *method_desc;
+    struct lwpb_client_call *call;
     int i;
     
     if (socket_client->socket == -1)
         return;
     
+    if (socket_client->uring.fd != -1) {
+        drain_uring(socket_client);
+        uring_free(&socket_client->uring);
+        outq_free(&socket_client->sending);
+        socket_client->receiving = 0;
+    }
+    
     // Free receive buffer
-    lwpb_transport_free_buf(transport, socket_client->buf);
+    inq_free(&socket_client->inq);
     
     // Close socket
     close(socket_client->socket);
-    socket_client->socket == -1;
+    socket_client->socket = -1;
+    outq_free(&socket_client->outq);
+    outq_free(&socket_client->batch);
+    socket_client->batch_calls = 0;
+    
+    // Forget the negotiated protocol version
+    LWPB_FREE(socket_client->hello);
+    socket_client->hello = NULL;
+    socket_client->version = 1;
+    socket_client->num_services = 0;
+    
+    // Fail outstanding calls
+    for (i = 0; i < socket_client->calls_size; i++) {
+        method_desc = socket_client->calls[i].method_desc;
+        if (!method_desc)
+            continue;
+        remove_call(socket_client, socket_client->calls[i].id, &call);
+        lwpb_client_call_done(socket_client->client, method_desc, call,
+                              LWPB_RPC_NOT_CONNECTED);
+    }
+    
+    LWPB_FREE(socket_client->calls);
+    LWPB_FREE(socket_client->free_slots);
+    socket_client->calls = NULL;
+    socket_client->free_slots = NULL;
+    socket_client->num_free_slots = 0;
+    socket_client->calls_size = 0;
+    socket_client->next_deadline = 0;
+}
+
+/**
+ * Writes queued requests to the server. If the connection failed, the
+ * client is closed and its outstanding calls fail with
+ * LWPB_RPC_NOT_CONNECTED.
+ * @param transport Transport handle
+ * @return Returns LWPB_ERR_OK if successful, LWPB_ERR_BUSY if data remains
+ * queued because the socket would block or LWPB_ERR_NET_INIT if the client
+ * was closed.
+ */
+lwpb_err_t lwpb_transport_socket_client_flush(lwpb_transport_t transport)
+{
+    struct lwpb_transport_socket_client *socket_client =
+        (struct lwpb_transport_socket_client *) transport;
+    int ret;
+    
+    if (socket_client->socket == -1)
+        return LWPB_ERR_OK;
+    
+    // Requests handed to io_uring are no longer queued
+    if (socket_client->uring.fd != -1) {
+        if (start_send(socket_client) != 0 ||
+            uring_submit(&socket_client->uring, 0) < 0) {
+            LWPB_ERR("Cannot send data to server (errno: %d)", errno);
+            lwpb_transport_socket_client_close(transport);
+            return LWPB_ERR_NET_INIT;
+        }
+        return LWPB_ERR_OK;
+    }
+    
+    ret = outq_flush(socket_client->socket, &socket_client->outq,
+                     socket_client->options);
+    if (ret < 0) {
+        LWPB_ERR("Cannot send data to server (errno: %d)", errno);
+        lwpb_transport_socket_client_close(transport);
+        return LWPB_ERR_NET_INIT;
+    }
+    
+    return ret ? LWPB_ERR_BUSY : LWPB_ERR_OK;
+}
+
+/**
+ * Returns the number of outstanding calls.
+ * @param transport Transport handle
+ * @return Returns the number of calls waiting for a response.
+ */
+int lwpb_transport_socket_client_pending(lwpb_transport_t transport)
+{
+    struct lwpb_transport_socket_client *socket_client =
+        (struct lwpb_transport_socket_client *) transport;
+    
+    return socket_client->num_calls;
 }
 
 /**
  * Updates the socket client. This method needs to be called periodically.
  * @param transport Transport handle
+ * @return Returns LWPB_ERR_OK if successful or LWPB_ERR_NET_INIT if the
+ * connection failed and the client was closed.
  */
 lwpb_err_t lwpb_transport_socket_client_update(lwpb_transport_t transport)
 {
     struct lwpb_transport_socket_client *socket_client =
         (struct lwpb_transport_socket_client *) transport;
     int i;
-    int socket;
     struct timeval timeout;
     fd_set read_fds;
+    fd_set write_fds;
     int high;
+    u64_t wait;
     
     if (socket_client->socket == -1)
-        return;
+        return LWPB_ERR_OK;
+    
+    // Complete calls which timed out and send a due batch, otherwise wake up
+    // in time for the next deadline or batch
+    handle_timers(socket_client);
+    wait = wait_time(socket_client, 1000000);
+    timeout.tv_sec = wait / 1000000;
+    timeout.tv_usec = wait % 1000000;
     
-    timeout.tv_sec = 1;
-    timeout.tv_usec = 0;
+    // Send queued requests and wait for responses with a single syscall
+    if (socket_client->uring.fd != -1) {
+        if (start_send(socket_client) != 0 ||
+            uring_submit(&socket_client->uring, timeout.tv_sec * 1000 +
+                         (timeout.tv_usec + 999) / 1000) < 0) {
+            LWPB_ERR("Cannot send data to server (errno: %d)", errno);
+            lwpb_transport_socket_client_close(transport);
+            return LWPB_ERR_NET_INIT;
+        }
+        handle_completions(socket_client);
+        return LWPB_ERR_OK;
+    }
     
-    // Create set of active sockets
+    // Write queued requests
+    if (lwpb_transport_socket_client_flush(transport) == LWPB_ERR_NET_INIT)
+        return LWPB_ERR_NET_INIT;
+    
+    // Create set of active sockets, waiting for writability while requests
+    // are queued
     high = socket_client->socket;
     FD_ZERO(&read_fds);
+    FD_ZERO(&write_fds);
     FD_SET(socket_client->socket, &read_fds);
+    if (socket_client->outq.len)
+        FD_SET(socket_client->socket, &write_fds);
     
     // Wait for socket to get active
-    i = select(high + 1, &read_fds, NULL, NULL, &timeout);
+    i = select(high + 1, &read_fds, &write_fds, NULL, &timeout);
     if (i < 0)
         LWPB_FAIL("select() failed");
     if (i == 0)
         return LWPB_ERR_OK;
     
+    if (FD_ISSET(socket_client->socket, &write_fds) &&
+        lwpb_transport_socket_client_flush(transport) == LWPB_ERR_NET_INIT)
+        return LWPB_ERR_NET_INIT;
+    
     // Handle data
-    handle_data(socket_client);
+    if (FD_ISSET(socket_client->socket, &read_fds))
+        handle_data(socket_client);
+    
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Returns the descriptor to watch when the client is driven by an external
+ * event loop instead of lwpb_transport_socket_client_update(). This is the
+ * socket, or the io_uring instance running it. The events to wait for
+ * change when requests are queued, so they need to be asked again after
+ * each call and each call of lwpb_transport_socket_client_process().
+ * @param transport Transport handle
+ * @param events Returns the events to wait for
+ * (LWPB_TRANSPORT_SOCKET_READABLE and LWPB_TRANSPORT_SOCKET_WRITABLE)
+ * @return Returns the descriptor or -1 if the client is not open.
+ */
+int lwpb_transport_socket_client_fd(lwpb_transport_t transport,
+                                    unsigned int *events)
+{
+    struct lwpb_transport_socket_client *socket_client =
+        (struct lwpb_transport_socket_client *) transport;
+    
+    *events = LWPB_TRANSPORT_SOCKET_READABLE;
+    if (socket_client->socket == -1)
+        return -1;
+    if (socket_client->uring.fd != -1)
+        return socket_client->uring.fd;
+    
+    if (socket_client->outq.len)
+        *events |= LWPB_TRANSPORT_SOCKET_WRITABLE;
+    
+    return socket_client->socket;
+}
+
+/**
+ * Returns when an external event loop has to call
+ * lwpb_transport_socket_client_process() even if the descriptor does not
+ * get ready, so calls time out and batches are sent in time.
+ * @param transport Transport handle
+ * @return Returns the time until the next deadline (ms), 0 if the client
+ * needs to be processed right away or -1 if there is no deadline.
+ */
+int lwpb_transport_socket_client_timeout(lwpb_transport_t transport)
+{
+    struct lwpb_transport_socket_client *socket_client =
+        (struct lwpb_transport_socket_client *) transport;
+    u64_t wait;
+    
+    if (socket_client->socket == -1)
+        return -1;
+    
+    // Requests queued for io_uring are only sent once processed
+    if (socket_client->uring.fd != -1 && socket_client->outq.len &&
+        !socket_client->sending.len)
+        return 0;
+    
+    wait = wait_time(socket_client, (u64_t) -1);
+    if (wait == (u64_t) -1)
+        return -1;
+    wait = (wait + 999) / 1000;
+    
+    return wait < 0x7fffffff ? (int) wait : 0x7fffffff;
+}
+
+/**
+ * Handles the events of the descriptor returned by
+ * lwpb_transport_socket_client_fd() without blocking. This is called by an
+ * external event loop when the descriptor is ready or the timeout returned
+ * by lwpb_transport_socket_client_timeout() has passed.
+ * @param transport Transport handle
+ * @param events Events the descriptor is ready for
+ * (LWPB_TRANSPORT_SOCKET_READABLE and LWPB_TRANSPORT_SOCKET_WRITABLE)
+ * @return Returns LWPB_ERR_OK if successful or LWPB_ERR_NET_INIT if the
+ * connection failed and the client was closed.
+ */
+lwpb_err_t lwpb_transport_socket_client_process(lwpb_transport_t transport,
+                                                unsigned int events)
+{
+    struct lwpb_transport_socket_client *socket_client =
+        (struct lwpb_transport_socket_client *) transport;
+    
+    if (socket_client->socket == -1)
+        return LWPB_ERR_OK;
+    
+    handle_timers(socket_client);
+    
+    // Completions are reaped before the requests queued by their handlers
+    // are submitted
+    if (socket_client->uring.fd != -1) {
+        handle_completions(socket_client);
+        return lwpb_transport_socket_client_flush(transport);
+    }
+    
+    if ((events & LWPB_TRANSPORT_SOCKET_WRITABLE) &&
+        lwpb_transport_socket_client_flush(transport) == LWPB_ERR_NET_INIT)
+        return LWPB_ERR_NET_INIT;
+    if (events & LWPB_TRANSPORT_SOCKET_READABLE)
+        handle_data(socket_client);
     
     return LWPB_ERR_OK;
 }
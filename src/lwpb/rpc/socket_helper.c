@@ -18,6 +18,14 @@
  */
 
 #include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 
 #include <lwpb/lwpb.h>
 
@@ -26,122 +34,850 @@
 
 
 #define PROTOCOL_MAGIC 0xdeadbeaf
+#define PROTOCOL_MAGIC_V2 0xdeadbe02
+
+/** Maximum size of pre-header and header */
+#define FRAME_HEADER_SIZE 140
 
+/** Pre-header of v1 frames, followed by a protobuf encoded header */
 struct pre_header {
     u32_t magic;
     u32_t header_len;
     u32_t msg_len;
 };
 
+/** Fixed size binary header of v2 frames (network byte order) */
+struct frame_header_v2 {
+    u32_t magic;
+    u8_t type;
+    u8_t status;                /**< Result of the call in responses */
+    u16_t service;              /**< Index in the server's service list */
+    u16_t method;               /**< Index in the service's method list */
+    u16_t timeout;              /**< Timeout of requests (ms), 0 for none */
+    u32_t id;
+    u32_t msg_len;
+};
+
+/** Largest timeout a v2 header can carry (ms) */
+#define MAX_TIMEOUT_V2 0xffff
+
+/** FNV-1a hash parameters */
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+
+/**
+ * Appends data to an output queue.
+ * @param outq Output queue
+ * @param data Data
+ * @param len Length of data
+ * @return Returns 0 if successful or -1 if memory could not be allocated.
+ */
+static int outq_append(struct lwpb_socket_outq *outq, const void *data, size_t len)
+{
+    u8_t *tmp;
+    size_t size;
+    
+    if (outq->len + len > outq->size) {
+        size = outq->size ? outq->size : 1024;
+        while (size < outq->len + len)
+            size *= 2;
+        tmp = LWPB_REALLOC(outq->data, size);
+        if (!tmp)
+            return -1;
+        outq->data = tmp;
+        outq->size = size;
+    }
+    
+    LWPB_MEMCPY(outq->data + outq->len, data, len);
+    outq->len += len;
+    
+    return 0;
+}
+
+/**
+ * Frees the memory of an output queue and discards queued data.
+ * @param outq Output queue
+ */
+void outq_free(struct lwpb_socket_outq *outq)
+{
+    LWPB_FREE(outq->data);
+    outq->data = NULL;
+    outq->len = 0;
+    outq->size = 0;
+}
+
+/**
+ * Writes as much of an output queue to a socket as possible.
+ * @param socket Socket
+ * @param outq Output queue
+ * @param options Socket transport options (LWPB_TRANSPORT_SOCKET_CORK)
+ * @return Returns 0 if the queue is empty, 1 if data remains queued (socket
+ * would block) or -1 if the socket failed.
+ */
+int outq_flush(int socket, struct lwpb_socket_outq *outq, unsigned int options)
+{
+    ssize_t n;
+    size_t pos = 0;
+    int ret = 0;
+    int cork;
+    
+    if (outq->len == 0)
+        return 0;
+    
+    cork = (options & LWPB_TRANSPORT_SOCKET_CORK) != 0;
+    if (cork)
+        setsockopt(socket, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    
+    while (pos < outq->len) {
+        n = send(socket, outq->data + pos, outq->len - pos, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            ret = (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+            break;
+        }
+        pos += n;
+    }
+    
+    // Uncorking pushes out any partial segment
+    if (cork) {
+        cork = 0;
+        setsockopt(socket, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    }
+    
+    if (ret < 0)
+        return ret;
+    
+    LWPB_MEMMOVE(outq->data, outq->data + pos, outq->len - pos);
+    outq->len -= pos;
+    
+    return outq->len ? 1 : 0;
+}
+
+/**
+ * Makes room in an input queue before receiving more data.
+ * @param inq Input queue
+ * @param need Size of the incomplete frame at the start of the queue, if
+ * known from its header, or 0
+ * @return Returns 0 if successful or -1 if memory could not be allocated.
+ */
+int inq_reserve(struct lwpb_socket_inq *inq, size_t need)
+{
+    u8_t *tmp;
+    size_t size;
+    
+    if (need <= inq->len)
+        need = inq->len + 1;
+    if (need <= inq->size)
+        return 0;
+    
+    size = inq->size ? inq->size : LWPB_TRANSPORT_SOCKET_BUF_SIZE;
+    while (size < need)
+        size *= 2;
+    tmp = LWPB_REALLOC(inq->data, size);
+    if (!tmp)
+        return -1;
+    inq->data = tmp;
+    inq->size = size;
+    
+    return 0;
+}
 
-int send_request(int socket, const struct lwpb_method_desc *method_desc,
-                 void *req_buf, size_t req_len)
+/**
+ * Removes handled frames from the start of an input queue. Large buffers are
+ * released once they are empty.
+ * @param inq Input queue
+ * @param len Number of bytes to remove
+ */
+void inq_consume(struct lwpb_socket_inq *inq, size_t len)
 {
+    if (len == 0)
+        return;
+    
+    inq->len -= len;
+    if (inq->len)
+        LWPB_MEMMOVE(inq->data, inq->data + len, inq->len);
+    else if (inq->size > LWPB_TRANSPORT_SOCKET_BUF_KEEP)
+        inq_free(inq);
+}
+
+/**
+ * Frees the memory of an input queue and discards received data.
+ * @param inq Input queue
+ */
+void inq_free(struct lwpb_socket_inq *inq)
+{
+    LWPB_FREE(inq->data);
+    inq->data = NULL;
+    inq->len = 0;
+    inq->size = 0;
+}
+
+/**
+ * Applies socket transport options to a connected socket.
+ * @param socket Socket
+ * @param options Socket transport options
+ */
+void set_socket_options(int socket, unsigned int options)
+{
+    int yes = 1;
+    
+    if (options & LWPB_TRANSPORT_SOCKET_NODELAY)
+        if (setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) == -1)
+            LWPB_ERR("Cannot set TCP_NODELAY (errno: %d)", errno);
+}
+
+/**
+ * Sends a frame with a single syscall. If the frame cannot be written
+ * completely, or if data is already queued or batching is enabled, the
+ * unsent part is appended to the output queue to keep frames in order.
+ * @param socket Socket
+ * @param outq Output queue
+ * @param options Socket transport options (LWPB_TRANSPORT_SOCKET_BATCH)
+ * @param header Pre-header and header
+ * @param header_len Length of pre-header and header
+ * @param msg Message
+ * @param msg_len Length of message
+ * @return Returns 0 if successful or -1 if the socket failed.
+ */
+static int send_frame(int socket, struct lwpb_socket_outq *outq,
+                      unsigned int options, u8_t *header, size_t header_len,
+                      void *msg, size_t msg_len)
+{
+    struct iovec iov[2];
+    struct msghdr msghdr;
+    ssize_t n = 0;
+    
+    if (!(options & LWPB_TRANSPORT_SOCKET_BATCH) && outq->len == 0) {
+        iov[0].iov_base = header;
+        iov[0].iov_len = header_len;
+        iov[1].iov_base = msg;
+        iov[1].iov_len = msg_len;
+        LWPB_MEMSET(&msghdr, 0, sizeof(msghdr));
+        msghdr.msg_iov = iov;
+        msghdr.msg_iovlen = 2;
+        
+        do {
+            n = sendmsg(socket, &msghdr, MSG_NOSIGNAL);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+            n = 0;
+        }
+        if (n == header_len + msg_len)
+            return 0;
+    }
+    
+    // Queue the unsent part of the frame
+    if (n < header_len) {
+        if (outq_append(outq, header + n, header_len - n) != 0)
+            return -1;
+        n = header_len;
+    }
+    if (outq_append(outq, msg + (n - header_len), msg_len - (n - header_len)) != 0)
+        return -1;
+    
+    return 0;
+}
+
+/**
+ * Computes the FNV-1a hash of a string.
+ * @param str String (not necessarily null-terminated)
+ * @param len Length of string
+ * @param seed Initial hash value
+ * @return Returns the hash value.
+ */
+static u32_t hash_name(const char *str, size_t len, u32_t seed)
+{
+    u32_t hash = seed;
+    
+    while (len--) {
+        hash ^= (u8_t) *str++;
+        hash *= FNV_PRIME;
+    }
+    
+    return hash;
+}
+
+/**
+ * Checks if a null-terminated name equals a string of the given length.
+ */
+static int name_equals(const char *name, const char *str, size_t len)
+{
+    return strncmp(name, str, len) == 0 && name[len] == '\0';
+}
+
+/**
+ * Inserts an entry into the method lookup table.
+ */
+static void method_table_insert(struct lwpb_socket_method_table *table, u32_t hash,
+                                const struct lwpb_service_desc *service_desc,
+                                const struct lwpb_method_desc *method_desc)
+{
+    struct lwpb_socket_method_entry *entry;
+    u32_t i;
+    
+    for (i = hash & table->mask; table->entries[i].service_desc; i = (i + 1) & table->mask)
+        ;
+    entry = &table->entries[i];
+    entry->hash = hash;
+    entry->service_desc = service_desc;
+    entry->method_desc = method_desc;
+}
+
+/**
+ * Creates the method lookup table for a list of services. Method names are
+ * hashed with the hash of their service name as seed, so a method is found
+ * with one probe sequence.
+ * @param service_list Null-terminated list of services
+ * @return Returns the method lookup table or NULL if memory could not be
+ * allocated.
+ */
+struct lwpb_socket_method_table *method_table_create(
+        const struct lwpb_service_desc **service_list)
+{
+    struct lwpb_socket_method_table *table;
     struct lwpb_encoder encoder;
-    struct pre_header pre_header;
-    u8_t header[128];
-    size_t len;
+    const struct lwpb_service_desc **service;
+    u32_t count = 0;
+    u32_t size = 8;
+    u32_t hash;
+    int i;
+    
+    table = LWPB_MALLOC(sizeof(*table));
+    if (!table)
+        return NULL;
+    LWPB_MEMSET(table, 0, sizeof(*table));
+    table->service_list = service_list;
+    
+    // Size the table for a load factor of at most 50%
+    table->hello_len = 16;
+    for (service = service_list; *service != NULL; service++) {
+        table->num_services++;
+        count += 1 + (*service)->num_methods;
+        table->hello_len += strlen((*service)->name) + 8;
+    }
+    while (size < count * 2)
+        size *= 2;
+    table->mask = size - 1;
+    
+    table->entries = LWPB_MALLOC(size * sizeof(struct lwpb_socket_method_entry));
+    table->hello = LWPB_MALLOC(table->hello_len);
+    if (!table->entries || !table->hello) {
+        method_table_free(table);
+        return NULL;
+    }
+    LWPB_MEMSET(table->entries, 0, size * sizeof(struct lwpb_socket_method_entry));
+    
+    for (service = service_list; *service != NULL; service++) {
+        hash = hash_name((*service)->name, strlen((*service)->name), FNV_OFFSET);
+        method_table_insert(table, hash, *service, NULL);
+        for (i = 0; i < (*service)->num_methods; i++)
+            method_table_insert(table,
+                                hash_name((*service)->methods[i].name,
+                                          strlen((*service)->methods[i].name), hash),
+                                *service, &(*service)->methods[i]);
+    }
     
+    // Encode the HELLO message sent to clients
     lwpb_encoder_init(&encoder);
-    lwpb_encoder_start(&encoder, socket_protocol_Header, header, sizeof(header));
-    lwpb_encoder_add_enum(&encoder, socket_protocol_Header_type, SOCKET_PROTOCOL_REQUEST);
-    lwpb_encoder_add_string(&encoder, socket_protocol_Header_service, (char *) method_desc->service->name);
-    lwpb_encoder_add_string(&encoder, socket_protocol_Header_method, (char *) method_desc->name);
-    len = lwpb_encoder_finish(&encoder);
+    lwpb_encoder_start(&encoder, socket_protocol_Hello, table->hello, table->hello_len);
+    lwpb_encoder_add_uint32(&encoder, socket_protocol_Hello_version, PROTOCOL_VERSION);
+    for (service = service_list; *service != NULL; service++)
+        lwpb_encoder_add_string(&encoder, socket_protocol_Hello_service, (char *) (*service)->name);
+    table->hello_len = lwpb_encoder_finish(&encoder);
     
-    pre_header.magic = htonl(PROTOCOL_MAGIC);
-    pre_header.header_len = htonl(len);
-    pre_header.msg_len = htonl(req_len);
+    return table;
+}
 
-    send(socket, &pre_header, sizeof(pre_header), 0);
-    send(socket, header, len, 0);
-    send(socket, req_buf, req_len, 0);
+/**
+ * Frees a method lookup table.
+ * @param table Method lookup table
+ */
+void method_table_free(struct lwpb_socket_method_table *table)
+{
+    if (!table)
+        return;
+    LWPB_FREE(table->entries);
+    LWPB_FREE(table->hello);
+    LWPB_FREE(table);
 }
 
-int send_response(int socket, const struct lwpb_method_desc *method_desc,
-                  void *res_buf, size_t res_len)
+/**
+ * Looks up a service by name.
+ * @param table Method lookup table
+ * @param value Service name
+ * @param hash Returns the hash of the service name
+ * @return Returns the service descriptor or NULL if not found.
+ */
+static const struct lwpb_service_desc *find_service(const struct lwpb_socket_method_table *table,
+                                                    union lwpb_value *value, u32_t *hash)
+{
+    struct lwpb_socket_method_entry *entry;
+    u32_t i;
+    
+    *hash = hash_name(value->string.str, value->string.len, FNV_OFFSET);
+    for (i = *hash & table->mask; table->entries[i].service_desc; i = (i + 1) & table->mask) {
+        entry = &table->entries[i];
+        if (entry->hash == *hash && !entry->method_desc &&
+            name_equals(entry->service_desc->name, value->string.str, value->string.len))
+            return entry->service_desc;
+    }
+    
+    return NULL;
+}
+
+/**
+ * Looks up a method of a service by name.
+ * @param table Method lookup table
+ * @param service_desc Service descriptor
+ * @param service_hash Hash of the service name
+ * @param value Method name
+ * @return Returns the method descriptor or NULL if not found.
+ */
+static const struct lwpb_method_desc *find_method(const struct lwpb_socket_method_table *table,
+                                                  const struct lwpb_service_desc *service_desc,
+                                                  u32_t service_hash, union lwpb_value *value)
+{
+    struct lwpb_socket_method_entry *entry;
+    u32_t hash;
+    u32_t i;
+    
+    hash = hash_name(value->string.str, value->string.len, service_hash);
+    for (i = hash & table->mask; table->entries[i].service_desc; i = (i + 1) & table->mask) {
+        entry = &table->entries[i];
+        if (entry->hash == hash && entry->method_desc &&
+            entry->service_desc == service_desc &&
+            name_equals(entry->method_desc->name, value->string.str, value->string.len))
+            return entry->method_desc;
+    }
+    
+    return NULL;
+}
+
+/**
+ * Encodes the pre-header and header of a v1 frame.
+ * @param buf Buffer of FRAME_HEADER_SIZE bytes
+ * @param type Message type
+ * @param method_desc Method descriptor (only encoded for requests)
+ * @param id Call ID
+ * @param status Result of the call (only encoded if not LWPB_RPC_OK)
+ * @param timeout Timeout of the call (ms, only encoded if not 0)
+ * @param msg_len Length of message
+ * @return Returns the length of pre-header and header.
+ */
+static size_t encode_frame_header(u8_t *buf, protocol_msg_type_t type,
+                                  const struct lwpb_method_desc *method_desc,
+                                  u32_t id, lwpb_rpc_result_t status,
+                                  u32_t timeout, size_t msg_len)
 {
     struct lwpb_encoder encoder;
     struct pre_header pre_header;
-    u8_t header[128];
     size_t len;
     
     lwpb_encoder_init(&encoder);
-    lwpb_encoder_start(&encoder, socket_protocol_Header, header, sizeof(header));
-    lwpb_encoder_add_enum(&encoder, socket_protocol_Header_type, SOCKET_PROTOCOL_RESPONSE);
+    lwpb_encoder_start(&encoder, socket_protocol_Header,
+                       buf + sizeof(pre_header), FRAME_HEADER_SIZE - sizeof(pre_header));
+    lwpb_encoder_add_enum(&encoder, socket_protocol_Header_type, type);
+    if (type == MSG_TYPE_REQUEST) {
+        lwpb_encoder_add_string(&encoder, socket_protocol_Header_service, (char *) method_desc->service->name);
+        lwpb_encoder_add_string(&encoder, socket_protocol_Header_method, (char *) method_desc->name);
+    }
+    lwpb_encoder_add_uint32(&encoder, socket_protocol_Header_id, id);
+    if (status != LWPB_RPC_OK)
+        lwpb_encoder_add_uint32(&encoder, socket_protocol_Header_status, status);
+    if (timeout)
+        lwpb_encoder_add_uint32(&encoder, socket_protocol_Header_timeout, timeout);
     len = lwpb_encoder_finish(&encoder);
     
     pre_header.magic = htonl(PROTOCOL_MAGIC);
     pre_header.header_len = htonl(len);
-    pre_header.msg_len = htonl(res_len);
+    pre_header.msg_len = htonl(msg_len);
+    LWPB_MEMCPY(buf, &pre_header, sizeof(pre_header));
+    
+    return sizeof(pre_header) + len;
+}
 
-    send(socket, &pre_header, sizeof(pre_header), 0);
-    send(socket, header, len, 0);
-    send(socket, res_buf, res_len, 0);
+/**
+ * Encodes the binary header of a v2 frame.
+ * @param buf Buffer of FRAME_HEADER_SIZE bytes
+ * @param type Message type
+ * @param service Service index
+ * @param method Method index
+ * @param id Call ID
+ * @param status Result of the call
+ * @param timeout Timeout of the call (ms), sent as 0 (no timeout) if it does
+ * not fit the header
+ * @param msg_len Length of message
+ * @return Returns the length of the header.
+ */
+static size_t encode_frame_header_v2(u8_t *buf, protocol_msg_type_t type,
+                                     int service, int method, u32_t id,
+                                     lwpb_rpc_result_t status, u32_t timeout,
+                                     size_t msg_len)
+{
+    struct frame_header_v2 header;
+    
+    header.magic = htonl(PROTOCOL_MAGIC_V2);
+    header.type = type;
+    header.status = status;
+    header.service = htons(service);
+    header.method = htons(method);
+    header.timeout = htons(timeout <= MAX_TIMEOUT_V2 ? timeout : 0);
+    header.id = htonl(id);
+    header.msg_len = htonl(msg_len);
+    LWPB_MEMCPY(buf, &header, sizeof(header));
+    
+    return sizeof(header);
 }
 
-static void parse_request_field_handler(struct lwpb_decoder *decoder,
-                                        const struct lwpb_msg_desc *msg_desc,
-                                        const struct lwpb_field_desc *field_desc,
-                                        union lwpb_value *value, void *arg)
+/**
+ * Sends a request frame.
+ * @param socket Socket
+ * @param outq Output queue
+ * @param options Socket transport options
+ * @param method_desc Method descriptor
+ * @param service_index Index of the service on the server, negative to send
+ * a v1 frame with service and method names
+ * @param id Call ID
+ * @param timeout Time the server has to handle the call (ms), 0 for no timeout
+ * @param req_buf Request message
+ * @param req_len Length of request message
+ * @return Returns 0 if successful or -1 if the socket failed.
+ */
+int send_request(int socket, struct lwpb_socket_outq *outq, unsigned int options,
+                 const struct lwpb_method_desc *method_desc, int service_index,
+                 u32_t id, u32_t timeout, void *req_buf, size_t req_len)
 {
-    struct protocol_header_info *header_info = arg;
-    int i;
+    u8_t header[FRAME_HEADER_SIZE];
+    size_t len;
     
-    if (msg_desc != socket_protocol_Header)
-        return;
+    if (service_index >= 0)
+        len = encode_frame_header_v2(header, MSG_TYPE_REQUEST, service_index,
+                                     method_desc - method_desc->service->methods,
+                                     id, LWPB_RPC_OK, timeout, req_len);
+    else
+        len = encode_frame_header(header, MSG_TYPE_REQUEST, method_desc, id,
+                                  LWPB_RPC_OK, timeout, req_len);
+    
+    return send_frame(socket, outq, options, header, len, req_buf, req_len);
+}
 
-    if (field_desc == socket_protocol_Header_type)
-        header_info->msg_type = value->enum_;
+/**
+ * Sends a response frame, using the protocol version of the request.
+ * @param socket Socket
+ * @param outq Output queue
+ * @param options Socket transport options
+ * @param version Protocol version of the request
+ * @param id Call ID
+ * @param status Result of the call, the message is empty if not LWPB_RPC_OK
+ * @param res_buf Response message
+ * @param res_len Length of response message
+ * @return Returns 0 if successful or -1 if the socket failed.
+ */
+int send_response(int socket, struct lwpb_socket_outq *outq, unsigned int options,
+                  int version, u32_t id, lwpb_rpc_result_t status,
+                  void *res_buf, size_t res_len)
+{
+    u8_t header[FRAME_HEADER_SIZE];
+    size_t len;
     
-    if (field_desc == socket_protocol_Header_service && header_info->_service_list) {
-        // Try to identify the service from the services list
-        const struct lwpb_service_desc **service;
-        for (service = header_info->_service_list; *service != NULL; *service++) {
-            if (value->string.len != strlen((*service)->name))
-                continue;
-            if (strncmp(value->string.str, (*service)->name, value->string.len) == 0) {
-                header_info->service_desc = *service;
-                break;
-            }
-        }
+    if (version >= 2)
+        len = encode_frame_header_v2(header, MSG_TYPE_RESPONSE, 0, 0, id,
+                                     status, 0, res_len);
+    else
+        len = encode_frame_header(header, MSG_TYPE_RESPONSE, NULL, id,
+                                  status, 0, res_len);
+    
+    return send_frame(socket, outq, options, header, len, res_buf, res_len);
+}
+
+/**
+ * Appends a frame of a streaming call to a buffer of frames. The frames are
+ * sent together with send_frames().
+ * @param frames Frame buffer
+ * @param version Protocol version of the request
+ * @param msg_type MSG_TYPE_STREAM for a response message or MSG_TYPE_STREAM_END
+ * to end the stream
+ * @param id Call ID
+ * @param status Result of the call (MSG_TYPE_STREAM_END only)
+ * @param res_buf Response message
+ * @param res_len Length of response message
+ * @return Returns 0 if successful or -1 if memory could not be allocated.
+ */
+int append_response(struct lwpb_socket_outq *frames, int version,
+                    protocol_msg_type_t msg_type, u32_t id,
+                    lwpb_rpc_result_t status, void *res_buf, size_t res_len)
+{
+    u8_t header[FRAME_HEADER_SIZE];
+    size_t len;
+    
+    if (version >= 2)
+        len = encode_frame_header_v2(header, msg_type, 0, 0, id, status, 0,
+                                     res_len);
+    else
+        len = encode_frame_header(header, msg_type, NULL, id, status, 0,
+                                  res_len);
+    
+    if (outq_append(frames, header, len) != 0 ||
+        outq_append(frames, res_buf, res_len) != 0)
+        return -1;
+    
+    return 0;
+}
+
+/**
+ * Sends the frames of a frame buffer and empties it.
+ * @param socket Socket
+ * @param outq Output queue
+ * @param options Socket transport options
+ * @param frames Frame buffer
+ * @return Returns 0 if successful or -1 if the socket failed.
+ */
+int send_frames(int socket, struct lwpb_socket_outq *outq, unsigned int options,
+                struct lwpb_socket_outq *frames)
+{
+    int ret;
+    
+    ret = send_frame(socket, outq, options, frames->data, frames->len, NULL, 0);
+    frames->len = 0;
+    
+    return ret;
+}
+
+/**
+ * Appends a request frame to a batch. The batch is sent as the message of a
+ * single BATCH frame with send_batch().
+ * @param batch Batch buffer
+ * @param method_desc Method descriptor
+ * @param service_index Index of the service on the server, negative for a v1
+ * frame
+ * @param id Call ID
+ * @param timeout Time the server has to handle the call (ms), 0 for no timeout
+ * @param req_buf Request message
+ * @param req_len Length of request message
+ * @return Returns 0 if successful or -1 if memory could not be allocated.
+ */
+int append_request(struct lwpb_socket_outq *batch,
+                   const struct lwpb_method_desc *method_desc, int service_index,
+                   u32_t id, u32_t timeout, void *req_buf, size_t req_len)
+{
+    u8_t header[FRAME_HEADER_SIZE];
+    size_t len;
+    
+    if (service_index >= 0)
+        len = encode_frame_header_v2(header, MSG_TYPE_REQUEST, service_index,
+                                     method_desc - method_desc->service->methods,
+                                     id, LWPB_RPC_OK, timeout, req_len);
+    else
+        len = encode_frame_header(header, MSG_TYPE_REQUEST, method_desc, id,
+                                  LWPB_RPC_OK, timeout, req_len);
+    
+    if (outq_append(batch, header, len) != 0 ||
+        outq_append(batch, req_buf, req_len) != 0)
+        return -1;
+    
+    return 0;
+}
+
+/**
+ * Sends a BATCH frame holding the request frames of a batch and empties the
+ * batch. BATCH frames always use a v2 header, as only servers which
+ * negotiated v2 know about them.
+ * @param socket Socket
+ * @param outq Output queue
+ * @param options Socket transport options
+ * @param batch Batch buffer
+ * @return Returns 0 if successful or -1 if the socket failed.
+ */
+int send_batch(int socket, struct lwpb_socket_outq *outq, unsigned int options,
+               struct lwpb_socket_outq *batch)
+{
+    u8_t header[FRAME_HEADER_SIZE];
+    size_t len;
+    int ret;
+    
+    len = encode_frame_header_v2(header, MSG_TYPE_BATCH, 0, 0, 0,
+                                 LWPB_RPC_OK, 0, batch->len);
+    ret = send_frame(socket, outq, options, header, len, batch->data, batch->len);
+    batch->len = 0;
+    
+    return ret;
+}
+
+/**
+ * Sends a CANCEL frame, telling the server that the client no longer waits
+ * for the response of a call. CANCEL frames always use a v2 header, as only
+ * servers which negotiated v2 know about them.
+ * @param socket Socket
+ * @param outq Output queue
+ * @param options Socket transport options
+ * @param id Call ID
+ * @return Returns 0 if successful or -1 if the socket failed.
+ */
+int send_cancel(int socket, struct lwpb_socket_outq *outq, unsigned int options,
+                u32_t id)
+{
+    u8_t header[FRAME_HEADER_SIZE];
+    size_t len;
+    
+    len = encode_frame_header_v2(header, MSG_TYPE_CANCEL, 0, 0, id,
+                                 LWPB_RPC_OK, 0, 0);
+    
+    return send_frame(socket, outq, options, header, len, NULL, 0);
+}
+
+/**
+ * Sends a HELLO frame. HELLO frames always use v1 framing, so servers which
+ * don't know the message type skip them like a call to an unknown method.
+ * @param socket Socket
+ * @param outq Output queue
+ * @param options Socket transport options
+ * @param table Method lookup table of the server or NULL to send the HELLO
+ * of a client, which only carries the protocol version
+ * @return Returns 0 if successful or -1 if the socket failed.
+ */
+int send_hello(int socket, struct lwpb_socket_outq *outq, unsigned int options,
+               const struct lwpb_socket_method_table *table)
+{
+    struct lwpb_encoder encoder;
+    u8_t header[FRAME_HEADER_SIZE];
+    u8_t msg[16];
+    size_t msg_len;
+    size_t len;
+    
+    if (table)
+        return send_frame(socket, outq, options, header,
+                          encode_frame_header(header, MSG_TYPE_HELLO, NULL, 0,
+                                              LWPB_RPC_OK, 0, table->hello_len),
+                          table->hello, table->hello_len);
+    
+    lwpb_encoder_init(&encoder);
+    lwpb_encoder_start(&encoder, socket_protocol_Hello, msg, sizeof(msg));
+    lwpb_encoder_add_uint32(&encoder, socket_protocol_Hello_version, PROTOCOL_VERSION);
+    msg_len = lwpb_encoder_finish(&encoder);
+    
+    len = encode_frame_header(header, MSG_TYPE_HELLO, NULL, 0, LWPB_RPC_OK, 0, msg_len);
+    
+    return send_frame(socket, outq, options, header, len, msg, msg_len);
+}
+
+/**
+ * Looks up the index of a service in the HELLO message of a server.
+ * @param hello HELLO message
+ * @param len Length of HELLO message
+ * @param service_desc Service descriptor
+ * @return Returns the index of the service or -1 if the server does not
+ * provide the service.
+ */
+int hello_service_index(const void *hello, size_t len,
+                        const struct lwpb_service_desc *service_desc)
+{
+    struct lwpb_reader reader;
+    const struct lwpb_field_desc *field_desc;
+    union lwpb_value value;
+    int index = 0;
+    
+    lwpb_reader_init(&reader, socket_protocol_Hello, (void *) hello, len);
+    while (lwpb_reader_next(&reader, &field_desc, &value) == LWPB_ERR_OK && field_desc) {
+        if (field_desc != socket_protocol_Hello_service)
+            continue;
+        if (value.string.len == strlen(service_desc->name) &&
+            strncmp(value.string.str, service_desc->name, value.string.len) == 0)
+            return index;
+        index++;
     }
     
-    if (field_desc == socket_protocol_Header_method && header_info->_service_list) {
-        if (header_info->service_desc) {
-            // Try to identify the method
-            for (i = 0; i < header_info->service_desc->num_methods; i++) {
-                const struct lwpb_method_desc *method = &header_info->service_desc->methods[i];
-                if (value->string.len != strlen(method->name))
-                    continue;
-                if (strncmp(value->string.str, method->name, value->string.len) == 0) {
-                    header_info->method_desc = method;
-                    break;
-                }
-            }
+    return -1;
+}
+
+/**
+ * Parses a v2 frame header. Service and method are resolved by index.
+ */
+static protocol_parse_err_t parse_header_v2(void *buf, size_t len,
+                                            struct protocol_header_info *info,
+                                            const struct lwpb_socket_method_table *table)
+{
+    struct frame_header_v2 header;
+    u16_t service;
+    u16_t method;
+    
+    if (len < sizeof(header))
+        return PARSE_ERR_END_OF_BUF;
+    LWPB_MEMCPY(&header, buf, sizeof(header));
+    
+    info->version = 2;
+    info->msg_type = header.type;
+    info->status = header.status;
+    info->timeout = ntohs(header.timeout);
+    info->id = ntohl(header.id);
+    info->header_len = sizeof(header);
+    info->msg_len = ntohl(header.msg_len);
+    if (len < info->header_len + info->msg_len)
+        return PARSE_ERR_END_OF_BUF;
+    
+    if (table && info->msg_type == MSG_TYPE_REQUEST) {
+        service = ntohs(header.service);
+        method = ntohs(header.method);
+        if (service < table->num_services) {
+            info->service_desc = table->service_list[service];
+            if (method < info->service_desc->num_methods)
+                info->method_desc = &info->service_desc->methods[method];
         }
     }
+    
+    return PARSE_ERR_OK;
 }
 
+/**
+ * Parses the header of a frame (v1 or v2).
+ * @param buf Buffer
+ * @param len Length of data in buffer
+ * @param info Returns the parsed header
+ * @param table Method lookup table used to resolve the called method or NULL
+ * @return Returns PARSE_ERR_OK if a complete frame was parsed,
+ * PARSE_ERR_END_OF_BUF if the frame is incomplete or an error code if the
+ * frame is invalid. If the frame is incomplete but its header lengths are
+ * known, info->header_len and info->msg_len are set, otherwise they are 0.
+ */
 protocol_parse_err_t parse_request(void *buf, size_t len,
                                    struct protocol_header_info *info,
-                                   const struct lwpb_service_desc **service_list)
+                                   const struct lwpb_socket_method_table *table)
 {
-    struct lwpb_decoder decoder;
+    struct lwpb_reader reader;
+    const struct lwpb_field_desc *field_desc;
+    union lwpb_value value;
     struct pre_header *pre_header;
     u32_t header_len;
+    u32_t service_hash = 0;
+    lwpb_err_t ret;
+    
+    info->header_len = 0;
+    info->msg_len = 0;
     
     if (len < sizeof(struct pre_header))
         return PARSE_ERR_END_OF_BUF;
     
     pre_header = buf;
-
+    
+    info->msg_type = 0;
+    info->service_desc = NULL;
+    info->method_desc = NULL;
+    info->id = 0;
+    info->status = LWPB_RPC_OK;
+    info->timeout = 0;
+    
     // Check magic
+    if (ntohl(pre_header->magic) == PROTOCOL_MAGIC_V2)
+        return parse_header_v2(buf, len, info, table);
     if (ntohl(pre_header->magic) != PROTOCOL_MAGIC)
         return PARSE_ERR_INVALID_MAGIC;
 
     // Check header and message length
     header_len = ntohl(pre_header->header_len);
+    info->version = 1;
     info->header_len = header_len + sizeof(struct pre_header);
     info->msg_len = ntohl(pre_header->msg_len);
     if (len < info->header_len + info->msg_len)
@@ -150,13 +886,29 @@ protocol_parse_err_t parse_request(void *buf, size_t len,
     // Decode header
     buf += sizeof(struct pre_header);
     
-    info->_service_list = service_list;
-    info->msg_type = 0;
-    info->service_desc = NULL;
-    info->method_desc = NULL;
+    lwpb_reader_init(&reader, socket_protocol_Header, buf, header_len);
+    for (;;) {
+        ret = lwpb_reader_next(&reader, &field_desc, &value);
+        if (ret != LWPB_ERR_OK)
+            return PARSE_ERR_INVALID_HEADER;
+        if (!field_desc)
+            break;
+        
+        if (field_desc == socket_protocol_Header_type) {
+            info->msg_type = value.enum_;
+        } else if (field_desc == socket_protocol_Header_service && table) {
+            info->service_desc = find_service(table, &value, &service_hash);
+        } else if (field_desc == socket_protocol_Header_method && info->service_desc) {
+            info->method_desc = find_method(table, info->service_desc,
+                                            service_hash, &value);
+        } else if (field_desc == socket_protocol_Header_id) {
+            info->id = value.uint32;
+        } else if (field_desc == socket_protocol_Header_status) {
+            info->status = value.uint32;
+        } else if (field_desc == socket_protocol_Header_timeout) {
+            info->timeout = value.uint32;
+        }
+    }
     
-    lwpb_decoder_init(&decoder);
-    lwpb_decoder_arg(&decoder, info);
-    lwpb_decoder_field_handler(&decoder, parse_request_field_handler);
-    return lwpb_decoder_decode(&decoder, socket_protocol_Header, buf, header_len, NULL);
+    return PARSE_ERR_OK;
 }
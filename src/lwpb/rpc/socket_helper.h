@@ -21,36 +21,113 @@
 #define __LWPB_RPC_SOCKET_HELPER_H__
 
 #include <lwpb/lwpb.h>
+#include <lwpb/rpc/socket.h>
 
 
+/** Protocol version using binary frame headers */
+#define PROTOCOL_VERSION 2
+
 typedef enum {
     MSG_TYPE_REQUEST = 0,
     MSG_TYPE_RESPONSE = 1,
+    MSG_TYPE_HELLO = 2,
+    MSG_TYPE_BATCH = 3,
+    MSG_TYPE_CANCEL = 4,
+    MSG_TYPE_STREAM = 5,
+    MSG_TYPE_STREAM_END = 6,
 } protocol_msg_type_t;
 
 struct protocol_header_info {
+    int version;
     protocol_msg_type_t msg_type;
     const struct lwpb_service_desc *service_desc;
     const struct lwpb_method_desc *method_desc;
+    u32_t id;
+    lwpb_rpc_result_t status;   /**< Result of the call (responses only) */
+    u32_t timeout;              /**< Timeout of the call (ms, requests only) */
     size_t header_len;
     size_t msg_len;
-    const struct lwpb_service_desc **_service_list;
 };
 
-int send_request(int socket, const struct lwpb_method_desc *method_desc,
-                 void *req_buf, size_t req_len);
+/** Entry of the method lookup table */
+struct lwpb_socket_method_entry {
+    u32_t hash;
+    const struct lwpb_service_desc *service_desc;
+    const struct lwpb_method_desc *method_desc; /**< NULL for service entries */
+};
+
+/**
+ * Method lookup table of a server. Resolves service and method names of v1
+ * headers through an open addressing hash table and service and method
+ * indices of v2 headers directly. Also holds the encoded HELLO message
+ * listing the services.
+ */
+struct lwpb_socket_method_table {
+    const struct lwpb_service_desc **service_list;
+    int num_services;
+    struct lwpb_socket_method_entry *entries;
+    u32_t mask;
+    u8_t *hello;
+    size_t hello_len;
+};
+
+struct lwpb_socket_method_table *method_table_create(
+        const struct lwpb_service_desc **service_list);
+
+void method_table_free(struct lwpb_socket_method_table *table);
+
+void set_socket_options(int socket, unsigned int options);
+
+int outq_flush(int socket, struct lwpb_socket_outq *outq, unsigned int options);
+
+void outq_free(struct lwpb_socket_outq *outq);
 
-int send_response(int socket, const struct lwpb_method_desc *method_desc,
+int inq_reserve(struct lwpb_socket_inq *inq, size_t need);
+
+void inq_consume(struct lwpb_socket_inq *inq, size_t len);
+
+void inq_free(struct lwpb_socket_inq *inq);
+
+int send_request(int socket, struct lwpb_socket_outq *outq, unsigned int options,
+                 const struct lwpb_method_desc *method_desc, int service_index,
+                 u32_t id, u32_t timeout, void *req_buf, size_t req_len);
+
+int send_response(int socket, struct lwpb_socket_outq *outq, unsigned int options,
+                  int version, u32_t id, lwpb_rpc_result_t status,
                   void *res_buf, size_t res_len);
 
+int append_response(struct lwpb_socket_outq *frames, int version,
+                    protocol_msg_type_t msg_type, u32_t id,
+                    lwpb_rpc_result_t status, void *res_buf, size_t res_len);
+
+int send_frames(int socket, struct lwpb_socket_outq *outq, unsigned int options,
+                struct lwpb_socket_outq *frames);
+
+int append_request(struct lwpb_socket_outq *batch,
+                   const struct lwpb_method_desc *method_desc, int service_index,
+                   u32_t id, u32_t timeout, void *req_buf, size_t req_len);
+
+int send_batch(int socket, struct lwpb_socket_outq *outq, unsigned int options,
+               struct lwpb_socket_outq *batch);
+
+int send_cancel(int socket, struct lwpb_socket_outq *outq, unsigned int options,
+                u32_t id);
+
+int send_hello(int socket, struct lwpb_socket_outq *outq, unsigned int options,
+               const struct lwpb_socket_method_table *table);
+
+int hello_service_index(const void *hello, size_t len,
+                        const struct lwpb_service_desc *service_desc);
+
 typedef enum {
     PARSE_ERR_OK,
     PARSE_ERR_END_OF_BUF,
     PARSE_ERR_INVALID_MAGIC,
+    PARSE_ERR_INVALID_HEADER,
 } protocol_parse_err_t;
 
 protocol_parse_err_t parse_request(void *buf, size_t len,
                                    struct protocol_header_info *info,
-                                   const struct lwpb_service_desc **service_list);
+                                   const struct lwpb_socket_method_table *table);
 
 #endif // __LWPB_RPC_SOCKET_HELPER_H__
@@ -41,6 +41,75 @@ const struct lwpb_field_desc lwpb_fields_socket_protocol_header[] = {
 #if LWPB_FIELD_NAMES
         .name = "method",
 #endif
+#if LWPB_FIELD_DEFAULTS
+        .def.string = "",
+#endif
+    },
+    {
+        .number = 4,
+        .opts.label = LWPB_OPTIONAL,
+        .opts.typ = LWPB_UINT32,
+        .opts.flags = 0,
+        .msg_desc = 0,
+#if LWPB_FIELD_NAMES
+        .name = "id",
+#endif
+#if LWPB_FIELD_DEFAULTS
+        .def.uint32 = 0,
+#endif
+    },
+    {
+        .number = 5,
+        .opts.label = LWPB_OPTIONAL,
+        .opts.typ = LWPB_UINT32,
+        .opts.flags = 0,
+        .msg_desc = 0,
+#if LWPB_FIELD_NAMES
+        .name = "status",
+#endif
+#if LWPB_FIELD_DEFAULTS
+        .def.uint32 = 0,
+#endif
+    },
+    {
+        .number = 6,
+        .opts.label = LWPB_OPTIONAL,
+        .opts.typ = LWPB_UINT32,
+        .opts.flags = 0,
+        .msg_desc = 0,
+#if LWPB_FIELD_NAMES
+        .name = "timeout",
+#endif
+#if LWPB_FIELD_DEFAULTS
+        .def.uint32 = 0,
+#endif
+    },
+};
+
+// 'Hello' field descriptors
+const struct lwpb_field_desc lwpb_fields_socket_protocol_hello[] = {
+    {
+        .number = 1,
+        .opts.label = LWPB_OPTIONAL,
+        .opts.typ = LWPB_UINT32,
+        .opts.flags = 0,
+        .msg_desc = 0,
+#if LWPB_FIELD_NAMES
+        .name = "version",
+#endif
+#if LWPB_FIELD_DEFAULTS
+        .def.uint32 = 0,
+#endif
+    },
+    {
+        .number = 2,
+        .opts.label = LWPB_REPEATED,
+        .opts.typ = LWPB_STRING,
+        .opts.flags = 0,
+        .msg_desc = 0,
+#if LWPB_FIELD_NAMES
+        .name = "service",
+#endif
 #if LWPB_FIELD_DEFAULTS
         .def.string = "",
 #endif
@@ -50,10 +119,17 @@ const struct lwpb_field_desc lwpb_fields_socket_protocol_header[] = {
 // Message descriptors
 const struct lwpb_msg_desc lwpb_messages_socket_protocol[] = {
     {
-        .num_fields = 3,
+        .num_fields = 6,
         .fields = lwpb_fields_socket_protocol_header,
 #if LWPB_MESSAGE_NAMES
         .name = "Header",
+#endif
+    },
+    {
+        .num_fields = 2,
+        .fields = lwpb_fields_socket_protocol_hello,
+#if LWPB_MESSAGE_NAMES
+        .name = "Hello",
 #endif
     },
 };
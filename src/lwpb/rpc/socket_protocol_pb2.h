@@ -9,11 +9,17 @@
 // 'MessageType' enumeration values
 #define SOCKET_PROTOCOL_REQUEST 0
 #define SOCKET_PROTOCOL_RESPONSE 1
+#define SOCKET_PROTOCOL_HELLO 2
+#define SOCKET_PROTOCOL_BATCH 3
+#define SOCKET_PROTOCOL_CANCEL 4
+#define SOCKET_PROTOCOL_STREAM 5
+#define SOCKET_PROTOCOL_STREAM_END 6
 
 extern const struct lwpb_msg_desc lwpb_messages_socket_protocol[];
 
 // Message descriptor pointers
 #define socket_protocol_Header (&lwpb_messages_socket_protocol[0])
+#define socket_protocol_Hello (&lwpb_messages_socket_protocol[1])
 
 extern const struct lwpb_field_desc lwpb_fields_socket_protocol_header[];
 
@@ -21,6 +27,15 @@ extern const struct lwpb_field_desc lwpb_fields_socket_protocol_header[];
 #define socket_protocol_Header_type (&lwpb_fields_socket_protocol_header[0])
 #define socket_protocol_Header_service (&lwpb_fields_socket_protocol_header[1])
 #define socket_protocol_Header_method (&lwpb_fields_socket_protocol_header[2])
+#define socket_protocol_Header_id (&lwpb_fields_socket_protocol_header[3])
+#define socket_protocol_Header_status (&lwpb_fields_socket_protocol_header[4])
+#define socket_protocol_Header_timeout (&lwpb_fields_socket_protocol_header[5])
+
+extern const struct lwpb_field_desc lwpb_fields_socket_protocol_hello[];
+
+// 'Hello' field descriptor pointers
+#define socket_protocol_Hello_version (&lwpb_fields_socket_protocol_hello[0])
+#define socket_protocol_Hello_service (&lwpb_fields_socket_protocol_hello[1])
 
 extern const struct lwpb_service_desc lwpb_services_socket_protocol[];
 
@@ -17,20 +17,28 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>
 
 #include <lwpb/lwpb.h>
 #include <lwpb/rpc/socket_server.h>
+#include <lwpb/rpc/stats.h>
 
 #include "socket_helper.h"
+#include "uring_helper.h"
 
 
 /**
@@ -50,46 +58,245 @@ static void make_nonblock(int sock)
 }
 
 /**
- * Accepts new connections on the listen socket.
+ * Grows the connection table.
  * @param socket_server Socket server
+ * @return Returns LWPB_ERR_OK if successful or LWPB_ERR_MEM if the table
+ * could not be grown.
  */
-static void handle_new_connection(struct lwpb_transport_socket_server *socket_server)
+static lwpb_err_t grow_conns(struct lwpb_transport_socket_server *socket_server)
 {
-    int socket;
-    struct sockaddr_storage addr;
-    socklen_t len = sizeof(addr);
-    char tmp[16];
-    struct sockaddr_in *addr_in;
+    struct lwpb_socket_server_conn **conns;
+    int *free_slots;
+    int size;
     int i;
-    const char msg[] = "No more connections allowed\n";
     
-    socket = accept(socket_server->socket, (struct sockaddr *) &addr, &len);
-    if (socket < 0) {
-        LWPB_ERR("Accepting new socket failed (errno: %d)", errno);
+    size = socket_server->conns_size ? socket_server->conns_size * 2 :
+                                       LWPB_TRANSPORT_SOCKET_SERVER_CONNS;
+    
+    conns = LWPB_REALLOC(socket_server->conns, size * sizeof(*conns));
+    if (!conns)
+        return LWPB_ERR_MEM;
+    socket_server->conns = conns;
+    
+    free_slots = LWPB_REALLOC(socket_server->free_slots, size * sizeof(*free_slots));
+    if (!free_slots)
+        return LWPB_ERR_MEM;
+    socket_server->free_slots = free_slots;
+    
+    // Push new slots in reverse order, so lower slots are used first
+    for (i = size - 1; i >= socket_server->conns_size; i--) {
+        conns[i] = NULL;
+        free_slots[socket_server->num_free_slots++] = i;
+    }
+    socket_server->conns_size = size;
+    
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Arms the multishot receive of a client connection, unless it is armed.
+ * @param socket_server Socket server
+ * @param conn Client connection
+ * @return Returns 0 if successful or -1 if the receive cannot be queued.
+ */
+static int start_recv(struct lwpb_transport_socket_server *socket_server,
+                      struct lwpb_socket_server_conn *conn)
+{
+    if (conn->receiving)
+        return 0;
+    
+    if (uring_recv(&socket_server->uring, conn->socket,
+                   URING_DATA(conn, URING_RECV)) != 0)
+        return -1;
+    
+    conn->receiving = 1;
+    conn->uring_ops++;
+    socket_server->uring_ops++;
+    
+    return 0;
+}
+
+/**
+ * Cancels the multishot receive of a client connection, so no more data is
+ * read while it is stalled or paused. Data received before the cancellation
+ * takes effect is kept in the receive buffer.
+ * @param socket_server Socket server
+ * @param conn Client connection
+ */
+static void stop_recv(struct lwpb_transport_socket_server *socket_server,
+                      struct lwpb_socket_server_conn *conn)
+{
+    if (socket_server->uring.fd == -1 || !conn->receiving)
         return;
+    
+    if (uring_cancel(&socket_server->uring, URING_DATA(conn, URING_RECV),
+                     URING_DATA(NULL, URING_CANCEL)) != 0)
+        LWPB_ERR("Client(%d) cannot cancel receive", conn->index);
+}
+
+/**
+ * Adds an accepted connection to the connection table and starts receiving
+ * from it.
+ * @param socket_server Socket server
+ * @param socket Socket of the new connection
+ * @return Returns the connection or NULL if the connection was closed.
+ */
+static struct lwpb_socket_server_conn *add_connection(
+        struct lwpb_transport_socket_server *socket_server, int socket)
+{
+    struct lwpb_socket_server_conn *conn;
+    struct epoll_event event;
+    int ret;
+    
+    // Get a free connection slot
+    if (socket_server->num_free_slots == 0 &&
+        grow_conns(socket_server) != LWPB_ERR_OK) {
+        LWPB_ERR("Cannot grow connection table");
+        close(socket);
+        return NULL;
+    }
+    
+    conn = LWPB_MALLOC(sizeof(*conn));
+    if (!conn) {
+        LWPB_ERR("Cannot allocate connection");
+        close(socket);
+        return NULL;
     }
     
-    make_nonblock(socket);
+    conn->index = socket_server->free_slots[--socket_server->num_free_slots];
+    conn->socket = socket;
+    conn->inq.data = NULL;
+    conn->inq.len = 0;
+    conn->inq.size = 0;
+    conn->pending = 0;
+    conn->closed = 0;
+    conn->stalled = 0;
+    conn->next_stalled = NULL;
+    conn->outq.data = NULL;
+    conn->outq.len = 0;
+    conn->outq.size = 0;
+    conn->queued = 0;
+    conn->next_queued = NULL;
+    conn->batching = 0;
+    conn->batch_pos = 0;
+    conn->paused = 0;
+    conn->resume_time = 0;
+    conn->next_paused = NULL;
+    conn->rate_time = 0;
+    conn->jobs = NULL;
+    conn->uring_ops = 0;
+    conn->receiving = 0;
+    conn->sending.data = NULL;
+    conn->sending.len = 0;
+    conn->sending.size = 0;
+    conn->sent = 0;
+    conn->serial = socket_server->next_serial++;
+    conn->captured = 0;
+    
+    set_socket_options(socket, socket_server->options);
+    
+    if (socket_server->uring.fd != -1) {
+        ret = start_recv(socket_server, conn);
+    } else {
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = conn;
+        ret = epoll_ctl(socket_server->epoll, EPOLL_CTL_ADD, socket, &event);
+    }
+    if (ret != 0) {
+        LWPB_ERR("Cannot wait for data on socket (errno: %d)", errno);
+        socket_server->free_slots[socket_server->num_free_slots++] = conn->index;
+        LWPB_FREE(conn);
+        close(socket);
+        return NULL;
+    }
+    
+    socket_server->conns[conn->index] = conn;
+    socket_server->num_conns++;
+    
+    return conn;
+}
+
+/**
+ * Accepts new connections on the listen socket. As the listen socket is
+ * edge-triggered, all pending connections are accepted.
+ * @param socket_server Socket server
+ */
+static void handle_new_connection(struct lwpb_transport_socket_server *socket_server)
+{
+    int socket;
+    struct sockaddr_storage addr;
+    socklen_t len;
+    char tmp[16];
+    struct sockaddr_in *addr_in;
+    struct lwpb_socket_server_conn *conn;
     
-    for (i = 0; i < LWPB_TRANSPORT_SOCKET_SERVER_CONNS; i++) {
-        struct lwpb_socket_server_conn *conn = &socket_server->conns[i];
-        if (conn->socket == -1) {
-            addr_in = (struct sockaddr_in *) &addr;
-            inet_ntop(addr.ss_family, &addr_in->sin_addr, tmp, sizeof(tmp));
-            LWPB_DEBUG("Client(%d) accepted conncetion from %s", conn->index, tmp);
-            conn->socket = socket;
-            if (!conn->buf)
-                lwpb_transport_alloc_buf(&socket_server->super, &conn->buf, &conn->len);
-            conn->pos = conn->buf;
-            socket_server->num_conns++;
+    for (;;) {
+        len = sizeof(addr);
+        socket = accept4(socket_server->socket, (struct sockaddr *) &addr, &len,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (socket < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                LWPB_ERR("Accepting new socket failed (errno: %d)", errno);
             return;
         }
+        
+        conn = add_connection(socket_server, socket);
+        if (!conn)
+            continue;
+        
+        addr_in = (struct sockaddr_in *) &addr;
+        inet_ntop(addr.ss_family, &addr_in->sin_addr, tmp, sizeof(tmp));
+        LWPB_DEBUG("Client(%d) accepted connection from %s", conn->index, tmp);
+    }
+}
+
+/**
+ * A call handler job running on the worker pool. Jobs are linked into the
+ * job list of their connection, so CANCEL frames can find them. Streaming
+ * calls are jobs for their whole lifetime, also without a worker pool, and
+ * are put on the stream list of the server while suspended.
+ */
+struct socket_server_job {
+    struct lwpb_worker_job super;
+    struct lwpb_transport_socket_server *socket_server;
+    struct lwpb_socket_server_conn *conn;
+    struct socket_server_job *next;
+    struct socket_server_job *prev;
+    const struct lwpb_method_desc *method_desc;
+    int version;
+    int batched;
+    u32_t id;
+    u64_t deadline;             /**< Time the call expires (ns), 0 for none */
+    int cancelled;              /**< Set by the I/O thread on CANCEL */
+    int dropped;                /**< Set if the call handler was not run */
+    void *frame;                /**< Memory holding the request message */
+    void *req_buf;
+    size_t req_len;
+    void *res_buf;
+    size_t res_len;
+    void *res;                  /**< Response message, may replace res_buf */
+    lwpb_err_t ret;
+    int stream;                 /**< Set for server streaming calls */
+    int started;                /**< Set once the handler has run */
+    struct lwpb_server_writer writer; /**< Writer of a streaming call */
+    struct lwpb_socket_outq frames; /**< Frames written by the last run */
+    struct socket_server_job *next_stream; /**< Next suspended stream */
+};
+
+/**
+ * Frees a closed client connection once no worker job, no stall list, no
+ * pause list, no flush list and no io_uring request refers to it anymore.
+ * @param conn Client connection
+ */
+static void release_connection(struct lwpb_socket_server_conn *conn)
+{
+    if (conn->closed && !conn->pending && !conn->stalled && !conn->paused &&
+        !conn->queued && !conn->uring_ops) {
+        outq_free(&conn->sending);
+        LWPB_FREE(conn);
     }
-    
-    // No more connections allowed
-    LWPB_DEBUG("No more connections allowed");
-    send(socket, msg, sizeof(msg), 0);
-    close(socket);
 }
 
 /**
@@ -100,74 +307,1416 @@ static void handle_new_connection(struct lwpb_transport_socket_server *socket_se
 static void close_connection(struct lwpb_transport_socket_server *socket_server,
                              struct lwpb_socket_server_conn *conn)
 {
+    struct socket_server_job *job;
+    
     LWPB_DEBUG("Client(%d) disconnected", conn->index);
+    
+    // Closing the socket also removes it from the epoll set, io_uring requests
+    // keep the socket open until they complete, which shutting it down forces
+    if (socket_server->uring.fd != -1)
+        shutdown(conn->socket, SHUT_RDWR);
     close(conn->socket);
-    conn->socket = -1;
+    inq_free(&conn->inq);
+    outq_free(&conn->outq);
+    
+    socket_server->conns[conn->index] = NULL;
+    socket_server->free_slots[socket_server->num_free_slots++] = conn->index;
     socket_server->num_conns--;
+    
+    // Streams of the connection are ended at their next run
+    for (job = conn->jobs; job; job = job->next)
+        if (job->stream)
+            __atomic_store_n(&job->cancelled, 1, __ATOMIC_RELAXED);
+    
+    conn->closed = 1;
+    release_connection(conn);
 }
 
 /**
- * Handles incoming data on a client connection.
+ * Checks the result of sending a frame to a client. Data which cannot be
+ * written right away (or is batched) stays in the output queue of the
+ * connection, which is put on the flush list.
  * @param socket_server Socket server
  * @param conn Client connection
+ * @param ret Result of the send function
  */
-static void handle_connection(struct lwpb_transport_socket_server *socket_server,
-        struct lwpb_socket_server_conn *conn)
+static void frame_sent(struct lwpb_transport_socket_server *socket_server,
+                       struct lwpb_socket_server_conn *conn, int ret)
 {
-    void *res_buf;
-    size_t res_len;
-    ssize_t len;
-    size_t used;
-    struct protocol_header_info info;
+    if (ret != 0) {
+        // The failed socket is closed when the read side notices
+        LWPB_ERR("Client(%d) cannot send response (errno: %d)", conn->index, errno);
+        conn->outq.len = 0;
+        return;
+    }
+    
+    if (conn->outq.len && !conn->queued) {
+        conn->queued = 1;
+        conn->next_queued = socket_server->queued;
+        socket_server->queued = conn;
+    }
+}
+
+/**
+ * Sends a response to a client. Responses to batched requests are always
+ * queued, so they are written together at the end of the update.
+ * @param socket_server Socket server
+ * @param conn Client connection
+ * @param method_desc Method descriptor of the request
+ * @param batched Set if the request was part of a batch
+ * @param version Protocol version of the request
+ * @param id Request ID
+ * @param buf Response message
+ * @param len Length of response message
+ * @param start Time the response is ready to be sent (ns) or 0 if unknown
+ */
+static void queue_response(struct lwpb_transport_socket_server *socket_server,
+                           struct lwpb_socket_server_conn *conn,
+                           const struct lwpb_method_desc *method_desc,
+                           int batched, int version, u32_t id,
+                           void *buf, size_t len, u64_t start)
+{
+    struct lwpb_stats *stats = socket_server->server->stats;
+    unsigned int options = socket_server->options;
+    
+    if (batched)
+        options |= LWPB_TRANSPORT_SOCKET_BATCH;
+    
+    if (stats && !start)
+        start = lwpb_stats_now();
+    
+    frame_sent(socket_server, conn,
+               send_response(conn->socket, &conn->outq, options,
+                             version, id, LWPB_RPC_OK, buf, len));
+    
+    if (stats)
+        lwpb_stats_record_send(stats, method_desc, lwpb_stats_now() - start);
+}
+
+/**
+ * Answers a request with an empty response holding only the result, so the
+ * client does not wait for a call which did not produce a response.
+ * @param socket_server Socket server
+ * @param conn Client connection
+ * @param batched Set if the request was part of a batch
+ * @param version Protocol version of the request
+ * @param id Request ID
+ * @param status Result of the call
+ */
+static void send_status(struct lwpb_transport_socket_server *socket_server,
+                        struct lwpb_socket_server_conn *conn, int batched,
+                        int version, u32_t id, lwpb_rpc_result_t status)
+{
+    unsigned int options = socket_server->options;
+    
+    if (batched)
+        options |= LWPB_TRANSPORT_SOCKET_BATCH;
+    
+    frame_sent(socket_server, conn,
+               send_response(conn->socket, &conn->outq, options, version, id,
+                             status, NULL, 0));
+}
+
+/**
+ * Sends the rest of the send buffer of a client connection on io_uring.
+ * @param socket_server Socket server
+ * @param conn Client connection
+ * @return Returns LWPB_ERR_OK if successful or LWPB_ERR_CANCEL if the
+ * connection was closed.
+ */
+static lwpb_err_t send_more(struct lwpb_transport_socket_server *socket_server,
+                            struct lwpb_socket_server_conn *conn)
+{
+    if (uring_send(&socket_server->uring, conn->socket,
+                   conn->sending.data + conn->sent, conn->sending.len - conn->sent,
+                   URING_DATA(conn, URING_SEND)) != 0) {
+        LWPB_ERR("Client(%d) cannot queue send", conn->index);
+        close_connection(socket_server, conn);
+        return LWPB_ERR_CANCEL;
+    }
+    
+    conn->uring_ops++;
+    socket_server->uring_ops++;
+    
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Starts sending the output queue of a client connection on io_uring. The
+ * output queue becomes the send buffer, so responses are queued while the
+ * send is in flight. If a send is already in flight, the output queue is
+ * sent once it completes.
+ * @param socket_server Socket server
+ * @param conn Client connection
+ * @return Returns LWPB_ERR_OK if successful or LWPB_ERR_CANCEL if the
+ * connection was closed.
+ */
+static lwpb_err_t start_send(struct lwpb_transport_socket_server *socket_server,
+                             struct lwpb_socket_server_conn *conn)
+{
+    struct lwpb_socket_outq tmp;
+    
+    if (conn->sending.len || !conn->outq.len)
+        return LWPB_ERR_OK;
+    
+    tmp = conn->sending;
+    conn->sending = conn->outq;
+    conn->outq = tmp;
+    conn->sent = 0;
+    
+    return send_more(socket_server, conn);
+}
+
+/**
+ * Writes the output queue of a client connection.
+ * @param socket_server Socket server
+ * @param conn Client connection
+ * @return Returns LWPB_ERR_OK if successful or LWPB_ERR_CANCEL if the
+ * connection was closed.
+ */
+static lwpb_err_t flush_connection(struct lwpb_transport_socket_server *socket_server,
+                                   struct lwpb_socket_server_conn *conn)
+{
+    if (socket_server->uring.fd != -1)
+        return start_send(socket_server, conn);
+    
+    if (outq_flush(conn->socket, &conn->outq, socket_server->options) < 0) {
+        LWPB_ERR("Client(%d) cannot send data (errno: %d)", conn->index, errno);
+        close_connection(socket_server, conn);
+        return LWPB_ERR_CANCEL;
+    }
+    
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Flushes all connections on the flush list. Data which still cannot be
+ * written is sent when the socket becomes writable again.
+ * @param socket_server Socket server
+ */
+static void flush_queued(struct lwpb_transport_socket_server *socket_server)
+{
+    struct lwpb_socket_server_conn *conn;
+    struct lwpb_socket_server_conn *next;
+    
+    conn = socket_server->queued;
+    socket_server->queued = NULL;
+    for (; conn; conn = next) {
+        next = conn->next_queued;
+        conn->queued = 0;
+        if (conn->closed)
+            release_connection(conn);
+        else
+            flush_connection(socket_server, conn);
+    }
+}
+
+/**
+ * Runs the call handler of a job. This method is called on a worker thread.
+ * Calls which were cancelled or expired while queued are dropped without
+ * running the call handler. Streaming calls run the stream handler, which
+ * ends the stream if it was cancelled after it started.
+ * @param worker_job Job
+ */
+static void run_job(struct lwpb_worker_job *worker_job)
+{
+    struct socket_server_job *job = (struct socket_server_job *) worker_job;
+    struct lwpb_server *server = job->socket_server->server;
+    struct lwpb_call_times times;
+    int cancelled = __atomic_load_n(&job->cancelled, __ATOMIC_RELAXED);
+    
+    if (!job->started &&
+        (cancelled || (job->deadline && worker_job->start_time > job->deadline))) {
+        job->dropped = 1;
+        return;
+    }
+    job->started = 1;
+    
+    if (job->stream) {
+        if (cancelled)
+            job->writer.cancelled = 1;
+        job->ret = lwpb_server_handle_stream(server, &job->writer,
+                                             job->req_buf, job->req_len,
+                                             worker_job->start_time -
+                                             worker_job->submit_time);
+        return;
+    }
+    
+    times.queued = worker_job->submit_time;
+    times.start = worker_job->start_time;
+    job->res = job->res_buf;
+    job->ret = lwpb_server_handle_call(server, job->method_desc,
+                                       job->req_buf, job->req_len,
+                                       &job->res, &job->res_len, &times);
+}
+
+/**
+ * Frees a job and its message buffers.
+ * @param socket_server Socket server
+ * @param job Job
+ */
+static void free_job(struct lwpb_transport_socket_server *socket_server,
+                     struct socket_server_job *job)
+{
+    LWPB_FREE(job->frame);
+    lwpb_server_free_response(job->res_buf, job->res);
+    if (job->res_buf)
+        lwpb_transport_free_buf(&socket_server->super, job->res_buf);
+    outq_free(&job->frames);
+    LWPB_FREE(job);
+}
+
+/**
+ * Unlinks a job from its connection and frees it.
+ * @param socket_server Socket server
+ * @param job Job
+ */
+static void release_job(struct lwpb_transport_socket_server *socket_server,
+                        struct socket_server_job *job)
+{
+    struct lwpb_socket_server_conn *conn = job->conn;
+    
+    if (job->prev)
+        job->prev->next = job->next;
+    else
+        conn->jobs = job->next;
+    if (job->next)
+        job->next->prev = job->prev;
+    
+    conn->pending--;
+    free_job(socket_server, job);
+    release_connection(conn);
+}
+
+/**
+ * Sends the frames written by a run of a stream handler. If the handler
+ * yielded, the stream is suspended until resume_streams() runs it again.
+ * Otherwise the stream is ended with a STREAM_END frame holding the result.
+ * Cancelled streams end without sending anything, as the client has stopped
+ * waiting for them.
+ * @param socket_server Socket server
+ * @param job Job of the streaming call
+ * @return Returns 1 if the stream was suspended and 0 if it ended.
+ */
+static int stream_written(struct lwpb_transport_socket_server *socket_server,
+                          struct socket_server_job *job)
+{
+    struct lwpb_socket_server_conn *conn = job->conn;
+    unsigned int options = socket_server->options;
+    int cancelled;
+    int suspend;
+    
+    cancelled = job->writer.cancelled || conn->closed ||
+                __atomic_load_n(&job->cancelled, __ATOMIC_RELAXED);
+    suspend = job->ret == LWPB_ERR_BUSY && !job->writer.cancelled;
+    
+    // A handler which yielded before noticing is run once more to end it
+    if (cancelled) {
+        job->frames.len = 0;
+        if (suspend) {
+            job->next_stream = socket_server->streams;
+            socket_server->streams = job;
+            return 1;
+        }
+        LWPB_DEBUG("Client(%d) cancelled stream %u", conn->index, job->id);
+        socket_server->cancelled++;
+        return 0;
+    }
+    
+    if (!suspend &&
+        append_response(&job->frames, job->version, MSG_TYPE_STREAM_END, job->id,
+                        job->ret == LWPB_ERR_OK ? LWPB_RPC_OK : LWPB_RPC_FAILED,
+                        NULL, 0) != 0)
+        LWPB_ERR("Client(%d) cannot end stream %u", conn->index, job->id);
+    
+    if (job->frames.len) {
+        if (job->batched)
+            options |= LWPB_TRANSPORT_SOCKET_BATCH;
+        frame_sent(socket_server, conn,
+                   send_frames(conn->socket, &conn->outq, options, &job->frames));
+    }
+    
+    if (suspend) {
+        job->next_stream = socket_server->streams;
+        socket_server->streams = job;
+    }
+    
+    return suspend;
+}
+
+/**
+ * Runs the stream handler of a streaming call on the I/O thread.
+ * @param socket_server Socket server
+ * @param job Job of the streaming call
+ */
+static void run_stream(struct lwpb_transport_socket_server *socket_server,
+                       struct socket_server_job *job)
+{
+    if (job->conn->closed || __atomic_load_n(&job->cancelled, __ATOMIC_RELAXED))
+        job->writer.cancelled = 1;
+    job->started = 1;
+    job->ret = lwpb_server_handle_stream(socket_server->server, &job->writer,
+                                         job->req_buf, job->req_len, 0);
+    
+    if (!stream_written(socket_server, job))
+        release_job(socket_server, job);
+}
+
+/**
+ * Completes a job returned from the worker pool. The response is sent back
+ * to the client unless the connection was closed in the meantime or the
+ * call was dropped, in which case the client has stopped waiting for it.
+ * Failed calls are answered with LWPB_RPC_FAILED. Streaming calls stay alive
+ * while their handler yields.
+ * @param socket_server Socket server
+ * @param job Job
+ */
+static void complete_job(struct lwpb_transport_socket_server *socket_server,
+                         struct socket_server_job *job)
+{
+    struct lwpb_socket_server_conn *conn = job->conn;
+    
+    socket_server->inflight--;
+    if (job->stream && !job->dropped) {
+        if (!stream_written(socket_server, job))
+            release_job(socket_server, job);
+        return;
+    }
+    
+    if (job->dropped) {
+        LWPB_DEBUG("Client(%d) dropped call %u", conn->index, job->id);
+        if (job->cancelled)
+            socket_server->cancelled++;
+        else
+            socket_server->expired++;
+    } else if (conn->closed) {
+        LWPB_DEBUG("Client(%d) closed before call %u completed", conn->index,
+                   job->id);
+    } else if (job->ret == LWPB_ERR_OK) {
+        queue_response(socket_server, conn, job->method_desc, job->batched,
+                       job->version, job->id, job->res, job->res_len, 0);
+    } else {
+        send_status(socket_server, conn, job->batched, job->version, job->id,
+                    LWPB_RPC_FAILED);
+    }
+    
+    release_job(socket_server, job);
+}
+
+/**
+ * Frames a response message of a streaming call. The message is added to
+ * the frames of the job, which are sent when the handler returns. This
+ * method is called on the thread running the stream handler.
+ * @param writer Writer
+ * @param buf Encoded response message
+ * @param len Length of response message
+ * @return Returns LWPB_ERR_OK if more messages can be written, LWPB_ERR_BUSY
+ * if a chunk is complete, LWPB_ERR_CANCEL if the call was cancelled or
+ * LWPB_ERR_MEM if the message could not be framed.
+ */
+static lwpb_err_t stream_write(struct lwpb_server_writer *writer,
+                               void *buf, size_t len)
+{
+    struct socket_server_job *job = writer->ctx;
+    
+    if (__atomic_load_n(&job->cancelled, __ATOMIC_RELAXED))
+        return LWPB_ERR_CANCEL;
+    
+    if (append_response(&job->frames, job->version, MSG_TYPE_STREAM, job->id,
+                        LWPB_RPC_OK, buf, len) != 0)
+        return LWPB_ERR_MEM;
+    
+    if (job->frames.len >= LWPB_TRANSPORT_SOCKET_SERVER_STREAM_CHUNK)
+        return LWPB_ERR_BUSY;
+    
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Allocates a job for a request.
+ * @param socket_server Socket server
+ * @param conn Client connection
+ * @param info Parsed request header
+ * @param buf Request message
+ * @param copy Set to copy the request message, otherwise the job refers to
+ * the receive buffer
+ * @return Returns the job or NULL if memory could not be allocated.
+ */
+static struct socket_server_job *alloc_job(struct lwpb_transport_socket_server *socket_server,
+                                           struct lwpb_socket_server_conn *conn,
+                                           struct protocol_header_info *info,
+                                           void *buf, int copy)
+{
+    struct lwpb_server *server = socket_server->server;
+    struct socket_server_job *job;
+    
+    job = LWPB_MALLOC(sizeof(*job));
+    if (!job) {
+        LWPB_ERR("Client(%d) cannot allocate job", conn->index);
+        return NULL;
+    }
+    job->super.fun = run_job;
+    job->socket_server = socket_server;
+    job->conn = conn;
+    job->method_desc = info->method_desc;
+    job->version = info->version;
+    job->batched = conn->batching;
+    job->id = info->id;
+    job->deadline = info->timeout ? lwpb_stats_now() + info->timeout * 1000000ULL : 0;
+    job->cancelled = 0;
+    job->dropped = 0;
+    job->frame = NULL;
+    job->req_buf = buf;
+    job->req_len = info->msg_len;
+    job->res_buf = NULL;
+    job->res = NULL;
+    job->ret = LWPB_ERR_OK;
+    job->stream = server->stream_methods &&
+                  lwpb_server_is_stream(server, info->method_desc);
+    job->started = 0;
+    job->frames.data = NULL;
+    job->frames.len = 0;
+    job->frames.size = 0;
+    
+    if (lwpb_transport_alloc_buf(&socket_server->super,
+                                 &job->res_buf, &job->res_len) != LWPB_ERR_OK) {
+        LWPB_ERR("Client(%d) cannot allocate job buffers", conn->index);
+        free_job(socket_server, job);
+        return NULL;
+    }
+    if (job->stream)
+        lwpb_server_writer_init(&job->writer, info->method_desc, stream_write,
+                                job, job->res_buf, job->res_len);
+    
+    if (copy) {
+        job->frame = LWPB_MALLOC(info->msg_len ? info->msg_len : 1);
+        if (!job->frame) {
+            LWPB_ERR("Client(%d) cannot allocate job buffers", conn->index);
+            free_job(socket_server, job);
+            return NULL;
+        }
+        LWPB_MEMCPY(job->frame, buf, info->msg_len);
+        job->req_buf = job->frame;
+    }
+    
+    return job;
+}
+
+/**
+ * Links a job into the job list of its connection.
+ * @param conn Client connection
+ * @param job Job
+ */
+static void link_job(struct lwpb_socket_server_conn *conn,
+                     struct socket_server_job *job)
+{
+    job->prev = NULL;
+    job->next = conn->jobs;
+    if (conn->jobs)
+        conn->jobs->prev = job;
+    conn->jobs = job;
+    
+    conn->pending++;
+}
+
+/**
+ * Queues a request on the worker pool. If the request is the last frame in
+ * the receive buffer, the job takes over the buffer and the request message
+ * is not copied. Otherwise the message is copied, as the receive buffer is
+ * reused before the job completes.
+ * @param socket_server Socket server
+ * @param conn Client connection
+ * @param info Parsed request header
+ * @param buf Request message
+ * @return Returns LWPB_ERR_OK if the request was queued or dropped and
+ * LWPB_ERR_BUSY if the job queue is full.
+ */
+static lwpb_err_t queue_request(struct lwpb_transport_socket_server *socket_server,
+                                struct lwpb_socket_server_conn *conn,
+                                struct protocol_header_info *info, void *buf)
+{
+    struct socket_server_job *job;
     lwpb_err_t ret;
+    int detach;
     
-    used = conn->pos - conn->buf;
+    detach = (u8_t *) buf + info->msg_len == conn->inq.data + conn->inq.len;
+    job = alloc_job(socket_server, conn, info, buf, !detach);
+    if (!job) {
+        send_status(socket_server, conn, conn->batching, info->version,
+                    info->id, LWPB_RPC_FAILED);
+        return LWPB_ERR_OK;
+    }
+    
+    ret = lwpb_worker_pool_submit(&socket_server->pool, &job->super);
+    if (ret != LWPB_ERR_OK) {
+        free_job(socket_server, job);
+        return ret;
+    }
+    
+    // The receive buffer now belongs to the job
+    if (detach) {
+        job->frame = conn->inq.data;
+        conn->inq.data = NULL;
+        conn->inq.len = 0;
+        conn->inq.size = 0;
+    }
+    
+    link_job(conn, job);
+    socket_server->inflight++;
+    
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Starts a streaming call without a worker pool. The request message is
+ * copied, as the stream outlives the receive buffer.
+ * @param socket_server Socket server
+ * @param conn Client connection
+ * @param info Parsed request header
+ * @param buf Request message
+ */
+static void start_stream(struct lwpb_transport_socket_server *socket_server,
+                         struct lwpb_socket_server_conn *conn,
+                         struct protocol_header_info *info, void *buf)
+{
+    struct socket_server_job *job;
+    
+    job = alloc_job(socket_server, conn, info, buf, 1);
+    if (!job) {
+        send_status(socket_server, conn, conn->batching, info->version,
+                    info->id, LWPB_RPC_FAILED);
+        return;
+    }
+    
+    link_job(conn, job);
+    run_stream(socket_server, job);
+}
+
+/**
+ * Checks if a suspended stream can be resumed.
+ * @param job Job of the streaming call
+ * @return Returns 1 if the stream can be resumed.
+ */
+static int stream_ready(struct socket_server_job *job)
+{
+    struct lwpb_socket_server_conn *conn = job->conn;
+    
+    return conn->closed || __atomic_load_n(&job->cancelled, __ATOMIC_RELAXED) ||
+           conn->outq.len + conn->sending.len < LWPB_TRANSPORT_SOCKET_SERVER_STREAM_WINDOW;
+}
+
+/**
+ * Resumes suspended streams whose connection has sent enough of their
+ * output, on the worker pool or inline. Streams which are cancelled or whose
+ * connection was closed are run once more to end them.
+ * @param socket_server Socket server
+ */
+static void resume_streams(struct lwpb_transport_socket_server *socket_server)
+{
+    struct socket_server_job *job;
+    struct socket_server_job *next;
+    
+    job = socket_server->streams;
+    socket_server->streams = NULL;
+    for (; job; job = next) {
+        next = job->next_stream;
+        if (!stream_ready(job) ||
+            (socket_server->num_workers > 0 &&
+             lwpb_worker_pool_submit(&socket_server->pool, &job->super) != LWPB_ERR_OK)) {
+            job->next_stream = socket_server->streams;
+            socket_server->streams = job;
+            continue;
+        }
+        
+        if (socket_server->num_workers > 0)
+            socket_server->inflight++;
+        else
+            run_stream(socket_server, job);
+    }
+}
+
+/**
+ * Handles a CANCEL frame. A queued call is dropped when a worker picks it
+ * up, calls which are already running complete as usual, but their response
+ * is ignored by the client. Streams end at their next message.
+ * @param socket_server Socket server
+ * @param conn Client connection
+ * @param id Call ID
+ */
+static void cancel_request(struct lwpb_transport_socket_server *socket_server,
+                           struct lwpb_socket_server_conn *conn, u32_t id)
+{
+    struct socket_server_job *job;
+    
+    for (job = conn->jobs; job; job = job->next) {
+        if (job->id == id) {
+            LWPB_DEBUG("Client(%d) cancelled call %u", conn->index, id);
+            __atomic_store_n(&job->cancelled, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+}
+
+/**
+ * Pauses reading from a client connection until it can be resumed by
+ * resume_paused().
+ * @param socket_server Socket server
+ * @param conn Client connection
+ * @param resume_time Time to resume (ns) or 0 to resume once the output
+ * queue is below the limit
+ */
+static void pause_connection(struct lwpb_transport_socket_server *socket_server,
+                             struct lwpb_socket_server_conn *conn, u64_t resume_time)
+{
+    LWPB_DEBUG("Client(%d) paused by admission control", conn->index);
+    
+    conn->paused = 1;
+    conn->resume_time = resume_time;
+    conn->next_paused = socket_server->paused;
+    socket_server->paused = conn;
+    socket_server->pauses++;
+}
+
+/**
+ * Answers a request with an empty OVERLOADED response.
+ * @param socket_server Socket server
+ * @param conn Client connection
+ * @param info Parsed request header
+ */
+static void reject_request(struct lwpb_transport_socket_server *socket_server,
+                           struct lwpb_socket_server_conn *conn,
+                           struct protocol_header_info *info)
+{
+    socket_server->rejected++;
+    send_status(socket_server, conn, conn->batching, info->version, info->id,
+                LWPB_RPC_OVERLOADED);
+}
+
+/**
+ * Checks a request against the admission control limits. Rate limiting
+ * works like a token bucket refilled at the configured rate, by tracking
+ * the earliest time the next request is allowed.
+ * @param socket_server Socket server
+ * @param conn Client connection
+ * @param info Parsed request header
+ * @return Returns LWPB_ERR_OK if the request can be handled, LWPB_ERR_BUSY
+ * if reading from the connection has to stop or LWPB_ERR_CANCEL if the
+ * request was rejected.
+ */
+static lwpb_err_t admit_request(struct lwpb_transport_socket_server *socket_server,
+                                struct lwpb_socket_server_conn *conn,
+                                struct protocol_header_info *info)
+{
+    struct lwpb_socket_server_limits *limits = &socket_server->limits;
+    u64_t interval;
+    u64_t slack;
+    u64_t t;
+    
+    // Stop reading while the client does not read its responses
+    if (limits->max_buffered &&
+        conn->outq.len + conn->sending.len > limits->max_buffered) {
+        pause_connection(socket_server, conn, 0);
+        return LWPB_ERR_BUSY;
+    }
+    
+    // Stalled connections are resumed as jobs complete
+    if (socket_server->num_workers > 0 &&
+        ((limits->max_pending && conn->pending >= limits->max_pending) ||
+         (limits->max_inflight && socket_server->inflight >= limits->max_inflight))) {
+        if (limits->policy == LWPB_TRANSPORT_SOCKET_SERVER_PAUSE)
+            return LWPB_ERR_BUSY;
+        reject_request(socket_server, conn, info);
+        return LWPB_ERR_CANCEL;
+    }
+    
+    if (limits->rate) {
+        interval = 1000000000ULL / limits->rate;
+        slack = (limits->burst > 1 ? limits->burst - 1 : 0) * interval;
+        t = lwpb_stats_now();
+        if (conn->rate_time < t)
+            conn->rate_time = t;
+        if (conn->rate_time > t + slack) {
+            if (limits->policy == LWPB_TRANSPORT_SOCKET_SERVER_PAUSE) {
+                pause_connection(socket_server, conn, conn->rate_time - slack);
+                return LWPB_ERR_BUSY;
+            }
+            reject_request(socket_server, conn, info);
+            return LWPB_ERR_CANCEL;
+        }
+        conn->rate_time += interval;
+    }
+    
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Handles a single request frame. The call handler is either called inline
+ * or the request is queued on the worker pool. Requests which cannot be
+ * handled are answered with LWPB_RPC_FAILED.
+ * @param socket_server Socket server
+ * @param conn Client connection
+ * @param info Parsed request header
+ * @param buf Start of the frame
+ * @return Returns LWPB_ERR_OK if the frame was consumed and LWPB_ERR_BUSY if
+ * the worker pool queue is full or admission control stopped reading from
+ * the connection, so the frame needs to be retried later.
+ */
+static lwpb_err_t handle_request(struct lwpb_transport_socket_server *socket_server,
+                                 struct lwpb_socket_server_conn *conn,
+                                 struct protocol_header_info *info, void *buf)
+{
+    struct lwpb_call_times times;
+    void *res_buf;
+    void *res;
+    size_t res_len;
+    lwpb_err_t ret;
+    
+    LWPB_DEBUG("Client(%d) received request header", conn->index);
+    LWPB_DEBUG("type = %d, service = %p, method = %p, id = %u, header_len = %d, msg_len = %d",
+               info->msg_type, info->service_desc, info->method_desc, info->id,
+               info->header_len, info->msg_len);
+    
+    // Tell the client which services we have and that we speak v2
+    if (info->msg_type == MSG_TYPE_HELLO) {
+        frame_sent(socket_server, conn,
+                   send_hello(conn->socket, &conn->outq, socket_server->options,
+                              socket_server->methods));
+        return LWPB_ERR_OK;
+    }
+    
+    if (info->msg_type == MSG_TYPE_CANCEL) {
+        cancel_request(socket_server, conn, info->id);
+        return LWPB_ERR_OK;
+    }
+    
+    if (!info->method_desc) {
+        LWPB_ERR("Client(%d) called unknown method", conn->index);
+        send_status(socket_server, conn, conn->batching, info->version,
+                    info->id, LWPB_RPC_FAILED);
+        return LWPB_ERR_OK;
+    }
+    
+    ret = admit_request(socket_server, conn, info);
+    if (ret == LWPB_ERR_CANCEL)
+        return LWPB_ERR_OK;
+    if (ret != LWPB_ERR_OK)
+        return ret;
+    
+    if (socket_server->num_workers > 0)
+        return queue_request(socket_server, conn, info, buf + info->header_len);
+    
+    if (socket_server->server->stream_methods &&
+        lwpb_server_is_stream(socket_server->server, info->method_desc)) {
+        start_stream(socket_server, conn, info, buf + info->header_len);
+        return LWPB_ERR_OK;
+    }
+    
+    // Allocate response buffer
+    ret = lwpb_transport_alloc_buf(&socket_server->super, &res_buf, &res_len);
+    if (ret != LWPB_ERR_OK) {
+        LWPB_ERR("Client(%d) cannot allocate response buffer", conn->index);
+        send_status(socket_server, conn, conn->batching, info->version,
+                    info->id, LWPB_RPC_FAILED);
+        return LWPB_ERR_OK;
+    }
+    
+    res = res_buf;
+    times.queued = 0;
+    times.start = 0;
+    ret = lwpb_server_handle_call(socket_server->server, info->method_desc,
+                                  buf + info->header_len, info->msg_len,
+                                  &res, &res_len, &times);
+    
+    // Send response back to client, the handler's end time is the send start
+    if (ret == LWPB_ERR_OK) {
+        queue_response(socket_server, conn, info->method_desc, conn->batching,
+                       info->version, info->id, res, res_len, times.end);
+        lwpb_server_free_response(res_buf, res);
+    } else {
+        send_status(socket_server, conn, conn->batching, info->version,
+                    info->id, LWPB_RPC_FAILED);
+    }
+    
+    lwpb_transport_free_buf(&socket_server->super, res_buf);
+    
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Handles a BATCH frame by dispatching each request frame it holds. If the
+ * worker pool queue fills up, the position in the batch is kept, so the
+ * remaining requests are handled when the frame is retried.
+ * @param socket_server Socket server
+ * @param conn Client connection
+ * @param info Parsed BATCH frame header
+ * @param buf Start of the frame
+ * @return Returns LWPB_ERR_OK if the frame was consumed, LWPB_ERR_BUSY if the
+ * worker pool queue is full or LWPB_ERR_INVALID_FIELD if the batch holds an
+ * invalid frame.
+ */
+static lwpb_err_t handle_batch(struct lwpb_transport_socket_server *socket_server,
+                               struct lwpb_socket_server_conn *conn,
+                               struct protocol_header_info *info, void *buf)
+{
+    struct protocol_header_info sub;
+    u8_t *msg = (u8_t *) buf + info->header_len;
+    size_t pos = conn->batch_pos;
+    lwpb_err_t err = LWPB_ERR_OK;
+    
+    conn->batching = 1;
+    while (pos < info->msg_len) {
+        if (parse_request(msg + pos, info->msg_len - pos, &sub,
+                          socket_server->methods) != PARSE_ERR_OK ||
+            sub.msg_type != MSG_TYPE_REQUEST) {
+            err = LWPB_ERR_INVALID_FIELD;
+            break;
+        }
+        
+        err = handle_request(socket_server, conn, &sub, msg + pos);
+        if (err != LWPB_ERR_OK)
+            break;
+        
+        // Stop if the receive buffer was handed over with the last request
+        if (!conn->inq.data)
+            break;
+        pos += sub.header_len + sub.msg_len;
+    }
+    conn->batching = 0;
+    conn->batch_pos = err == LWPB_ERR_BUSY ? pos : 0;
+    
+    return err;
+}
+
+/**
+ * Handles all complete request frames in the receive buffer of a client
+ * connection and moves the remaining partial frame to the start of the
+ * buffer.
+ * @param socket_server Socket server
+ * @param conn Client connection
+ * @param need Returns the size of the partial frame if known from its header
+ * or 0
+ * @return Returns LWPB_ERR_OK if successful, LWPB_ERR_BUSY if the worker pool
+ * queue is full, LWPB_ERR_MEM if the method lookup table could not be created
+ * or LWPB_ERR_INVALID_FIELD if the client sent an invalid or too large frame.
+ */
+static lwpb_err_t handle_frames(struct lwpb_transport_socket_server *socket_server,
+                                struct lwpb_socket_server_conn *conn, size_t *need)
+{
+    struct protocol_header_info info;
+    protocol_parse_err_t ret;
+    lwpb_err_t err = LWPB_ERR_OK;
+    size_t pos = 0;
+    
+    *need = 0;
+    
+    // Build the method lookup table with the first request
+    if (!socket_server->methods) {
+        socket_server->methods = method_table_create(socket_server->server->service_list);
+        if (!socket_server->methods)
+            return LWPB_ERR_MEM;
+    }
+    
+    for (;;) {
+        ret = parse_request(conn->inq.data + pos, conn->inq.len - pos, &info,
+                            socket_server->methods);
+        if (ret == PARSE_ERR_END_OF_BUF) {
+            *need = info.header_len + info.msg_len;
+            break;
+        }
+        if (ret != PARSE_ERR_OK)
+            return LWPB_ERR_INVALID_FIELD;
+        
+        // Record the frame unless it was recorded before the queue got full
+        if (socket_server->capture && (pos || !conn->captured) &&
+            lwpb_capture_write(socket_server->capture, conn->serial,
+                               conn->inq.data + pos,
+                               info.header_len + info.msg_len) != LWPB_ERR_OK) {
+            LWPB_ERR("Cannot write capture, capture stopped");
+            socket_server->capture = NULL;
+        }
+        
+        if (info.msg_type == MSG_TYPE_BATCH)
+            err = handle_batch(socket_server, conn, &info, conn->inq.data + pos);
+        else
+            err = handle_request(socket_server, conn, &info, conn->inq.data + pos);
+        if (err == LWPB_ERR_INVALID_FIELD)
+            return err;
+        if (err != LWPB_ERR_OK) {
+            conn->captured = socket_server->capture != NULL;
+            break;
+        }
+        conn->captured = 0;
+        
+        // Stop if the receive buffer was handed over to a worker job
+        if (!conn->inq.data)
+            return LWPB_ERR_OK;
+        pos += info.header_len + info.msg_len;
+    }
+    
+    if (*need > socket_server->max_frame) {
+        LWPB_ERR("Client(%d) frame of %u bytes exceeds maximum frame size",
+                 conn->index, (unsigned int) *need);
+        return LWPB_ERR_INVALID_FIELD;
+    }
+    
+    // Compact receive buffer
+    inq_consume(&conn->inq, pos);
+    
+    return err;
+}
+
+/**
+ * Handles incoming data on a client connection. As client sockets are
+ * edge-triggered, the socket is read until it would block. With io_uring,
+ * the received data is already in the receive buffer and the multishot
+ * receive is armed again if it ended. If the worker pool queue is full,
+ * reading stops and the connection is stalled until jobs complete.
+ * Connections paused by admission control are already on the pause list.
+ * @param socket_server Socket server
+ * @param conn Client connection
+ */
+static void handle_connection(struct lwpb_transport_socket_server *socket_server,
+        struct lwpb_socket_server_conn *conn)
+{
+    ssize_t len;
+    size_t need;
+    lwpb_err_t ret;
+    
+    if (conn->stalled || conn->paused)
+        return;
+    
+    for (;;) {
+        ret = handle_frames(socket_server, conn, &need);
+        if (ret == LWPB_ERR_BUSY && conn->paused) {
+            stop_recv(socket_server, conn);
+            return;
+        }
+        if (ret == LWPB_ERR_BUSY) {
+            LWPB_DEBUG("Client(%d) stalled, worker queue is full", conn->index);
+            conn->stalled = 1;
+            conn->next_stalled = socket_server->stalled;
+            socket_server->stalled = conn;
+            stop_recv(socket_server, conn);
+            return;
+        }
+        if (ret != LWPB_ERR_OK) {
+            LWPB_ERR("Client(%d) sent invalid frame", conn->index);
+            close_connection(socket_server, conn);
+            return;
+        }
+        
+        // Grow the receive buffer to hold the partial frame
+        if (inq_reserve(&conn->inq, need) != 0) {
+            LWPB_ERR("Client(%d) cannot allocate receive buffer", conn->index);
+            close_connection(socket_server, conn);
+            return;
+        }
+        
+        if (socket_server->uring.fd != -1) {
+            if (start_recv(socket_server, conn) != 0) {
+                LWPB_ERR("Client(%d) cannot queue receive", conn->index);
+                close_connection(socket_server, conn);
+            }
+            return;
+        }
+        
+        len = recv(conn->socket, conn->inq.data + conn->inq.len,
+                   conn->inq.size - conn->inq.len, 0);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            close_connection(socket_server, conn);
+            return;
+        }
+        if (len == 0) {
+            close_connection(socket_server, conn);
+            return;
+        }
+        
+        conn->inq.len += len;
+        
+        LWPB_DEBUG("Client(%d) received %d bytes", conn->index, len);
+    }
+}
+
+/**
+ * Sends the responses of completed worker jobs and resumes stalled
+ * connections.
+ * @param socket_server Socket server
+ */
+static void handle_completed(struct lwpb_transport_socket_server *socket_server)
+{
+    struct lwpb_worker_job *job;
+    struct lwpb_worker_job *next;
+    struct lwpb_socket_server_conn *conn;
+    struct lwpb_socket_server_conn *next_conn;
+    
+    for (job = lwpb_worker_pool_completed(&socket_server->pool); job; job = next) {
+        next = job->next;
+        complete_job(socket_server, (struct socket_server_job *) job);
+    }
+    
+    // Retry stalled connections, which may stall again
+    conn = socket_server->stalled;
+    socket_server->stalled = NULL;
+    for (; conn; conn = next_conn) {
+        next_conn = conn->next_stalled;
+        conn->stalled = 0;
+        if (conn->closed)
+            release_connection(conn);
+        else
+            handle_connection(socket_server, conn);
+    }
+}
+
+/**
+ * Checks if a paused connection can be resumed.
+ * @param socket_server Socket server
+ * @param conn Client connection
+ * @param t Current time (ns)
+ * @return Returns 1 if the connection can be resumed.
+ */
+static int can_resume(struct lwpb_transport_socket_server *socket_server,
+                      struct lwpb_socket_server_conn *conn, u64_t t)
+{
+    if (conn->closed)
+        return 1;
+    if (!conn->resume_time)
+        return conn->outq.len + conn->sending.len <=
+               socket_server->limits.max_buffered;
+    
+    return conn->resume_time <= t;
+}
+
+/**
+ * Returns how long to wait for socket events, so paused connections are
+ * resumed in time and suspended streams which can be resumed don't wait.
+ * @param socket_server Socket server
+ * @param timeout Timeout if no connection or stream is waiting (ms), -1 to
+ * wait forever
+ * @return Returns the timeout for epoll_wait() (ms).
+ */
+static int paused_timeout(struct lwpb_transport_socket_server *socket_server,
+                          int timeout)
+{
+    struct lwpb_socket_server_conn *conn;
+    struct socket_server_job *job;
+    u64_t wait;
+    u64_t t;
+    
+    for (job = socket_server->streams; job; job = job->next_stream)
+        if (stream_ready(job))
+            return 0;
+    
+    if (!socket_server->paused)
+        return timeout;
+    
+    t = lwpb_stats_now();
+    for (conn = socket_server->paused; conn; conn = conn->next_paused) {
+        if (can_resume(socket_server, conn, t))
+            return 0;
+        if (!conn->resume_time)
+            continue;
+        wait = (conn->resume_time - t + 999999) / 1000000;
+        if (wait < (u64_t) timeout)
+            timeout = (int) wait;
+    }
+    
+    return timeout;
+}
+
+/**
+ * Resumes reading from paused connections which are below their limits
+ * again. Connections may be paused again right away.
+ * @param socket_server Socket server
+ */
+static void resume_paused(struct lwpb_transport_socket_server *socket_server)
+{
+    struct lwpb_socket_server_conn *conn;
+    struct lwpb_socket_server_conn *next;
+    struct lwpb_socket_server_conn *resume = NULL;
+    struct lwpb_socket_server_conn **prev;
+    u64_t t;
+    
+    if (!socket_server->paused)
+        return;
+    
+    // Move connections which can be resumed to their own list first
+    t = lwpb_stats_now();
+    prev = &socket_server->paused;
+    for (conn = socket_server->paused; conn; conn = next) {
+        next = conn->next_paused;
+        if (can_resume(socket_server, conn, t)) {
+            *prev = next;
+            conn->next_paused = resume;
+            resume = conn;
+        } else {
+            prev = &conn->next_paused;
+        }
+    }
+    
+    for (conn = resume; conn; conn = next) {
+        next = conn->next_paused;
+        conn->paused = 0;
+        if (conn->closed)
+            release_connection(conn);
+        else
+            handle_connection(socket_server, conn);
+    }
+}
+
+/**
+ * Starts the multishot accept on the listen socket.
+ * @param socket_server Socket server
+ * @return Returns 0 if successful or -1 if the accept cannot be queued.
+ */
+static int start_accept(struct lwpb_transport_socket_server *socket_server)
+{
+    if (uring_accept(&socket_server->uring, socket_server->socket,
+                     URING_DATA(NULL, URING_ACCEPT)) != 0)
+        return -1;
+    
+    socket_server->uring_ops++;
+    
+    return 0;
+}
+
+/**
+ * Handles the completion of the multishot accept, which is started again if
+ * it ended, unless the listen socket was shut down.
+ * @param socket_server Socket server
+ * @param res Socket of the new connection or negative error code
+ * @param flags Completion flags
+ */
+static void handle_accept(struct lwpb_transport_socket_server *socket_server,
+                          int res, unsigned int flags)
+{
+    struct lwpb_socket_server_conn *conn;
+    
+    if (!(flags & IORING_CQE_F_MORE)) {
+        socket_server->uring_ops--;
+        if (res != -EINVAL && res != -ECANCELED &&
+            start_accept(socket_server) != 0)
+            LWPB_ERR("Cannot queue accept");
+    }
+    
+    if (res < 0) {
+        if (res != -EINVAL && res != -ECANCELED)
+            LWPB_ERR("Accepting new socket failed (errno: %d)", -res);
+        return;
+    }
+    
+    conn = add_connection(socket_server, res);
+    if (conn)
+        LWPB_DEBUG("Client(%d) accepted connection", conn->index);
+}
+
+/**
+ * Handles a completion of the multishot receive of a client connection. The
+ * data is appended to the receive buffer and the provided buffer is given
+ * back right away.
+ * @param socket_server Socket server
+ * @param conn Client connection
+ * @param res Number of received bytes or negative error code
+ * @param flags Completion flags
+ */
+static void handle_recv(struct lwpb_transport_socket_server *socket_server,
+                        struct lwpb_socket_server_conn *conn,
+                        int res, unsigned int flags)
+{
+    struct lwpb_uring *uring = &socket_server->uring;
+    unsigned int bid;
+    
+    if (!(flags & IORING_CQE_F_MORE)) {
+        conn->receiving = 0;
+        conn->uring_ops--;
+        socket_server->uring_ops--;
+    }
+    
+    if (flags & IORING_CQE_F_BUFFER) {
+        bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res > 0 && !conn->closed) {
+            if (inq_reserve(&conn->inq, conn->inq.len + res) != 0) {
+                uring_recycle_buf(uring, bid);
+                LWPB_ERR("Client(%d) cannot allocate receive buffer", conn->index);
+                close_connection(socket_server, conn);
+                return;
+            }
+            LWPB_MEMCPY(conn->inq.data + conn->inq.len, uring_buf(uring, bid), res);
+            conn->inq.len += res;
+            LWPB_DEBUG("Client(%d) received %d bytes", conn->index, res);
+        }
+        uring_recycle_buf(uring, bid);
+    }
+    
+    if (conn->closed) {
+        release_connection(conn);
+        return;
+    }
+    
+    // Running out of provided buffers or a cancelled receive are no errors,
+    // the receive is armed again unless the connection stopped reading
+    if (res == 0 || (res < 0 && res != -ENOBUFS && res != -ECANCELED)) {
+        close_connection(socket_server, conn);
+        return;
+    }
+    
+    handle_connection(socket_server, conn);
+}
+
+/**
+ * Handles the completion of a send of a client connection. The rest of a
+ * short send is sent again, otherwise the responses queued in the meantime
+ * are sent.
+ * @param socket_server Socket server
+ * @param conn Client connection
+ * @param res Number of sent bytes or negative error code
+ */
+static void handle_send(struct lwpb_transport_socket_server *socket_server,
+                        struct lwpb_socket_server_conn *conn, int res)
+{
+    conn->uring_ops--;
+    socket_server->uring_ops--;
+    
+    if (conn->closed) {
+        release_connection(conn);
+        return;
+    }
     
-    len = recv(conn->socket, conn->pos, conn->len - used, 0);
-    if (len <= 0) {
+    if (res <= 0) {
+        LWPB_ERR("Client(%d) cannot send data (errno: %d)", conn->index, -res);
         close_connection(socket_server, conn);
         return;
     }
     
-    conn->pos += len;
-    used = conn->pos - conn->buf;
-    
-    LWPB_DEBUG("Client(%d) received %d bytes", conn->index, len);
-    
-    // Try to decode the request
-    ret = parse_request(conn->buf, used, &info, socket_server->server->service_list);
-    if (ret != PARSE_ERR_OK)
+    conn->sent += res;
+    if (conn->sent < conn->sending.len) {
+        send_more(socket_server, conn);
         return;
+    }
     
-    LWPB_DEBUG("Client(%d) received request header", conn->index);
-    LWPB_DEBUG("type = %d, service = %p, method = %p, header_len = %d, msg_len = %d",
-               info.msg_type, info.service_desc, info.method_desc,
-               info.header_len, info.msg_len);
+    conn->sending.len = 0;
+    start_send(socket_server, conn);
+}
+
+/**
+ * Handles all io_uring completions.
+ * @param socket_server Socket server
+ * @return Returns LWPB_ERR_OK if successful or LWPB_ERR_CANCEL if the
+ * wakeup eventfd was signalled.
+ */
+static lwpb_err_t handle_completions(struct lwpb_transport_socket_server *socket_server)
+{
+    struct lwpb_uring *uring = &socket_server->uring;
+    struct io_uring_cqe *cqe;
+    struct lwpb_socket_server_conn *conn;
+    lwpb_err_t ret = LWPB_ERR_OK;
+    u64_t user_data;
+    unsigned int flags;
+    int completed = 0;
+    int res;
     
-    if (!info.service_desc) {
-        // TODO unknown service
+    while ((cqe = uring_peek(uring))) {
+        user_data = cqe->user_data;
+        res = cqe->res;
+        flags = cqe->flags;
+        uring_advance(uring);
+        
+        conn = (struct lwpb_socket_server_conn *) (uintptr_t)
+               (user_data & ~(u64_t) URING_TYPE_MASK);
+        switch (user_data & URING_TYPE_MASK) {
+        case URING_ACCEPT:
+            handle_accept(socket_server, res, flags);
+            break;
+        case URING_RECV:
+            handle_recv(socket_server, conn, res, flags);
+            break;
+        case URING_SEND:
+            handle_send(socket_server, conn, res);
+            break;
+        case URING_POOL:
+            if (!(flags & IORING_CQE_F_MORE) &&
+                uring_poll(uring, socket_server->pool.event, 1,
+                           URING_DATA(NULL, URING_POOL)) != 0)
+                LWPB_ERR("Cannot poll worker pool");
+            completed = 1;
+            break;
+        case URING_WAKEUP:
+            // Poll again, so every update sees the wakeup like with epoll
+            if (uring_poll(uring, socket_server->wakeup, 0,
+                           URING_DATA(NULL, URING_WAKEUP)) != 0)
+                LWPB_ERR("Cannot poll wakeup eventfd");
+            ret = LWPB_ERR_CANCEL;
+            break;
+        default:
+            break;
+        }
     }
     
-    if (!info.method_desc) {
-        // TODO unknown method
-    }
+    // Like with epoll, stalled connections are retried after all completions
+    if (completed)
+        handle_completed(socket_server);
     
-    // Allocate response buffer
-    ret = lwpb_transport_alloc_buf(&socket_server->super, &res_buf, &res_len);
-    if (ret != LWPB_ERR_OK) {
-        // TODO handle memory error
+    return ret;
+}
+
+/**
+ * Shuts down the listen socket and waits for the outstanding io_uring
+ * requests of closed connections, which refer to their connection and send
+ * buffer until they complete. Connections accepted in the meantime are
+ * closed right away.
+ * @param socket_server Socket server
+ */
+static void drain_uring(struct lwpb_transport_socket_server *socket_server)
+{
+    int tries;
+    int i;
+    
+    shutdown(socket_server->socket, SHUT_RDWR);
+    
+    for (tries = 0; tries < 100; tries++) {
+        for (i = 0; i < socket_server->conns_size; i++)
+            if (socket_server->conns[i])
+                close_connection(socket_server, socket_server->conns[i]);
+        if (!socket_server->uring_ops)
+            return;
+        if (uring_submit(&socket_server->uring, 10) < 0)
+            break;
+        handle_completions(socket_server);
     }
     
-    ret = socket_server->server->call_handler(
-        socket_server->server, info.method_desc,
-        info.method_desc->req_desc,conn->buf + info.header_len, info.msg_len,
-        info.method_desc->res_desc, res_buf, &res_len,
-        socket_server->server->arg);
+    LWPB_ERR("Closing with %d outstanding io_uring requests",
+             socket_server->uring_ops);
+}
+
+/**
+ * Sets up io_uring for the socket server. Responses are always batched, so
+ * they are sent by io_uring at the end of the update.
+ * @param socket_server Socket server
+ * @return Returns 0 if successful or -1 if io_uring is not available.
+ */
+static int open_uring(struct lwpb_transport_socket_server *socket_server)
+{
+    struct lwpb_uring *uring = &socket_server->uring;
+    
+    if (uring_init(uring, LWPB_URING_ENTRIES) != 0)
+        return -1;
+    
+    if (uring_setup_bufs(uring, LWPB_URING_BUFS, LWPB_URING_BUF_SIZE) != 0 ||
+        start_accept(socket_server) != 0 ||
+        (socket_server->wakeup != -1 &&
+         uring_poll(uring, socket_server->wakeup, 0,
+                    URING_DATA(NULL, URING_WAKEUP)) != 0)) {
+        uring_free(uring);
+        socket_server->uring_ops = 0;
+        return -1;
+    }
     
-    // Send response back to server
-    send_response(conn->socket, info.method_desc, res_buf, res_len);
+    socket_server->options |= LWPB_TRANSPORT_SOCKET_BATCH;
     
-    lwpb_transport_free_buf(&socket_server->super, res_buf);
+    return 0;
 }
 
 /**
@@ -187,11 +1736,13 @@ static void transport_register_client(lwpb_transport_t transport,
  * @param transport Transport implementation
  * @param client Client
  * @param method_desc Method descriptor
+ * @param call Call context
  * @return Returns LWPB_ERR_OK if successful.
  */
 static lwpb_err_t transport_call(lwpb_transport_t transport,
                                  struct lwpb_client *client,
-                                 const struct lwpb_method_desc *method_desc)
+                                 const struct lwpb_method_desc *method_desc,
+                                 struct lwpb_client_call *call)
 {
     struct lwpb_transport_socket_server *socket_server =
         (struct lwpb_transport_socket_server *) transport;
@@ -199,6 +1750,7 @@ static lwpb_err_t transport_call(lwpb_transport_t transport,
     void *req_buf = NULL;
     size_t req_len;
     void *res_buf = NULL;
+    void *res = NULL;
     size_t res_len;
     
     // Allocate a buffer for the request message
@@ -212,35 +1764,33 @@ static lwpb_err_t transport_call(lwpb_transport_t transport,
         goto out;
 
     // Encode the request message
-    ret = client->request_handler(client, method_desc, method_desc->req_desc,
-                                  req_buf, &req_len, client->arg);
+    ret = call->request_handler(client, method_desc, method_desc->req_desc,
+                                req_buf, &req_len, call->arg);
     if (ret != LWPB_ERR_OK)
         goto out;
     
     // We need a registered server to continue
     if (!socket_server->server) {
-        client->done_handler(client, method_desc,
-                             LWPB_RPC_NOT_CONNECTED, client->arg);
+        lwpb_client_call_done(client, method_desc, call, LWPB_RPC_NOT_CONNECTED);
         goto out;
     }
     
     // Process the call on the server
-    ret = socket_server->server->call_handler(socket_server->server, method_desc,
-                                              method_desc->req_desc, req_buf, req_len,
-                                              method_desc->res_desc, res_buf, &res_len,
-                                              socket_server->server->arg);
+    res = res_buf;
+    ret = lwpb_server_handle_call(socket_server->server, method_desc,
+                                  req_buf, req_len, &res, &res_len, NULL);
     if (ret != LWPB_ERR_OK) {
-        client->done_handler(client, method_desc,
-                             LWPB_RPC_FAILED, client->arg);
+        lwpb_client_call_done(client, method_desc, call, LWPB_RPC_FAILED);
         goto out;
     }
     
     // Process the response in the client
-    ret = client->response_handler(client, method_desc,
-                                   method_desc->res_desc, res_buf, res_len,
-                                   client->arg);
+    ret = call->response_handler(client, method_desc,
+                                 method_desc->res_desc, res, res_len,
+                                 call->arg);
+    lwpb_server_free_response(res_buf, res);
     
-    client->done_handler(client, method_desc, LWPB_RPC_OK, client->arg);
+    lwpb_client_call_done(client, method_desc, call, LWPB_RPC_OK);
     
 out:
     // Free allocated message buffers
@@ -253,15 +1803,18 @@ out:
 }
 
 /**
- * This method is called from the client when the current RPC call should
+ * This method is called from the client when an outstanding RPC call should
  * be cancelled.
  * @param transport Transport implementation
  * @param client Client
+ * @param call Call context
  */
 static void transport_cancel(lwpb_transport_t transport,
-                             struct lwpb_client *client)
+                             struct lwpb_client *client,
+                             struct lwpb_client_call *call)
 {
-    // Cancel is not supported in this transport implementation.
+    // Calls are done before transport_call() returns, so there is never an
+    // outstanding call to cancel.
 }
 
 /**
@@ -296,25 +1849,152 @@ static const struct lwpb_transport_funs transport_funs = {
 lwpb_transport_t lwpb_transport_socket_server_init(
         struct lwpb_transport_socket_server *socket_server)
 {
-    int i;
-    
     LWPB_DEBUG("Initializing socket server");
     
     lwpb_transport_init(&socket_server->super, &transport_funs);
     
     socket_server->server = NULL;
     socket_server->socket = -1;
+    socket_server->epoll = -1;
     socket_server->num_conns = 0;
-    for (i = 0; i < LWPB_TRANSPORT_SOCKET_SERVER_CONNS; i++) {
-        struct lwpb_socket_server_conn *conn = &socket_server->conns[i];
-        conn->index = i;
-        conn->socket = -1;
-        conn->buf = NULL;
-    }
+    socket_server->conns = NULL;
+    socket_server->free_slots = NULL;
+    socket_server->num_free_slots = 0;
+    socket_server->conns_size = 0;
+    socket_server->num_workers = 0;
+    socket_server->queue_size = LWPB_TRANSPORT_SOCKET_SERVER_QUEUE;
+    socket_server->pool.threads = NULL;
+    socket_server->stalled = NULL;
+    socket_server->options = LWPB_TRANSPORT_SOCKET_DEFAULT_OPTIONS;
+    socket_server->queued = NULL;
+    socket_server->reuseport = 0;
+    socket_server->wakeup = -1;
+    socket_server->methods = NULL;
+    socket_server->max_frame = LWPB_TRANSPORT_SOCKET_MAX_FRAME;
+    LWPB_MEMSET(&socket_server->limits, 0, sizeof(socket_server->limits));
+    socket_server->inflight = 0;
+    socket_server->paused = NULL;
+    socket_server->streams = NULL;
+    socket_server->rejected = 0;
+    socket_server->pauses = 0;
+    socket_server->expired = 0;
+    socket_server->cancelled = 0;
+    socket_server->uring.fd = -1;
+    socket_server->uring_ops = 0;
+    socket_server->capture = NULL;
+    socket_server->next_serial = 0;
     
     return &socket_server->super;
 }
 
+/**
+ * Sets the socket transport options (LWPB_TRANSPORT_SOCKET_xxx) of the
+ * socket server. With LWPB_TRANSPORT_SOCKET_BATCH, all responses produced in
+ * one update are written with a single syscall per connection at the end of
+ * the update. With LWPB_TRANSPORT_SOCKET_URING, the server runs on io_uring
+ * if the kernel supports it. This method must be called before
+ * lwpb_transport_socket_server_open().
+ * @param transport Transport handle
+ * @param options Socket transport options
+ */
+void lwpb_transport_socket_server_options(lwpb_transport_t transport,
+                                          unsigned int options)
+{
+    struct lwpb_transport_socket_server *socket_server =
+        (struct lwpb_transport_socket_server *) transport;
+    
+    LWPB_ASSERT(socket_server->socket == -1,
+                "Options must be set before opening the server");
+    
+    socket_server->options = options;
+}
+
+/**
+ * Sets the maximum size of a request frame (header and message). Clients
+ * sending larger frames are disconnected. This method must be called before
+ * lwpb_transport_socket_server_open().
+ * @param transport Transport handle
+ * @param max_frame Maximum frame size in bytes
+ */
+void lwpb_transport_socket_server_max_frame(lwpb_transport_t transport,
+                                            size_t max_frame)
+{
+    struct lwpb_transport_socket_server *socket_server =
+        (struct lwpb_transport_socket_server *) transport;
+    
+    LWPB_ASSERT(socket_server->socket == -1,
+                "Maximum frame size must be set before opening the server");
+    
+    socket_server->max_frame = max_frame;
+}
+
+/**
+ * Configures the socket server to run the call handler on a pool of worker
+ * threads, so slow calls do not block the I/O loop. Requests are read and
+ * responses are sent on the thread calling lwpb_transport_socket_server_update(),
+ * while the call handler runs on the workers and must be thread-safe.
+ * Responses are sent in completion order and carry the request ID, so clients
+ * match them to their calls. This method must be called before
+ * lwpb_transport_socket_server_open().
+ * @param transport Transport handle
+ * @param num_workers Number of worker threads (0 to call the handler inline)
+ * @param queue_size Maximum number of queued requests (0 for the default)
+ */
+void lwpb_transport_socket_server_workers(lwpb_transport_t transport,
+                                          int num_workers, size_t queue_size)
+{
+    struct lwpb_transport_socket_server *socket_server =
+        (struct lwpb_transport_socket_server *) transport;
+    
+    LWPB_ASSERT(socket_server->socket == -1,
+                "Workers must be configured before opening the server");
+    
+    socket_server->num_workers = num_workers;
+    socket_server->queue_size = queue_size ? queue_size :
+                                LWPB_TRANSPORT_SOCKET_SERVER_QUEUE;
+}
+
+/**
+ * Sets the admission control limits, which keep latency bounded when the
+ * server is saturated. Requests over a limit either pause reading from the
+ * connection, so TCP backpressure slows down the client, or are answered
+ * right away with LWPB_RPC_OVERLOADED, depending on the policy. Limits are
+ * per shard in a server group. This method must be called before
+ * lwpb_transport_socket_server_open().
+ * @param transport Transport handle
+ * @param limits Admission control limits
+ */
+void lwpb_transport_socket_server_limits(lwpb_transport_t transport,
+                                         const struct lwpb_socket_server_limits *limits)
+{
+    struct lwpb_transport_socket_server *socket_server =
+        (struct lwpb_transport_socket_server *) transport;
+    
+    LWPB_ASSERT(socket_server->socket == -1,
+                "Limits must be set before opening the server");
+    
+    socket_server->limits = *limits;
+}
+
+/**
+ * Starts or stops capturing the frames received by the socket server. Every
+ * frame is recorded as received, with the serial number of its connection
+ * and its arrival time, so lwpb_replay_run() can send the traffic again.
+ * Frames are recorded on the thread calling
+ * lwpb_transport_socket_server_update(), which must also start and stop the
+ * capture. If the capture cannot be written, capturing stops.
+ * @param transport Transport handle
+ * @param capture Capture created with lwpb_capture_create() or NULL to stop
+ */
+void lwpb_transport_socket_server_capture(lwpb_transport_t transport,
+                                          struct lwpb_capture *capture)
+{
+    struct lwpb_transport_socket_server *socket_server =
+        (struct lwpb_transport_socket_server *) transport;
+    
+    socket_server->capture = capture;
+}
+
 /**
  * Opens the socket server for communication.
  * @param transport Transport handle
@@ -334,6 +2014,7 @@ lwpb_err_t lwpb_transport_socket_server_open(lwpb_transport_t transport,
     struct sockaddr_in *addr;
     char tmp[16];
     int yes = 1;
+    struct epoll_event event;
     
     if (socket_server->socket != -1) {
         LWPB_INFO("Socket server already opened");
@@ -349,8 +2030,7 @@ lwpb_err_t lwpb_transport_socket_server_open(lwpb_transport_t transport,
     snprintf(tmp, sizeof(tmp), "%d", port);
     if ((status = getaddrinfo(host, tmp, &hints, &res)) != 0) {
         LWPB_ERR("getaddrinfo error: %s\n", gai_strerror(status));
-        ret = LWPB_ERR_NET_INIT;
-        goto out;
+        return LWPB_ERR_NET_INIT;
     }
     addr = (struct sockaddr_in *) res->ai_addr;
     inet_ntop(res->ai_family, &addr->sin_addr, tmp, sizeof(tmp));
@@ -371,8 +2051,13 @@ lwpb_err_t lwpb_transport_socket_server_open(lwpb_transport_t transport,
         goto out;
     }
     
-    // Make non-blocking
-    make_nonblock(socket_server->socket);
+    // Share the port with other shards of a server group
+    if (socket_server->reuseport &&
+        setsockopt(socket_server->socket, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == -1) {
+        LWPB_ERR("Cannot set SO_REUSEPORT (error: %d)", errno);
+        ret = LWPB_ERR_NET_INIT;
+        goto out;
+    }
     
     // Bind listen socket
     LWPB_DEBUG("Binding server socket to %s:%d", tmp, port);
@@ -384,16 +2069,90 @@ lwpb_err_t lwpb_transport_socket_server_open(lwpb_transport_t transport,
 
     // Start listening
     LWPB_DEBUG("Start listening on server socket");
-    if (listen(socket_server->socket, LWPB_TRANSPORT_SOCKET_SERVER_CONNS) == -1) {
+    if (listen(socket_server->socket, SOMAXCONN) == -1) {
         LWPB_ERR("Cannot listen on server socket (errno: %d)", errno);
-        close(socket_server->socket);
         ret = LWPB_ERR_NET_INIT;
         goto out;
     }
     
+    // Use io_uring if requested, which accepts on the blocking listen socket
+    if ((socket_server->options & LWPB_TRANSPORT_SOCKET_URING) &&
+        open_uring(socket_server) != 0)
+        LWPB_INFO("Cannot set up io_uring (errno: %d), using epoll", errno);
+    if (socket_server->uring.fd != -1)
+        goto workers;
+    
+    // Make non-blocking
+    make_nonblock(socket_server->socket);
+    
+    // Create epoll instance and register listen socket
+    socket_server->epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (socket_server->epoll == -1) {
+        LWPB_ERR("Cannot create epoll instance (errno: %d)", errno);
+        ret = LWPB_ERR_NET_INIT;
+        goto out;
+    }
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = NULL;
+    if (epoll_ctl(socket_server->epoll, EPOLL_CTL_ADD, socket_server->socket, &event) == -1) {
+        LWPB_ERR("Cannot add server socket to epoll (errno: %d)", errno);
+        ret = LWPB_ERR_NET_INIT;
+        goto out;
+    }
+    
+    // Register wakeup eventfd, which is never read, so it stays readable
+    if (socket_server->wakeup != -1) {
+        event.events = EPOLLIN;
+        event.data.ptr = &socket_server->wakeup;
+        if (epoll_ctl(socket_server->epoll, EPOLL_CTL_ADD,
+                      socket_server->wakeup, &event) == -1) {
+            LWPB_ERR("Cannot add wakeup eventfd to epoll (errno: %d)", errno);
+            ret = LWPB_ERR_NET_INIT;
+            goto out;
+        }
+    }
+    
+workers:
+    // Start worker pool and register its completion eventfd
+    if (socket_server->num_workers > 0) {
+        ret = lwpb_worker_pool_init(&socket_server->pool,
+                                    socket_server->num_workers,
+                                    socket_server->queue_size);
+        if (ret != LWPB_ERR_OK)
+            goto out;
+        if (socket_server->uring.fd != -1) {
+            if (uring_poll(&socket_server->uring, socket_server->pool.event, 1,
+                           URING_DATA(NULL, URING_POOL)) != 0) {
+                LWPB_ERR("Cannot poll worker pool");
+                ret = LWPB_ERR_NET_INIT;
+            }
+            goto out;
+        }
+        event.events = EPOLLIN;
+        event.data.ptr = &socket_server->pool;
+        if (epoll_ctl(socket_server->epoll, EPOLL_CTL_ADD,
+                      socket_server->pool.event, &event) == -1) {
+            LWPB_ERR("Cannot add worker pool to epoll (errno: %d)", errno);
+            ret = LWPB_ERR_NET_INIT;
+            goto out;
+        }
+    }
+    
 out:
     freeaddrinfo(res);
     
+    if (ret != LWPB_ERR_OK) {
+        lwpb_worker_pool_destroy(&socket_server->pool);
+        uring_free(&socket_server->uring);
+        socket_server->uring_ops = 0;
+        if (socket_server->epoll != -1)
+            close(socket_server->epoll);
+        if (socket_server->socket != -1)
+            close(socket_server->socket);
+        socket_server->epoll = -1;
+        socket_server->socket = -1;
+    }
+    
     return ret;
 }
 
@@ -405,70 +2164,410 @@ void lwpb_transport_socket_server_close(lwpb_transport_t transport)
 {
     struct lwpb_transport_socket_server *socket_server =
         (struct lwpb_transport_socket_server *) transport;
+    struct lwpb_worker_job *job;
+    struct lwpb_worker_job *next;
+    struct lwpb_socket_server_conn *conn;
+    struct socket_server_job *stream;
     int i;
     
     if (socket_server->socket == -1)
         return;
     
     // Close active connections
-    for (i = 0; i < LWPB_TRANSPORT_SOCKET_SERVER_CONNS; i++) {
-        struct lwpb_socket_server_conn *conn = &socket_server->conns[i];
-        if (conn->socket != -1)
-            close_connection(socket_server, conn);
+    for (i = 0; i < socket_server->conns_size; i++)
+        if (socket_server->conns[i])
+            close_connection(socket_server, socket_server->conns[i]);
+    if (socket_server->uring.fd != -1)
+        drain_uring(socket_server);
+    
+    // Wait for running jobs and release them along with stalled connections
+    for (job = lwpb_worker_pool_destroy(&socket_server->pool); job; job = next) {
+        next = job->next;
+        complete_job(socket_server, (struct socket_server_job *) job);
     }
-        
+    
+    // End suspended streams, which are all cancelled by now
+    while ((stream = socket_server->streams)) {
+        socket_server->streams = stream->next_stream;
+        run_stream(socket_server, stream);
+    }
+    while ((conn = socket_server->stalled)) {
+        socket_server->stalled = conn->next_stalled;
+        conn->stalled = 0;
+        release_connection(conn);
+    }
+    while ((conn = socket_server->paused)) {
+        socket_server->paused = conn->next_paused;
+        conn->paused = 0;
+        release_connection(conn);
+    }
+    while ((conn = socket_server->queued)) {
+        socket_server->queued = conn->next_queued;
+        conn->queued = 0;
+        release_connection(conn);
+    }
+    
+    LWPB_FREE(socket_server->conns);
+    LWPB_FREE(socket_server->free_slots);
+    socket_server->conns = NULL;
+    socket_server->free_slots = NULL;
+    socket_server->num_free_slots = 0;
+    socket_server->conns_size = 0;
+    
+    method_table_free(socket_server->methods);
+    socket_server->methods = NULL;
+    
     // Close listen socket
+    if (socket_server->uring.fd != -1)
+        uring_free(&socket_server->uring);
+    socket_server->uring_ops = 0;
+    if (socket_server->epoll != -1)
+        close(socket_server->epoll);
     close(socket_server->socket);
-    socket_server->socket == -1;
+    socket_server->epoll = -1;
+    socket_server->socket = -1;
+}
+
+/**
+ * Returns the port the socket server is listening on. This is useful when
+ * the server was opened on port 0.
+ * @param transport Transport handle
+ * @return Returns the listen port or 0 if the server is not open.
+ */
+u16_t lwpb_transport_socket_server_port(lwpb_transport_t transport)
+{
+    struct lwpb_transport_socket_server *socket_server =
+        (struct lwpb_transport_socket_server *) transport;
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    
+    if (socket_server->socket == -1)
+        return 0;
+    if (getsockname(socket_server->socket, (struct sockaddr *) &addr, &len) == -1)
+        return 0;
+    
+    return ntohs(addr.sin_port);
+}
+
+/**
+ * Waits for socket events and handles the sockets which are ready. With
+ * io_uring, the requests queued by the last update are submitted with the
+ * same system call that waits for completions.
+ * @param socket_server Socket server
+ * @param timeout Maximum time to wait (ms), 0 to return right away
+ * @return Returns LWPB_ERR_OK if successful or LWPB_ERR_CANCEL if the
+ * wakeup eventfd was signalled.
+ */
+static lwpb_err_t handle_events(struct lwpb_transport_socket_server *socket_server,
+                                int timeout)
+{
+    struct epoll_event events[LWPB_TRANSPORT_SOCKET_SERVER_EVENTS];
+    struct lwpb_socket_server_conn *conn;
+    int completed = 0;
+    int i, n;
+    
+    if (socket_server->uring.fd != -1) {
+        if (uring_submit(&socket_server->uring, timeout) < 0)
+            LWPB_FAIL("io_uring_enter() failed");
+        if (handle_completions(socket_server) == LWPB_ERR_CANCEL)
+            return LWPB_ERR_CANCEL;
+        goto out;
+    }
+    
+    // Wait for sockets to get ready
+    n = epoll_wait(socket_server->epoll, events,
+                   LWPB_TRANSPORT_SOCKET_SERVER_EVENTS, timeout);
+    if (n < 0) {
+        if (errno == EINTR)
+            return LWPB_ERR_OK;
+        LWPB_FAIL("epoll_wait() failed");
+    }
+    
+    // Completed jobs are handled after the other events, retrying stalled
+    // connections may close and free connections which have events left in
+    // this batch
+    for (i = 0; i < n; i++) {
+        conn = events[i].data.ptr;
+        if (events[i].data.ptr == &socket_server->wakeup) {
+            if (completed)
+                handle_completed(socket_server);
+            return LWPB_ERR_CANCEL;
+        }
+        if (!events[i].data.ptr) {
+            handle_new_connection(socket_server);
+        } else if (events[i].data.ptr == &socket_server->pool) {
+            completed = 1;
+        } else {
+            // Send queued responses when the socket becomes writable
+            if ((events[i].events & EPOLLOUT) && conn->outq.len &&
+                flush_connection(socket_server, conn) != LWPB_ERR_OK)
+                continue;
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                handle_connection(socket_server, conn);
+        }
+    }
+    if (completed)
+        handle_completed(socket_server);
+    
+out:
+    // Resume paused connections and streams before their responses are written
+    resume_paused(socket_server);
+    resume_streams(socket_server);
+    
+    // Write batched responses
+    flush_queued(socket_server);
+    
+    return LWPB_ERR_OK;
 }
 
 /**
  * Updates the socket server. This method needs to be called periodically.
+ * It waits up to one second for socket events and only handles the sockets
+ * which are ready.
  * @param transport Transport handle
+ * @return Returns LWPB_ERR_OK if successful or LWPB_ERR_CANCEL if the
+ * wakeup eventfd was signalled.
  */
 lwpb_err_t lwpb_transport_socket_server_update(lwpb_transport_t transport)
 {
     struct lwpb_transport_socket_server *socket_server =
         (struct lwpb_transport_socket_server *) transport;
-    int i;
-    int socket;
-    struct timeval timeout;
-    fd_set read_fds;
-    int high;
     
     if (socket_server->socket == -1)
-        return;
+        return LWPB_ERR_OK;
     
-    timeout.tv_sec = 1;
-    timeout.tv_usec = 0;
-    
-    // Create set of active sockets
-    high = socket_server->socket;
-    FD_ZERO(&read_fds);
-    FD_SET(socket_server->socket, &read_fds);
-    for (i = 0; i < LWPB_TRANSPORT_SOCKET_SERVER_CONNS; i++)
-        if (socket_server->conns[i].socket != -1) {
-            FD_SET(socket_server->conns[i].socket, &read_fds);
-            high = socket_server->conns[i].socket;
-        }
+    return handle_events(socket_server, paused_timeout(socket_server, 1000));
+}
+
+/**
+ * Returns the descriptor to watch when the server is driven by an external
+ * event loop instead of lwpb_transport_socket_server_update(). This is the
+ * epoll (or io_uring) instance holding all sockets of the server, so it
+ * becomes readable whenever the server has work to do. The descriptor stays
+ * the same until the server is closed.
+ * @param transport Transport handle
+ * @param events Returns the events to wait for
+ * (LWPB_TRANSPORT_SOCKET_READABLE)
+ * @return Returns the descriptor or -1 if the server is not open.
+ */
+int lwpb_transport_socket_server_fd(lwpb_transport_t transport,
+                                    unsigned int *events)
+{
+    struct lwpb_transport_socket_server *socket_server =
+        (struct lwpb_transport_socket_server *) transport;
+    
+    *events = LWPB_TRANSPORT_SOCKET_READABLE;
+    if (socket_server->socket == -1)
+        return -1;
+    
+    return socket_server->uring.fd != -1 ? socket_server->uring.fd :
+           socket_server->epoll;
+}
+
+/**
+ * Returns when an external event loop has to call
+ * lwpb_transport_socket_server_process() even if the descriptor does not
+ * get ready, so paused connections and suspended streams are resumed in
+ * time. Needs to be asked again after each call of
+ * lwpb_transport_socket_server_process().
+ * @param transport Transport handle
+ * @return Returns the time until the next deadline (ms), 0 if the server
+ * needs to be processed right away or -1 if there is no deadline.
+ */
+int lwpb_transport_socket_server_timeout(lwpb_transport_t transport)
+{
+    struct lwpb_transport_socket_server *socket_server =
+        (struct lwpb_transport_socket_server *) transport;
+    
+    if (socket_server->socket == -1)
+        return -1;
+    
+    return paused_timeout(socket_server, -1);
+}
+
+/**
+ * Handles the sockets which are ready without blocking. This is called by
+ * an external event loop when the descriptor returned by
+ * lwpb_transport_socket_server_fd() is ready or the timeout returned by
+ * lwpb_transport_socket_server_timeout() has passed. With io_uring, the
+ * requests queued while processing are submitted before returning, so their
+ * completions make the descriptor ready.
+ * @param transport Transport handle
+ * @param events Events the descriptor is ready for (unused, the ready
+ * sockets are taken from the epoll or io_uring instance)
+ * @return Returns LWPB_ERR_OK if successful or LWPB_ERR_CANCEL if the
+ * wakeup eventfd was signalled.
+ */
+lwpb_err_t lwpb_transport_socket_server_process(lwpb_transport_t transport,
+                                                unsigned int events)
+{
+    struct lwpb_transport_socket_server *socket_server =
+        (struct lwpb_transport_socket_server *) transport;
+    lwpb_err_t ret;
     
-    // Wait for a socket to get active
-    i = select(high + 1, &read_fds, NULL, NULL, &timeout);
-    if (i < 0)
-        LWPB_FAIL("select() failed");
-    if (i == 0)
+    if (socket_server->socket == -1)
         return LWPB_ERR_OK;
     
-    // Accept new connections
-    if (FD_ISSET(socket_server->socket, &read_fds))
-        handle_new_connection(socket_server);
+    ret = handle_events(socket_server, 0);
+    if (ret == LWPB_ERR_OK && socket_server->uring.fd != -1 &&
+        uring_submit(&socket_server->uring, 0) < 0)
+        LWPB_FAIL("io_uring_enter() failed");
     
-    // Handle active connections
-    for (i = 0; i < LWPB_TRANSPORT_SOCKET_SERVER_CONNS; i++) {
-        struct lwpb_socket_server_conn *conn = &socket_server->conns[i];
-        if (conn->socket != -1 && FD_ISSET(conn->socket, &read_fds))
-            handle_connection(socket_server, conn);
+    return ret;
+}
+
+/**
+ * Reactor thread of a server group shard. Updates the shard until the group
+ * is closed.
+ * @param arg Shard transport
+ */
+static void *reactor_main(void *arg)
+{
+    while (lwpb_transport_socket_server_update(arg) != LWPB_ERR_CANCEL)
+        ;
+    
+    return NULL;
+}
+
+/**
+ * Initializes a socket server group. Each shard gets its own server, all
+ * sharing the same service list, call handler and user argument. Shards can
+ * be configured (worker pool, allocator) with lwpb_socket_server_group_shard()
+ * before opening the group.
+ * @param group Server group
+ * @param num_shards Number of shards (reactor threads)
+ * @param service_list Null-terminated list of supported services
+ * @param call_handler Call handler (must be thread-safe)
+ * @param arg User argument
+ * @return Returns LWPB_ERR_OK if successful or LWPB_ERR_MEM if memory could
+ * not be allocated.
+ */
+lwpb_err_t lwpb_socket_server_group_init(struct lwpb_socket_server_group *group,
+                                         int num_shards,
+                                         const struct lwpb_service_desc **service_list,
+                                         lwpb_server_call_handler_t call_handler,
+                                         void *arg)
+{
+    lwpb_transport_t transport;
+    int i;
+    
+    LWPB_ASSERT(num_shards > 0, "Server group needs at least one shard");
+    
+    group->shards = LWPB_MALLOC(num_shards * sizeof(*group->shards));
+    group->servers = LWPB_MALLOC(num_shards * sizeof(*group->servers));
+    group->threads = LWPB_MALLOC(num_shards * sizeof(*group->threads));
+    if (!group->shards || !group->servers || !group->threads) {
+        LWPB_FREE(group->shards);
+        LWPB_FREE(group->servers);
+        LWPB_FREE(group->threads);
+        return LWPB_ERR_MEM;
+    }
+    group->num_shards = num_shards;
+    group->num_threads = 0;
+    group->wakeup = -1;
+    
+    for (i = 0; i < num_shards; i++) {
+        transport = lwpb_transport_socket_server_init(&group->shards[i]);
+        group->shards[i].reuseport = 1;
+        lwpb_server_init(&group->servers[i], service_list, transport);
+        lwpb_server_handler(&group->servers[i], call_handler);
+        lwpb_server_arg(&group->servers[i], arg);
+    }
+    
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Returns the transport of a server group shard.
+ * @param group Server group
+ * @param index Shard index
+ * @return Returns the transport handle.
+ */
+lwpb_transport_t lwpb_socket_server_group_shard(struct lwpb_socket_server_group *group,
+                                                int index)
+{
+    LWPB_ASSERT(index >= 0 && index < group->num_shards, "Invalid shard index");
+    
+    return &group->shards[index].super;
+}
+
+/**
+ * Opens all shards of a server group on the same port and starts their
+ * reactor threads. If port is 0, the port chosen for the first shard is
+ * used for all other shards. If opening fails, the group is closed.
+ * @param group Server group
+ * @param host Hostname or IP address (using local address if NULL)
+ * @param port Port number for listen port
+ * @return Returns LWPB_ERR_OK if successful.
+ */
+lwpb_err_t lwpb_socket_server_group_open(struct lwpb_socket_server_group *group,
+                                         const char *host, u16_t port)
+{
+    lwpb_err_t ret;
+    int i;
+    
+    group->wakeup = eventfd(0, EFD_CLOEXEC);
+    if (group->wakeup == -1) {
+        LWPB_ERR("Cannot create eventfd (errno: %d)", errno);
+        return LWPB_ERR_NET_INIT;
+    }
+    
+    for (i = 0; i < group->num_shards; i++) {
+        group->shards[i].wakeup = group->wakeup;
+        ret = lwpb_transport_socket_server_open(&group->shards[i].super, host, port);
+        if (ret != LWPB_ERR_OK)
+            goto err;
+        if (port == 0)
+            port = lwpb_transport_socket_server_port(&group->shards[i].super);
+    }
+    
+    for (i = 0; i < group->num_shards; i++) {
+        if (pthread_create(&group->threads[i], NULL, reactor_main,
+                           &group->shards[i].super) != 0) {
+            LWPB_ERR("Cannot create reactor thread");
+            ret = LWPB_ERR_NET_INIT;
+            goto err;
+        }
+        group->num_threads++;
     }
     
     return LWPB_ERR_OK;
+    
+err:
+    lwpb_socket_server_group_close(group);
+    return ret;
+}
+
+/**
+ * Stops the reactor threads, closes all shards and frees the server group.
+ * @param group Server group
+ */
+void lwpb_socket_server_group_close(struct lwpb_socket_server_group *group)
+{
+    u64_t one = 1;
+    int i;
+    
+    // Wake up all reactors
+    if (group->wakeup != -1 &&
+        write(group->wakeup, &one, sizeof(one)) != sizeof(one))
+        LWPB_ERR("Cannot wake up reactor threads (errno: %d)", errno);
+    
+    for (i = 0; i < group->num_threads; i++)
+        pthread_join(group->threads[i], NULL);
+    group->num_threads = 0;
+    
+    for (i = 0; i < group->num_shards; i++)
+        lwpb_transport_socket_server_close(&group->shards[i].super);
+    
+    if (group->wakeup != -1)
+        close(group->wakeup);
+    group->wakeup = -1;
+    
+    LWPB_FREE(group->shards);
+    LWPB_FREE(group->servers);
+    LWPB_FREE(group->threads);
+    group->shards = NULL;
+    group->servers = NULL;
+    group->threads = NULL;
+    group->num_shards = 0;
 }
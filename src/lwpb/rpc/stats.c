@@ -0,0 +1,410 @@
+/** @file stats.c
+ * 
+ * Per-method RPC server statistics.
+ * 
+ * Copyright 2009 Simon Kallweit
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <time.h>
+
+#include <lwpb/lwpb.h>
+#include <lwpb/rpc/stats.h>
+
+
+// Counters have a single writer, so relaxed loads and stores are enough
+// for snapshots taken on other threads to see whole values
+#define STAT_LOAD(_var_) __atomic_load_n(&(_var_), __ATOMIC_RELAXED)
+#define STAT_STORE(_var_, _value_) \
+    __atomic_store_n(&(_var_), (_value_), __ATOMIC_RELAXED)
+#define STAT_ADD(_var_, _value_) STAT_STORE(_var_, (_var_) + (_value_))
+
+/**
+ * Returns the histogram bucket of a value.
+ * @param value Value
+ * @return Returns the bucket index.
+ */
+static int bucket_index(u64_t value)
+{
+    int bits;
+
+    if (value < LWPB_STATS_SUB_BUCKETS)
+        return (int) value;
+
+    bits = 63 - __builtin_clzll(value);
+    if (bits >= LWPB_STATS_MAX_BITS)
+        return LWPB_STATS_BUCKETS - 1;
+
+    return (bits - LWPB_STATS_SUB_BITS + 1) * LWPB_STATS_SUB_BUCKETS +
+           (int) (value >> (bits - LWPB_STATS_SUB_BITS)) - LWPB_STATS_SUB_BUCKETS;
+}
+
+/**
+ * Returns the highest value which falls into a histogram bucket.
+ * @param index Bucket index
+ * @return Returns the highest value of the bucket.
+ */
+static u64_t bucket_max(int index)
+{
+    int shift;
+
+    if (index < LWPB_STATS_SUB_BUCKETS)
+        return index;
+
+    shift = index / LWPB_STATS_SUB_BUCKETS - 1;
+    return (((u64_t) (index % LWPB_STATS_SUB_BUCKETS + LWPB_STATS_SUB_BUCKETS + 1))
+            << shift) - 1;
+}
+
+/**
+ * Records a value in a histogram owned by the calling thread.
+ * @param histogram Histogram
+ * @param value Value
+ */
+static void histogram_add(struct lwpb_histogram *histogram, u64_t value)
+{
+    STAT_ADD(histogram->count, 1);
+    STAT_ADD(histogram->sum, value);
+    if (value > histogram->max)
+        STAT_STORE(histogram->max, value);
+    STAT_ADD(histogram->buckets[bucket_index(value)], 1);
+}
+
+/**
+ * Adds a histogram which may still be recorded to into another one.
+ * @param dst Destination histogram
+ * @param src Source histogram
+ */
+static void histogram_load(struct lwpb_histogram *dst,
+                           const struct lwpb_histogram *src)
+{
+    u64_t max;
+    int i;
+
+    dst->count += STAT_LOAD(src->count);
+    dst->sum += STAT_LOAD(src->sum);
+    max = STAT_LOAD(src->max);
+    if (max > dst->max)
+        dst->max = max;
+    for (i = 0; i < LWPB_STATS_BUCKETS; i++)
+        dst->buckets[i] += STAT_LOAD(src->buckets[i]);
+}
+
+/**
+ * Returns the shard of the calling thread, creating it on first use.
+ * @param stats Statistics
+ * @return Returns the shard or NULL if it cannot be allocated.
+ */
+static struct lwpb_stats_shard *get_shard(struct lwpb_stats *stats)
+{
+    struct lwpb_stats_shard *shard;
+    size_t size;
+
+    shard = pthread_getspecific(stats->key);
+    if (shard)
+        return shard;
+
+    size = sizeof(*shard) + stats->num_methods * sizeof(struct lwpb_method_stats);
+    shard = LWPB_MALLOC(size);
+    if (!shard)
+        return NULL;
+    LWPB_MEMSET(shard, 0, size);
+
+    pthread_mutex_lock(&stats->lock);
+    shard->next = stats->shards;
+    stats->shards = shard;
+    pthread_mutex_unlock(&stats->lock);
+
+    pthread_setspecific(stats->key, shard);
+
+    return shard;
+}
+
+/**
+ * Returns the statistics of a method in the shard of the calling thread.
+ * @param stats Statistics
+ * @param method_desc Method descriptor
+ * @return Returns the method statistics or NULL if the method is unknown.
+ */
+static struct lwpb_method_stats *get_method(struct lwpb_stats *stats,
+                                            const struct lwpb_method_desc *method_desc)
+{
+    struct lwpb_stats_shard *shard;
+    int index;
+
+    index = lwpb_stats_method_index(stats, method_desc);
+    if (index < 0)
+        return NULL;
+
+    shard = get_shard(stats);
+    if (!shard)
+        return NULL;
+
+    return &shard->methods[index];
+}
+
+/**
+ * Initializes the statistics for the methods of a service list.
+ * @param stats Statistics
+ * @param service_list Null-terminated list of services
+ * @return Returns LWPB_ERR_OK if successful or LWPB_ERR_MEM if out of memory.
+ */
+lwpb_err_t lwpb_stats_init(struct lwpb_stats *stats,
+                           const struct lwpb_service_desc **service_list)
+{
+    int i;
+
+    stats->service_list = service_list;
+    stats->num_services = 0;
+    stats->num_methods = 0;
+    stats->shards = NULL;
+
+    while (service_list[stats->num_services])
+        stats->num_services++;
+
+    stats->method_base = LWPB_MALLOC((stats->num_services + 1) * sizeof(int));
+    if (!stats->method_base)
+        return LWPB_ERR_MEM;
+
+    for (i = 0; i < stats->num_services; i++) {
+        stats->method_base[i] = stats->num_methods;
+        stats->num_methods += service_list[i]->num_methods;
+    }
+
+    if (pthread_key_create(&stats->key, NULL) != 0) {
+        LWPB_FREE(stats->method_base);
+        return LWPB_ERR_MEM;
+    }
+    pthread_mutex_init(&stats->lock, NULL);
+
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Frees the statistics. No thread may record calls anymore.
+ * @param stats Statistics
+ */
+void lwpb_stats_destroy(struct lwpb_stats *stats)
+{
+    struct lwpb_stats_shard *shard;
+
+    while (stats->shards) {
+        shard = stats->shards;
+        stats->shards = shard->next;
+        LWPB_FREE(shard);
+    }
+
+    pthread_key_delete(stats->key);
+    pthread_mutex_destroy(&stats->lock);
+    LWPB_FREE(stats->method_base);
+}
+
+/**
+ * Returns the current monotonic time in nanoseconds, which is the time base
+ * of all recorded latencies.
+ */
+u64_t lwpb_stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Returns the index of a method in the statistics.
+ * @param stats Statistics
+ * @param method_desc Method descriptor
+ * @return Returns the method index or -1 if the method is not part of the
+ * service list.
+ */
+int lwpb_stats_method_index(struct lwpb_stats *stats,
+                            const struct lwpb_method_desc *method_desc)
+{
+    const struct lwpb_service_desc *service_desc = method_desc->service;
+    int i;
+
+    for (i = 0; i < stats->num_services; i++)
+        if (stats->service_list[i] == service_desc)
+            return stats->method_base[i] + (int) (method_desc - service_desc->methods);
+
+    return -1;
+}
+
+/**
+ * Records a handled call.
+ * @param stats Statistics
+ * @param method_desc Method descriptor
+ * @param failed Set if the call handler failed
+ * @param req_len Length of the request message
+ * @param res_len Length of the response message
+ * @param queue_time Time the call was queued before the handler ran (ns)
+ * @param handler_time Time spent in the call handler (ns)
+ */
+void lwpb_stats_record_call(struct lwpb_stats *stats,
+                            const struct lwpb_method_desc *method_desc,
+                            int failed, size_t req_len, size_t res_len,
+                            u64_t queue_time, u64_t handler_time)
+{
+    struct lwpb_method_stats *method;
+
+    method = get_method(stats, method_desc);
+    if (!method)
+        return;
+
+    STAT_ADD(method->calls, 1);
+    if (failed)
+        STAT_ADD(method->errors, 1);
+    STAT_ADD(method->req_bytes, req_len);
+    STAT_ADD(method->res_bytes, res_len);
+    histogram_add(&method->queue, queue_time);
+    histogram_add(&method->handler, handler_time);
+}
+
+/**
+ * Records the time it took to send a response.
+ * @param stats Statistics
+ * @param method_desc Method descriptor
+ * @param send_time Time spent sending the response (ns)
+ */
+void lwpb_stats_record_send(struct lwpb_stats *stats,
+                            const struct lwpb_method_desc *method_desc,
+                            u64_t send_time)
+{
+    struct lwpb_method_stats *method;
+
+    method = get_method(stats, method_desc);
+    if (!method)
+        return;
+
+    histogram_add(&method->send, send_time);
+}
+
+/**
+ * Takes a snapshot of the statistics of all methods. Recording can go on
+ * while the snapshot is taken, so a call may be counted while some of its
+ * latencies are not yet.
+ * @param stats Statistics
+ * @param methods Returns the statistics of all methods, must hold
+ * stats->num_methods entries
+ */
+void lwpb_stats_snapshot(struct lwpb_stats *stats,
+                         struct lwpb_method_stats *methods)
+{
+    struct lwpb_stats_shard *shard;
+    struct lwpb_method_stats *src;
+    int i;
+
+    LWPB_MEMSET(methods, 0, stats->num_methods * sizeof(struct lwpb_method_stats));
+
+    pthread_mutex_lock(&stats->lock);
+    for (shard = stats->shards; shard; shard = shard->next) {
+        for (i = 0; i < stats->num_methods; i++) {
+            src = &shard->methods[i];
+            methods[i].calls += STAT_LOAD(src->calls);
+            methods[i].errors += STAT_LOAD(src->errors);
+            methods[i].req_bytes += STAT_LOAD(src->req_bytes);
+            methods[i].res_bytes += STAT_LOAD(src->res_bytes);
+            histogram_load(&methods[i].queue, &src->queue);
+            histogram_load(&methods[i].handler, &src->handler);
+            histogram_load(&methods[i].send, &src->send);
+        }
+    }
+    pthread_mutex_unlock(&stats->lock);
+}
+
+/**
+ * Merges snapshots, e.g. of several servers with the same service list.
+ * @param dst Destination snapshot
+ * @param src Source snapshot
+ * @param num_methods Number of methods in the snapshots
+ */
+void lwpb_stats_merge(struct lwpb_method_stats *dst,
+                      const struct lwpb_method_stats *src, int num_methods)
+{
+    int i;
+
+    for (i = 0; i < num_methods; i++) {
+        dst[i].calls += src[i].calls;
+        dst[i].errors += src[i].errors;
+        dst[i].req_bytes += src[i].req_bytes;
+        dst[i].res_bytes += src[i].res_bytes;
+        lwpb_histogram_merge(&dst[i].queue, &src[i].queue);
+        lwpb_histogram_merge(&dst[i].handler, &src[i].handler);
+        lwpb_histogram_merge(&dst[i].send, &src[i].send);
+    }
+}
+
+/**
+ * Records a value in a histogram.
+ * @param histogram Histogram
+ * @param value Value
+ */
+void lwpb_histogram_record(struct lwpb_histogram *histogram, u64_t value)
+{
+    histogram_add(histogram, value);
+}
+
+/**
+ * Adds the values of a histogram to another one.
+ * @param dst Destination histogram
+ * @param src Source histogram
+ */
+void lwpb_histogram_merge(struct lwpb_histogram *dst,
+                          const struct lwpb_histogram *src)
+{
+    int i;
+
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->max > dst->max)
+        dst->max = src->max;
+    for (i = 0; i < LWPB_STATS_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+}
+
+/**
+ * Returns a percentile of a histogram. The result is the highest value of
+ * the bucket holding the percentile, but never more than the maximum.
+ * @param histogram Histogram
+ * @param percentile Percentile (0-100)
+ * @return Returns the value at the percentile or 0 if the histogram is empty.
+ */
+u64_t lwpb_histogram_percentile(const struct lwpb_histogram *histogram,
+                                double percentile)
+{
+    u64_t rank;
+    u64_t seen = 0;
+    u64_t value;
+    int i;
+
+    if (histogram->count == 0)
+        return 0;
+
+    rank = (u64_t) (percentile / 100.0 * histogram->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    if (rank > histogram->count)
+        rank = histogram->count;
+
+    for (i = 0; i < LWPB_STATS_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank)
+            break;
+    }
+
+    value = i < LWPB_STATS_BUCKETS ? bucket_max(i) : histogram->max;
+
+    return value < histogram->max ? value : histogram->max;
+}
@@ -0,0 +1,446 @@
+/** @file uring_helper.c
+ * 
+ * Helper functions for running the socket transports on io_uring. The
+ * rings are set up with the raw system calls, so no library is needed.
+ * 
+ * Copyright 2009 Simon Kallweit
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <lwpb/lwpb.h>
+
+#include "uring_helper.h"
+
+
+/** Features the transports rely on (Linux 5.11) */
+#define URING_FEATURES (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | \
+                        IORING_FEAT_EXT_ARG)
+
+/**
+ * Sets up an io_uring instance and maps its rings. The completion ring is
+ * four times the size of the submission ring, as multishot requests post
+ * many completions each.
+ * @param uring io_uring instance
+ * @param entries Number of submission queue entries
+ * @return Returns 0 if successful or -1 if io_uring is not available.
+ */
+int uring_init(struct lwpb_uring *uring, unsigned int entries)
+{
+    struct io_uring_params params;
+    u8_t *ring;
+    size_t sq_size;
+    size_t cq_size;
+    unsigned int i;
+
+    uring->ring_mem = NULL;
+    uring->sqe_mem = NULL;
+    uring->buf_ring = NULL;
+    uring->buf_data = NULL;
+
+    LWPB_MEMSET(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+                   IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = entries * 4;
+    uring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (uring->fd < 0 && errno == EINVAL) {
+        // Kernels before 5.19 don't know all setup flags
+        LWPB_MEMSET(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 4;
+        uring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if (uring->fd < 0) {
+        uring->fd = -1;
+        return -1;
+    }
+    if ((params.features & URING_FEATURES) != URING_FEATURES) {
+        errno = ENOSYS;
+        goto err;
+    }
+
+    // Both rings share a single mapping
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    uring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    uring->ring_mem = mmap(NULL, uring->ring_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+    if (uring->ring_mem == MAP_FAILED) {
+        uring->ring_mem = NULL;
+        goto err;
+    }
+    uring->sqe_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqe_mem = mmap(NULL, uring->sqe_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+    if (uring->sqe_mem == MAP_FAILED) {
+        uring->sqe_mem = NULL;
+        goto err;
+    }
+
+    ring = uring->ring_mem;
+    uring->sq_head = (unsigned int *) (ring + params.sq_off.head);
+    uring->sq_tail = (unsigned int *) (ring + params.sq_off.tail);
+    uring->sq_array = (unsigned int *) (ring + params.sq_off.array);
+    uring->sq_mask = *(unsigned int *) (ring + params.sq_off.ring_mask);
+    uring->sq_entries = params.sq_entries;
+    uring->sqes = uring->sqe_mem;
+    uring->cq_head = (unsigned int *) (ring + params.cq_off.head);
+    uring->cq_tail = (unsigned int *) (ring + params.cq_off.tail);
+    uring->cq_mask = *(unsigned int *) (ring + params.cq_off.ring_mask);
+    uring->cqes = ring + params.cq_off.cqes;
+
+    // Submission queue entries are always used in ring order
+    for (i = 0; i < uring->sq_entries; i++)
+        uring->sq_array[i] = i;
+    uring->sq_local_tail = *uring->sq_tail;
+    uring->sq_submitted = uring->sq_local_tail;
+
+    return 0;
+
+err:
+    uring_free(uring);
+    return -1;
+}
+
+/**
+ * Frees an io_uring instance. Closing the io_uring file descriptor cancels
+ * all outstanding requests.
+ * @param uring io_uring instance
+ */
+void uring_free(struct lwpb_uring *uring)
+{
+    if (uring->fd != -1)
+        close(uring->fd);
+    if (uring->ring_mem)
+        munmap(uring->ring_mem, uring->ring_size);
+    if (uring->sqe_mem)
+        munmap(uring->sqe_mem, uring->sqe_size);
+    if (uring->buf_ring)
+        munmap(uring->buf_ring, uring->buf_count * sizeof(struct io_uring_buf));
+    LWPB_FREE(uring->buf_data);
+    uring->fd = -1;
+    uring->ring_mem = NULL;
+    uring->sqe_mem = NULL;
+    uring->buf_ring = NULL;
+    uring->buf_data = NULL;
+}
+
+/**
+ * Adds a receive buffer to the provided buffer ring without publishing it.
+ * @param uring io_uring instance
+ * @param bid Buffer ID
+ */
+static void add_buf(struct lwpb_uring *uring, unsigned int bid)
+{
+    struct io_uring_buf_ring *ring = uring->buf_ring;
+    struct io_uring_buf *buf;
+
+    buf = &ring->bufs[uring->buf_tail & (uring->buf_count - 1)];
+    buf->addr = (u64_t) (uintptr_t) uring_buf(uring, bid);
+    buf->len = uring->buf_size;
+    buf->bid = bid;
+    uring->buf_tail++;
+}
+
+/**
+ * Registers a ring of receive buffers with the kernel (Linux 5.19), which
+ * multishot receives pick their buffers from.
+ * @param uring io_uring instance
+ * @param count Number of buffers (power of two)
+ * @param size Size of a buffer
+ * @return Returns 0 if successful or -1 if the buffers could not be set up.
+ */
+int uring_setup_bufs(struct lwpb_uring *uring, unsigned int count,
+                     unsigned int size)
+{
+    struct io_uring_buf_ring *ring;
+    struct io_uring_buf_reg reg;
+    unsigned int i;
+
+    uring->buf_count = count;
+    uring->buf_size = size;
+    uring->buf_tail = 0;
+
+    uring->buf_ring = mmap(NULL, count * sizeof(struct io_uring_buf),
+                           PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (uring->buf_ring == MAP_FAILED) {
+        uring->buf_ring = NULL;
+        return -1;
+    }
+    uring->buf_data = LWPB_MALLOC((size_t) count * size);
+    if (!uring->buf_data)
+        return -1;
+
+    LWPB_MEMSET(&reg, 0, sizeof(reg));
+    reg.ring_addr = (u64_t) (uintptr_t) uring->buf_ring;
+    reg.ring_entries = count;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) < 0)
+        return -1;
+
+    for (i = 0; i < count; i++)
+        add_buf(uring, i);
+    ring = uring->buf_ring;
+    __atomic_store_n(&ring->tail, uring->buf_tail, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/**
+ * Returns the memory of a receive buffer.
+ * @param uring io_uring instance
+ * @param bid Buffer ID from the completion flags
+ * @return Returns the start of the buffer.
+ */
+void *uring_buf(struct lwpb_uring *uring, unsigned int bid)
+{
+    return uring->buf_data + (size_t) bid * uring->buf_size;
+}
+
+/**
+ * Gives a receive buffer back to the kernel once its data is consumed.
+ * @param uring io_uring instance
+ * @param bid Buffer ID
+ */
+void uring_recycle_buf(struct lwpb_uring *uring, unsigned int bid)
+{
+    struct io_uring_buf_ring *ring = uring->buf_ring;
+
+    add_buf(uring, bid);
+    __atomic_store_n(&ring->tail, uring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Submits the queued requests and waits for a completion, unless one is
+ * already waiting, with a single io_uring_enter() call.
+ * @param uring io_uring instance
+ * @param timeout Maximum time to wait (ms), 0 to only submit or -1 to wait
+ * without timeout
+ * @return Returns the number of submitted requests or -1 if io_uring_enter()
+ * failed.
+ */
+int uring_submit(struct lwpb_uring *uring, int timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned int to_submit = uring->sq_local_tail - uring->sq_submitted;
+    unsigned int flags = 0;
+    int ret;
+
+    __atomic_store_n(uring->sq_tail, uring->sq_local_tail, __ATOMIC_RELEASE);
+
+    if (timeout != 0 && !uring_peek(uring)) {
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        LWPB_MEMSET(&arg, 0, sizeof(arg));
+        if (timeout > 0) {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000LL;
+            arg.ts = (u64_t) (uintptr_t) &ts;
+        }
+    } else if (to_submit == 0) {
+        return 0;
+    }
+
+    ret = syscall(__NR_io_uring_enter, uring->fd, to_submit, flags ? 1 : 0,
+                  flags, flags ? &arg : NULL, flags ? sizeof(arg) : 0);
+    if (ret < 0) {
+        // Requests which could not be submitted stay queued
+        if (errno == ETIME || errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            return 0;
+        return -1;
+    }
+    uring->sq_submitted += ret;
+
+    return ret;
+}
+
+/**
+ * Returns the next completion without removing it.
+ * @param uring io_uring instance
+ * @return Returns the completion or NULL if there is none.
+ */
+struct io_uring_cqe *uring_peek(struct lwpb_uring *uring)
+{
+    unsigned int head = *uring->cq_head;
+
+    if (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    return (struct io_uring_cqe *) uring->cqes + (head & uring->cq_mask);
+}
+
+/**
+ * Removes the completion returned by uring_peek().
+ * @param uring io_uring instance
+ */
+void uring_advance(struct lwpb_uring *uring)
+{
+    __atomic_store_n(uring->cq_head, *uring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Returns a cleared submission queue entry. If the submission ring is full,
+ * the queued requests are submitted first.
+ * @param uring io_uring instance
+ * @return Returns the entry or NULL if the ring cannot be submitted.
+ */
+static struct io_uring_sqe *get_sqe(struct lwpb_uring *uring)
+{
+    struct io_uring_sqe *sqe;
+
+    if (uring->sq_local_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >=
+        uring->sq_entries) {
+        uring_submit(uring, 0);
+        if (uring->sq_local_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >=
+            uring->sq_entries)
+            return NULL;
+    }
+
+    sqe = (struct io_uring_sqe *) uring->sqes + (uring->sq_local_tail & uring->sq_mask);
+    LWPB_MEMSET(sqe, 0, sizeof(*sqe));
+    uring->sq_local_tail++;
+
+    return sqe;
+}
+
+/**
+ * Queues a multishot accept, which completes once per new connection.
+ * @param uring io_uring instance
+ * @param socket Listen socket
+ * @param user_data User data of the completions
+ * @return Returns 0 if successful or -1 if the request cannot be queued.
+ */
+int uring_accept(struct lwpb_uring *uring, int socket, u64_t user_data)
+{
+    struct io_uring_sqe *sqe = get_sqe(uring);
+
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = socket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = user_data;
+
+    return 0;
+}
+
+/**
+ * Queues a multishot receive into the provided buffers (Linux 6.0), which
+ * completes every time data arrives. The buffer ID is in the upper 16 bits
+ * of the completion flags.
+ * @param uring io_uring instance
+ * @param socket Socket
+ * @param user_data User data of the completions
+ * @return Returns 0 if successful or -1 if the request cannot be queued.
+ */
+int uring_recv(struct lwpb_uring *uring, int socket, u64_t user_data)
+{
+    struct io_uring_sqe *sqe = get_sqe(uring);
+
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = socket;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = user_data;
+
+    return 0;
+}
+
+/**
+ * Queues a send. The buffer must not change until the send completes.
+ * @param uring io_uring instance
+ * @param socket Socket
+ * @param buf Data
+ * @param len Length of data
+ * @param user_data User data of the completion
+ * @return Returns 0 if successful or -1 if the request cannot be queued.
+ */
+int uring_send(struct lwpb_uring *uring, int socket, const void *buf,
+               size_t len, u64_t user_data)
+{
+    struct io_uring_sqe *sqe = get_sqe(uring);
+
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = socket;
+    sqe->addr = (u64_t) (uintptr_t) buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+
+    return 0;
+}
+
+/**
+ * Queues a poll for readability.
+ * @param uring io_uring instance
+ * @param fd File descriptor
+ * @param multishot Set to complete every time the file becomes readable
+ * @param user_data User data of the completions
+ * @return Returns 0 if successful or -1 if the request cannot be queued.
+ */
+int uring_poll(struct lwpb_uring *uring, int fd, int multishot,
+               u64_t user_data)
+{
+    struct io_uring_sqe *sqe = get_sqe(uring);
+
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = user_data;
+
+    return 0;
+}
+
+/**
+ * Queues the cancellation of an outstanding request.
+ * @param uring io_uring instance
+ * @param target User data of the request to cancel
+ * @param user_data User data of the completion
+ * @return Returns 0 if successful or -1 if the request cannot be queued.
+ */
+int uring_cancel(struct lwpb_uring *uring, u64_t target, u64_t user_data)
+{
+    struct io_uring_sqe *sqe = get_sqe(uring);
+
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+
+    return 0;
+}
@@ -0,0 +1,75 @@
+/** @file uring_helper.h
+ * 
+ * Helper functions for running the socket transports on io_uring.
+ * 
+ * Copyright 2009 Simon Kallweit
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __LWPB_RPC_URING_HELPER_H__
+#define __LWPB_RPC_URING_HELPER_H__
+
+#include <stdint.h>
+
+#include <linux/io_uring.h>
+
+#include <lwpb/lwpb.h>
+#include <lwpb/rpc/uring.h>
+
+
+/** Buffer group of the provided receive buffers */
+#define URING_BGID 0
+
+/* Types of io_uring requests, kept in the low bits of the user data */
+#define URING_ACCEPT    0
+#define URING_RECV      1
+#define URING_SEND      2
+#define URING_POOL      3
+#define URING_WAKEUP    4
+#define URING_CANCEL    5
+#define URING_TYPE_MASK 7
+
+/** User data of an io_uring request of an object (or NULL) */
+#define URING_DATA(_ptr_, _type_) ((u64_t) (uintptr_t) (_ptr_) | (_type_))
+
+int uring_init(struct lwpb_uring *uring, unsigned int entries);
+
+void uring_free(struct lwpb_uring *uring);
+
+int uring_setup_bufs(struct lwpb_uring *uring, unsigned int count,
+                     unsigned int size);
+
+void *uring_buf(struct lwpb_uring *uring, unsigned int bid);
+
+void uring_recycle_buf(struct lwpb_uring *uring, unsigned int bid);
+
+int uring_submit(struct lwpb_uring *uring, int timeout);
+
+struct io_uring_cqe *uring_peek(struct lwpb_uring *uring);
+
+void uring_advance(struct lwpb_uring *uring);
+
+int uring_accept(struct lwpb_uring *uring, int socket, u64_t user_data);
+
+int uring_recv(struct lwpb_uring *uring, int socket, u64_t user_data);
+
+int uring_send(struct lwpb_uring *uring, int socket, const void *buf,
+               size_t len, u64_t user_data);
+
+int uring_poll(struct lwpb_uring *uring, int fd, int multishot,
+               u64_t user_data);
+
+int uring_cancel(struct lwpb_uring *uring, u64_t target, u64_t user_data);
+
+#endif // __LWPB_RPC_URING_HELPER_H__
@@ -0,0 +1,242 @@
+/** @file worker_pool.c
+ * 
+ * Worker thread pool for RPC transports.
+ * 
+ * Copyright 2009 Simon Kallweit
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+#include <lwpb/lwpb.h>
+#include <lwpb/rpc/stats.h>
+#include <lwpb/rpc/worker_pool.h>
+
+
+/**
+ * Worker thread main loop. Takes jobs from the queue, runs them and hands
+ * them back to the I/O thread.
+ * @param arg Worker pool
+ */
+static void *worker_main(void *arg)
+{
+    struct lwpb_worker_pool *pool = arg;
+    struct lwpb_worker_job *job;
+    u64_t wait;
+    u64_t one = 1;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->stop && pool->queue_len == 0)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        if (pool->queue_len == 0) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+
+        job = pool->queue[pool->queue_head];
+        pool->queue_head = (pool->queue_head + 1) % pool->queue_size;
+        pool->queue_len--;
+
+        job->start_time = lwpb_stats_now();
+        wait = job->start_time - job->submit_time;
+        pool->stats.wait_total += wait;
+        if (wait > pool->stats.wait_max)
+            pool->stats.wait_max = wait;
+        pthread_mutex_unlock(&pool->lock);
+
+        job->fun(job);
+
+        // Append to completion list
+        pthread_mutex_lock(&pool->lock);
+        job->next = NULL;
+        if (pool->done_tail)
+            pool->done_tail->next = job;
+        else
+            pool->done_head = job;
+        pool->done_tail = job;
+        pool->stats.completed++;
+        pthread_mutex_unlock(&pool->lock);
+
+        // Wake up the I/O thread
+        if (write(pool->event, &one, sizeof(one)) != sizeof(one))
+            LWPB_ERR("Cannot signal job completion (errno: %d)", errno);
+    }
+}
+
+/**
+ * Initializes and starts a worker pool.
+ * @param pool Worker pool
+ * @param num_threads Number of worker threads
+ * @param queue_size Maximum number of queued jobs
+ * @return Returns LWPB_ERR_OK if successful, LWPB_ERR_MEM if memory could
+ * not be allocated or LWPB_ERR_NET_INIT if the eventfd or the worker threads
+ * could not be created.
+ */
+lwpb_err_t lwpb_worker_pool_init(struct lwpb_worker_pool *pool,
+                                 int num_threads, size_t queue_size)
+{
+    int i;
+
+    LWPB_ASSERT(num_threads > 0, "Worker pool needs at least one thread");
+    LWPB_ASSERT(queue_size > 0, "Worker pool needs a queue");
+
+    LWPB_MEMSET(pool, 0, sizeof(*pool));
+    pool->event = -1;
+
+    pool->threads = LWPB_MALLOC(num_threads * sizeof(pthread_t));
+    pool->queue = LWPB_MALLOC(queue_size * sizeof(struct lwpb_worker_job *));
+    if (!pool->threads || !pool->queue) {
+        LWPB_FREE(pool->threads);
+        LWPB_FREE(pool->queue);
+        return LWPB_ERR_MEM;
+    }
+    pool->queue_size = queue_size;
+
+    pool->event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool->event == -1) {
+        LWPB_ERR("Cannot create eventfd (errno: %d)", errno);
+        LWPB_FREE(pool->threads);
+        LWPB_FREE(pool->queue);
+        return LWPB_ERR_NET_INIT;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0) {
+            LWPB_ERR("Cannot create worker thread");
+            lwpb_worker_pool_destroy(pool);
+            return LWPB_ERR_NET_INIT;
+        }
+        pool->num_threads++;
+    }
+
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Stops the worker threads and frees the worker pool. Jobs which are still
+ * queued are run before the workers exit.
+ * @param pool Worker pool
+ * @return Returns the list of completed jobs which have not been taken with
+ * lwpb_worker_pool_completed() yet, so the caller can release them.
+ */
+struct lwpb_worker_job *lwpb_worker_pool_destroy(struct lwpb_worker_pool *pool)
+{
+    struct lwpb_worker_job *job;
+    int i;
+
+    if (!pool->threads)
+        return NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->num_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    job = pool->done_head;
+    pool->done_head = NULL;
+    pool->done_tail = NULL;
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    close(pool->event);
+
+    LWPB_FREE(pool->threads);
+    LWPB_FREE(pool->queue);
+    pool->threads = NULL;
+    pool->queue = NULL;
+    pool->num_threads = 0;
+    pool->event = -1;
+
+    return job;
+}
+
+/**
+ * Submits a job to the worker pool. The job is run on one of the worker
+ * threads and later returned by lwpb_worker_pool_completed().
+ * @param pool Worker pool
+ * @param job Job (job->fun must be set)
+ * @return Returns LWPB_ERR_OK if successful or LWPB_ERR_BUSY if the job
+ * queue is full.
+ */
+lwpb_err_t lwpb_worker_pool_submit(struct lwpb_worker_pool *pool,
+                                   struct lwpb_worker_job *job)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    if (pool->queue_len == pool->queue_size) {
+        pool->stats.rejected++;
+        pthread_mutex_unlock(&pool->lock);
+        return LWPB_ERR_BUSY;
+    }
+
+    job->submit_time = lwpb_stats_now();
+    pool->queue[(pool->queue_head + pool->queue_len) % pool->queue_size] = job;
+    pool->queue_len++;
+    pool->stats.submitted++;
+    if (pool->queue_len > pool->stats.queue_max)
+        pool->stats.queue_max = pool->queue_len;
+
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Takes all completed jobs from the worker pool. This method should be called
+ * whenever the pool's eventfd becomes readable.
+ * @param pool Worker pool
+ * @return Returns a list of completed jobs (linked by job->next) or NULL if
+ * no jobs have completed.
+ */
+struct lwpb_worker_job *lwpb_worker_pool_completed(struct lwpb_worker_pool *pool)
+{
+    struct lwpb_worker_job *job;
+    u64_t count;
+
+    // Reset the eventfd counter before taking the list, so no wakeup is lost
+    while (read(pool->event, &count, sizeof(count)) < 0 && errno == EINTR)
+        ;
+
+    pthread_mutex_lock(&pool->lock);
+    job = pool->done_head;
+    pool->done_head = NULL;
+    pool->done_tail = NULL;
+    pthread_mutex_unlock(&pool->lock);
+
+    return job;
+}
+
+/**
+ * Returns a snapshot of the worker pool metrics.
+ * @param pool Worker pool
+ * @param stats Metrics
+ */
+void lwpb_worker_pool_get_stats(struct lwpb_worker_pool *pool,
+                                struct lwpb_worker_pool_stats *stats)
+{
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+}
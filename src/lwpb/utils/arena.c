@@ -0,0 +1,63 @@
+/** @file arena.c
+ * 
+ * Implementation of the arena allocator.
+ * 
+ * Copyright 2009 Simon Kallweit
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *     
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <lwpb/lwpb.h>
+
+
+/**
+ * Initializes an arena.
+ * @param arena Arena
+ * @param data Memory block to allocate from
+ * @param size Size of the memory block
+ */
+void lwpb_arena_init(struct lwpb_arena *arena, void *data, size_t size)
+{
+    arena->base = data;
+    arena->size = size;
+    arena->used = 0;
+}
+
+/**
+ * Allocates memory from an arena. The memory is aligned to LWPB_ARENA_ALIGN
+ * bytes relative to the start of the memory block.
+ * @param arena Arena
+ * @param size Number of bytes to allocate
+ * @return Returns the allocated memory or NULL if the arena is exhausted.
+ */
+void *lwpb_arena_alloc(struct lwpb_arena *arena, size_t size)
+{
+    size_t ofs;
+    
+    ofs = (arena->used + LWPB_ARENA_ALIGN - 1) & ~(size_t) (LWPB_ARENA_ALIGN - 1);
+    if (ofs > arena->size || size > arena->size - ofs)
+        return NULL;
+    
+    arena->used = ofs + size;
+    
+    return arena->base + ofs;
+}
+
+/**
+ * Releases all memory allocated from an arena.
+ * @param arena Arena
+ */
+void lwpb_arena_reset(struct lwpb_arena *arena)
+{
+    arena->used = 0;
+}
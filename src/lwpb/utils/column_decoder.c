@@ -0,0 +1,620 @@
+/** @file column_decoder.c
+ * 
+ * Implementation of the protocol buffers columnar decoder.
+ * 
+ * Copyright 2009 Simon Kallweit
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <lwpb/lwpb.h>
+#include <lwpb/utils/column_decoder.h>
+
+#include "private.h"
+
+
+#define INITIAL_ROWS 64
+#define INITIAL_VALUES 64
+#define INITIAL_DATA 1024
+
+// Column utilities
+
+/**
+ * Returns the size of a single value of the given field in a column.
+ * @param field_desc Field descriptor
+ * @return Returns the value size or 0 if the field cannot be stored.
+ */
+static size_t value_size(const struct lwpb_field_desc *field_desc)
+{
+    switch (field_desc->opts.typ) {
+    case LWPB_DOUBLE:
+        return sizeof(double);
+    case LWPB_FLOAT:
+        return sizeof(float);
+    case LWPB_INT32:
+    case LWPB_SINT32:
+    case LWPB_SFIXED32:
+        return sizeof(s32_t);
+    case LWPB_UINT32:
+    case LWPB_FIXED32:
+        return sizeof(u32_t);
+    case LWPB_INT64:
+    case LWPB_SINT64:
+    case LWPB_SFIXED64:
+        return sizeof(s64_t);
+    case LWPB_UINT64:
+    case LWPB_FIXED64:
+        return sizeof(u64_t);
+    case LWPB_BOOL:
+        return sizeof(lwpb_bool_t);
+    case LWPB_ENUM:
+        return sizeof(lwpb_enum_t);
+    case LWPB_STRING:
+    case LWPB_BYTES:
+        return sizeof(u32_t);
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Checks if a field descriptor belongs to a message descriptor.
+ * @param msg_desc Message descriptor
+ * @param field_desc Field descriptor
+ * @return Returns 1 if the field is part of the message.
+ */
+static int is_msg_field(const struct lwpb_msg_desc *msg_desc,
+                        const struct lwpb_field_desc *field_desc)
+{
+    return field_desc >= msg_desc->fields &&
+           field_desc < &msg_desc->fields[msg_desc->num_fields];
+}
+
+/**
+ * Grows an array so it can hold at least the given number of elements.
+ * @param array Pointer to array
+ * @param size Pointer to number of allocated elements
+ * @param need Number of elements needed
+ * @param elem_size Size of a single element
+ * @param initial Initial number of elements
+ * @return Returns LWPB_ERR_OK if successful or LWPB_ERR_MEM if the array
+ * could not be grown.
+ */
+static lwpb_err_t grow(void **array, size_t *size, size_t need,
+                       size_t elem_size, size_t initial)
+{
+    size_t new_size;
+    void *new_array;
+
+    if (need <= *size)
+        return LWPB_ERR_OK;
+
+    new_size = *size ? *size : initial;
+    while (new_size < need)
+        new_size *= 2;
+
+    new_array = LWPB_REALLOC(*array, new_size * elem_size);
+    if (!new_array)
+        return LWPB_ERR_MEM;
+
+    *array = new_array;
+    *size = new_size;
+
+    return LWPB_ERR_OK;
+}
+
+#define VALUE_PTR(_column_, _index_) \
+    ((u8_t *) (_column_)->values + (_column_)->value_size * (_index_))
+
+/**
+ * Starts a new row in a column.
+ * @param column Column
+ * @return Returns LWPB_ERR_OK if successful.
+ */
+static lwpb_err_t column_begin_row(struct lwpb_column *column)
+{
+    lwpb_err_t ret;
+    size_t rows_size = column->rows_size;
+    int string = column->path[column->path_len - 1]->opts.typ == LWPB_STRING ||
+                 column->path[column->path_len - 1]->opts.typ == LWPB_BYTES;
+
+    // Make room for the presence bit and the row offset
+    ret = grow((void **) &column->offsets, &column->rows_size,
+               column->num_rows + 2, sizeof(u32_t), INITIAL_ROWS);
+    if (ret != LWPB_ERR_OK)
+        return ret;
+    if (column->rows_size != rows_size) {
+        u8_t *valid = LWPB_REALLOC(column->valid, (column->rows_size + 7) / 8);
+        if (!valid) {
+            column->rows_size = rows_size;
+            return LWPB_ERR_MEM;
+        }
+        column->valid = valid;
+    }
+    column->valid[column->num_rows >> 3] &= ~(1 << (column->num_rows & 7));
+    if (column->num_rows == 0)
+        column->offsets[0] = 0;
+
+    column->row_values = column->num_values;
+    column->row_data_len = column->data_len;
+
+    if (column->repeated)
+        return LWPB_ERR_OK;
+
+    // Non-repeated columns hold exactly one (zero) value per row
+    ret = grow(&column->values, &column->values_size,
+               column->num_values + 2, column->value_size, INITIAL_VALUES);
+    if (ret != LWPB_ERR_OK)
+        return ret;
+    if (string) {
+        if (column->num_values == 0)
+            ((u32_t *) column->values)[0] = 0;
+        ((u32_t *) column->values)[column->num_values + 1] = column->data_len;
+    } else
+        LWPB_MEMSET(VALUE_PTR(column, column->num_values), 0, column->value_size);
+    column->num_values++;
+
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Finishes the current row in a column.
+ * @param column Column
+ */
+static void column_end_row(struct lwpb_column *column)
+{
+    if (column->repeated)
+        column->offsets[column->num_rows + 1] = column->num_values;
+    column->num_rows++;
+}
+
+/**
+ * Discards the current row in a column.
+ * @param column Column
+ */
+static void column_rollback_row(struct lwpb_column *column)
+{
+    column->num_values = column->row_values;
+    column->data_len = column->row_data_len;
+}
+
+/**
+ * Adds a value to the current row of a column.
+ * @param column Column
+ * @param field_desc Field descriptor
+ * @param value Field value
+ * @return Returns LWPB_ERR_OK if successful.
+ */
+static lwpb_err_t column_add_value(struct lwpb_column *column,
+                                   const struct lwpb_field_desc *field_desc,
+                                   union lwpb_value *value)
+{
+    lwpb_err_t ret;
+    size_t index;
+    size_t len;
+    void *src;
+    u32_t *ends;
+
+    if (column->repeated) {
+        ret = grow(&column->values, &column->values_size,
+                   column->num_values + 2, column->value_size, INITIAL_VALUES);
+        if (ret != LWPB_ERR_OK)
+            return ret;
+        index = column->num_values++;
+    } else {
+        // The last occurance of a non-repeated field wins
+        index = column->num_values - 1;
+    }
+
+    column->valid[column->num_rows >> 3] |= 1 << (column->num_rows & 7);
+
+    switch (field_desc->opts.typ) {
+    case LWPB_DOUBLE:
+        *((double *) VALUE_PTR(column, index)) = value->double_;
+        break;
+    case LWPB_FLOAT:
+        *((float *) VALUE_PTR(column, index)) = value->float_;
+        break;
+    case LWPB_INT32:
+    case LWPB_SINT32:
+    case LWPB_SFIXED32:
+        *((s32_t *) VALUE_PTR(column, index)) = value->int32;
+        break;
+    case LWPB_UINT32:
+    case LWPB_FIXED32:
+        *((u32_t *) VALUE_PTR(column, index)) = value->uint32;
+        break;
+    case LWPB_INT64:
+    case LWPB_SINT64:
+    case LWPB_SFIXED64:
+        *((s64_t *) VALUE_PTR(column, index)) = value->int64;
+        break;
+    case LWPB_UINT64:
+    case LWPB_FIXED64:
+        *((u64_t *) VALUE_PTR(column, index)) = value->uint64;
+        break;
+    case LWPB_BOOL:
+        *((lwpb_bool_t *) VALUE_PTR(column, index)) = value->bool;
+        break;
+    case LWPB_ENUM:
+        *((lwpb_enum_t *) VALUE_PTR(column, index)) = value->enum_;
+        break;
+    case LWPB_STRING:
+    case LWPB_BYTES:
+        if (field_desc->opts.typ == LWPB_STRING) {
+            src = value->string.str;
+            len = value->string.len;
+        } else {
+            src = value->bytes.data;
+            len = value->bytes.len;
+        }
+        ends = column->values;
+        if (index == 0)
+            ends[0] = 0;
+        // Overwrite the previous value of a non-repeated field
+        column->data_len = ends[index];
+        ret = grow((void **) &column->data, &column->data_size,
+                   column->data_len + len, 1, INITIAL_DATA);
+        if (ret != LWPB_ERR_OK)
+            return ret;
+        LWPB_MEMCPY(column->data + column->data_len, src, len);
+        column->data_len += len;
+        ends[index + 1] = column->data_len;
+        break;
+    }
+
+    return LWPB_ERR_OK;
+}
+
+// Column
+
+/**
+ * Initializes a column.
+ * @param column Column
+ * @param path Array of field descriptors leading from the root message to the
+ * field stored in the column. All but the last field must be messages.
+ * @param path_len Number of field descriptors in path
+ * @return Returns LWPB_ERR_OK if successful or LWPB_ERR_INVALID_FIELD if the
+ * path is invalid.
+ */
+lwpb_err_t lwpb_column_init(struct lwpb_column *column,
+                            const struct lwpb_field_desc **path, int path_len)
+{
+    int i;
+
+    if (path_len < 1 || path_len >= LWPB_MAX_DEPTH)
+        return LWPB_ERR_INVALID_FIELD;
+
+    column->repeated = 0;
+    for (i = 0; i < path_len; i++) {
+        if (i < path_len - 1) {
+            if (path[i]->opts.typ != LWPB_MESSAGE ||
+                !is_msg_field(path[i]->msg_desc, path[i + 1]))
+                return LWPB_ERR_INVALID_FIELD;
+        }
+        if (path[i]->opts.label == LWPB_REPEATED)
+            column->repeated = 1;
+        column->path[i] = path[i];
+    }
+    column->path_len = path_len;
+
+    column->value_size = value_size(path[path_len - 1]);
+    if (column->value_size == 0)
+        return LWPB_ERR_INVALID_FIELD;
+
+    column->values = NULL;
+    column->valid = NULL;
+    column->offsets = NULL;
+    column->data = NULL;
+    column->values_size = 0;
+    column->rows_size = 0;
+    column->data_size = 0;
+    lwpb_column_clear(column);
+
+    return LWPB_ERR_OK;
+}
+
+#if LWPB_FIELD_NAMES
+
+/**
+ * Initializes a column from a dotted field path, e.g. "phone.number".
+ * @param column Column
+ * @param msg_desc Root message descriptor
+ * @param name Dotted field path
+ * @return Returns LWPB_ERR_OK if successful or LWPB_ERR_UNKNOWN_FIELD if the
+ * path cannot be resolved.
+ */
+lwpb_err_t lwpb_column_init_name(struct lwpb_column *column,
+                                 const struct lwpb_msg_desc *msg_desc,
+                                 const char *name)
+{
+    const struct lwpb_field_desc *path[LWPB_MAX_DEPTH];
+    int path_len = 0;
+    const char *end;
+    size_t len;
+    int i;
+
+    while (*name) {
+        if (!msg_desc || path_len == LWPB_MAX_DEPTH)
+            return LWPB_ERR_UNKNOWN_FIELD;
+
+        for (end = name; *end && *end != '.'; end++);
+        len = end - name;
+
+        for (i = 0; i < msg_desc->num_fields; i++)
+            if (LWPB_STRLEN(msg_desc->fields[i].name) == len &&
+                LWPB_MEMCMP(msg_desc->fields[i].name, name, len) == 0)
+                break;
+        if (i == msg_desc->num_fields)
+            return LWPB_ERR_UNKNOWN_FIELD;
+
+        path[path_len++] = &msg_desc->fields[i];
+        msg_desc = msg_desc->fields[i].msg_desc;
+        name = *end ? end + 1 : end;
+    }
+
+    return lwpb_column_init(column, path, path_len);
+}
+
+#endif
+
+/**
+ * Removes all rows from a column. The allocated memory is kept for reuse.
+ * @param column Column
+ */
+void lwpb_column_clear(struct lwpb_column *column)
+{
+    column->num_rows = 0;
+    column->num_values = 0;
+    column->data_len = 0;
+}
+
+/**
+ * Frees the memory allocated by a column.
+ * @param column Column
+ */
+void lwpb_column_free(struct lwpb_column *column)
+{
+    if (column->values)
+        LWPB_FREE(column->values);
+    if (column->valid)
+        LWPB_FREE(column->valid);
+    if (column->offsets)
+        LWPB_FREE(column->offsets);
+    if (column->data)
+        LWPB_FREE(column->data);
+    column->values = NULL;
+    column->valid = NULL;
+    column->offsets = NULL;
+    column->data = NULL;
+    column->values_size = 0;
+    column->rows_size = 0;
+    column->data_size = 0;
+    lwpb_column_clear(column);
+}
+
+// Decoder handlers
+
+static void cdecoder_msg_end_handler(struct lwpb_decoder *decoder,
+                                     const struct lwpb_msg_desc *msg_desc,
+                                     void *arg)
+{
+    struct lwpb_column_decoder *cdecoder = arg;
+
+    // Leaving a nested message
+    if (cdecoder->depth > 0)
+        cdecoder->depth--;
+}
+
+/**
+ * Checks if the current path followed by a field matches the start of a
+ * column path.
+ * @param cdecoder Columnar decoder
+ * @param column Column
+ * @param field_desc Field descriptor
+ * @param path_len Required path length of the column, or 0 for any path
+ * longer than the current path.
+ * @return Returns 1 if the path matches.
+ */
+static int path_matches(struct lwpb_column_decoder *cdecoder,
+                        struct lwpb_column *column,
+                        const struct lwpb_field_desc *field_desc,
+                        int path_len)
+{
+    int depth = cdecoder->depth;
+    int j;
+
+    if (path_len ? column->path_len != path_len : column->path_len <= depth + 1)
+        return 0;
+    if (column->path[depth] != field_desc)
+        return 0;
+    for (j = 0; j < depth; j++)
+        if (column->path[j] != cdecoder->path[j])
+            return 0;
+
+    return 1;
+}
+
+static lwpb_decoder_action_t cdecoder_field_handler(struct lwpb_decoder *decoder,
+                                                    const struct lwpb_msg_desc *msg_desc,
+                                                    const struct lwpb_field_desc *field_desc,
+                                                    union lwpb_value *value, void *arg)
+{
+    struct lwpb_column_decoder *cdecoder = arg;
+    struct lwpb_column *column;
+    lwpb_err_t ret;
+    int i;
+
+    // Entering a nested message, skip it if no column is below it
+    if (!value) {
+        for (i = 0; i < cdecoder->num_columns; i++)
+            if (path_matches(cdecoder, &cdecoder->columns[i], field_desc, 0))
+                break;
+        if (i == cdecoder->num_columns)
+            return LWPB_DECODER_SKIP;
+        LWPB_ASSERT(cdecoder->depth < LWPB_MAX_DEPTH, "Message nesting too deep");
+        cdecoder->path[cdecoder->depth++] = field_desc;
+        return LWPB_DECODER_CONTINUE;
+    }
+
+    for (i = 0; i < cdecoder->num_columns; i++) {
+        column = &cdecoder->columns[i];
+        if (!path_matches(cdecoder, column, field_desc, cdecoder->depth + 1))
+            continue;
+
+        ret = column_add_value(column, field_desc, value);
+        if (ret != LWPB_ERR_OK) {
+            cdecoder->err = ret;
+            return LWPB_DECODER_STOP;
+        }
+    }
+
+    return LWPB_DECODER_CONTINUE;
+}
+
+// Column decoder
+
+/**
+ * Initializes the columnar decoder.
+ * @param cdecoder Columnar decoder
+ * @param msg_desc Message descriptor of the decoded messages
+ * @param columns Array of initialized columns to decode into
+ * @param num_columns Number of columns
+ */
+void lwpb_column_decoder_init(struct lwpb_column_decoder *cdecoder,
+                              const struct lwpb_msg_desc *msg_desc,
+                              struct lwpb_column *columns, int num_columns)
+{
+    int i;
+
+    for (i = 0; i < num_columns; i++)
+        LWPB_ASSERT(is_msg_field(msg_desc, columns[i].path[0]),
+                    "Column does not belong to message");
+
+    lwpb_decoder_init(&cdecoder->decoder);
+    lwpb_decoder_arg(&cdecoder->decoder, cdecoder);
+    lwpb_decoder_msg_handler(&cdecoder->decoder, NULL, cdecoder_msg_end_handler);
+    lwpb_decoder_field_handler(&cdecoder->decoder, cdecoder_field_handler);
+
+    cdecoder->msg_desc = msg_desc;
+    cdecoder->columns = columns;
+    cdecoder->num_columns = num_columns;
+}
+
+/**
+ * Decodes a single message and appends it as a new row to all columns. When
+ * decoding fails, no row is appended.
+ * @param cdecoder Columnar decoder
+ * @param data Data to decode
+ * @param len Length of data to decode
+ * @return Returns LWPB_ERR_OK when data was successfully decoded.
+ */
+lwpb_err_t lwpb_column_decoder_decode(struct lwpb_column_decoder *cdecoder,
+                                      void *data, size_t len)
+{
+    lwpb_err_t ret = LWPB_ERR_OK;
+    int i;
+
+    for (i = 0; i < cdecoder->num_columns; i++) {
+        ret = column_begin_row(&cdecoder->columns[i]);
+        if (ret != LWPB_ERR_OK)
+            goto out;
+    }
+
+    cdecoder->depth = 0;
+    cdecoder->err = LWPB_ERR_OK;
+
+    ret = lwpb_decoder_decode(&cdecoder->decoder, cdecoder->msg_desc,
+                              data, len, NULL);
+    if (cdecoder->err != LWPB_ERR_OK)
+        ret = cdecoder->err;
+
+out:
+    if (ret != LWPB_ERR_OK) {
+        while (i-- > 0)
+            column_rollback_row(&cdecoder->columns[i]);
+        return ret;
+    }
+
+    for (i = 0; i < cdecoder->num_columns; i++)
+        column_end_row(&cdecoder->columns[i]);
+
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Decodes an array of messages.
+ * @param cdecoder Columnar decoder
+ * @param data Array of data pointers
+ * @param len Array of data lengths
+ * @param count Number of messages
+ * @return Returns LWPB_ERR_OK when all messages were successfully decoded.
+ */
+lwpb_err_t lwpb_column_decoder_decode_array(struct lwpb_column_decoder *cdecoder,
+                                            void **data, size_t *len,
+                                            size_t count)
+{
+    lwpb_err_t ret;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        ret = lwpb_column_decoder_decode(cdecoder, data[i], len[i]);
+        if (ret != LWPB_ERR_OK)
+            return ret;
+    }
+
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Decodes a stream of messages, each prefixed with its length as a little
+ * endian 32 bit integer (the record format of lwpb.stream.StreamWriter).
+ * @param cdecoder Columnar decoder
+ * @param data Data to decode
+ * @param len Length of data to decode
+ * @param used Returns the number of bytes of all completely decoded messages
+ * when not NULL.
+ * @return Returns LWPB_ERR_OK when all data was successfully decoded or
+ * LWPB_ERR_END_OF_BUF if the data ends with an incomplete message. Decoding
+ * can then be resumed at 'used' once more data is available.
+ */
+lwpb_err_t lwpb_column_decoder_decode_stream(struct lwpb_column_decoder *cdecoder,
+                                             void *data, size_t len,
+                                             size_t *used)
+{
+    lwpb_err_t ret = LWPB_ERR_OK;
+    struct lwpb_buf buf;
+    u32_t record_len;
+
+    lwpb_buf_init(&buf, data, len);
+
+    while (lwpb_buf_left(&buf) > 0) {
+        ret = lwpb_decode_32bit(&buf, &record_len);
+        if (ret != LWPB_ERR_OK)
+            break;
+        if (record_len > lwpb_buf_left(&buf)) {
+            ret = LWPB_ERR_END_OF_BUF;
+            break;
+        }
+        ret = lwpb_column_decoder_decode(cdecoder, buf.pos, record_len);
+        if (ret != LWPB_ERR_OK)
+            break;
+        buf.pos += record_len;
+        data = buf.pos;
+    }
+
+    if (used)
+        *used = (u8_t *) data - buf.base;
+
+    return ret;
+}
@@ -31,6 +31,8 @@ static const struct lwpb_struct_map_field *find_map_field(
     for (field = map->fields; field->field_desc; field++)
         if (field->field_desc == field_desc)
             return field;
+    
+    return NULL;
 }
 
 #define FIELD_BASE(_field_, _base_, _index_) \
@@ -42,6 +44,8 @@ static void unpack_field(struct lwpb_struct_decoder *sdecoder,
 {
     size_t len;
     struct lwpb_struct_decoder_stack_frame *frame;
+    struct lwpb_string_view *string_view;
+    struct lwpb_bytes_view *bytes_view;
     
     frame = &sdecoder->stack[sdecoder->depth];
     
@@ -50,7 +54,11 @@ static void unpack_field(struct lwpb_struct_decoder *sdecoder,
         frame->field_index = 0;
     frame->last_field = field;
     
-    if (field->count >= field->count)
+    // Drop values which do not fit into the struct
+    if (frame->field_index >= field->count) {
+        frame->msg_field = NULL;
+        return;
+    }
 
     switch (field->field_desc->opts.typ) {
     case LWPB_DOUBLE:
@@ -100,29 +108,49 @@ static void unpack_field(struct lwpb_struct_decoder *sdecoder,
         frame->field_index++;
         break;
     case LWPB_STRING:
+        if (field->flags & LWPB_STRUCT_MAP_VIEW) {
+            LWPB_ASSERT(field->len == sizeof(struct lwpb_string_view), "Field type mismatch");
+            string_view = (struct lwpb_string_view *) FIELD_BASE(field, frame->base, frame->field_index);
+            string_view->str = value->string.str;
+            string_view->len = value->string.len;
+            frame->field_index++;
+            break;
+        }
         len = field->len < value->string.len + 1 ? field->len : value->string.len + 1;
         LWPB_MEMCPY(FIELD_BASE(field, frame->base, frame->field_index), value->string.str, len);
         ((char *) FIELD_BASE(field, frame->base, frame->field_index))[len - 1] = '\0';
         frame->field_index++;
         break;
     case LWPB_BYTES:
+        if (field->flags & LWPB_STRUCT_MAP_VIEW) {
+            LWPB_ASSERT(field->len == sizeof(struct lwpb_bytes_view), "Field type mismatch");
+            bytes_view = (struct lwpb_bytes_view *) FIELD_BASE(field, frame->base, frame->field_index);
+            bytes_view->data = value->bytes.data;
+            bytes_view->len = value->bytes.len;
+            frame->field_index++;
+            break;
+        }
         len = field->len < value->bytes.len ? field->len : value->bytes.len;
         LWPB_MEMCPY(FIELD_BASE(field, frame->base, frame->field_index), value->bytes.data, len);
         frame->field_index++;
         break;
     case LWPB_MESSAGE:
         LWPB_DIAG_PRINTF("submessage\n");
+        frame->msg_field = field;
         break;
     }
     
 }
 
-static void sdecoder_msg_start_handler(struct lwpb_decoder *decoder,
-                                    const struct lwpb_msg_desc *msg_desc,
-                                    void *arg)
+static lwpb_decoder_action_t sdecoder_msg_start_handler(struct lwpb_decoder *decoder,
+                                                        const struct lwpb_msg_desc *msg_desc,
+                                                        void *arg)
 {
     struct lwpb_struct_decoder *sdecoder = arg;
     struct lwpb_struct_decoder_stack_frame *frame, *last_frame;
+    struct lwpb_struct_lazy *lazy;
+    struct lwpb_buf *buf;
+    lwpb_decoder_action_t action = LWPB_DECODER_CONTINUE;
 
     LWPB_DIAG_PRINTF("msg start\n");
 
@@ -131,18 +159,41 @@ static void sdecoder_msg_start_handler(struct lwpb_decoder *decoder,
     
     if (sdecoder->depth > 0) {
         last_frame = &sdecoder->stack[sdecoder->depth - 1];
-        frame->map = (const struct lwpb_struct_map *) last_frame->last_field->len;
-        frame->base = last_frame->base + last_frame->last_field->ofs +
-            (frame->map->struct_size * last_frame->field_index);
         frame->last_field = NULL;
+        frame->msg_field = NULL;
         frame->field_index = 0;
-        last_frame->field_index++;
+        if (last_frame->map && last_frame->msg_field &&
+            (last_frame->msg_field->flags & LWPB_STRUCT_MAP_LAZY)) {
+            // Record the encoded span and skip decoding the submessage
+            buf = &decoder->stack[decoder->depth - 1].buf;
+            lazy = (struct lwpb_struct_lazy *) (last_frame->base +
+                    last_frame->msg_field->ofs) + last_frame->field_index;
+            lazy->data = buf->base;
+            lazy->len = buf->end - buf->base;
+            lazy->map = (const struct lwpb_struct_map *) last_frame->msg_field->len;
+            lazy->value = NULL;
+            last_frame->field_index++;
+            action = LWPB_DECODER_SKIP;
+            frame->map = NULL;
+            frame->base = NULL;
+        } else if (last_frame->map && last_frame->msg_field) {
+            frame->map = (const struct lwpb_struct_map *) last_frame->msg_field->len;
+            frame->base = last_frame->base + last_frame->msg_field->ofs +
+                (frame->map->struct_size * last_frame->field_index);
+            last_frame->field_index++;
+        } else {
+            // Submessage is not mapped, ignore its fields
+            frame->map = NULL;
+            frame->base = NULL;
+        }
     }
     
-    LWPB_ASSERT(frame->map->msg_desc == msg_desc, "Message type mismatch");
+    LWPB_ASSERT(!frame->map || frame->map->msg_desc == msg_desc, "Message type mismatch");
     
     if (sdecoder->msg_start_handler)
         sdecoder->msg_start_handler(sdecoder, msg_desc, sdecoder->arg);
+    
+    return action;
 }
 
 static void sdecoder_msg_end_handler(struct lwpb_decoder *decoder,
@@ -161,21 +212,30 @@ static void sdecoder_msg_end_handler(struct lwpb_decoder *decoder,
         sdecoder->msg_end_handler(sdecoder, msg_desc, sdecoder->arg);
 }
 
-static void sdecoder_field_handler(struct lwpb_decoder *decoder,
-                                const struct lwpb_msg_desc *msg_desc,
-                                const struct lwpb_field_desc *field_desc,
-                                union lwpb_value *value, void *arg)
+static lwpb_decoder_action_t sdecoder_field_handler(struct lwpb_decoder *decoder,
+                                                    const struct lwpb_msg_desc *msg_desc,
+                                                    const struct lwpb_field_desc *field_desc,
+                                                    union lwpb_value *value, void *arg)
 {
     struct lwpb_struct_decoder *sdecoder = arg;
     struct lwpb_struct_decoder_stack_frame *frame = &sdecoder->stack[sdecoder->depth];
     const struct lwpb_struct_map_field *field;
     
-    field = find_map_field(frame->map, field_desc);
+    field = frame->map ? find_map_field(frame->map, field_desc) : NULL;
     if (field)
         unpack_field(sdecoder, field, value);
+    else
+        frame->msg_field = NULL;
 
     if (sdecoder->field_handler)
         sdecoder->field_handler(sdecoder, msg_desc, field_desc, value, sdecoder->arg);
+    
+    // Skip unmapped submessages unless the user handlers want to see them
+    if (!value && !frame->msg_field && !sdecoder->field_handler &&
+        !sdecoder->msg_start_handler && !sdecoder->msg_end_handler)
+        return LWPB_DECODER_SKIP;
+    
+    return LWPB_DECODER_CONTINUE;
 }
 
 
@@ -257,7 +317,48 @@ lwpb_err_t lwpb_struct_decoder_decode(struct lwpb_struct_decoder *sdecoder,
     sdecoder->stack[0].map = struct_map;
     sdecoder->stack[0].base = struct_base;
     sdecoder->stack[0].last_field = NULL;
+    sdecoder->stack[0].msg_field = NULL;
     sdecoder->stack[0].field_index = 0;
     
     return lwpb_decoder_decode(&sdecoder->decoder, struct_map->msg_desc, data, len, used);
 }
+
+/**
+ * Returns the decoded struct of a lazy submessage, decoding it on first
+ * access. The struct is allocated from the arena and cached in the lazy
+ * submessage, so later calls return the same struct.
+ * @param lazy Lazy submessage
+ * @param arena Arena to allocate the decoded struct from
+ * @param value Returns the decoded struct or NULL if the submessage was
+ * missing from the input (lazy submessage zeroed before decoding)
+ * @return Returns LWPB_ERR_OK when the submessage was successfully decoded
+ * or missing or LWPB_ERR_MEM if the arena is exhausted.
+ */
+lwpb_err_t lwpb_struct_lazy_get(struct lwpb_struct_lazy *lazy,
+                                struct lwpb_arena *arena, void **value)
+{
+    struct lwpb_struct_decoder sdecoder;
+    void *base;
+    lwpb_err_t ret;
+    
+    if (lazy->value || !lazy->map) {
+        *value = lazy->value;
+        return LWPB_ERR_OK;
+    }
+    
+    base = lwpb_arena_alloc(arena, lazy->map->struct_size);
+    if (!base)
+        return LWPB_ERR_MEM;
+    LWPB_MEMSET(base, 0, lazy->map->struct_size);
+    
+    lwpb_struct_decoder_init(&sdecoder);
+    ret = lwpb_struct_decoder_decode(&sdecoder, lazy->map, base,
+                                     lazy->data, lazy->len, NULL);
+    if (ret != LWPB_ERR_OK)
+        return ret;
+    
+    lazy->value = base;
+    *value = base;
+    
+    return LWPB_ERR_OK;
+}
@@ -51,6 +51,16 @@ void *__lwpb_memmove(void *dest, const void *src, size_t n)
     return dest;
 }
 
+void *__lwpb_memset(void *s, int c, size_t n)
+{
+    u8_t *d = s;
+    
+    while (n--)
+        *d++ = (u8_t) c;
+    
+    return s;
+}
+
 int __lwpb_memcmp(const void *s1, const void *s2, size_t n)
 {
     const u8_t *m1 = (const u8_t *) s1;
@@ -0,0 +1,415 @@
+/** @file bench_rpc_uring.c
+ * 
+ * Compares the socket RPC transports on epoll/select and on io_uring over
+ * loopback: calls per second and system calls per call of client and server.
+ * 
+ * Copyright 2009 Simon Kallweit
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+
+#include <lwpb/lwpb.h>
+#include <lwpb/rpc/socket_client.h>
+#include <lwpb/rpc/socket_server.h>
+
+#include "generated/test_rpc_pb2.h"
+
+/** Number of calls of a throughput run */
+#define NUM_CALLS 20000
+
+/** Number of calls of a run counting system calls */
+#define NUM_TRACED_CALLS 2000
+
+/** Maximum number of calls in flight */
+#define MAX_DEPTH 64
+
+/** Result of a client run, reported to the parent through a pipe */
+struct bench_result {
+    int ok;             /**< Number of successful calls */
+    int uring;          /**< Set if the client ran on io_uring */
+    double secs;        /**< Time spent in the calls */
+};
+
+/** Set by SIGTERM to close the server */
+static volatile sig_atomic_t server_stop;
+
+// Client handlers
+
+static lwpb_err_t client_request_handler(
+    struct lwpb_client *client, const struct lwpb_method_desc *method_desc,
+    const struct lwpb_msg_desc *msg_desc, void *buf, size_t *len, void *arg)
+{
+    struct lwpb_encoder encoder;
+
+    lwpb_encoder_init(&encoder);
+    lwpb_encoder_start(&encoder, msg_desc, buf, *len);
+    lwpb_encoder_add_string(&encoder, test_Name_name, "client 42");
+    *len = lwpb_encoder_finish(&encoder);
+
+    return LWPB_ERR_OK;
+}
+
+static lwpb_err_t client_response_handler(
+    struct lwpb_client *client, const struct lwpb_method_desc *method_desc,
+    const struct lwpb_msg_desc *msg_desc, void *buf, size_t len, void *arg)
+{
+    return LWPB_ERR_OK;
+}
+
+// Server handlers
+
+static lwpb_err_t server_request_handler(
+    struct lwpb_server *server, const struct lwpb_method_desc *method_desc,
+    const struct lwpb_msg_desc *req_desc, void *req_buf, size_t req_len,
+    const struct lwpb_msg_desc *res_desc, void *res_buf, size_t *res_len,
+    void *arg)
+{
+    struct lwpb_encoder encoder;
+
+    lwpb_encoder_init(&encoder);
+    lwpb_encoder_start(&encoder, res_desc, res_buf, *res_len);
+    lwpb_encoder_nested_start(&encoder, test_LookupResult_person);
+    lwpb_encoder_add_string(&encoder, test_Person_name, "Simon Kallweit");
+    lwpb_encoder_add_int32(&encoder, test_Person_id, 42);
+    lwpb_encoder_nested_end(&encoder);
+    *res_len = lwpb_encoder_finish(&encoder);
+
+    return LWPB_ERR_OK;
+}
+
+static const struct lwpb_service_desc *service_list[] = {
+    test_Search, NULL,
+};
+
+static void stop_handler(int sig)
+{
+    server_stop = 1;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Runs an inline server until SIGTERM, then closes it.
+ * @param options Socket transport options
+ * @param trace Set to stop for the tracing parent once the server is open
+ * @param fd Pipe to report the listen port to (0 on failure)
+ */
+static void run_server(unsigned int options, int trace, int fd)
+{
+    struct lwpb_transport_socket_server socket_server;
+    lwpb_transport_t transport;
+    struct lwpb_server server;
+    u16_t port = 0;
+
+    signal(SIGTERM, stop_handler);
+    if (trace)
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+
+    transport = lwpb_transport_socket_server_init(&socket_server);
+    lwpb_server_init(&server, service_list, transport);
+    lwpb_server_handler(&server, server_request_handler);
+    lwpb_transport_socket_server_options(transport, options);
+    if (lwpb_transport_socket_server_open(transport, "127.0.0.1", 0) == LWPB_ERR_OK)
+        port = lwpb_transport_socket_server_port(transport);
+    if (write(fd, &port, sizeof(port)) != sizeof(port) || !port)
+        exit(1);
+    if (trace)
+        raise(SIGSTOP);
+
+    while (!server_stop)
+        lwpb_transport_socket_server_update(transport);
+    lwpb_transport_socket_server_close(transport);
+    exit(0);
+}
+
+/**
+ * Runs calls with a fixed number of them in flight. Once connected, the
+ * client stops for the tracing parent, so only the calls are counted.
+ * @param options Socket transport options
+ * @param port Port of the server
+ * @param depth Number of calls in flight
+ * @param count Number of calls
+ * @param trace Set to stop for the tracing parent before the calls
+ * @param fd Pipe to report the result to
+ */
+static void run_client(unsigned int options, u16_t port, int depth, int count,
+                       int trace, int fd)
+{
+    static struct lwpb_client_call calls[MAX_DEPTH];
+    static int idle[MAX_DEPTH];
+    struct lwpb_transport_socket_client socket_client;
+    struct lwpb_client client;
+    struct bench_result result;
+    lwpb_transport_t transport;
+    double start;
+    int issued = 0;
+    int done = 0;
+    int i;
+
+    if (trace)
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+
+    LWPB_MEMSET(&result, 0, sizeof(result));
+    transport = lwpb_transport_socket_client_init(&socket_client);
+    lwpb_client_init(&client, transport);
+    lwpb_transport_socket_client_options(transport, options);
+    if (lwpb_transport_socket_client_open(transport, "127.0.0.1", port) != LWPB_ERR_OK)
+        exit(1);
+    while (socket_client.version != 2)
+        lwpb_transport_socket_client_update(transport);
+    result.uring = socket_client.uring.fd != -1;
+    if (trace)
+        raise(SIGSTOP);
+
+    start = now();
+    for (i = 0; i < depth; i++) {
+        lwpb_client_call_init(&calls[i], client_request_handler,
+                              client_response_handler, NULL, NULL);
+        lwpb_client_call_async(&client, test_Search_search_by_name, &calls[i]);
+    }
+    issued = depth;
+
+    // Issue the next call in a slot as soon as its call is done
+    while (done < count) {
+        lwpb_transport_socket_client_update(transport);
+        for (i = 0; i < depth; i++) {
+            if (!calls[i].done || idle[i])
+                continue;
+            done++;
+            if (calls[i].result == LWPB_RPC_OK)
+                result.ok++;
+            if (issued < count) {
+                lwpb_client_call_init(&calls[i], client_request_handler,
+                                      client_response_handler, NULL, NULL);
+                lwpb_client_call_async(&client, test_Search_search_by_name,
+                                       &calls[i]);
+                issued++;
+            } else {
+                idle[i] = 1;
+            }
+        }
+    }
+    result.secs = now() - start;
+
+    if (write(fd, &result, sizeof(result)) != sizeof(result))
+        exit(1);
+    lwpb_transport_socket_client_close(transport);
+    exit(0);
+}
+
+/**
+ * Follows the traced server and client, counting system call stops of each
+ * from the moment the client starts its calls until it exits.
+ * @param server Process id of the server
+ * @param client Process id of the client
+ * @param server_calls Returns the number of system calls of the server
+ * @param client_calls Returns the number of system calls of the client
+ */
+static void trace_run(pid_t server, pid_t client, long *server_calls,
+                      long *client_calls)
+{
+    long stops[2] = { 0, 0 };
+    int started[2] = { 0, 0 };
+    int status;
+    int sig;
+    int i;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, __WALL)) > 0) {
+        i = pid == client;
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            if (pid == client) {
+                *server_calls = stops[0] / 2;
+                *client_calls = stops[1] / 2;
+                kill(server, SIGTERM);
+            }
+            continue;
+        }
+        sig = WSTOPSIG(status);
+        if (sig == (SIGTRAP | 0x80)) {
+            stops[i]++;
+            sig = 0;
+        } else if (sig == SIGSTOP && !started[i]) {
+            // Initial stop, count from here on
+            ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *) PTRACE_O_TRACESYSGOOD);
+            started[i] = 1;
+            stops[0] = 0;
+            sig = 0;
+        }
+        ptrace(PTRACE_SYSCALL, pid, NULL, (void *) (long) sig);
+    }
+}
+
+/**
+ * Runs a client against a server, both in child processes with their
+ * output discarded.
+ * @param options Socket transport options of client and server
+ * @param depth Number of calls in flight
+ * @param count Number of calls
+ * @param trace Set to count system calls
+ * @param result Returns the result of the client
+ * @param server_calls Returns the number of system calls of the server
+ * @param client_calls Returns the number of system calls of the client
+ * @return Returns 0 if all calls succeeded.
+ */
+static int run_bench(unsigned int options, int depth, int count, int trace,
+                     struct bench_result *result, long *server_calls,
+                     long *client_calls)
+{
+    pid_t server, client;
+    int status;
+    int fds[2];
+    u16_t port;
+
+    if (pipe(fds) == -1)
+        return 1;
+    fflush(stdout);
+
+    server = fork();
+    if (server == 0) {
+        freopen("/dev/null", "w", stdout);
+        run_server(options, trace, fds[1]);
+    }
+    if (read(fds[0], &port, sizeof(port)) != sizeof(port) || !port) {
+        kill(server, SIGKILL);
+        return 1;
+    }
+
+    client = fork();
+    if (client == 0) {
+        freopen("/dev/null", "w", stdout);
+        run_client(options, port, depth, count, trace, fds[1]);
+    }
+
+    if (trace) {
+        trace_run(server, client, server_calls, client_calls);
+    } else {
+        waitpid(client, NULL, 0);
+        kill(server, SIGTERM);
+        waitpid(server, &status, 0);
+    }
+
+    LWPB_MEMSET(result, 0, sizeof(*result));
+    if (read(fds[0], result, sizeof(*result)) != sizeof(*result))
+        result->ok = 0;
+    close(fds[0]);
+    close(fds[1]);
+
+    return result->ok != count;
+}
+
+/**
+ * Checks whether this process may trace its children.
+ * @return Returns 1 if system calls can be counted.
+ */
+static int can_trace(void)
+{
+    pid_t pid;
+    int status;
+
+    pid = fork();
+    if (pid == 0) {
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) == -1)
+            exit(1);
+        raise(SIGSTOP);
+        exit(0);
+    }
+    if (waitpid(pid, &status, 0) != pid)
+        return 0;
+    if (WIFSTOPPED(status)) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return 1;
+    }
+    return 0;
+}
+
+int main()
+{
+    static const unsigned int options[2] = {
+        LWPB_TRANSPORT_SOCKET_DEFAULT_OPTIONS,
+        LWPB_TRANSPORT_SOCKET_DEFAULT_OPTIONS | LWPB_TRANSPORT_SOCKET_URING,
+    };
+    static const int depths[2] = { 1, MAX_DEPTH };
+    struct bench_result result;
+    long server_calls, client_calls;
+    double per_call[2] = { 0, 0 };
+    int uring = 0;
+    int trace;
+    int m, d;
+
+    trace = can_trace();
+    if (!trace)
+        LWPB_DIAG_PRINTF("cannot trace child processes, not counting system calls\n");
+
+    LWPB_DIAG_PRINTF("%-8s %6s %12s %16s %16s\n", "mode", "depth", "calls/s",
+                     "client sys/call", "server sys/call");
+
+    for (m = 0; m < 2; m++) {
+        for (d = 0; d < 2; d++) {
+            if (run_bench(options[m], depths[d], NUM_CALLS, 0, &result,
+                          NULL, NULL) != 0) {
+                LWPB_DIAG_PRINTF("%s, depth %d: only %d of %d calls succeeded\n",
+                                 m ? "uring" : "epoll", depths[d], result.ok,
+                                 NUM_CALLS);
+                return 1;
+            }
+            if (m)
+                uring = result.uring;
+            LWPB_DIAG_PRINTF("%-8s %6d %12.0f", m ? "uring" : "epoll",
+                             depths[d], result.ok / result.secs);
+
+            if (!trace) {
+                LWPB_DIAG_PRINTF("\n");
+                continue;
+            }
+            if (run_bench(options[m], depths[d], NUM_TRACED_CALLS, 1, &result,
+                          &server_calls, &client_calls) != 0) {
+                LWPB_DIAG_PRINTF("\ntraced run failed\n");
+                return 1;
+            }
+            LWPB_DIAG_PRINTF(" %16.2f %16.2f\n",
+                             (double) client_calls / NUM_TRACED_CALLS,
+                             (double) server_calls / NUM_TRACED_CALLS);
+            if (d == 0)
+                per_call[m] = (double) (client_calls + server_calls) /
+                              NUM_TRACED_CALLS;
+        }
+    }
+
+    if (!uring) {
+        LWPB_DIAG_PRINTF("io_uring is not available, ran on epoll/select\n");
+        return 0;
+    }
+
+    // A call in flight alone costs fewer system calls on io_uring
+    if (trace && per_call[1] >= per_call[0]) {
+        LWPB_DIAG_PRINTF("io_uring takes %.2f system calls per call, "
+                         "epoll %.2f\n", per_call[1], per_call[0]);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,586 @@
+/** @file rpc_bench.c
+ * 
+ * RPC load generator and latency benchmark (lwpb-rpc-bench).
+ * 
+ * Starts a local server with a configurable handler cost and runs a number
+ * of client connections against it, each on its own thread. In closed-loop
+ * mode every connection keeps a fixed number of calls in flight. In
+ * open-loop mode calls arrive at a fixed rate, and their latency is measured
+ * from the time they were due, so a server falling behind shows up in the
+ * latency instead of slowing down the arrivals. Reports throughput and
+ * latency percentiles for each transport.
+ * 
+ * Copyright 2009 Simon Kallweit
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <lwpb/lwpb.h>
+#include <lwpb/rpc/direct.h>
+#include <lwpb/rpc/shm_client.h>
+#include <lwpb/rpc/shm_server.h>
+#include <lwpb/rpc/socket_client.h>
+#include <lwpb/rpc/socket_server.h>
+#include <lwpb/rpc/stats.h>
+
+#include "generated/test_rpc_pb2.h"
+
+/** Maximum number of calls in flight per connection */
+#define MAX_SLOTS 1024
+
+/** Maximum number of client connections */
+#define MAX_CONNS 256
+
+/** Transports the benchmark runs on */
+enum bench_kind {
+    BENCH_DIRECT,
+    BENCH_SOCKET,
+    BENCH_URING,
+    BENCH_SHM,
+    BENCH_KINDS,
+};
+
+static const char *kind_names[BENCH_KINDS] = {
+    "direct", "socket", "uring", "shm",
+};
+
+/** Benchmark parameters, set from the command line */
+struct bench_params {
+    int conns;                  /**< Number of client connections */
+    int depth;                  /**< Calls in flight per connection (closed loop) */
+    double rate;                /**< Total arrival rate (calls/s), 0 = closed loop */
+    double duration;            /**< Time calls are issued (s) */
+    u32_t cost;                 /**< Time spent in the server handler (us) */
+    int workers;                /**< Socket server worker threads (0 = inline) */
+};
+
+struct bench_conn;
+
+/** A call in flight */
+struct bench_slot {
+    struct lwpb_client_call call;
+    struct bench_conn *conn;
+    struct bench_slot *next;    /**< Next free slot */
+    u64_t start;                /**< Time the call was due (ns) */
+};
+
+/** A client connection, driven by its own thread */
+struct bench_conn {
+    enum bench_kind kind;
+    pthread_t thread;
+    union {
+        struct lwpb_transport_direct direct;
+        struct lwpb_transport_socket_client socket;
+        struct lwpb_transport_shm_client shm;
+    } u;
+    struct lwpb_server server;  /**< In-process server of the direct transport */
+    struct lwpb_client client;
+    lwpb_transport_t transport;
+    struct bench_slot slots[MAX_SLOTS];
+    struct bench_slot *free;    /**< Free slots */
+    int pending;                /**< Number of calls in flight */
+    u64_t start;                /**< Time the first call was due (ns) */
+    u64_t interval;             /**< Time between arrivals (ns), 0 = closed loop */
+    u64_t ok;                   /**< Number of successful calls */
+    u64_t errors;               /**< Number of failed calls */
+    struct lwpb_histogram latency; /**< Latency of successful calls (ns) */
+};
+
+static struct bench_params params = {
+    .conns = 4,
+    .depth = 1,
+    .rate = 0,
+    .duration = 1,
+    .cost = 0,
+    .workers = 0,
+};
+
+static struct bench_conn *conns[MAX_CONNS];
+
+// Client handlers
+
+static lwpb_err_t client_request_handler(
+    struct lwpb_client *client, const struct lwpb_method_desc *method_desc,
+    const struct lwpb_msg_desc *msg_desc, void *buf, size_t *len, void *arg)
+{
+    struct lwpb_encoder encoder;
+
+    lwpb_encoder_init(&encoder);
+    lwpb_encoder_start(&encoder, msg_desc, buf, *len);
+    lwpb_encoder_add_string(&encoder, test_Name_name, "client 42");
+    *len = lwpb_encoder_finish(&encoder);
+
+    return LWPB_ERR_OK;
+}
+
+static lwpb_err_t client_response_handler(
+    struct lwpb_client *client, const struct lwpb_method_desc *method_desc,
+    const struct lwpb_msg_desc *msg_desc, void *buf, size_t len, void *arg)
+{
+    return LWPB_ERR_OK;
+}
+
+static void client_call_done_handler(
+    struct lwpb_client *client, const struct lwpb_method_desc *method_desc,
+    lwpb_rpc_result_t result, void *arg)
+{
+    struct bench_slot *slot = arg;
+    struct bench_conn *conn = slot->conn;
+
+    if (result == LWPB_RPC_OK) {
+        conn->ok++;
+        lwpb_histogram_record(&conn->latency, lwpb_stats_now() - slot->start);
+    } else {
+        conn->errors++;
+    }
+    conn->pending--;
+    slot->next = conn->free;
+    conn->free = slot;
+}
+
+// Server handlers
+
+static lwpb_err_t server_request_handler(
+    struct lwpb_server *server, const struct lwpb_method_desc *method_desc,
+    const struct lwpb_msg_desc *req_desc, void *req_buf, size_t req_len,
+    const struct lwpb_msg_desc *res_desc, void *res_buf, size_t *res_len,
+    void *arg)
+{
+    struct lwpb_encoder encoder;
+    u64_t end;
+
+    // Burn the handler cost on the CPU, like a real handler would
+    if (params.cost) {
+        end = lwpb_stats_now() + params.cost * 1000ULL;
+        while (lwpb_stats_now() < end);
+    }
+
+    lwpb_encoder_init(&encoder);
+    lwpb_encoder_start(&encoder, res_desc, res_buf, *res_len);
+    lwpb_encoder_nested_start(&encoder, test_LookupResult_person);
+    lwpb_encoder_add_string(&encoder, test_Person_name, "Simon Kallweit");
+    lwpb_encoder_add_int32(&encoder, test_Person_id, 42);
+    lwpb_encoder_nested_end(&encoder);
+    *res_len = lwpb_encoder_finish(&encoder);
+
+    return LWPB_ERR_OK;
+}
+
+static const struct lwpb_service_desc *service_list[] = {
+    test_Search, NULL,
+};
+
+/**
+ * Runs a server in the current process until it is killed.
+ * @param kind Transport of the server
+ * @param path Path of the shared memory server socket
+ * @param fd Pipe to report the listen port to (0 on failure)
+ */
+static void run_server(enum bench_kind kind, const char *path, int fd)
+{
+    struct lwpb_transport_socket_server socket_server;
+    struct lwpb_transport_shm_server shm_server;
+    lwpb_transport_t transport;
+    struct lwpb_server server;
+    u16_t port = 0;
+
+    if (kind == BENCH_SHM) {
+        transport = lwpb_transport_shm_server_init(&shm_server);
+        lwpb_server_init(&server, service_list, transport);
+        lwpb_server_handler(&server, server_request_handler);
+        if (lwpb_transport_shm_server_open(transport, path) == LWPB_ERR_OK)
+            port = 1;
+        if (write(fd, &port, sizeof(port)) != sizeof(port) || !port)
+            exit(1);
+        while (1)
+            lwpb_transport_shm_server_update(transport);
+    }
+
+    transport = lwpb_transport_socket_server_init(&socket_server);
+    lwpb_server_init(&server, service_list, transport);
+    lwpb_server_handler(&server, server_request_handler);
+    lwpb_transport_socket_server_workers(transport, params.workers, 0);
+    if (kind == BENCH_URING)
+        lwpb_transport_socket_server_options(transport,
+            LWPB_TRANSPORT_SOCKET_DEFAULT_OPTIONS | LWPB_TRANSPORT_SOCKET_URING);
+    if (lwpb_transport_socket_server_open(transport, "127.0.0.1", 0) == LWPB_ERR_OK)
+        port = lwpb_transport_socket_server_port(transport);
+    if (write(fd, &port, sizeof(port)) != sizeof(port) || !port)
+        exit(1);
+    while (1)
+        lwpb_transport_socket_server_update(transport);
+}
+
+/**
+ * Starts the server of a transport in a child process. The direct transport
+ * has its server in each client thread instead.
+ * @param kind Transport of the server
+ * @param path Path of the shared memory server socket
+ * @param pid Returns the process id of the server
+ * @param port Returns the listen port of a socket server
+ * @return Returns 0 if the server is running.
+ */
+static int start_server(enum bench_kind kind, const char *path, pid_t *pid,
+                        u16_t *port)
+{
+    int fds[2];
+
+    *pid = 0;
+    if (kind == BENCH_DIRECT)
+        return 0;
+
+    if (pipe(fds) == -1)
+        return 1;
+    fflush(stdout);
+    *pid = fork();
+    if (*pid == 0)
+        run_server(kind, path, fds[1]);
+    if (read(fds[0], port, sizeof(*port)) != sizeof(*port) || !*port) {
+        kill(*pid, SIGKILL);
+        waitpid(*pid, NULL, 0);
+        return 1;
+    }
+    close(fds[0]);
+    close(fds[1]);
+
+    return 0;
+}
+
+/**
+ * Opens a client connection.
+ * @param conn Connection
+ * @param kind Transport of the connection
+ * @param path Path of the shared memory server socket
+ * @param port Listen port of a socket server
+ * @return Returns LWPB_ERR_OK if successful.
+ */
+static lwpb_err_t open_conn(struct bench_conn *conn, enum bench_kind kind,
+                            const char *path, u16_t port)
+{
+    lwpb_err_t ret = LWPB_ERR_OK;
+    int i;
+
+    LWPB_MEMSET(conn, 0, sizeof(*conn));
+    conn->kind = kind;
+    for (i = 0; i < MAX_SLOTS; i++) {
+        conn->slots[i].conn = conn;
+        conn->slots[i].next = conn->free;
+        conn->free = &conn->slots[i];
+    }
+
+    switch (kind) {
+    case BENCH_DIRECT:
+        conn->transport = lwpb_transport_direct_init(&conn->u.direct);
+        lwpb_server_init(&conn->server, service_list, conn->transport);
+        lwpb_server_handler(&conn->server, server_request_handler);
+        break;
+    case BENCH_SOCKET:
+    case BENCH_URING:
+        conn->transport = lwpb_transport_socket_client_init(&conn->u.socket);
+        if (kind == BENCH_URING)
+            lwpb_transport_socket_client_options(conn->transport,
+                LWPB_TRANSPORT_SOCKET_DEFAULT_OPTIONS | LWPB_TRANSPORT_SOCKET_URING);
+        ret = lwpb_transport_socket_client_open(conn->transport, "127.0.0.1", port);
+        break;
+    case BENCH_SHM:
+        conn->transport = lwpb_transport_shm_client_init(&conn->u.shm);
+        ret = lwpb_transport_shm_client_open(conn->transport, path);
+        break;
+    default:
+        return LWPB_ERR_NET_INIT;
+    }
+    lwpb_client_init(&conn->client, conn->transport);
+
+    return ret;
+}
+
+/**
+ * Closes a client connection.
+ * @param conn Connection
+ */
+static void close_conn(struct bench_conn *conn)
+{
+    switch (conn->kind) {
+    case BENCH_DIRECT:
+        lwpb_transport_direct_free(conn->transport);
+        break;
+    case BENCH_SOCKET:
+    case BENCH_URING:
+        lwpb_transport_socket_client_close(conn->transport);
+        break;
+    case BENCH_SHM:
+        lwpb_transport_shm_client_close(conn->transport);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * Waits for completions of a connection. Returns when at least one call is
+ * done or the transport gives up waiting.
+ * @param conn Connection
+ */
+static void update_conn(struct bench_conn *conn)
+{
+    switch (conn->kind) {
+    case BENCH_SOCKET:
+    case BENCH_URING:
+        lwpb_transport_socket_client_update(conn->transport);
+        break;
+    case BENCH_SHM:
+        lwpb_transport_shm_client_update(conn->transport);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * Issues a call on a connection.
+ * @param conn Connection
+ * @param due Time the call was due (ns)
+ */
+static void issue_call(struct bench_conn *conn, u64_t due)
+{
+    struct bench_slot *slot = conn->free;
+
+    conn->free = slot->next;
+    conn->pending++;
+    slot->start = due;
+    lwpb_client_call_init(&slot->call, client_request_handler,
+                          client_response_handler, client_call_done_handler,
+                          slot);
+    lwpb_client_call_async(&conn->client, test_Search_search_by_name, &slot->call);
+}
+
+/**
+ * Thread running the calls of a connection until the end of the benchmark,
+ * then waiting for the calls in flight.
+ * @param arg Connection
+ * @return Returns NULL.
+ */
+static void *conn_thread(void *arg)
+{
+    struct bench_conn *conn = arg;
+    u64_t end = conn->start + (u64_t) (params.duration * 1e9);
+    u64_t next = conn->start;
+    u64_t current;
+    struct timespec ts;
+    int n;
+
+    while (1) {
+        current = lwpb_stats_now();
+        if (current < end) {
+            if (!conn->interval) {
+                // Direct calls are done right away, so refill only once
+                for (n = params.depth - conn->pending; n > 0; n--)
+                    issue_call(conn, lwpb_stats_now());
+            } else {
+                // Calls which became due while waiting are issued late, but
+                // their latency still counts from when they were due
+                while (next <= current && next < end && conn->free) {
+                    issue_call(conn, next);
+                    next += conn->interval;
+                }
+            }
+        } else if (!conn->pending) {
+            break;
+        }
+
+        if (conn->pending) {
+            update_conn(conn);
+        } else if (next > current + 100000) {
+            // Sleep until shortly before the next arrival and spin the rest,
+            // as waking up late would add to the measured latency
+            ts.tv_sec = (next - current - 50000) / 1000000000;
+            ts.tv_nsec = (next - current - 50000) % 1000000000;
+            nanosleep(&ts, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Runs the benchmark on a transport and prints a line with the results.
+ * @param kind Transport
+ * @param out Stream to print the results to
+ * @return Returns 0 if all calls succeeded.
+ */
+static int run_bench(enum bench_kind kind, FILE *out)
+{
+    struct lwpb_histogram latency;
+    char path[64];
+    u64_t start, elapsed;
+    u64_t ok = 0, errors = 0;
+    u16_t port = 0;
+    pid_t pid;
+    int opened = 0;
+    int failed = 0;
+    int i;
+
+    snprintf(path, sizeof(path), "/tmp/lwpb-rpc-bench-%d", (int) getpid());
+    if (start_server(kind, path, &pid, &port) != 0) {
+        fprintf(out, "%-8s cannot start server\n", kind_names[kind]);
+        return 1;
+    }
+
+    for (opened = 0; opened < params.conns; opened++) {
+        if (open_conn(conns[opened], kind, path, port) != LWPB_ERR_OK) {
+            fprintf(out, "%-8s cannot open connection %d\n", kind_names[kind],
+                    opened);
+            failed = 1;
+            break;
+        }
+    }
+
+    // Spread the arrivals of the connections evenly
+    start = lwpb_stats_now() + 10000000;
+    for (i = 0; i < opened && !failed; i++) {
+        conns[i]->interval = params.rate > 0 ?
+                             (u64_t) (params.conns * 1e9 / params.rate) : 0;
+        conns[i]->start = start + conns[i]->interval * i / params.conns;
+        if (pthread_create(&conns[i]->thread, NULL, conn_thread, conns[i]) != 0)
+            failed = 1;
+    }
+    for (i = 0; i < opened && !failed; i++)
+        pthread_join(conns[i]->thread, NULL);
+    elapsed = lwpb_stats_now() - start;
+
+    LWPB_MEMSET(&latency, 0, sizeof(latency));
+    for (i = 0; i < opened; i++) {
+        ok += conns[i]->ok;
+        errors += conns[i]->errors;
+        lwpb_histogram_merge(&latency, &conns[i]->latency);
+        close_conn(conns[i]);
+    }
+
+    if (pid) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    if (kind == BENCH_SHM)
+        unlink(path);
+
+    if (failed)
+        return 1;
+
+    fprintf(out, "%-8s %6d %10.0f %10.1f %10.1f %10.1f %10.1f %8llu\n",
+            kind_names[kind], params.conns, ok * 1e9 / elapsed,
+            lwpb_histogram_percentile(&latency, 50) / 1e3,
+            lwpb_histogram_percentile(&latency, 99) / 1e3,
+            lwpb_histogram_percentile(&latency, 99.9) / 1e3,
+            latency.max / 1e3, (unsigned long long) errors);
+    fflush(out);
+
+    return errors != 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -t list   transports to run, comma separated "
+            "(direct,socket,uring,shm; default all)\n"
+            "  -c n      number of client connections (default %d)\n"
+            "  -p n      calls in flight per connection in closed-loop mode "
+            "(default %d)\n"
+            "  -r rate   total arrival rate in calls/s, runs open-loop "
+            "(default closed-loop)\n"
+            "  -d secs   duration of each run (default %g)\n"
+            "  -w us     time spent in the server handler (default %u)\n"
+            "  -W n      socket server worker threads (default %d)\n",
+            name, params.conns, params.depth, params.duration, params.cost,
+            params.workers);
+}
+
+int main(int argc, char *argv[])
+{
+    int kinds[BENCH_KINDS] = { 1, 1, 1, 1 };
+    char *list, *name;
+    FILE *out;
+    int failed = 0;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "t:c:p:r:d:w:W:h")) != -1) {
+        switch (opt) {
+        case 't':
+            LWPB_MEMSET(kinds, 0, sizeof(kinds));
+            for (list = optarg; (name = strtok(list, ",")); list = NULL) {
+                for (i = 0; i < BENCH_KINDS; i++)
+                    if (strcmp(name, kind_names[i]) == 0)
+                        kinds[i] = 1;
+                if (!strcmp(name, "all"))
+                    for (i = 0; i < BENCH_KINDS; i++)
+                        kinds[i] = 1;
+            }
+            break;
+        case 'c': params.conns = atoi(optarg); break;
+        case 'p': params.depth = atoi(optarg); break;
+        case 'r': params.rate = atof(optarg); break;
+        case 'd': params.duration = atof(optarg); break;
+        case 'w': params.cost = atoi(optarg); break;
+        case 'W': params.workers = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (params.conns < 1 || params.conns > MAX_CONNS ||
+        params.depth < 1 || params.depth > MAX_SLOTS || params.rate < 0 ||
+        params.duration <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for (i = 0; i < params.conns; i++) {
+        conns[i] = malloc(sizeof(struct bench_conn));
+        if (!conns[i])
+            return 1;
+    }
+
+    // The library logs every frame to stdout, keep it out of the results
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    if (!out || !freopen("/dev/null", "w", stdout))
+        return 1;
+
+    if (params.rate > 0)
+        fprintf(out, "open loop, %.0f calls/s", params.rate);
+    else
+        fprintf(out, "closed loop, %d calls in flight per connection",
+                params.depth);
+    fprintf(out, ", handler cost %u us, %d workers, %g s\n", params.cost,
+            params.workers, params.duration);
+    fprintf(out, "%-8s %6s %10s %10s %10s %10s %10s %8s\n", "transport",
+            "conns", "calls/s", "p50 us", "p99 us", "p999 us", "max us",
+            "errors");
+
+    for (i = 0; i < BENCH_KINDS; i++)
+        if (kinds[i] && run_bench(i, out) != 0)
+            failed = 1;
+
+    for (i = 0; i < params.conns; i++)
+        free(conns[i]);
+    fclose(out);
+
+    return failed;
+}
@@ -0,0 +1,219 @@
+/** @file rpc_replay.c
+ *
+ * RPC traffic replay (lwpb-rpc-replay).
+ *
+ * Sends the frames of a capture written by a socket server with
+ * lwpb_transport_socket_server_capture() again, either against a server
+ * given on the command line or against a local server of the test services.
+ * Frames are sent with their captured timing, scaled by a speed factor, or
+ * as fast as possible. Reports throughput and latency percentiles.
+ *
+ * Copyright 2009 Simon Kallweit
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <lwpb/lwpb.h>
+#include <lwpb/rpc/capture.h>
+#include <lwpb/rpc/socket_server.h>
+
+#include "generated/test_rpc_pb2.h"
+
+/** Replay parameters, set from the command line */
+struct replay_params {
+    const char *host;           /**< Host of the server */
+    u16_t port;                 /**< Port of the server, 0 = local server */
+    double speed;               /**< Speed factor, 0 = as fast as possible */
+    int workers;                /**< Local server worker threads (0 = inline) */
+    int uring;                  /**< Run the local server on io_uring */
+};
+
+static struct replay_params params = {
+    .host = "127.0.0.1",
+    .port = 0,
+    .speed = 1,
+    .workers = 0,
+    .uring = 0,
+};
+
+// Server handlers
+
+static lwpb_err_t server_request_handler(
+    struct lwpb_server *server, const struct lwpb_method_desc *method_desc,
+    const struct lwpb_msg_desc *req_desc, void *req_buf, size_t req_len,
+    const struct lwpb_msg_desc *res_desc, void *res_buf, size_t *res_len,
+    void *arg)
+{
+    struct lwpb_encoder encoder;
+
+    lwpb_encoder_init(&encoder);
+    lwpb_encoder_start(&encoder, res_desc, res_buf, *res_len);
+    lwpb_encoder_nested_start(&encoder, test_LookupResult_person);
+    lwpb_encoder_add_string(&encoder, test_Person_name, "Simon Kallweit");
+    lwpb_encoder_add_int32(&encoder, test_Person_id, 42);
+    lwpb_encoder_nested_end(&encoder);
+    *res_len = lwpb_encoder_finish(&encoder);
+
+    return LWPB_ERR_OK;
+}
+
+static const struct lwpb_service_desc *service_list[] = {
+    test_Search, NULL,
+};
+
+/**
+ * Runs a local socket server in the current process until it is killed.
+ * @param fd Pipe to report the listen port to (0 on failure)
+ */
+static void run_server(int fd)
+{
+    struct lwpb_transport_socket_server socket_server;
+    lwpb_transport_t transport;
+    struct lwpb_server server;
+    u16_t port = 0;
+
+    transport = lwpb_transport_socket_server_init(&socket_server);
+    lwpb_server_init(&server, service_list, transport);
+    lwpb_server_handler(&server, server_request_handler);
+    lwpb_transport_socket_server_workers(transport, params.workers, 0);
+    if (params.uring)
+        lwpb_transport_socket_server_options(transport,
+            LWPB_TRANSPORT_SOCKET_DEFAULT_OPTIONS | LWPB_TRANSPORT_SOCKET_URING);
+    if (lwpb_transport_socket_server_open(transport, "127.0.0.1", 0) == LWPB_ERR_OK)
+        port = lwpb_transport_socket_server_port(transport);
+    if (write(fd, &port, sizeof(port)) != sizeof(port) || !port)
+        exit(1);
+    while (1)
+        lwpb_transport_socket_server_update(transport);
+}
+
+/**
+ * Starts the local server in a child process.
+ * @param pid Returns the process id of the server
+ * @param port Returns the listen port of the server
+ * @return Returns 0 if the server is running.
+ */
+static int start_server(pid_t *pid, u16_t *port)
+{
+    int fds[2];
+
+    if (pipe(fds) == -1)
+        return 1;
+    fflush(stdout);
+    *pid = fork();
+    if (*pid == 0)
+        run_server(fds[1]);
+    if (read(fds[0], port, sizeof(*port)) != sizeof(*port) || !*port) {
+        kill(*pid, SIGKILL);
+        waitpid(*pid, NULL, 0);
+        return 1;
+    }
+    close(fds[0]);
+    close(fds[1]);
+
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [options] capture\n"
+            "  -H host   host of the server (default %s)\n"
+            "  -p port   port of the server (default a local server)\n"
+            "  -s speed  speed factor of the captured timing, 0 sends as fast "
+            "as possible (default %g)\n"
+            "  -W n      local server worker threads (default %d)\n"
+            "  -u        run the local server on io_uring\n",
+            name, params.host, params.speed, params.workers);
+}
+
+int main(int argc, char *argv[])
+{
+    struct lwpb_capture capture;
+    struct lwpb_replay_result result;
+    lwpb_err_t ret;
+    FILE *out;
+    pid_t pid = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "H:p:s:W:uh")) != -1) {
+        switch (opt) {
+        case 'H': params.host = optarg; break;
+        case 'p': params.port = atoi(optarg); break;
+        case 's': params.speed = atof(optarg); break;
+        case 'W': params.workers = atoi(optarg); break;
+        case 'u': params.uring = 1; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || params.speed < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // The library logs every frame to stdout, keep it out of the results
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    if (!out || !freopen("/dev/null", "w", stdout))
+        return 1;
+
+    if (lwpb_capture_open(&capture, argv[optind]) != LWPB_ERR_OK) {
+        fprintf(out, "cannot open capture '%s'\n", argv[optind]);
+        return 1;
+    }
+    if (!params.port && start_server(&pid, &params.port) != 0) {
+        fprintf(out, "cannot start server\n");
+        lwpb_capture_close(&capture);
+        return 1;
+    }
+
+    ret = lwpb_replay_run(&capture, params.host, params.port, params.speed,
+                          &result);
+    lwpb_capture_close(&capture);
+
+    if (pid) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+
+    if (params.speed > 0)
+        fprintf(out, "replay at %gx speed", params.speed);
+    else
+        fprintf(out, "replay as fast as possible");
+    fprintf(out, ", %d connections, %llu frames, %llu bytes\n", result.conns,
+            (unsigned long long) result.frames,
+            (unsigned long long) result.bytes);
+    fprintf(out, "%10s %10s %10s %10s %10s %10s %10s %8s %8s\n", "requests",
+            "responses", "calls/s", "p50 us", "p99 us", "p999 us", "max us",
+            "errors", "lost");
+    fprintf(out, "%10llu %10llu %10.0f %10.1f %10.1f %10.1f %10.1f %8llu %8llu\n",
+            (unsigned long long) result.requests,
+            (unsigned long long) result.responses,
+            result.duration ? result.responses * 1e9 / result.duration : 0,
+            lwpb_histogram_percentile(&result.latency, 50) / 1e3,
+            lwpb_histogram_percentile(&result.latency, 99) / 1e3,
+            lwpb_histogram_percentile(&result.latency, 99.9) / 1e3,
+            result.latency.max / 1e3, (unsigned long long) result.errors,
+            (unsigned long long) result.lost);
+    if (ret != LWPB_ERR_OK)
+        fprintf(out, "replay failed (%d)\n", ret);
+    fclose(out);
+
+    return ret != LWPB_ERR_OK || result.errors || result.lost;
+}
@@ -0,0 +1,147 @@
+/** @file test_column.c
+ *
+ * Tests the columnar decoder.
+ * 
+ * Copyright 2009 Simon Kallweit
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <lwpb/lwpb.h>
+
+#include "generated/test_simple_pb2.h"
+
+#define NUM_RECORDS 100
+
+#define CHECK(_expr_)                                                       \
+    do {                                                                    \
+        if (!(_expr_)) {                                                    \
+            LWPB_DIAG_PRINTF("%s:%d: check failed: %s\n",                   \
+                             __FILE__, __LINE__, #_expr_);                  \
+            return 1;                                                       \
+        }                                                                   \
+    } while (0)
+
+/**
+ * Encodes a person record into a stream buffer, prefixed with its length.
+ */
+static size_t encode_record(u8_t *buf, size_t len, int i)
+{
+    struct lwpb_encoder encoder;
+    char name[32];
+    char number[32];
+    size_t record_len;
+    int j;
+
+    snprintf(name, sizeof(name), "person %d", i);
+
+    lwpb_encoder_init(&encoder);
+    lwpb_encoder_start(&encoder, test_Person, buf + 4, len - 4);
+    lwpb_encoder_add_string(&encoder, test_Person_name, name);
+    lwpb_encoder_add_int32(&encoder, test_Person_id, i);
+    if (i % 2 == 0)
+        lwpb_encoder_add_string(&encoder, test_Person_email, "even@example.com");
+    for (j = 0; j < i % 3; j++) {
+        snprintf(number, sizeof(number), "%d-%d", i, j);
+        lwpb_encoder_nested_start(&encoder, test_Person_phone);
+        lwpb_encoder_add_string(&encoder, test_PhoneNumber_number, number);
+        lwpb_encoder_add_enum(&encoder, test_PhoneNumber_type, j);
+        lwpb_encoder_nested_end(&encoder);
+    }
+    record_len = lwpb_encoder_finish(&encoder);
+
+    buf[0] = record_len & 0xff;
+    buf[1] = (record_len >> 8) & 0xff;
+    buf[2] = (record_len >> 16) & 0xff;
+    buf[3] = (record_len >> 24) & 0xff;
+
+    return record_len + 4;
+}
+
+int main()
+{
+    static u8_t buf[NUM_RECORDS * 128];
+    size_t len = 0;
+    size_t used;
+    lwpb_err_t ret;
+    struct lwpb_column columns[4];
+    struct lwpb_column *id = &columns[0];
+    struct lwpb_column *email = &columns[1];
+    struct lwpb_column *number = &columns[2];
+    struct lwpb_column *type = &columns[3];
+    const struct lwpb_field_desc *type_path[] = {
+        test_Person_phone, test_PhoneNumber_type,
+    };
+    struct lwpb_column_decoder cdecoder;
+    s64_t id_sum = 0;
+    u32_t *ends;
+    int i, j;
+
+    for (i = 0; i < NUM_RECORDS; i++)
+        len += encode_record(buf + len, sizeof(buf) - len, i);
+
+    LWPB_DIAG_PRINTF("encoded stream length = %d\n", (int) len);
+
+    CHECK(lwpb_column_init_name(id, test_Person, "id") == LWPB_ERR_OK);
+    CHECK(lwpb_column_init_name(email, test_Person, "email") == LWPB_ERR_OK);
+    CHECK(lwpb_column_init_name(number, test_Person, "phone.number") == LWPB_ERR_OK);
+    CHECK(lwpb_column_init(type, type_path, 2) == LWPB_ERR_OK);
+    CHECK(lwpb_column_init_name(&columns[0], test_Person, "phone.foo") ==
+          LWPB_ERR_UNKNOWN_FIELD);
+
+    lwpb_column_decoder_init(&cdecoder, test_Person, columns, 4);
+
+    // Decode the stream in two chunks, the first ending mid-record
+    ret = lwpb_column_decoder_decode_stream(&cdecoder, buf, len / 2, &used);
+    LWPB_DIAG_PRINTF("first chunk: ret = %d, used = %d\n", ret, (int) used);
+    CHECK(ret == LWPB_ERR_END_OF_BUF);
+    ret = lwpb_column_decoder_decode_stream(&cdecoder, buf + used, len - used, &used);
+    LWPB_DIAG_PRINTF("second chunk: ret = %d\n", ret);
+    CHECK(ret == LWPB_ERR_OK);
+
+    for (i = 0; i < 4; i++)
+        CHECK(columns[i].num_rows == NUM_RECORDS);
+
+    // Vectorizable loop over a non-repeated column
+    for (i = 0; i < id->num_values; i++)
+        id_sum += ((s32_t *) id->values)[i];
+    LWPB_DIAG_PRINTF("sum(id) = %lld\n", id_sum);
+    CHECK(id_sum == NUM_RECORDS * (NUM_RECORDS - 1) / 2);
+
+    // Optional string column with presence bitmap
+    ends = email->values;
+    for (i = 0; i < NUM_RECORDS; i++) {
+        CHECK(LWPB_COLUMN_IS_VALID(email, i) == (i % 2 == 0));
+        CHECK(ends[i + 1] - ends[i] == (i % 2 == 0 ? 16 : 0));
+    }
+
+    // Repeated string column
+    ends = number->values;
+    for (i = 0; i < NUM_RECORDS; i++) {
+        CHECK(number->offsets[i + 1] - number->offsets[i] == i % 3);
+        CHECK(LWPB_COLUMN_IS_VALID(number, i) == (i % 3 != 0));
+        for (j = number->offsets[i]; j < number->offsets[i + 1]; j++) {
+            char tmp[32];
+            snprintf(tmp, sizeof(tmp), "%d-%d", i, j - number->offsets[i]);
+            CHECK(ends[j + 1] - ends[j] == strlen(tmp));
+            CHECK(memcmp(number->data + ends[j], tmp, strlen(tmp)) == 0);
+        }
+    }
+    LWPB_DIAG_PRINTF("phone.number values = %d\n", (int) number->num_values);
+    CHECK(type->num_values == number->num_values);
+
+    for (i = 0; i < 4; i++)
+        lwpb_column_free(&columns[i]);
+
+    return 0;
+}
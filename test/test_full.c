@@ -276,20 +276,20 @@ struct testing_fields {
     } u;
 };
 
-static void generic_field_handler(struct lwpb_decoder *decoder,
-                                  const struct lwpb_msg_desc *msg_desc,
-                                  const struct lwpb_field_desc *field_desc,
-                                  union lwpb_value *value, void *arg)
+static lwpb_decoder_action_t generic_field_handler(struct lwpb_decoder *decoder,
+                                                    const struct lwpb_msg_desc *msg_desc,
+                                                    const struct lwpb_field_desc *field_desc,
+                                                    union lwpb_value *value, void *arg)
 {
     struct testing_fields *fields = decoder->arg;
     
     if (msg_desc == foo_TestMessRequiredEnumSmall) {
         if (field_desc == foo_TestMessRequiredEnumSmall_test) {
-            CHECK_VALUE(value->enum_, fields->u.TestMessRequiredEnumSmall.test); return;
+            CHECK_VALUE(value->enum_, fields->u.TestMessRequiredEnumSmall.test); return LWPB_DECODER_CONTINUE;
         }
     } else if (msg_desc == foo_TestMessRequiredEnum) {
         if (field_desc == foo_TestMessRequiredEnum_test) {
-            CHECK_VALUE(value->enum_, fields->u.TestMessRequiredEnum.test); return;
+            CHECK_VALUE(value->enum_, fields->u.TestMessRequiredEnum.test); return LWPB_DECODER_CONTINUE;
         }
     } else if (msg_desc == foo_TestFieldNo15 ||
                msg_desc == foo_TestFieldNo16 ||
@@ -308,174 +308,176 @@ static void generic_field_handler(struct lwpb_decoder *decoder,
             field_desc == foo_TestFieldNo33554431_test ||
             field_desc == foo_TestFieldNo33554432_test) {
             CHECK_STRING(value->string.str, value->string.len, fields->u.TestFieldNo.test);
-            return;
+            return LWPB_DECODER_CONTINUE;
         }
     } else if (msg_desc == foo_TestMessRequiredInt32) {
         if (field_desc == foo_TestMessRequiredInt32_test) {
-            CHECK_VALUE(value->int32, fields->u.TestMessRequiredInt32.test); return;
+            CHECK_VALUE(value->int32, fields->u.TestMessRequiredInt32.test); return LWPB_DECODER_CONTINUE;
         }
     } else if (msg_desc == foo_TestMessRequiredSInt32) {
         if (field_desc == foo_TestMessRequiredSInt32_test) {
-            CHECK_VALUE(value->int32, fields->u.TestMessRequiredSInt32.test); return;
+            CHECK_VALUE(value->int32, fields->u.TestMessRequiredSInt32.test); return LWPB_DECODER_CONTINUE;
         }
     } else if (msg_desc == foo_TestMessRequiredSFixed32) {
         if (field_desc == foo_TestMessRequiredSFixed32_test) {
-            CHECK_VALUE(value->int32, fields->u.TestMessRequiredSFixed32.test); return;
+            CHECK_VALUE(value->int32, fields->u.TestMessRequiredSFixed32.test); return LWPB_DECODER_CONTINUE;
         }
     } else if (msg_desc == foo_TestMessRequiredUInt32) {
         if (field_desc == foo_TestMessRequiredUInt32_test) {
-            CHECK_VALUE(value->uint32, fields->u.TestMessRequiredUInt32.test); return;
+            CHECK_VALUE(value->uint32, fields->u.TestMessRequiredUInt32.test); return LWPB_DECODER_CONTINUE;
         }
     } else if (msg_desc == foo_TestMessRequiredFixed32) {
         if (field_desc == foo_TestMessRequiredFixed32_test) {
-            CHECK_VALUE(value->uint32, fields->u.TestMessRequiredFixed32.test); return;
+            CHECK_VALUE(value->uint32, fields->u.TestMessRequiredFixed32.test); return LWPB_DECODER_CONTINUE;
         }
     } else if (msg_desc == foo_TestMessRequiredInt64) {
         if (field_desc == foo_TestMessRequiredInt64_test) {
-            CHECK_VALUE(value->int64, fields->u.TestMessRequiredInt64.test); return;
+            CHECK_VALUE(value->int64, fields->u.TestMessRequiredInt64.test); return LWPB_DECODER_CONTINUE;
         }
     } else if (msg_desc == foo_TestMessRequiredSInt64) {
         if (field_desc == foo_TestMessRequiredSInt64_test) {
-            CHECK_VALUE(value->int64, fields->u.TestMessRequiredSInt64.test); return;
+            CHECK_VALUE(value->int64, fields->u.TestMessRequiredSInt64.test); return LWPB_DECODER_CONTINUE;
         }
     } else if (msg_desc == foo_TestMessRequiredSFixed64) {
         if (field_desc == foo_TestMessRequiredSFixed64_test) {
-            CHECK_VALUE(value->int64, fields->u.TestMessRequiredSFixed64.test); return;
+            CHECK_VALUE(value->int64, fields->u.TestMessRequiredSFixed64.test); return LWPB_DECODER_CONTINUE;
         }
     } else if (msg_desc == foo_TestMessRequiredUInt64) {
         if (field_desc == foo_TestMessRequiredUInt64_test) {
-            CHECK_VALUE(value->uint64, fields->u.TestMessRequiredUInt64.test); return;
+            CHECK_VALUE(value->uint64, fields->u.TestMessRequiredUInt64.test); return LWPB_DECODER_CONTINUE;
         }
     } else if (msg_desc == foo_TestMessRequiredFixed64) {
         if (field_desc == foo_TestMessRequiredFixed64_test) {
-            CHECK_VALUE(value->uint64, fields->u.TestMessRequiredFixed64.test); return;
+            CHECK_VALUE(value->uint64, fields->u.TestMessRequiredFixed64.test); return LWPB_DECODER_CONTINUE;
         }
     } else if (msg_desc == foo_TestMessRequiredFloat) {
         if (field_desc == foo_TestMessRequiredFloat_test) {
-            CHECK_FVALUE(value->float_, fields->u.TestMessRequiredFloat.test); return;
+            CHECK_FVALUE(value->float_, fields->u.TestMessRequiredFloat.test); return LWPB_DECODER_CONTINUE;
         }
     } else if (msg_desc == foo_TestMessRequiredDouble) {
         if (field_desc == foo_TestMessRequiredDouble_test) {
-            CHECK_FVALUE(value->double_, fields->u.TestMessRequiredDouble.test); return;
+            CHECK_FVALUE(value->double_, fields->u.TestMessRequiredDouble.test); return LWPB_DECODER_CONTINUE;
         }
     } else if (msg_desc == foo_TestMessRequiredBool) {
         if (field_desc == foo_TestMessRequiredBool_test) {
-            CHECK_VALUE(value->bool, fields->u.TestMessRequiredBool.test); return;
+            CHECK_VALUE(value->bool, fields->u.TestMessRequiredBool.test); return LWPB_DECODER_CONTINUE;
         }
     } else if (msg_desc == foo_TestMessRequiredString) {
         if (field_desc == foo_TestMessRequiredString_test) {
-            CHECK_STRING(value->string.str, value->string.len, fields->u.TestMessRequiredString.test); return;
+            CHECK_STRING(value->string.str, value->string.len, fields->u.TestMessRequiredString.test); return LWPB_DECODER_CONTINUE;
         }
     } else if (msg_desc == foo_TestMessRequiredBytes) {
         if (field_desc == foo_TestMessRequiredBytes_test) {
-            CHECK_BYTES(value->bytes.data, value->bytes.len, fields->u.TestMessRequiredBytes.test, fields->u.TestMessRequiredBytes.len); return;
+            CHECK_BYTES(value->bytes.data, value->bytes.len, fields->u.TestMessRequiredBytes.test, fields->u.TestMessRequiredBytes.len); return LWPB_DECODER_CONTINUE;
         }
     } else if (msg_desc == foo_TestMessOptional) {
         if (field_desc == foo_TestMessOptional_test_int32) {
-            CHECK_VALUE(value->int32, fields->u.TestMessOptional.test_int32); return;
+            CHECK_VALUE(value->int32, fields->u.TestMessOptional.test_int32); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessOptional_test_sint32) {
-            CHECK_VALUE(value->int32, fields->u.TestMessOptional.test_sint32); return;
+            CHECK_VALUE(value->int32, fields->u.TestMessOptional.test_sint32); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessOptional_test_sfixed32) {
-            CHECK_VALUE(value->int32, fields->u.TestMessOptional.test_sfixed32); return;
+            CHECK_VALUE(value->int32, fields->u.TestMessOptional.test_sfixed32); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessOptional_test_uint32) {
-            CHECK_VALUE(value->uint32, fields->u.TestMessOptional.test_uint32); return;
+            CHECK_VALUE(value->uint32, fields->u.TestMessOptional.test_uint32); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessOptional_test_fixed32) {
-            CHECK_VALUE(value->uint32, fields->u.TestMessOptional.test_fixed32); return;
+            CHECK_VALUE(value->uint32, fields->u.TestMessOptional.test_fixed32); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessOptional_test_int64) {
-            CHECK_VALUE(value->int64, fields->u.TestMessOptional.test_int64); return;
+            CHECK_VALUE(value->int64, fields->u.TestMessOptional.test_int64); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessOptional_test_sint64) {
-            CHECK_VALUE(value->int64, fields->u.TestMessOptional.test_sint64); return;
+            CHECK_VALUE(value->int64, fields->u.TestMessOptional.test_sint64); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessOptional_test_sfixed64) {
-            CHECK_VALUE(value->int64, fields->u.TestMessOptional.test_sfixed64); return;
+            CHECK_VALUE(value->int64, fields->u.TestMessOptional.test_sfixed64); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessOptional_test_uint64) {
-            CHECK_VALUE(value->uint64, fields->u.TestMessOptional.test_uint64); return;
+            CHECK_VALUE(value->uint64, fields->u.TestMessOptional.test_uint64); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessOptional_test_fixed64) {
-            CHECK_VALUE(value->uint64, fields->u.TestMessOptional.test_fixed64); return;
+            CHECK_VALUE(value->uint64, fields->u.TestMessOptional.test_fixed64); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessOptional_test_float) {
-            CHECK_FVALUE(value->float_, fields->u.TestMessOptional.test_float); return;
+            CHECK_FVALUE(value->float_, fields->u.TestMessOptional.test_float); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessOptional_test_double) {
-            CHECK_FVALUE(value->double_, fields->u.TestMessOptional.test_double); return;
+            CHECK_FVALUE(value->double_, fields->u.TestMessOptional.test_double); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessOptional_test_boolean) {
-            CHECK_VALUE(value->bool, fields->u.TestMessOptional.test_boolean); return;
+            CHECK_VALUE(value->bool, fields->u.TestMessOptional.test_boolean); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessOptional_test_enum_small) {
-            CHECK_VALUE(value->enum_, fields->u.TestMessOptional.test_enum_small); return;
+            CHECK_VALUE(value->enum_, fields->u.TestMessOptional.test_enum_small); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessOptional_test_enum) {
-            CHECK_VALUE(value->enum_, fields->u.TestMessOptional.test_enum); return;
+            CHECK_VALUE(value->enum_, fields->u.TestMessOptional.test_enum); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessOptional_test_string) {
-            CHECK_STRING(value->string.str, value->string.len, fields->u.TestMessOptional.test_string); return;
+            CHECK_STRING(value->string.str, value->string.len, fields->u.TestMessOptional.test_string); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessOptional_test_bytes) {
-            CHECK_BYTES(value->bytes.data, value->bytes.len, fields->u.TestMessOptional.test_bytes, fields->u.TestMessOptional.test_bytes_len); return;
+            CHECK_BYTES(value->bytes.data, value->bytes.len, fields->u.TestMessOptional.test_bytes, fields->u.TestMessOptional.test_bytes_len); return LWPB_DECODER_CONTINUE;
         }
     } else if (msg_desc == foo_TestMess) {
         if (field_desc == foo_TestMess_test_int32) {
-            CHECK_VALUE(value->int32, *fields->u.TestMess.test_int32++); return;
+            CHECK_VALUE(value->int32, *fields->u.TestMess.test_int32++); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMess_test_sint32) {
-            CHECK_VALUE(value->int32, *fields->u.TestMess.test_sint32++); return;
+            CHECK_VALUE(value->int32, *fields->u.TestMess.test_sint32++); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMess_test_sfixed32) {
-            CHECK_VALUE(value->int32, *fields->u.TestMess.test_sfixed32++); return;
+            CHECK_VALUE(value->int32, *fields->u.TestMess.test_sfixed32++); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMess_test_uint32) {
-            CHECK_VALUE(value->uint32, *fields->u.TestMess.test_uint32++); return;
+            CHECK_VALUE(value->uint32, *fields->u.TestMess.test_uint32++); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMess_test_fixed32) {
-            CHECK_VALUE(value->uint32, *fields->u.TestMess.test_fixed32++); return;
+            CHECK_VALUE(value->uint32, *fields->u.TestMess.test_fixed32++); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMess_test_int64) {
-            CHECK_VALUE(value->int64, *fields->u.TestMess.test_int64++); return;
+            CHECK_VALUE(value->int64, *fields->u.TestMess.test_int64++); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMess_test_sint64) {
-            CHECK_VALUE(value->int64, *fields->u.TestMess.test_sint64++); return;
+            CHECK_VALUE(value->int64, *fields->u.TestMess.test_sint64++); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMess_test_sfixed64) {
-            CHECK_VALUE(value->int64, *fields->u.TestMess.test_sfixed64++); return;
+            CHECK_VALUE(value->int64, *fields->u.TestMess.test_sfixed64++); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMess_test_uint64) {
-            CHECK_VALUE(value->uint64, *fields->u.TestMess.test_uint64++); return;
+            CHECK_VALUE(value->uint64, *fields->u.TestMess.test_uint64++); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMess_test_fixed64) {
-            CHECK_VALUE(value->uint64, *fields->u.TestMess.test_fixed64++); return;
+            CHECK_VALUE(value->uint64, *fields->u.TestMess.test_fixed64++); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMess_test_float) {
-            CHECK_FVALUE(value->float_, *fields->u.TestMess.test_float++); return;
+            CHECK_FVALUE(value->float_, *fields->u.TestMess.test_float++); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMess_test_double) {
-            CHECK_FVALUE(value->double_, *fields->u.TestMess.test_double++); return;
+            CHECK_FVALUE(value->double_, *fields->u.TestMess.test_double++); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMess_test_boolean) {
-            CHECK_VALUE(value->bool, *fields->u.TestMess.test_boolean++); return;
+            CHECK_VALUE(value->bool, *fields->u.TestMess.test_boolean++); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMess_test_enum_small) {
-            CHECK_VALUE(value->enum_, *fields->u.TestMess.test_enum_small++); return;
+            CHECK_VALUE(value->enum_, *fields->u.TestMess.test_enum_small++); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMess_test_enum) {
-            CHECK_VALUE(value->enum_, *fields->u.TestMess.test_enum++); return;
+            CHECK_VALUE(value->enum_, *fields->u.TestMess.test_enum++); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMess_test_string) {
-            CHECK_STRING(value->string.str, value->string.len, *fields->u.TestMess.test_string++); return;
+            CHECK_STRING(value->string.str, value->string.len, *fields->u.TestMess.test_string++); return LWPB_DECODER_CONTINUE;
         }
     } else if (msg_desc == foo_TestMessPacked) {
         if (field_desc == foo_TestMessPacked_test_int32) {
-            CHECK_VALUE(value->int32, *fields->u.TestMessPacked.test_int32++); return;
+            CHECK_VALUE(value->int32, *fields->u.TestMessPacked.test_int32++); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessPacked_test_sint32) {
-            CHECK_VALUE(value->int32, *fields->u.TestMessPacked.test_sint32++); return;
+            CHECK_VALUE(value->int32, *fields->u.TestMessPacked.test_sint32++); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessPacked_test_sfixed32) {
-            CHECK_VALUE(value->int32, *fields->u.TestMessPacked.test_sfixed32++); return;
+            CHECK_VALUE(value->int32, *fields->u.TestMessPacked.test_sfixed32++); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessPacked_test_uint32) {
-            CHECK_VALUE(value->uint32, *fields->u.TestMessPacked.test_uint32++); return;
+            CHECK_VALUE(value->uint32, *fields->u.TestMessPacked.test_uint32++); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessPacked_test_fixed32) {
-            CHECK_VALUE(value->uint32, *fields->u.TestMessPacked.test_fixed32++); return;
+            CHECK_VALUE(value->uint32, *fields->u.TestMessPacked.test_fixed32++); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessPacked_test_int64) {
-            CHECK_VALUE(value->int64, *fields->u.TestMessPacked.test_int64++); return;
+            CHECK_VALUE(value->int64, *fields->u.TestMessPacked.test_int64++); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessPacked_test_sint64) {
-            CHECK_VALUE(value->int64, *fields->u.TestMessPacked.test_sint64++); return;
+            CHECK_VALUE(value->int64, *fields->u.TestMessPacked.test_sint64++); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessPacked_test_sfixed64) {
-            CHECK_VALUE(value->int64, *fields->u.TestMessPacked.test_sfixed64++); return;
+            CHECK_VALUE(value->int64, *fields->u.TestMessPacked.test_sfixed64++); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessPacked_test_uint64) {
-            CHECK_VALUE(value->uint64, *fields->u.TestMessPacked.test_uint64++); return;
+            CHECK_VALUE(value->uint64, *fields->u.TestMessPacked.test_uint64++); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessPacked_test_fixed64) {
-            CHECK_VALUE(value->uint64, *fields->u.TestMessPacked.test_fixed64++); return;
+            CHECK_VALUE(value->uint64, *fields->u.TestMessPacked.test_fixed64++); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessPacked_test_float) {
-            CHECK_FVALUE(value->float_, *fields->u.TestMessPacked.test_float++); return;
+            CHECK_FVALUE(value->float_, *fields->u.TestMessPacked.test_float++); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessPacked_test_double) {
-            CHECK_FVALUE(value->double_, *fields->u.TestMessPacked.test_double++); return;
+            CHECK_FVALUE(value->double_, *fields->u.TestMessPacked.test_double++); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessPacked_test_boolean) {
-            CHECK_VALUE(value->bool, *fields->u.TestMessPacked.test_boolean++); return;
+            CHECK_VALUE(value->bool, *fields->u.TestMessPacked.test_boolean++); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessPacked_test_enum_small) {
-            CHECK_VALUE(value->enum_, *fields->u.TestMessPacked.test_enum_small++); return;
+            CHECK_VALUE(value->enum_, *fields->u.TestMessPacked.test_enum_small++); return LWPB_DECODER_CONTINUE;
         } else if (field_desc == foo_TestMessPacked_test_enum) {
-            CHECK_VALUE(value->enum_, *fields->u.TestMessPacked.test_enum++); return;
+            CHECK_VALUE(value->enum_, *fields->u.TestMessPacked.test_enum++); return LWPB_DECODER_CONTINUE;
         }
     }
     
     LWPB_DIAG_PRINTF("Decoded unhandled field\n");
     LWPB_ABORT();
+    
+    return LWPB_DECODER_STOP;
 }
 
 static void test_enum_small(void)
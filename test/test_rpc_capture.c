@@ -0,0 +1,421 @@
+/** @file test_rpc_capture.c
+ *
+ * Tests capturing the traffic of a socket server and replaying it.
+ *
+ * Copyright 2009 Simon Kallweit
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <lwpb/lwpb.h>
+#include <lwpb/rpc/capture.h>
+#include <lwpb/rpc/socket_client.h>
+#include <lwpb/rpc/socket_server.h>
+
+#include "generated/test_rpc_pb2.h"
+
+#define NUM_CLIENTS 8
+
+/** Time spent in the server call handler (us) */
+static int handler_delay;
+
+/** Socket transport options of clients and server */
+static unsigned int socket_options = LWPB_TRANSPORT_SOCKET_DEFAULT_OPTIONS;
+
+/** Path of the capture file */
+static char capture_path[64];
+
+struct client_state {
+    int calls;          /**< Number of calls made */
+    int done;           /**< Number of calls done */
+    int result;         /**< Result of last call */
+};
+
+/** Server replayed against, run by its own thread */
+struct replay_server {
+    struct lwpb_transport_socket_server socket_server;
+    struct lwpb_server server;
+    lwpb_transport_t transport;
+    pthread_t thread;
+    volatile int stop;
+};
+
+// Client handlers
+
+static lwpb_err_t client_request_handler(
+    struct lwpb_client *client, const struct lwpb_method_desc *method_desc,
+    const struct lwpb_msg_desc *msg_desc, void *buf, size_t *len, void *arg)
+{
+    struct client_state *state = arg;
+    struct lwpb_encoder encoder;
+    char name[32];
+
+    snprintf(name, sizeof(name), "client %d", state->calls++);
+
+    lwpb_encoder_init(&encoder);
+    lwpb_encoder_start(&encoder, msg_desc, buf, *len);
+    lwpb_encoder_add_string(&encoder, test_Name_name, name);
+    *len = lwpb_encoder_finish(&encoder);
+
+    return LWPB_ERR_OK;
+}
+
+static lwpb_err_t client_response_handler(
+    struct lwpb_client *client, const struct lwpb_method_desc *method_desc,
+    const struct lwpb_msg_desc *msg_desc, void *buf, size_t len, void *arg)
+{
+    return LWPB_ERR_OK;
+}
+
+static void client_call_done_handler(
+    struct lwpb_client *client, const struct lwpb_method_desc *method_desc,
+    lwpb_rpc_result_t result, void *arg)
+{
+    struct client_state *state = arg;
+
+    state->done++;
+    if (state->result == LWPB_RPC_OK)
+        state->result = result;
+}
+
+// Server handlers
+
+static lwpb_err_t server_request_handler(
+    struct lwpb_server *server, const struct lwpb_method_desc *method_desc,
+    const struct lwpb_msg_desc *req_desc, void *req_buf, size_t req_len,
+    const struct lwpb_msg_desc *res_desc, void *res_buf, size_t *res_len,
+    void *arg)
+{
+    struct lwpb_encoder encoder;
+
+    if (handler_delay > 0)
+        usleep(handler_delay);
+
+    lwpb_encoder_init(&encoder);
+    lwpb_encoder_start(&encoder, res_desc, res_buf, *res_len);
+    lwpb_encoder_nested_start(&encoder, test_LookupResult_person);
+    lwpb_encoder_add_string(&encoder, test_Person_name, "Simon Kallweit");
+    lwpb_encoder_add_int32(&encoder, test_Person_id, 42);
+    lwpb_encoder_nested_end(&encoder);
+    *res_len = lwpb_encoder_finish(&encoder);
+
+    return LWPB_ERR_OK;
+}
+
+static const struct lwpb_service_desc *service_list[] = {
+    test_Search, NULL,
+};
+
+/**
+ * Adds the descriptor of a transport to a poll set.
+ * @param pfd Poll set entry
+ * @param fd Descriptor of the transport
+ * @param events Events of the transport to wait for
+ */
+static void poll_transport(struct pollfd *pfd, int fd, unsigned int events)
+{
+    pfd->fd = fd;
+    pfd->events = 0;
+    pfd->revents = 0;
+    if (events & LWPB_TRANSPORT_SOCKET_READABLE)
+        pfd->events |= POLLIN;
+    if (events & LWPB_TRANSPORT_SOCKET_WRITABLE)
+        pfd->events |= POLLOUT;
+}
+
+/**
+ * Returns the events of the transport a descriptor is ready for.
+ * @param pfd Poll set entry
+ * @return Returns the ready events.
+ */
+static unsigned int ready_events(struct pollfd *pfd)
+{
+    unsigned int events = 0;
+
+    if (pfd->revents & (POLLIN | POLLHUP | POLLERR))
+        events |= LWPB_TRANSPORT_SOCKET_READABLE;
+    if (pfd->revents & POLLOUT)
+        events |= LWPB_TRANSPORT_SOCKET_WRITABLE;
+
+    return events;
+}
+
+/**
+ * Runs a capturing server and its clients in this process, driven by a
+ * single poll() loop, and writes the capture file.
+ * @param num_workers Number of server worker threads (0 = inline)
+ * @param queue_size Depth of the worker job queue (0 for the default)
+ * @param num_calls Number of pipelined calls per client
+ * @return Returns 0 if all calls succeeded and were captured.
+ */
+static int record(int num_workers, size_t queue_size, int num_calls)
+{
+    static struct lwpb_transport_socket_client socket_clients[NUM_CLIENTS];
+    static struct lwpb_client clients[NUM_CLIENTS];
+    static struct client_state states[NUM_CLIENTS];
+    struct lwpb_transport_socket_server socket_server;
+    struct lwpb_server server;
+    struct lwpb_capture capture;
+    lwpb_transport_t server_transport;
+    lwpb_transport_t transport;
+    struct pollfd pfds[NUM_CLIENTS + 1];
+    unsigned int events;
+    time_t start;
+    int timeout;
+    int t;
+    int done;
+    int calls = 0;
+    int failed = 0;
+    int i, j;
+
+    LWPB_DIAG_PRINTF("recording %d workers, queue %d, %d calls\n",
+                     num_workers, (int) queue_size, num_calls);
+
+    if (lwpb_capture_create(&capture, capture_path) != LWPB_ERR_OK)
+        return 1;
+
+    server_transport = lwpb_transport_socket_server_init(&socket_server);
+    lwpb_server_init(&server, service_list, server_transport);
+    lwpb_server_handler(&server, server_request_handler);
+    lwpb_transport_socket_server_workers(server_transport, num_workers,
+                                         queue_size);
+    lwpb_transport_socket_server_options(server_transport, socket_options);
+    lwpb_transport_socket_server_capture(server_transport, &capture);
+    if (lwpb_transport_socket_server_open(server_transport, "127.0.0.1", 0) !=
+        LWPB_ERR_OK)
+        return 1;
+
+    for (i = 0; i < NUM_CLIENTS; i++) {
+        LWPB_MEMSET(&states[i], 0, sizeof(states[i]));
+        transport = lwpb_transport_socket_client_init(&socket_clients[i]);
+        lwpb_client_init(&clients[i], transport);
+        lwpb_client_arg(&clients[i], &states[i]);
+        lwpb_client_handler(&clients[i],
+                            client_request_handler,
+                            client_response_handler,
+                            client_call_done_handler);
+        lwpb_transport_socket_client_options(transport, socket_options);
+        if (lwpb_transport_socket_client_open(transport, "127.0.0.1",
+                lwpb_transport_socket_server_port(server_transport)) !=
+            LWPB_ERR_OK)
+            return 1;
+    }
+
+    start = time(NULL);
+    do {
+        // Pipeline all calls of a client once it is connected
+        for (i = 0; i < NUM_CLIENTS; i++) {
+            if (!states[i].calls && socket_clients[i].version == 2) {
+                for (j = 0; j < num_calls; j++)
+                    lwpb_client_call(&clients[i], test_Search_search_by_name);
+                calls += num_calls;
+            }
+        }
+
+        poll_transport(&pfds[0], lwpb_transport_socket_server_fd(server_transport,
+                                                                 &events),
+                       events);
+        timeout = lwpb_transport_socket_server_timeout(server_transport);
+        for (i = 0; i < NUM_CLIENTS; i++) {
+            poll_transport(&pfds[i + 1],
+                           lwpb_transport_socket_client_fd(clients[i].transport,
+                                                           &events),
+                           events);
+            t = lwpb_transport_socket_client_timeout(clients[i].transport);
+            if (t >= 0 && (timeout < 0 || t < timeout))
+                timeout = t;
+        }
+        if (timeout < 0 || timeout > 10)
+            timeout = 10;
+        if (poll(pfds, NUM_CLIENTS + 1, timeout) < 0)
+            return 1;
+
+        lwpb_transport_socket_server_process(server_transport,
+                                             ready_events(&pfds[0]));
+        done = 0;
+        for (i = 0; i < NUM_CLIENTS; i++) {
+            lwpb_transport_socket_client_process(clients[i].transport,
+                                                 ready_events(&pfds[i + 1]));
+            done += states[i].done;
+        }
+    } while ((calls < NUM_CLIENTS * num_calls || done < calls) &&
+             time(NULL) - start < 10);
+
+    for (i = 0; i < NUM_CLIENTS; i++) {
+        if (states[i].done != num_calls || states[i].result != LWPB_RPC_OK)
+            failed = 1;
+        lwpb_transport_socket_client_close(clients[i].transport);
+    }
+    lwpb_transport_socket_server_capture(server_transport, NULL);
+    lwpb_transport_socket_server_close(server_transport);
+
+    // Every client sent a HELLO frame and its requests
+    LWPB_DIAG_PRINTF("captured %llu frames, %llu bytes\n",
+                     (unsigned long long) capture.frames,
+                     (unsigned long long) capture.bytes);
+    if (capture.frames < NUM_CLIENTS + 1 ||
+        capture.frames > (u64_t) NUM_CLIENTS * (num_calls + 1))
+        failed = 1;
+    lwpb_capture_close(&capture);
+
+    return failed;
+}
+
+/**
+ * Thread running the server replayed against until it is stopped.
+ * @param arg Replay server
+ * @return Returns NULL.
+ */
+static void *server_thread(void *arg)
+{
+    struct replay_server *rs = arg;
+    struct pollfd pfd;
+    unsigned int events;
+
+    while (!rs->stop) {
+        poll_transport(&pfd, lwpb_transport_socket_server_fd(rs->transport,
+                                                             &events),
+                       events);
+        if (poll(&pfd, 1, 10) < 0)
+            break;
+        lwpb_transport_socket_server_process(rs->transport, ready_events(&pfd));
+    }
+
+    return NULL;
+}
+
+/**
+ * Replays the capture file against a fresh server.
+ * @param speed Speed factor of the captured timing, 0 = as fast as possible
+ * @param num_calls Number of calls per client in the capture
+ * @return Returns 0 if every captured request was answered.
+ */
+static int replay(double speed, int num_calls)
+{
+    static struct replay_server rs;
+    struct lwpb_capture capture;
+    struct lwpb_replay_result result;
+    lwpb_err_t ret;
+    int failed = 0;
+
+    LWPB_DIAG_PRINTF("replaying at speed %g\n", speed);
+
+    rs.transport = lwpb_transport_socket_server_init(&rs.socket_server);
+    lwpb_server_init(&rs.server, service_list, rs.transport);
+    lwpb_server_handler(&rs.server, server_request_handler);
+    lwpb_transport_socket_server_options(rs.transport, socket_options);
+    if (lwpb_transport_socket_server_open(rs.transport, "127.0.0.1", 0) !=
+        LWPB_ERR_OK)
+        return 1;
+    rs.stop = 0;
+    if (pthread_create(&rs.thread, NULL, server_thread, &rs) != 0)
+        return 1;
+
+    if (lwpb_capture_open(&capture, capture_path) != LWPB_ERR_OK)
+        return 1;
+    ret = lwpb_replay_run(&capture, "127.0.0.1",
+                          lwpb_transport_socket_server_port(rs.transport),
+                          speed, &result);
+    lwpb_capture_close(&capture);
+
+    rs.stop = 1;
+    pthread_join(rs.thread, NULL);
+    lwpb_transport_socket_server_close(rs.transport);
+
+    LWPB_DIAG_PRINTF("%d conns, %llu frames, %llu requests, %llu responses, "
+                     "%llu errors, %llu lost, p99 %llu ns\n", result.conns,
+                     (unsigned long long) result.frames,
+                     (unsigned long long) result.requests,
+                     (unsigned long long) result.responses,
+                     (unsigned long long) result.errors,
+                     (unsigned long long) result.lost,
+                     (unsigned long long) lwpb_histogram_percentile(&result.latency, 99));
+    if (ret != LWPB_ERR_OK || result.conns != NUM_CLIENTS ||
+        result.requests != (u64_t) NUM_CLIENTS * num_calls ||
+        result.responses != result.requests || result.errors ||
+        result.lost || result.latency.count != result.responses)
+        failed = 1;
+
+    return failed;
+}
+
+/**
+ * Checks that files other than captures are refused.
+ * @return Returns 0 if the file was refused.
+ */
+static int open_invalid(void)
+{
+    struct lwpb_capture capture;
+    FILE *file;
+
+    file = fopen(capture_path, "wb");
+    if (!file)
+        return 1;
+    fputs("no capture", file);
+    fclose(file);
+
+    if (lwpb_capture_open(&capture, capture_path) != LWPB_ERR_INVALID_FIELD)
+        return 1;
+    if (lwpb_capture_open(&capture, "/nonexistent/capture") != LWPB_ERR_NET_INIT)
+        return 1;
+
+    return 0;
+}
+
+int main()
+{
+    int failed = 1;
+
+    snprintf(capture_path, sizeof(capture_path), "/tmp/test_rpc_capture-%d",
+             (int) getpid());
+
+    do {
+        // Inline server, replayed as fast as possible and with its timing
+        if (record(0, 0, 16) != 0)
+            break;
+        if (replay(0, 16) != 0)
+            break;
+        if (replay(1, 16) != 0)
+            break;
+
+        // Connections stall on a full worker queue, frames are still
+        // captured once
+        handler_delay = 200;
+        if (record(2, 2, 16) != 0)
+            break;
+        handler_delay = 0;
+        if (replay(0, 16) != 0)
+            break;
+
+        // Server on io_uring
+        socket_options = LWPB_TRANSPORT_SOCKET_DEFAULT_OPTIONS |
+                         LWPB_TRANSPORT_SOCKET_URING;
+        if (record(4, 0, 16) != 0)
+            break;
+        if (replay(0, 16) != 0)
+            break;
+
+        if (open_invalid() != 0)
+            break;
+        failed = 0;
+    } while (0);
+
+    unlink(capture_path);
+
+    return failed;
+}
@@ -22,8 +22,67 @@
 
 #include "generated/test_rpc_pb2.h"
 
+#define NUM_CALLS 1000
+
+/** Depth of nested calls, deeper than the buffers kept by the transport */
+#define NESTED_DEPTH (LWPB_TRANSPORT_DIRECT_DEPTH + 2)
+
+/** Set to print messages */
+static int verbose = 1;
+
+/** Number of buffers allocated by the transport */
+static int num_allocs;
+
+/** Client used by the server handler for nested calls */
+static struct lwpb_client *nested_client;
+
+/** Current depth of nested calls */
+static int nested_depth;
+
+/** Number of messages of a streaming call, the handler yields every third */
+#define NUM_STREAM 10
+
+/** Number of responses received by the client */
+static int num_responses;
+
+/** Number of phone numbers of a response grown by the encode handler */
+#define NUM_PHONES 200
+
+/** Number of phone numbers in the last response received by the client */
+static int num_phones;
+
+/** Length of the last response received by the client */
+static size_t last_len;
+
+static lwpb_err_t counting_alloc_buf(lwpb_transport_t transport, void **buf, size_t *len)
+{
+    num_allocs++;
+    *len = 1024;
+    *buf = malloc(*len);
+    return *buf ? LWPB_ERR_OK : LWPB_ERR_MEM;
+}
+
+static void counting_free_buf(lwpb_transport_t transport, void *buf)
+{
+    free(buf);
+}
+
+static const struct lwpb_allocator_funs counting_allocator = {
+    .alloc_buf = counting_alloc_buf,
+    .free_buf = counting_free_buf,
+};
+
 // Client handlers
 
+static lwpb_decoder_action_t count_phones(
+    struct lwpb_decoder *decoder, const struct lwpb_msg_desc *msg_desc,
+    void *arg)
+{
+    if (msg_desc == test_PhoneNumber)
+        num_phones++;
+    return LWPB_DECODER_CONTINUE;
+}
+
 static lwpb_err_t client_request_handler(
     struct lwpb_client *client, const struct lwpb_method_desc *method_desc,
     const struct lwpb_msg_desc *msg_desc, void *buf, size_t *len, void *arg)
@@ -33,7 +92,8 @@ static lwpb_err_t client_request_handler(
     lwpb_encoder_init(&encoder);
     
     if (method_desc == test_Search_search_by_name) {
-        LWPB_DIAG_PRINTF("Client: Preparing request\n");
+        if (verbose)
+            LWPB_DIAG_PRINTF("Client: Preparing request\n");
         lwpb_encoder_start(&encoder, msg_desc, buf, *len);
         lwpb_encoder_add_string(&encoder, test_Name_name, "some name");
         *len = lwpb_encoder_finish(&encoder);
@@ -50,6 +110,16 @@ static lwpb_err_t client_response_handler(
 {
     struct lwpb_decoder decoder;
     
+    num_responses++;
+    last_len = len;
+    num_phones = 0;
+    lwpb_decoder_init(&decoder);
+    lwpb_decoder_msg_handler(&decoder, count_phones, NULL);
+    if (lwpb_decoder_decode(&decoder, msg_desc, buf, len, NULL) != LWPB_ERR_OK)
+        return LWPB_ERR_INVALID_FIELD;
+    if (!verbose)
+        return LWPB_ERR_OK;
+    
     lwpb_decoder_init(&decoder);
     lwpb_decoder_use_debug_handlers(&decoder);
     
@@ -64,6 +134,13 @@ static void client_call_done_handler(
     struct lwpb_client *client, const struct lwpb_method_desc *method_desc,
     lwpb_rpc_result_t result, void *arg)
 {
+    int *failed = arg;
+    
+    if (failed && result != LWPB_RPC_OK)
+        (*failed)++;
+    if (!verbose)
+        return;
+    
     switch (result) {
     case LWPB_RPC_OK: LWPB_DIAG_PRINTF("Client: Result = OK\n"); break;
     case LWPB_RPC_NOT_CONNECTED: LWPB_DIAG_PRINTF("Client: Result = Not connected\n"); break;
@@ -88,10 +165,18 @@ static lwpb_err_t server_request_handler(
     lwpb_encoder_init(&encoder);
     
     if (method_desc == test_Search_search_by_name) {
-        LWPB_DIAG_PRINTF("Server: Received request\n");
-        lwpb_decoder_decode(&decoder, req_desc, req_buf, req_len, NULL);
+        if (verbose) {
+            LWPB_DIAG_PRINTF("Server: Received request\n");
+            lwpb_decoder_decode(&decoder, req_desc, req_buf, req_len, NULL);
+            LWPB_DIAG_PRINTF("Server: Preparing response\n");
+        }
+        
+        // Call the service again through the same transport
+        if (nested_client && nested_depth < NESTED_DEPTH) {
+            nested_depth++;
+            lwpb_client_call(nested_client, test_Search_search_by_name);
+        }
         
-        LWPB_DIAG_PRINTF("Server: Preparing response\n");
         lwpb_encoder_start(&encoder, test_LookupResult, res_buf, *res_len);
         lwpb_encoder_nested_start(&encoder, test_LookupResult_person);
         lwpb_encoder_add_string(&encoder, test_Person_name, "Simon Kallweit");
@@ -111,10 +196,63 @@ static lwpb_err_t server_request_handler(
     return LWPB_ERR_OK;
 }
 
+static lwpb_err_t server_encode_handler(
+    struct lwpb_server *server, const struct lwpb_method_desc *method_desc,
+    const struct lwpb_msg_desc *req_desc, void *req_buf, size_t req_len,
+    struct lwpb_encoder *encoder, void *arg)
+{
+    lwpb_err_t ret;
+    int i;
+    
+    lwpb_encoder_nested_start(encoder, test_LookupResult_person);
+    lwpb_encoder_add_string(encoder, test_Person_name, "Simon Kallweit");
+    lwpb_encoder_add_int32(encoder, test_Person_id, 123);
+    for (i = 0; i < NUM_PHONES; i++) {
+        lwpb_encoder_nested_start(encoder, test_Person_phone);
+        lwpb_encoder_add_string(encoder, test_PhoneNumber_number, "123456789");
+        lwpb_encoder_add_enum(encoder, test_PhoneNumber_type, TEST_PHONENUMBER_WORK);
+        ret = lwpb_encoder_nested_end(encoder);
+        if (ret != LWPB_ERR_OK)
+            return ret;
+    }
+    
+    return lwpb_encoder_nested_end(encoder);
+}
+
+static lwpb_err_t server_stream_handler(
+    struct lwpb_server *server, const struct lwpb_method_desc *method_desc,
+    const struct lwpb_msg_desc *req_desc, void *req_buf, size_t req_len,
+    const struct lwpb_msg_desc *res_desc, struct lwpb_server_writer *writer,
+    void *arg)
+{
+    struct lwpb_encoder encoder;
+    lwpb_err_t ret;
+    
+    while (writer->count < NUM_STREAM) {
+        lwpb_encoder_init(&encoder);
+        lwpb_encoder_start(&encoder, res_desc, writer->buf, writer->len);
+        lwpb_encoder_nested_start(&encoder, test_LookupResult_person);
+        lwpb_encoder_add_string(&encoder, test_Person_name, "Simon Kallweit");
+        lwpb_encoder_add_int32(&encoder, test_Person_id, writer->count);
+        lwpb_encoder_nested_end(&encoder);
+        ret = lwpb_server_writer_write(writer, lwpb_encoder_finish(&encoder));
+        if (ret != LWPB_ERR_OK)
+            return ret;
+        if (writer->count % 3 == 0)
+            return LWPB_ERR_BUSY;
+    }
+    
+    return LWPB_ERR_OK;
+}
+
 static const struct lwpb_service_desc *service_list[] = {
     test_Search, NULL,
 };
 
+static const struct lwpb_method_desc *stream_methods[] = {
+    test_Search_search_by_name, NULL,
+};
+
 int main()
 {
     lwpb_err_t ret;
@@ -122,9 +260,17 @@ int main()
     struct lwpb_transport_direct transport_direct;
     lwpb_transport_t transport;
     struct lwpb_client client;
+    struct lwpb_client client2;
     struct lwpb_server server;
+    u8_t req_buf[64];
+    u8_t res_buf[256];
+    size_t req_len;
+    size_t res_len;
+    int failed = 0;
+    int i;
     
     transport = lwpb_transport_direct_init(&transport_direct);
+    lwpb_transport_set_allocator(transport, &counting_allocator);
     
     lwpb_client_init(&client, transport);
     lwpb_client_handler(&client,
@@ -132,10 +278,85 @@ int main()
                         client_response_handler,
                         client_call_done_handler);
     
+    // Calls without a server are not connected
+    ret = lwpb_client_call(&client, test_Search_search_by_name);
+    
     lwpb_server_init(&server, service_list, transport);
     lwpb_server_handler(&server, server_request_handler);
     
+    ret = lwpb_client_call(&client, test_Search_search_by_name);
+    LWPB_DIAG_PRINTF("call: ret = %d, allocs = %d\n", ret, num_allocs);
+    
+    // A second client shares the buffers of the first
+    verbose = 0;
+    lwpb_client_init(&client2, transport);
+    lwpb_client_arg(&client2, &failed);
+    lwpb_client_handler(&client2,
+                        client_request_handler,
+                        client_response_handler,
+                        client_call_done_handler);
+    for (i = 0; i < NUM_CALLS; i++)
+        lwpb_client_call(&client2, test_Search_search_by_name);
+    LWPB_DIAG_PRINTF("%d calls: failed = %d, allocs = %d\n", NUM_CALLS, failed,
+                     num_allocs);
+    if (failed || num_allocs != 2)
+        return 1;
+    
+    // Nested calls get their own buffers, levels beyond the kept ones
+    // allocate them per call
+    nested_client = &client2;
     lwpb_client_call(&client, test_Search_search_by_name);
+    nested_client = NULL;
+    LWPB_DIAG_PRINTF("nested calls: depth = %d, failed = %d, allocs = %d\n",
+                     nested_depth, failed, num_allocs);
+    if (failed || nested_depth != NESTED_DEPTH ||
+        num_allocs != 2 * (NESTED_DEPTH + 1))
+        return 1;
+    
+    // Calls with buffers of the caller
+    req_len = sizeof(req_buf);
+    res_len = sizeof(res_buf);
+    client_request_handler(NULL, test_Search_search_by_name, test_Name,
+                           req_buf, &req_len, NULL);
+    if (lwpb_transport_direct_invoke(transport, test_Search_search_by_name,
+                                     req_buf, req_len, res_buf, &res_len) !=
+        LWPB_RPC_OK || res_len == 0)
+        return 1;
+    LWPB_DIAG_PRINTF("invoke: response length = %d\n", (int) res_len);
+    
+    // Encode handlers grow the response beyond the transport buffer
+    lwpb_server_encode_handler(&server, server_encode_handler);
+    lwpb_client_call(&client2, test_Search_search_by_name);
+    LWPB_DIAG_PRINTF("encode: response length = %d, phones = %d, failed = %d\n",
+                     (int) last_len, num_phones, failed);
+    if (failed || last_len <= 1024 || num_phones != NUM_PHONES)
+        return 1;
+    
+    // Grown responses don't fit the buffer of the caller
+    res_len = sizeof(res_buf);
+    if (lwpb_transport_direct_invoke(transport, test_Search_search_by_name,
+                                     req_buf, req_len, res_buf, &res_len) !=
+        LWPB_RPC_FAILED)
+        return 1;
+    lwpb_server_encode_handler(&server, NULL);
+    
+    // Streamed messages are passed to the client as they are written
+    lwpb_server_stream_handler(&server, stream_methods, server_stream_handler);
+    num_responses = 0;
+    lwpb_client_call(&client2, test_Search_search_by_name);
+    LWPB_DIAG_PRINTF("stream: responses = %d, failed = %d\n", num_responses,
+                     failed);
+    if (failed || num_responses != NUM_STREAM)
+        return 1;
+    
+    // Streaming methods cannot be invoked with a single response buffer
+    res_len = sizeof(res_buf);
+    if (lwpb_transport_direct_invoke(transport, test_Search_search_by_name,
+                                     req_buf, req_len, res_buf, &res_len) !=
+        LWPB_RPC_FAILED)
+        return 1;
+    
+    lwpb_transport_direct_free(transport);
     
     return 0;
 }
@@ -0,0 +1,384 @@
+/** @file test_rpc_shm.c
+ * 
+ * Tests the shared memory RPC transports.
+ * 
+ * Copyright 2009 Simon Kallweit
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <lwpb/lwpb.h>
+#include <lwpb/rpc/shm_client.h>
+#include <lwpb/rpc/shm_server.h>
+
+#include "generated/test_rpc_pb2.h"
+
+/** Number of concurrent asynchronous calls */
+#define NUM_CALLS 2000
+
+/** Small rings, so they wrap and fill up during the test */
+#define RING_SIZE 4096
+#define MAX_MSG 512
+
+/** Calls with ids divisible by this fail on the server */
+#define FAIL_EVERY 100
+
+struct call_state {
+    int id;             /**< Person id requested */
+    int person_id;      /**< Person id of the response */
+};
+
+// Client handlers
+
+static lwpb_err_t client_request_handler(
+    struct lwpb_client *client, const struct lwpb_method_desc *method_desc,
+    const struct lwpb_msg_desc *msg_desc, void *buf, size_t *len, void *arg)
+{
+    struct call_state *state = arg;
+    struct lwpb_encoder encoder;
+    char name[32];
+
+    snprintf(name, sizeof(name), "client %d", state->id);
+
+    lwpb_encoder_init(&encoder);
+    lwpb_encoder_start(&encoder, msg_desc, buf, *len);
+    lwpb_encoder_add_string(&encoder, test_Name_name, name);
+    *len = lwpb_encoder_finish(&encoder);
+
+    return LWPB_ERR_OK;
+}
+
+static lwpb_err_t client_response_handler(
+    struct lwpb_client *client, const struct lwpb_method_desc *method_desc,
+    const struct lwpb_msg_desc *msg_desc, void *buf, size_t len, void *arg)
+{
+    struct call_state *state = arg;
+    struct lwpb_reader reader;
+    const struct lwpb_field_desc *field_desc;
+    union lwpb_value value;
+    lwpb_err_t ret;
+
+    lwpb_reader_init(&reader, msg_desc, buf, len);
+    while ((ret = lwpb_reader_next(&reader, &field_desc, &value)) == LWPB_ERR_OK) {
+        if (!field_desc && reader.depth == 1)
+            break;
+        if (field_desc == test_LookupResult_person)
+            lwpb_reader_enter(&reader);
+        if (field_desc == test_Person_id)
+            state->person_id = value.int32;
+    }
+
+    return ret;
+}
+
+static void client_call_done_handler(
+    struct lwpb_client *client, const struct lwpb_method_desc *method_desc,
+    lwpb_rpc_result_t result, void *arg)
+{
+}
+
+// Server handlers
+
+static lwpb_err_t server_request_handler(
+    struct lwpb_server *server, const struct lwpb_method_desc *method_desc,
+    const struct lwpb_msg_desc *req_desc, void *req_buf, size_t req_len,
+    const struct lwpb_msg_desc *res_desc, void *res_buf, size_t *res_len,
+    void *arg)
+{
+    struct lwpb_reader reader;
+    const struct lwpb_field_desc *field_desc;
+    union lwpb_value value;
+    struct lwpb_encoder encoder;
+    char name[32];
+    size_t len;
+    int id = -1;
+
+    lwpb_reader_init(&reader, req_desc, req_buf, req_len);
+    while (lwpb_reader_next(&reader, &field_desc, &value) == LWPB_ERR_OK && field_desc) {
+        if (field_desc == test_Name_name && value.string.len > 7) {
+            // Reader strings are not null-terminated
+            len = value.string.len < sizeof(name) ? value.string.len : sizeof(name) - 1;
+            LWPB_MEMCPY(name, value.string.str, len);
+            name[len] = '\0';
+            id = atoi(name + 7);
+        }
+    }
+
+    if (id % FAIL_EVERY == FAIL_EVERY - 1)
+        return LWPB_ERR_INVALID_FIELD;
+
+    lwpb_encoder_init(&encoder);
+    lwpb_encoder_start(&encoder, res_desc, res_buf, *res_len);
+    lwpb_encoder_nested_start(&encoder, test_LookupResult_person);
+    lwpb_encoder_add_string(&encoder, test_Person_name, "Simon Kallweit");
+    lwpb_encoder_add_int32(&encoder, test_Person_id, id);
+    lwpb_encoder_nested_end(&encoder);
+    *res_len = lwpb_encoder_finish(&encoder);
+
+    return LWPB_ERR_OK;
+}
+
+static const struct lwpb_service_desc *service_list[] = {
+    test_Search, NULL,
+};
+
+/**
+ * Runs the server in a child process until it is killed.
+ * @param path Path of the server socket
+ * @param busy_poll Busy poll time of the server (us)
+ * @param pid Returns the process id of the server
+ * @return Returns 0 if the server is running.
+ */
+static int start_server(const char *path, u32_t busy_poll, pid_t *pid)
+{
+    struct lwpb_transport_shm_server shm_server;
+    lwpb_transport_t transport;
+    struct lwpb_server server;
+    int fds[2];
+    char ok = 0;
+
+    if (pipe(fds) == -1)
+        return 1;
+    fflush(stdout);
+    *pid = fork();
+    if (*pid == 0) {
+        transport = lwpb_transport_shm_server_init(&shm_server);
+        lwpb_server_init(&server, service_list, transport);
+        lwpb_server_handler(&server, server_request_handler);
+        lwpb_transport_shm_server_rings(transport, RING_SIZE, MAX_MSG);
+        lwpb_transport_shm_server_busy_poll(transport, busy_poll);
+        ok = lwpb_transport_shm_server_open(transport, path) == LWPB_ERR_OK;
+        if (write(fds[1], &ok, 1) != 1 || !ok)
+            exit(1);
+        while (1)
+            lwpb_transport_shm_server_update(transport);
+    }
+    if (read(fds[0], &ok, 1) != 1 || !ok) {
+        LWPB_DIAG_PRINTF("Cannot open shared memory server\n");
+        kill(*pid, SIGKILL);
+        return 1;
+    }
+    close(fds[0]);
+    close(fds[1]);
+
+    return 0;
+}
+
+/**
+ * Runs many concurrent asynchronous calls through small rings and checks
+ * that calls fail once the server is gone.
+ * @param busy_poll Busy poll time of client and server (us)
+ * @return Returns 0 if all calls completed as expected.
+ */
+static int run_test(u32_t busy_poll)
+{
+    static struct lwpb_client_call calls[NUM_CALLS];
+    static struct call_state states[NUM_CALLS];
+    struct lwpb_transport_shm_client shm_client;
+    struct lwpb_client client;
+    struct call_state state;
+    lwpb_transport_t transport;
+    lwpb_rpc_result_t result;
+    char path[64];
+    pid_t pid;
+    int failed = 0;
+    int i;
+
+    LWPB_DIAG_PRINTF("running %d calls, busy poll %u us\n", NUM_CALLS, busy_poll);
+
+    snprintf(path, sizeof(path), "/tmp/lwpb-test-shm-%d", (int) getpid());
+    if (start_server(path, busy_poll, &pid) != 0)
+        return 1;
+
+    transport = lwpb_transport_shm_client_init(&shm_client);
+    lwpb_client_init(&client, transport);
+    lwpb_client_arg(&client, &state);
+    lwpb_client_handler(&client, client_request_handler, client_response_handler,
+                        client_call_done_handler);
+    lwpb_transport_shm_client_busy_poll(transport, busy_poll);
+    if (lwpb_transport_shm_client_open(transport, path) != LWPB_ERR_OK) {
+        LWPB_DIAG_PRINTF("Cannot open shared memory client\n");
+        kill(pid, SIGKILL);
+        return 1;
+    }
+
+    // Single call with the client's handlers
+    state.id = 42;
+    state.person_id = -1;
+    lwpb_client_call(&client, test_Search_search_by_name);
+    result = lwpb_client_wait(&client, &client.call);
+    LWPB_DIAG_PRINTF("single call: result = %d, person_id = %d\n",
+                     result, state.person_id);
+    if (result != LWPB_RPC_OK || state.person_id != 42)
+        failed = 1;
+
+    // More calls than the request ring holds, waiting for space on the way
+    for (i = 0; i < NUM_CALLS; i++) {
+        states[i].id = i;
+        states[i].person_id = -1;
+        lwpb_client_call_init(&calls[i], client_request_handler,
+                              client_response_handler, NULL, &states[i]);
+        lwpb_client_call_async(&client, test_Search_search_by_name, &calls[i]);
+    }
+    LWPB_DIAG_PRINTF("outstanding calls = %d\n",
+                     lwpb_transport_shm_client_pending(transport));
+
+    for (i = 0; i < NUM_CALLS; i++) {
+        result = lwpb_client_wait(&client, &calls[i]);
+        if (i % FAIL_EVERY == FAIL_EVERY - 1 ?
+            result != LWPB_RPC_FAILED :
+            result != LWPB_RPC_OK || states[i].person_id != i) {
+            LWPB_DIAG_PRINTF("call %d: result = %d, person_id = %d\n", i,
+                             result, states[i].person_id);
+            failed = 1;
+        }
+    }
+
+    // Cancelled calls are done right away, their response is discarded
+    for (i = 0; i < 2; i++) {
+        states[i].id = i;
+        states[i].person_id = -1;
+        lwpb_client_call_init(&calls[i], client_request_handler,
+                              client_response_handler, NULL, &states[i]);
+        lwpb_client_call_async(&client, test_Search_search_by_name, &calls[i]);
+    }
+    lwpb_client_call_cancel(&client, &calls[0]);
+    result = lwpb_client_wait(&client, &calls[0]);
+    LWPB_DIAG_PRINTF("cancelled call: result = %d\n", result);
+    if (result != LWPB_RPC_CANCELLED)
+        failed = 1;
+    result = lwpb_client_wait(&client, &calls[1]);
+    if (result != LWPB_RPC_OK || states[1].person_id != 1 ||
+        states[0].person_id != -1)
+        failed = 1;
+
+    // Calls fail once the client notices that the server is gone
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    lwpb_client_call_init(&calls[0], client_request_handler,
+                          client_response_handler, NULL, &states[0]);
+    lwpb_client_call_async(&client, test_Search_search_by_name, &calls[0]);
+    result = lwpb_client_wait(&client, &calls[0]);
+    LWPB_DIAG_PRINTF("after server exit: result = %d\n", result);
+    if (result != LWPB_RPC_NOT_CONNECTED)
+        failed = 1;
+
+    lwpb_transport_shm_client_close(transport);
+    unlink(path);
+
+    return failed;
+}
+
+/**
+ * Corrupts the request ring of a client the way a broken or hostile client
+ * could and checks that the server drops only that client.
+ * @return Returns 0 if the server rejected the corrupted rings.
+ */
+static int run_corrupt_test(void)
+{
+    struct lwpb_transport_shm_client shm_client;
+    struct lwpb_client client;
+    struct call_state state;
+    struct lwpb_shm_ring *ring;
+    struct lwpb_shm_record *record;
+    lwpb_transport_t transport;
+    lwpb_rpc_result_t result;
+    char path[64];
+    u64_t one = 1;
+    pid_t pid;
+    int failed = 0;
+    int round, i;
+
+    snprintf(path, sizeof(path), "/tmp/lwpb-test-shm-%d", (int) getpid());
+    if (start_server(path, 0, &pid) != 0)
+        return 1;
+
+    for (round = 0; round < 3 && !failed; round++) {
+        transport = lwpb_transport_shm_client_init(&shm_client);
+        lwpb_client_init(&client, transport);
+        lwpb_client_arg(&client, &state);
+        lwpb_client_handler(&client, client_request_handler, client_response_handler,
+                            client_call_done_handler);
+        if (lwpb_transport_shm_client_open(transport, path) != LWPB_ERR_OK) {
+            LWPB_DIAG_PRINTF("Cannot open shared memory client\n");
+            failed = 1;
+            break;
+        }
+
+        state.id = round;
+        state.person_id = -1;
+        lwpb_client_call(&client, test_Search_search_by_name);
+        result = lwpb_client_wait(&client, &client.call);
+        if (result != LWPB_RPC_OK || state.person_id != round) {
+            LWPB_DIAG_PRINTF("round %d: result = %d\n", round, result);
+            failed = 1;
+        }
+        if (round == 2)
+            break;
+
+        // The sizes in the shared memory must not be trusted either
+        ring = shm_client.channel.req;
+        ring->size = 1u << 30;
+        ring->max_msg = 1u << 29;
+        if (round == 0) {
+            // Head far ahead of the tail
+            ring->head = ring->tail + 16 * RING_SIZE;
+        } else {
+            // Record running past the end of the ring
+            ring->tail = ring->head = 3 * RING_SIZE - 8;
+            record = (struct lwpb_shm_record *) (ring->data + RING_SIZE - 8);
+            record->len = MAX_MSG;
+            ring->head += RING_SIZE;
+        }
+        if (write(shm_client.channel.req_event, &one, sizeof(one)) != sizeof(one))
+            failed = 1;
+
+        // The server closes the connection
+        for (i = 0; i < 50 && shm_client.channel.socket != -1; i++)
+            lwpb_transport_shm_client_update(transport);
+        LWPB_DIAG_PRINTF("corrupted ring %d: connection %s\n", round,
+                         shm_client.channel.socket == -1 ? "closed" : "open");
+        if (shm_client.channel.socket != -1)
+            failed = 1;
+        lwpb_transport_shm_client_close(transport);
+    }
+    lwpb_transport_shm_client_close(transport);
+
+    if (waitpid(pid, NULL, WNOHANG) != 0) {
+        LWPB_DIAG_PRINTF("server exited\n");
+        failed = 1;
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    unlink(path);
+
+    return failed;
+}
+
+int main()
+{
+    if (run_test(0) != 0)
+        return 1;
+
+    if (run_test(50) != 0)
+        return 1;
+
+    if (run_corrupt_test() != 0)
+        return 1;
+
+    return 0;
+}
@@ -0,0 +1,1523 @@
+/** @file test_rpc_socket.c
+ * 
+ * Tests the socket RPC transports over loopback.
+ * 
+ * Copyright 2009 Simon Kallweit
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <lwpb/lwpb.h>
+#include <lwpb/rpc/socket_client.h>
+#include <lwpb/rpc/socket_server.h>
+
+#include "generated/test_rpc_pb2.h"
+
+#define NUM_CLIENTS 32
+
+/** Number of concurrent asynchronous calls */
+#define NUM_ASYNC_CALLS 500
+
+/** Timeout of calls to a test client's server (ms), so waits never hang */
+#define CALL_TIMEOUT 5000
+
+/**
+ * Time spent in the server call handler (us). If negative, earlier calls of
+ * a client take longer, so their responses are overtaken by later ones.
+ */
+static int handler_delay;
+
+/** Number of pipelined calls per client */
+static int num_calls;
+
+/** Socket transport options of clients and server */
+static unsigned int socket_options = LWPB_TRANSPORT_SOCKET_DEFAULT_OPTIONS;
+
+/** Number of padding bytes appended to the name in requests */
+static int request_padding;
+
+/** Number of padding bytes appended to the name in responses */
+static int response_padding;
+
+/** Padded name of responses, filled in by the server before it starts */
+static char response_name[32 * 1024];
+
+/** Admission control limits of the server */
+static struct lwpb_socket_server_limits server_limits;
+
+/** Set to serve search_by_name as a server streaming method */
+static int stream_calls;
+
+/** Set to make the server call handler fail for odd person ids */
+static int fail_calls;
+
+/** Size of client message buffers, large enough for padded requests */
+#define LARGE_BUF_SIZE (64 * 1024)
+
+struct client_state {
+    int id;             /**< Person id of the first call */
+    int calls;          /**< Number of calls made */
+    int done;           /**< Number of calls done */
+    int result;         /**< Result of last call */
+    int person_id;      /**< Person id of last response */
+    u32_t seen;         /**< Person ids received (relative to id) */
+    int reordered;      /**< Set if responses arrived out of order */
+};
+
+// Client handlers
+
+static lwpb_err_t client_request_handler(
+    struct lwpb_client *client, const struct lwpb_method_desc *method_desc,
+    const struct lwpb_msg_desc *msg_desc, void *buf, size_t *len, void *arg)
+{
+    struct client_state *state = arg;
+    struct lwpb_encoder encoder;
+    static char name[LARGE_BUF_SIZE / 2];
+    int n;
+
+    n = snprintf(name, sizeof(name), "client %d", state->id + state->calls++);
+    LWPB_MEMSET(name + n, 'x', request_padding);
+    name[n + request_padding] = '\0';
+
+    lwpb_encoder_init(&encoder);
+    lwpb_encoder_start(&encoder, msg_desc, buf, *len);
+    lwpb_encoder_add_string(&encoder, test_Name_name, name);
+    *len = lwpb_encoder_finish(&encoder);
+
+    return LWPB_ERR_OK;
+}
+
+static lwpb_err_t client_response_handler(
+    struct lwpb_client *client, const struct lwpb_method_desc *method_desc,
+    const struct lwpb_msg_desc *msg_desc, void *buf, size_t len, void *arg)
+{
+    struct client_state *state = arg;
+    struct lwpb_reader reader;
+    const struct lwpb_field_desc *field_desc;
+    union lwpb_value value;
+    lwpb_err_t ret;
+
+    lwpb_reader_init(&reader, msg_desc, buf, len);
+    while ((ret = lwpb_reader_next(&reader, &field_desc, &value)) == LWPB_ERR_OK) {
+        if (!field_desc && reader.depth == 1)
+            break;
+        if (field_desc == test_LookupResult_person)
+            lwpb_reader_enter(&reader);
+        if (field_desc == test_Person_id) {
+            if (state->done && value.int32 < state->person_id)
+                state->reordered = 1;
+            state->person_id = value.int32;
+            if (value.int32 >= state->id && value.int32 < state->id + 32)
+                state->seen |= 1 << (value.int32 - state->id);
+        }
+    }
+
+    return ret;
+}
+
+static void client_call_done_handler(
+    struct lwpb_client *client, const struct lwpb_method_desc *method_desc,
+    lwpb_rpc_result_t result, void *arg)
+{
+    struct client_state *state = arg;
+
+    state->done++;
+    if (state->result == LWPB_RPC_OK)
+        state->result = result;
+}
+
+static lwpb_err_t large_alloc_buf(lwpb_transport_t transport, void **buf, size_t *len)
+{
+    *buf = malloc(LARGE_BUF_SIZE);
+    *len = LARGE_BUF_SIZE;
+    return *buf ? LWPB_ERR_OK : LWPB_ERR_MEM;
+}
+
+static void large_free_buf(lwpb_transport_t transport, void *buf)
+{
+    free(buf);
+}
+
+static const struct lwpb_allocator_funs large_allocator = {
+    .alloc_buf = large_alloc_buf,
+    .free_buf = large_free_buf,
+};
+
+// Server handlers
+
+/**
+ * Returns the number of the calling client in a request, which is the
+ * person id of the response.
+ */
+static int requested_id(const struct lwpb_msg_desc *req_desc, void *req_buf,
+                        size_t req_len)
+{
+    struct lwpb_reader reader;
+    const struct lwpb_field_desc *field_desc;
+    union lwpb_value value;
+    char name[32];
+    size_t len;
+    int id = -1;
+
+    // Answer with the number of the calling client as the person id
+    lwpb_reader_init(&reader, req_desc, req_buf, req_len);
+    while (lwpb_reader_next(&reader, &field_desc, &value) == LWPB_ERR_OK && field_desc) {
+        if (field_desc == test_Name_name && value.string.len > 7) {
+            // Reader strings are not null-terminated
+            len = value.string.len < sizeof(name) ? value.string.len : sizeof(name) - 1;
+            LWPB_MEMCPY(name, value.string.str, len);
+            name[len] = '\0';
+            id = atoi(name + 7);
+        }
+    }
+
+    return id;
+}
+
+static lwpb_err_t server_request_handler(
+    struct lwpb_server *server, const struct lwpb_method_desc *method_desc,
+    const struct lwpb_msg_desc *req_desc, void *req_buf, size_t req_len,
+    const struct lwpb_msg_desc *res_desc, void *res_buf, size_t *res_len,
+    void *arg)
+{
+    struct lwpb_encoder encoder;
+    int id = requested_id(req_desc, req_buf, req_len);
+
+    if (handler_delay > 0)
+        usleep(handler_delay);
+    else if (handler_delay < 0)
+        usleep((num_calls - id % num_calls) * -handler_delay);
+
+    if (fail_calls && id % 2)
+        return LWPB_ERR_MEM;
+
+    lwpb_encoder_init(&encoder);
+    lwpb_encoder_start(&encoder, res_desc, res_buf, *res_len);
+    lwpb_encoder_nested_start(&encoder, test_LookupResult_person);
+    lwpb_encoder_add_string(&encoder, test_Person_name, "Simon Kallweit");
+    lwpb_encoder_add_int32(&encoder, test_Person_id, id);
+    lwpb_encoder_nested_end(&encoder);
+    *res_len = lwpb_encoder_finish(&encoder);
+
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Answers with a padded name, so responses are larger than the response
+ * buffers of the transport.
+ */
+static lwpb_err_t server_encode_handler(
+    struct lwpb_server *server, const struct lwpb_method_desc *method_desc,
+    const struct lwpb_msg_desc *req_desc, void *req_buf, size_t req_len,
+    struct lwpb_encoder *encoder, void *arg)
+{
+    int id = requested_id(req_desc, req_buf, req_len);
+
+    lwpb_encoder_nested_start(encoder, test_LookupResult_person);
+    lwpb_encoder_add_string(encoder, test_Person_name, response_name);
+    lwpb_encoder_add_int32(encoder, test_Person_id, id);
+    return lwpb_encoder_nested_end(encoder);
+}
+
+/**
+ * Streams as many results as the number in the requested name, with the
+ * person ids counting up from 0.
+ */
+static lwpb_err_t server_stream_handler(
+    struct lwpb_server *server, const struct lwpb_method_desc *method_desc,
+    const struct lwpb_msg_desc *req_desc, void *req_buf, size_t req_len,
+    const struct lwpb_msg_desc *res_desc, struct lwpb_server_writer *writer,
+    void *arg)
+{
+    struct lwpb_reader reader;
+    const struct lwpb_field_desc *field_desc;
+    union lwpb_value value;
+    struct lwpb_encoder encoder;
+    char name[32];
+    size_t len;
+    int *pos = writer->state;
+    int count = 0;
+    lwpb_err_t ret = LWPB_ERR_OK;
+
+    if (writer->cancelled) {
+        free(pos);
+        return LWPB_ERR_CANCEL;
+    }
+
+    lwpb_reader_init(&reader, req_desc, req_buf, req_len);
+    while (lwpb_reader_next(&reader, &field_desc, &value) == LWPB_ERR_OK && field_desc) {
+        if (field_desc == test_Name_name && value.string.len > 7) {
+            len = value.string.len < sizeof(name) ? value.string.len : sizeof(name) - 1;
+            LWPB_MEMCPY(name, value.string.str, len);
+            name[len] = '\0';
+            count = atoi(name + 7);
+        }
+    }
+
+    if (!pos) {
+        pos = malloc(sizeof(*pos));
+        if (!pos)
+            return LWPB_ERR_MEM;
+        *pos = 0;
+        writer->state = pos;
+    }
+
+    while (*pos < count) {
+        lwpb_encoder_init(&encoder);
+        lwpb_encoder_start(&encoder, res_desc, writer->buf, writer->len);
+        lwpb_encoder_nested_start(&encoder, test_LookupResult_person);
+        lwpb_encoder_add_string(&encoder, test_Person_name, "Simon Kallweit");
+        lwpb_encoder_add_int32(&encoder, test_Person_id, *pos);
+        lwpb_encoder_nested_end(&encoder);
+        ret = lwpb_server_writer_write(writer, lwpb_encoder_finish(&encoder));
+        if (ret != LWPB_ERR_OK && ret != LWPB_ERR_BUSY)
+            break;
+        (*pos)++;
+        if (ret == LWPB_ERR_BUSY && *pos < count)
+            return LWPB_ERR_BUSY;
+    }
+
+    if (*pos == count)
+        ret = LWPB_ERR_OK;
+    free(pos);
+    writer->state = NULL;
+
+    return ret;
+}
+
+static const struct lwpb_service_desc *service_list[] = {
+    test_Search, NULL,
+};
+
+static const struct lwpb_method_desc *stream_methods[] = {
+    test_Search_search_by_name, NULL,
+};
+
+/**
+ * Opens the server and runs it until the process is killed.
+ * @param num_shards Number of server group shards (0 = single server)
+ * @param num_workers Number of server worker threads (0 = inline)
+ * @param queue_size Depth of the server worker queue
+ * @param fd Pipe to report the listen port to (0 on failure)
+ */
+static void run_server(int num_shards, int num_workers, size_t queue_size, int fd)
+{
+    struct lwpb_transport_socket_server socket_server;
+    lwpb_transport_t server_transport;
+    struct lwpb_server server;
+    struct lwpb_socket_server_group group;
+    u16_t port = 0;
+    int i;
+
+    if (num_shards == 0) {
+        server_transport = lwpb_transport_socket_server_init(&socket_server);
+        lwpb_server_init(&server, service_list, server_transport);
+        lwpb_server_handler(&server, server_request_handler);
+        if (response_padding) {
+            LWPB_MEMSET(response_name, 'x', response_padding);
+            response_name[response_padding] = '\0';
+            lwpb_server_encode_handler(&server, server_encode_handler);
+        }
+        if (stream_calls)
+            lwpb_server_stream_handler(&server, stream_methods,
+                                       server_stream_handler);
+        lwpb_transport_socket_server_workers(server_transport, num_workers, queue_size);
+        lwpb_transport_socket_server_options(server_transport, socket_options);
+        lwpb_transport_socket_server_limits(server_transport, &server_limits);
+        if (lwpb_transport_socket_server_open(server_transport, "127.0.0.1", 0) ==
+            LWPB_ERR_OK)
+            port = lwpb_transport_socket_server_port(server_transport);
+        if (write(fd, &port, sizeof(port)) != sizeof(port) || !port)
+            exit(1);
+        while (1)
+            lwpb_transport_socket_server_update(server_transport);
+    }
+
+    // Sharded server, the group's reactor threads do all the work
+    if (lwpb_socket_server_group_init(&group, num_shards, service_list,
+                                      server_request_handler, NULL) != LWPB_ERR_OK)
+        exit(1);
+    for (i = 0; i < num_shards; i++) {
+        lwpb_transport_socket_server_workers(lwpb_socket_server_group_shard(&group, i),
+                                             num_workers, queue_size);
+        lwpb_transport_socket_server_options(lwpb_socket_server_group_shard(&group, i),
+                                             socket_options);
+    }
+    if (lwpb_socket_server_group_open(&group, "127.0.0.1", 0) == LWPB_ERR_OK)
+        port = lwpb_transport_socket_server_port(lwpb_socket_server_group_shard(&group, 0));
+    if (write(fd, &port, sizeof(port)) != sizeof(port) || !port)
+        exit(1);
+    while (1)
+        pause();
+}
+
+/**
+ * Runs the server in a child process, which opens it on an ephemeral port,
+ * so the worker threads are started in the child.
+ * @param num_shards Number of server group shards (0 = single server)
+ * @param num_workers Number of server worker threads (0 = inline)
+ * @param queue_size Depth of the server worker queue
+ * @param pid Returns the process id of the server
+ * @param port Returns the listen port of the server
+ * @return Returns 0 if the server is running.
+ */
+static int start_server(int num_shards, int num_workers, size_t queue_size,
+                        pid_t *pid, u16_t *port)
+{
+    int fds[2];
+
+    if (pipe(fds) == -1)
+        return 1;
+    fflush(stdout);
+    *pid = fork();
+    if (*pid == 0)
+        run_server(num_shards, num_workers, queue_size, fds[1]);
+    if (read(fds[0], port, sizeof(*port)) != sizeof(*port) || !*port) {
+        LWPB_DIAG_PRINTF("Cannot open socket server\n");
+        kill(*pid, SIGKILL);
+        return 1;
+    }
+    close(fds[0]);
+    close(fds[1]);
+
+    return 0;
+}
+
+/**
+ * Runs pipelined calls from a number of clients against a forked server.
+ * @param num_shards Number of server group shards (0 = single server)
+ * @param num_workers Number of server worker threads (0 = inline)
+ * @param queue_size Depth of the server worker queue
+ * @param num_clients Number of clients
+ * @return Returns 0 if all calls succeeded.
+ */
+static int run_test(int num_shards, int num_workers, size_t queue_size,
+                    int num_clients)
+{
+    lwpb_err_t ret;
+    static struct lwpb_transport_socket_client socket_clients[NUM_CLIENTS];
+    static struct lwpb_client clients[NUM_CLIENTS];
+    static struct client_state states[NUM_CLIENTS];
+    lwpb_transport_t transport;
+    u16_t port;
+    pid_t pid;
+    time_t start;
+    int done;
+    int i, j;
+
+    LWPB_DIAG_PRINTF("running with %d shards, %d workers, queue size %d, "
+                     "%d clients, %d calls\n", num_shards, num_workers,
+                     (int) queue_size, num_clients, num_calls);
+
+    if (start_server(num_shards, num_workers, queue_size, &pid, &port) != 0)
+        return 1;
+
+    // Connect more clients than the old fixed connection limit
+    for (i = 0; i < num_clients; i++) {
+        LWPB_MEMSET(&states[i], 0, sizeof(states[i]));
+        states[i].id = i * num_calls;
+        transport = lwpb_transport_socket_client_init(&socket_clients[i]);
+        lwpb_client_init(&clients[i], transport);
+        lwpb_client_arg(&clients[i], &states[i]);
+        lwpb_client_handler(&clients[i],
+                            client_request_handler,
+                            client_response_handler,
+                            client_call_done_handler);
+        lwpb_transport_socket_client_options(transport, socket_options);
+        if (request_padding)
+            lwpb_transport_set_allocator(transport, &large_allocator);
+        ret = lwpb_transport_socket_client_open(transport, "127.0.0.1", port);
+        if (ret != LWPB_ERR_OK) {
+            LWPB_DIAG_PRINTF("Cannot open socket client %d\n", i);
+            kill(pid, SIGKILL);
+            return 1;
+        }
+    }
+
+    // Wait for the HELLO exchange, so calls use the binary v2 header
+    start = time(NULL);
+    for (i = 0; i < num_clients; i++)
+        while ((socket_options & LWPB_TRANSPORT_SOCKET_V2) &&
+               socket_clients[i].version != 2 && time(NULL) - start < 10)
+            lwpb_transport_socket_client_update(clients[i].transport);
+
+    // Pipeline all calls without waiting for responses
+    for (i = 0; i < num_clients; i++)
+        for (j = 0; j < num_calls; j++)
+            lwpb_client_call(&clients[i], test_Search_search_by_name);
+
+    // Wait for all calls to complete
+    start = time(NULL);
+    do {
+        done = 0;
+        for (i = 0; i < num_clients; i++) {
+            if (lwpb_transport_socket_client_pending(clients[i].transport))
+                lwpb_transport_socket_client_update(clients[i].transport);
+            done += states[i].done;
+        }
+    } while (done < num_clients * num_calls && time(NULL) - start < 10);
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+
+    for (i = 0; i < num_clients; i++) {
+        LWPB_DIAG_PRINTF("client %d: version = %d, done = %d, result = %d, "
+                         "seen = %08x, reordered = %d\n", i,
+                         socket_clients[i].version, states[i].done,
+                         states[i].result, states[i].seen, states[i].reordered);
+        if (states[i].done != num_calls || states[i].result != LWPB_RPC_OK ||
+            states[i].seen != (u32_t) ((1ULL << num_calls) - 1))
+            return 1;
+        lwpb_transport_socket_client_close(clients[i].transport);
+    }
+
+    return 0;
+}
+
+// Asynchronous call handlers, each call has its own state
+
+struct async_state {
+    int id;             /**< Person id requested */
+    int person_id;      /**< Person id of the response */
+};
+
+static lwpb_err_t async_request_handler(
+    struct lwpb_client *client, const struct lwpb_method_desc *method_desc,
+    const struct lwpb_msg_desc *msg_desc, void *buf, size_t *len, void *arg)
+{
+    struct async_state *state = arg;
+    struct lwpb_encoder encoder;
+    char name[32];
+
+    snprintf(name, sizeof(name), "client %d", state->id);
+
+    lwpb_encoder_init(&encoder);
+    lwpb_encoder_start(&encoder, msg_desc, buf, *len);
+    lwpb_encoder_add_string(&encoder, test_Name_name, name);
+    *len = lwpb_encoder_finish(&encoder);
+
+    return LWPB_ERR_OK;
+}
+
+static lwpb_err_t async_response_handler(
+    struct lwpb_client *client, const struct lwpb_method_desc *method_desc,
+    const struct lwpb_msg_desc *msg_desc, void *buf, size_t len, void *arg)
+{
+    struct async_state *state = arg;
+    struct lwpb_reader reader;
+    const struct lwpb_field_desc *field_desc;
+    union lwpb_value value;
+    lwpb_err_t ret;
+
+    lwpb_reader_init(&reader, msg_desc, buf, len);
+    while ((ret = lwpb_reader_next(&reader, &field_desc, &value)) == LWPB_ERR_OK) {
+        if (!field_desc && reader.depth == 1)
+            break;
+        if (field_desc == test_LookupResult_person)
+            lwpb_reader_enter(&reader);
+        if (field_desc == test_Person_id)
+            state->person_id = value.int32;
+    }
+
+    return ret;
+}
+
+/** Client connected to a forked server */
+struct test_client {
+    struct lwpb_transport_socket_client socket_client;
+    struct lwpb_client client;
+    lwpb_transport_t transport;
+    pid_t pid;          /**< Process id of the server, 0 once it is killed */
+};
+
+/**
+ * Kills the server of a test client.
+ * @param tc Test client
+ */
+static void kill_test_server(struct test_client *tc)
+{
+    if (!tc->pid)
+        return;
+    kill(tc->pid, SIGKILL);
+    waitpid(tc->pid, NULL, 0);
+    tc->pid = 0;
+}
+
+/**
+ * Starts a single server and connects a client to it. Calls of the client
+ * time out after CALL_TIMEOUT unless the test sets another timeout, so
+ * waiting for a call fails instead of hanging if the server never answers.
+ * @param tc Test client
+ * @param num_workers Number of server worker threads (0 = inline)
+ * @param v2 Set to wait until the client negotiated v2 with the server
+ * @return Returns 0 if the client is connected.
+ */
+static int open_test_client(struct test_client *tc, int num_workers, int v2)
+{
+    time_t start;
+    u16_t port;
+
+    if (start_server(0, num_workers, 0, &tc->pid, &port) != 0)
+        return 1;
+
+    tc->transport = lwpb_transport_socket_client_init(&tc->socket_client);
+    lwpb_client_init(&tc->client, tc->transport);
+    lwpb_transport_socket_client_options(tc->transport, socket_options);
+    lwpb_client_timeout(&tc->client, CALL_TIMEOUT);
+    if (lwpb_transport_socket_client_open(tc->transport, "127.0.0.1", port) !=
+        LWPB_ERR_OK) {
+        LWPB_DIAG_PRINTF("Cannot open socket client\n");
+        kill_test_server(tc);
+        return 1;
+    }
+
+    start = time(NULL);
+    while (v2 && tc->socket_client.version != 2 && time(NULL) - start < 10)
+        lwpb_transport_socket_client_update(tc->transport);
+    if (v2 && tc->socket_client.version != 2) {
+        LWPB_DIAG_PRINTF("Socket client did not negotiate v2\n");
+        kill_test_server(tc);
+        lwpb_transport_socket_client_close(tc->transport);
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Kills the server of a test client and closes the client.
+ * @param tc Test client
+ */
+static void close_test_client(struct test_client *tc)
+{
+    kill_test_server(tc);
+    lwpb_transport_socket_client_close(tc->transport);
+}
+
+/**
+ * Runs many concurrent asynchronous calls from a single client and waits
+ * for each of them.
+ * @param num_workers Number of server worker threads (0 = inline)
+ * @param count Number of calls
+ * @param batch Set to send the calls in batches
+ * @return Returns 0 if all calls succeeded.
+ */
+static int run_async_test(int num_workers, int count, int batch)
+{
+    static struct lwpb_client_call calls[NUM_ASYNC_CALLS];
+    static struct async_state states[NUM_ASYNC_CALLS];
+    struct test_client tc;
+    int failed = 0;
+    int i;
+
+    LWPB_DIAG_PRINTF("running %d async calls with %d workers%s\n", count,
+                     num_workers, batch ? ", batched" : "");
+
+    num_calls = count;
+    handler_delay = -10;
+
+    // Batches are only sent to servers which negotiated v2
+    if (open_test_client(&tc, num_workers, batch) != 0)
+        return 1;
+    if (batch)
+        lwpb_client_batch_begin(&tc.client);
+
+    for (i = 0; i < count; i++) {
+        states[i].id = i;
+        states[i].person_id = -1;
+        lwpb_client_call_init(&calls[i], async_request_handler,
+                              async_response_handler, NULL, &states[i]);
+        lwpb_client_call_async(&tc.client, test_Search_search_by_name, &calls[i]);
+    }
+    if (batch)
+        lwpb_client_batch_end(&tc.client);
+    LWPB_DIAG_PRINTF("outstanding calls = %d\n",
+                     lwpb_transport_socket_client_pending(tc.transport));
+
+    // Wait for the calls in order, while later ones complete in the meantime
+    for (i = 0; i < count; i++) {
+        if (lwpb_client_wait(&tc.client, &calls[i]) != LWPB_RPC_OK ||
+            states[i].person_id != i) {
+            LWPB_DIAG_PRINTF("call %d: result = %d, person_id = %d\n", i,
+                             calls[i].result, states[i].person_id);
+            failed = 1;
+        }
+    }
+
+    close_test_client(&tc);
+
+    return failed;
+}
+
+/**
+ * Runs a burst of asynchronous calls against a server with admission control
+ * limits. Calls are either answered or rejected as overloaded, none are lost.
+ * @param num_workers Number of server worker threads (0 = inline)
+ * @param count Number of calls
+ * @param min_ok Minimum number of calls which have to succeed
+ * @param max_ok Maximum number of calls which may succeed
+ * @return Returns 0 if all calls completed as expected.
+ */
+static int run_admission_test(int num_workers, int count, int min_ok, int max_ok)
+{
+    static struct lwpb_client_call calls[NUM_ASYNC_CALLS];
+    static struct async_state states[NUM_ASYNC_CALLS];
+    struct test_client tc;
+    lwpb_rpc_result_t result;
+    int failed = 0;
+    int ok = 0;
+    int i;
+
+    LWPB_DIAG_PRINTF("running %d calls with %d workers, max pending %d, "
+                     "rate %u, burst %u, max buffered %d, %s\n", count,
+                     num_workers, server_limits.max_pending, server_limits.rate,
+                     server_limits.burst, (int) server_limits.max_buffered,
+                     server_limits.policy == LWPB_TRANSPORT_SOCKET_SERVER_REJECT ?
+                     "reject" : "pause");
+
+    num_calls = count;
+    if (open_test_client(&tc, num_workers, 0) != 0)
+        return 1;
+
+    for (i = 0; i < count; i++) {
+        states[i].id = i;
+        states[i].person_id = -1;
+        lwpb_client_call_init(&calls[i], async_request_handler,
+                              async_response_handler, NULL, &states[i]);
+        lwpb_client_call_async(&tc.client, test_Search_search_by_name, &calls[i]);
+    }
+
+    for (i = 0; i < count; i++) {
+        result = lwpb_client_wait(&tc.client, &calls[i]);
+        if (result == LWPB_RPC_OK && states[i].person_id == i) {
+            ok++;
+        } else if (result != LWPB_RPC_OVERLOADED) {
+            LWPB_DIAG_PRINTF("call %d: result = %d, person_id = %d\n", i,
+                             result, states[i].person_id);
+            failed = 1;
+        }
+    }
+    LWPB_DIAG_PRINTF("%d calls succeeded, %d overloaded\n", ok, count - ok);
+    if (ok < min_ok || ok > max_ok)
+        failed = 1;
+
+    close_test_client(&tc);
+
+    return failed;
+}
+
+/**
+ * Runs calls from a single client against a slow server with a single
+ * worker, so most calls wait in the worker queue. Calls either time out or
+ * are cancelled right after they are started. Afterwards, a call must get
+ * through in time, which requires the server to have dropped the calls
+ * nobody waits for anymore.
+ * @param count Number of calls
+ * @param timeout Timeout of the calls (ms), 0 for CALL_TIMEOUT
+ * @param cancel_every Cancel every n-th call, 0 for none
+ * @param min_ok Minimum number of successful calls
+ * @param max_ok Maximum number of successful calls
+ * @return Returns 0 if the calls completed as expected.
+ */
+static int run_deadline_test(int count, u32_t timeout, int cancel_every,
+                             int min_ok, int max_ok)
+{
+    static struct lwpb_client_call calls[NUM_ASYNC_CALLS];
+    static struct async_state states[NUM_ASYNC_CALLS];
+    struct test_client tc;
+    lwpb_rpc_result_t result;
+    lwpb_rpc_result_t expected;
+    int failed = 0;
+    int ok = 0;
+    int i;
+
+    LWPB_DIAG_PRINTF("running %d calls with timeout %u ms, cancelling every "
+                     "%d\n", count, timeout, cancel_every);
+
+    num_calls = count;
+    if (open_test_client(&tc, 1, 0) != 0)
+        return 1;
+    if (timeout)
+        lwpb_client_timeout(&tc.client, timeout);
+
+    // Negotiate v2 first, CANCEL frames are only sent to v2 servers
+    states[0].id = 0;
+    lwpb_client_call_init(&calls[0], async_request_handler,
+                          async_response_handler, NULL, &states[0]);
+    lwpb_client_call_timeout(&calls[0], 1000);
+    lwpb_client_call_async(&tc.client, test_Search_search_by_name, &calls[0]);
+    if (lwpb_client_wait(&tc.client, &calls[0]) != LWPB_RPC_OK)
+        failed = 1;
+
+    for (i = 0; i < count; i++) {
+        states[i].id = i;
+        states[i].person_id = -1;
+        lwpb_client_call_init(&calls[i], async_request_handler,
+                              async_response_handler, NULL, &states[i]);
+        lwpb_client_call_async(&tc.client, test_Search_search_by_name, &calls[i]);
+        if (cancel_every && i % cancel_every == cancel_every - 1)
+            lwpb_client_call_cancel(&tc.client, &calls[i]);
+    }
+
+    for (i = 0; i < count; i++) {
+        expected = timeout ? LWPB_RPC_TIMEOUT : LWPB_RPC_OK;
+        if (cancel_every && i % cancel_every == cancel_every - 1)
+            expected = LWPB_RPC_CANCELLED;
+        result = lwpb_client_wait(&tc.client, &calls[i]);
+        if (result == LWPB_RPC_OK && states[i].person_id == i) {
+            ok++;
+        } else if (result != expected) {
+            LWPB_DIAG_PRINTF("call %d: result = %d, person_id = %d\n", i,
+                             result, states[i].person_id);
+            failed = 1;
+        }
+    }
+    LWPB_DIAG_PRINTF("%d calls succeeded, %d timed out or cancelled\n", ok,
+                     count - ok);
+    if (ok < min_ok || ok > max_ok)
+        failed = 1;
+
+    // The dropped calls must not hold up the next one
+    states[0].id = 0;
+    states[0].person_id = -1;
+    lwpb_client_call_init(&calls[0], async_request_handler,
+                          async_response_handler, NULL, &states[0]);
+    lwpb_client_call_timeout(&calls[0], 100);
+    lwpb_client_call_async(&tc.client, test_Search_search_by_name, &calls[0]);
+    result = lwpb_client_wait(&tc.client, &calls[0]);
+    LWPB_DIAG_PRINTF("call after drops: result = %d\n", result);
+    if (result != LWPB_RPC_OK || states[0].person_id != 0)
+        failed = 1;
+
+    close_test_client(&tc);
+
+    return failed;
+}
+
+/**
+ * Runs asynchronous calls against a server whose call handler fails for
+ * every other call. Failed calls must be answered with LWPB_RPC_FAILED
+ * instead of leaving the client waiting, so the calls have a timeout to
+ * catch unanswered ones.
+ * @param num_workers Number of server worker threads (0 = inline)
+ * @param count Number of calls
+ * @return Returns 0 if all calls completed as expected.
+ */
+static int run_failure_test(int num_workers, int count)
+{
+    static struct lwpb_client_call calls[NUM_ASYNC_CALLS];
+    static struct async_state states[NUM_ASYNC_CALLS];
+    struct test_client tc;
+    lwpb_rpc_result_t result;
+    lwpb_rpc_result_t expected;
+    int failed = 0;
+    int i;
+
+    LWPB_DIAG_PRINTF("running %d failing calls with %d workers\n", count,
+                     num_workers);
+
+    fail_calls = 1;
+    failed = open_test_client(&tc, num_workers, 0);
+    fail_calls = 0;
+    if (failed)
+        return 1;
+
+    for (i = 0; i < count; i++) {
+        states[i].id = i;
+        states[i].person_id = -1;
+        lwpb_client_call_init(&calls[i], async_request_handler,
+                              async_response_handler, NULL, &states[i]);
+        lwpb_client_call_async(&tc.client, test_Search_search_by_name, &calls[i]);
+    }
+
+    for (i = 0; i < count; i++) {
+        expected = i % 2 ? LWPB_RPC_FAILED : LWPB_RPC_OK;
+        result = lwpb_client_wait(&tc.client, &calls[i]);
+        if (result != expected ||
+            (result == LWPB_RPC_OK && states[i].person_id != i)) {
+            LWPB_DIAG_PRINTF("call %d: result = %d, person_id = %d\n", i,
+                             result, states[i].person_id);
+            failed = 1;
+        }
+    }
+
+    close_test_client(&tc);
+
+    return failed;
+}
+
+/**
+ * Runs asynchronous calls against a slow server, which is killed while the
+ * calls are outstanding. The client must close and fail the calls with
+ * LWPB_RPC_NOT_CONNECTED instead of aborting the process, including a call
+ * made after the server went away.
+ * @param count Number of calls
+ * @return Returns 0 if all calls failed as expected.
+ */
+static int run_disconnect_test(int count)
+{
+    static struct lwpb_client_call calls[NUM_ASYNC_CALLS];
+    static struct async_state states[NUM_ASYNC_CALLS];
+    struct test_client tc;
+    lwpb_rpc_result_t result;
+    int failed = 0;
+    int i;
+
+    LWPB_DIAG_PRINTF("running %d calls against a server going away\n", count);
+
+    handler_delay = 200000;
+    failed = open_test_client(&tc, 0, 0);
+    handler_delay = 0;
+    if (failed)
+        return 1;
+
+    for (i = 0; i < count; i++) {
+        states[i].id = i;
+        states[i].person_id = -1;
+        lwpb_client_call_init(&calls[i], async_request_handler,
+                              async_response_handler, NULL, &states[i]);
+        lwpb_client_call_async(&tc.client, test_Search_search_by_name, &calls[i]);
+        if (i == count - 2) {
+            lwpb_transport_socket_client_flush(tc.transport);
+            usleep(50000);
+            kill_test_server(&tc);
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        result = lwpb_client_wait(&tc.client, &calls[i]);
+        if (result != LWPB_RPC_NOT_CONNECTED) {
+            LWPB_DIAG_PRINTF("call %d: result = %d\n", i, result);
+            failed = 1;
+        }
+    }
+
+    close_test_client(&tc);
+
+    return failed;
+}
+
+/** Transport closed by close_done_handler() */
+static lwpb_transport_t close_transport;
+
+/** Id of the call whose completion closes the transport */
+static int close_id;
+
+static void close_done_handler(
+    struct lwpb_client *client, const struct lwpb_method_desc *method_desc,
+    lwpb_rpc_result_t result, void *arg)
+{
+    struct async_state *state = arg;
+
+    if (state->id == close_id)
+        lwpb_transport_socket_client_close(close_transport);
+}
+
+/**
+ * Runs calls whose responses arrive together and closes the client from the
+ * done handler of one of them. The client must stop handling the received
+ * frames, whose buffer is freed by the close, and fail the remaining calls
+ * with LWPB_RPC_NOT_CONNECTED.
+ * @param count Number of calls
+ * @return Returns 0 if all calls completed as expected.
+ */
+static int run_close_in_done_test(int count)
+{
+    static struct lwpb_client_call calls[NUM_ASYNC_CALLS];
+    static struct async_state states[NUM_ASYNC_CALLS];
+    struct test_client tc;
+    lwpb_rpc_result_t result;
+    int failed = 0;
+    int i;
+
+    LWPB_DIAG_PRINTF("running %d calls, closing the client after call %d\n",
+                     count, count / 2);
+
+    handler_delay = 0;
+    if (open_test_client(&tc, 0, 0) != 0)
+        return 1;
+    close_transport = tc.transport;
+    close_id = count / 2;
+
+    for (i = 0; i < count; i++) {
+        states[i].id = i;
+        states[i].person_id = -1;
+        lwpb_client_call_init(&calls[i], async_request_handler,
+                              async_response_handler, close_done_handler,
+                              &states[i]);
+        lwpb_client_call_async(&tc.client, test_Search_search_by_name, &calls[i]);
+    }
+    lwpb_transport_socket_client_flush(tc.transport);
+
+    // Let all responses arrive, so they are handled from a single buffer
+    usleep(100000);
+
+    for (i = 0; i < count; i++) {
+        result = lwpb_client_wait(&tc.client, &calls[i]);
+        if (i <= close_id ?
+            result != LWPB_RPC_OK || states[i].person_id != i :
+            result != LWPB_RPC_NOT_CONNECTED) {
+            LWPB_DIAG_PRINTF("call %d: result = %d, person_id = %d\n", i,
+                             result, states[i].person_id);
+            failed = 1;
+        }
+    }
+
+    close_test_client(&tc);
+
+    return failed;
+}
+
+/**
+ * Runs pipelined calls from several clients against a server with a single
+ * worker and a worker queue of one job, so all but one connection stall.
+ * All clients but the first close while their connections are stalled and
+ * the worker queue drains. The server has to retry and close the stalled
+ * connections without touching them after they are freed, and must still
+ * answer all calls of the first client.
+ * @param num_clients Number of clients
+ * @param count Number of calls per client
+ * @return Returns 0 if all calls of the first client succeeded.
+ */
+static int run_stall_close_test(int num_clients, int count)
+{
+    static struct lwpb_transport_socket_client socket_clients[NUM_CLIENTS];
+    static struct lwpb_client clients[NUM_CLIENTS];
+    static struct lwpb_client_call calls[NUM_ASYNC_CALLS];
+    static struct async_state states[NUM_ASYNC_CALLS];
+    lwpb_transport_t transport;
+    lwpb_rpc_result_t result;
+    u16_t port;
+    pid_t pid;
+    int failed = 0;
+    int i, j;
+
+    LWPB_DIAG_PRINTF("running %d stalled clients closing while the worker "
+                     "queue drains, %d calls each\n", num_clients, count);
+
+    handler_delay = 2000;
+    failed = start_server(0, 1, 1, &pid, &port);
+    handler_delay = 0;
+    if (failed)
+        return 1;
+
+    for (i = 0; i < num_clients; i++) {
+        transport = lwpb_transport_socket_client_init(&socket_clients[i]);
+        lwpb_client_init(&clients[i], transport);
+        lwpb_transport_socket_client_options(transport, socket_options);
+        lwpb_client_timeout(&clients[i], CALL_TIMEOUT);
+        if (lwpb_transport_socket_client_open(transport, "127.0.0.1", port) !=
+            LWPB_ERR_OK) {
+            LWPB_DIAG_PRINTF("Cannot open socket client %d\n", i);
+            while (i-- > 0)
+                lwpb_transport_socket_client_close(clients[i].transport);
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+            return 1;
+        }
+    }
+
+    for (i = 0; i < num_clients; i++) {
+        for (j = 0; j < count; j++) {
+            states[i * count + j].id = j;
+            states[i * count + j].person_id = -1;
+            lwpb_client_call_init(&calls[i * count + j], async_request_handler,
+                                  async_response_handler, NULL,
+                                  &states[i * count + j]);
+            lwpb_client_call_async(&clients[i], test_Search_search_by_name,
+                                   &calls[i * count + j]);
+        }
+        lwpb_transport_socket_client_flush(clients[i].transport);
+    }
+
+    // Close the other clients one by one while jobs keep completing
+    usleep(5000);
+    for (i = 1; i < num_clients; i++) {
+        lwpb_transport_socket_client_close(clients[i].transport);
+        usleep(1000);
+    }
+
+    for (j = 0; j < count; j++) {
+        result = lwpb_client_wait(&clients[0], &calls[j]);
+        if (result != LWPB_RPC_OK || states[j].person_id != j) {
+            LWPB_DIAG_PRINTF("call %d: result = %d, person_id = %d\n", j,
+                             result, states[j].person_id);
+            failed = 1;
+        }
+    }
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    lwpb_transport_socket_client_close(clients[0].transport);
+
+    return failed;
+}
+
+// Streaming call handlers, each stream has its own state
+
+struct stream_state {
+    int count;          /**< Number of results requested */
+    int received;       /**< Number of results received */
+    int stop;           /**< Stop the stream after this many results, 0 = never */
+    int ordered;        /**< Cleared if a result arrived out of order */
+};
+
+static lwpb_err_t stream_request_handler(
+    struct lwpb_client *client, const struct lwpb_method_desc *method_desc,
+    const struct lwpb_msg_desc *msg_desc, void *buf, size_t *len, void *arg)
+{
+    struct stream_state *state = arg;
+    struct lwpb_encoder encoder;
+    char name[32];
+
+    snprintf(name, sizeof(name), "client %d", state->count);
+
+    lwpb_encoder_init(&encoder);
+    lwpb_encoder_start(&encoder, msg_desc, buf, *len);
+    lwpb_encoder_add_string(&encoder, test_Name_name, name);
+    *len = lwpb_encoder_finish(&encoder);
+
+    return LWPB_ERR_OK;
+}
+
+static lwpb_err_t stream_response_handler(
+    struct lwpb_client *client, const struct lwpb_method_desc *method_desc,
+    const struct lwpb_msg_desc *msg_desc, void *buf, size_t len, void *arg)
+{
+    struct stream_state *state = arg;
+    struct lwpb_reader reader;
+    const struct lwpb_field_desc *field_desc;
+    union lwpb_value value;
+    lwpb_err_t ret;
+
+    lwpb_reader_init(&reader, msg_desc, buf, len);
+    while ((ret = lwpb_reader_next(&reader, &field_desc, &value)) == LWPB_ERR_OK) {
+        if (!field_desc && reader.depth == 1)
+            break;
+        if (field_desc == test_LookupResult_person)
+            lwpb_reader_enter(&reader);
+        if (field_desc == test_Person_id && value.int32 != state->received)
+            state->ordered = 0;
+    }
+    state->received++;
+
+    if (state->stop && state->received == state->stop)
+        return LWPB_ERR_CANCEL;
+
+    return ret;
+}
+
+/**
+ * Runs concurrent server streaming calls from a single client. The client
+ * first stops reading, so the server has to suspend the streams until the
+ * client catches up. One stream asks for far more results and is stopped
+ * by the client early on, the server ends it while the other streams
+ * complete.
+ * @param num_workers Number of server worker threads (0 = inline)
+ * @param count Number of results per stream
+ * @param num_streams Number of streams
+ * @return Returns 0 if all streams completed as expected.
+ */
+static int run_stream_test(int num_workers, int count, int num_streams)
+{
+    static struct lwpb_client_call calls[NUM_ASYNC_CALLS];
+    static struct stream_state states[NUM_ASYNC_CALLS];
+    struct test_client tc;
+    lwpb_rpc_result_t result;
+    lwpb_rpc_result_t expected;
+    int failed = 0;
+    int i;
+
+    LWPB_DIAG_PRINTF("running %d streams of %d results with %d workers\n",
+                     num_streams, count, num_workers);
+
+    // Stopped streams are only cancelled on servers which negotiated v2
+    stream_calls = 1;
+    failed = open_test_client(&tc, num_workers, 1);
+    stream_calls = 0;
+    if (failed)
+        return 1;
+
+    for (i = 0; i < num_streams; i++) {
+        states[i].count = i == 1 ? count * 100 : count;
+        states[i].received = 0;
+        states[i].stop = i == 1 ? 10 : 0;
+        states[i].ordered = 1;
+        lwpb_client_call_init(&calls[i], stream_request_handler,
+                              stream_response_handler, NULL, &states[i]);
+        lwpb_client_call_async(&tc.client, test_Search_search_by_name, &calls[i]);
+    }
+    lwpb_transport_socket_client_flush(tc.transport);
+
+    // Let the socket buffers fill up
+    usleep(200000);
+
+    for (i = 0; i < num_streams; i++) {
+        expected = states[i].stop ? LWPB_RPC_FAILED : LWPB_RPC_OK;
+        result = lwpb_client_wait(&tc.client, &calls[i]);
+        if (result != expected || !states[i].ordered ||
+            states[i].received != (states[i].stop ? states[i].stop : count)) {
+            LWPB_DIAG_PRINTF("stream %d: result = %d, received = %d, "
+                             "ordered = %d\n", i, result, states[i].received,
+                             states[i].ordered);
+            failed = 1;
+        }
+    }
+
+    // An empty stream ends right away
+    states[0].count = 0;
+    states[0].received = 0;
+    lwpb_client_call_init(&calls[0], stream_request_handler,
+                          stream_response_handler, NULL, &states[0]);
+    lwpb_client_call_async(&tc.client, test_Search_search_by_name, &calls[0]);
+    if (lwpb_client_wait(&tc.client, &calls[0]) != LWPB_RPC_OK ||
+        states[0].received != 0)
+        failed = 1;
+
+    close_test_client(&tc);
+
+    return failed;
+}
+
+/**
+ * Adds the descriptor of a transport to a poll set.
+ * @param pfd Poll set entry
+ * @param fd Descriptor of the transport
+ * @param events Events of the transport to wait for
+ */
+static void poll_transport(struct pollfd *pfd, int fd, unsigned int events)
+{
+    pfd->fd = fd;
+    pfd->events = 0;
+    pfd->revents = 0;
+    if (events & LWPB_TRANSPORT_SOCKET_READABLE)
+        pfd->events |= POLLIN;
+    if (events & LWPB_TRANSPORT_SOCKET_WRITABLE)
+        pfd->events |= POLLOUT;
+}
+
+/**
+ * Returns the events of the transport a descriptor is ready for.
+ * @param pfd Poll set entry
+ * @return Returns the ready events.
+ */
+static unsigned int ready_events(struct pollfd *pfd)
+{
+    unsigned int events = 0;
+
+    if (pfd->revents & (POLLIN | POLLHUP | POLLERR))
+        events |= LWPB_TRANSPORT_SOCKET_READABLE;
+    if (pfd->revents & POLLOUT)
+        events |= LWPB_TRANSPORT_SOCKET_WRITABLE;
+
+    return events;
+}
+
+/**
+ * Runs a server and its clients in this process, driven by a single poll()
+ * loop of the application instead of the update functions.
+ * @param num_workers Number of server worker threads (0 = inline)
+ * @param num_clients Number of clients
+ * @return Returns 0 if all calls succeeded.
+ */
+static int run_loop_test(int num_workers, int num_clients)
+{
+    static struct lwpb_transport_socket_client socket_clients[NUM_CLIENTS];
+    static struct lwpb_client clients[NUM_CLIENTS];
+    static struct client_state states[NUM_CLIENTS];
+    struct lwpb_transport_socket_server socket_server;
+    struct lwpb_server server;
+    lwpb_transport_t server_transport;
+    lwpb_transport_t transport;
+    struct pollfd pfds[NUM_CLIENTS + 1];
+    unsigned int events;
+    time_t start;
+    int timeout;
+    int t;
+    int done;
+    int calls = 0;
+    int failed = 0;
+    int i, j;
+
+    LWPB_DIAG_PRINTF("running event loop with %d workers, %d clients, "
+                     "%d calls\n", num_workers, num_clients, num_calls);
+
+    server_transport = lwpb_transport_socket_server_init(&socket_server);
+    lwpb_server_init(&server, service_list, server_transport);
+    lwpb_server_handler(&server, server_request_handler);
+    lwpb_transport_socket_server_workers(server_transport, num_workers, 0);
+    lwpb_transport_socket_server_options(server_transport, socket_options);
+    if (lwpb_transport_socket_server_open(server_transport, "127.0.0.1", 0) !=
+        LWPB_ERR_OK)
+        return 1;
+
+    for (i = 0; i < num_clients; i++) {
+        LWPB_MEMSET(&states[i], 0, sizeof(states[i]));
+        states[i].id = i * num_calls;
+        transport = lwpb_transport_socket_client_init(&socket_clients[i]);
+        lwpb_client_init(&clients[i], transport);
+        lwpb_client_arg(&clients[i], &states[i]);
+        lwpb_client_handler(&clients[i],
+                            client_request_handler,
+                            client_response_handler,
+                            client_call_done_handler);
+        lwpb_transport_socket_client_options(transport, socket_options);
+        if (lwpb_transport_socket_client_open(transport, "127.0.0.1",
+                lwpb_transport_socket_server_port(server_transport)) !=
+            LWPB_ERR_OK)
+            return 1;
+    }
+
+    start = time(NULL);
+    do {
+        // Pipeline all calls of a client once it is connected
+        for (i = 0; i < num_clients; i++) {
+            if (!states[i].calls && socket_clients[i].version == 2) {
+                for (j = 0; j < num_calls; j++)
+                    lwpb_client_call(&clients[i], test_Search_search_by_name);
+                calls += num_calls;
+            }
+        }
+
+        // Wait for the descriptors and the earliest deadline
+        poll_transport(&pfds[0], lwpb_transport_socket_server_fd(server_transport,
+                                                                 &events),
+                       events);
+        timeout = lwpb_transport_socket_server_timeout(server_transport);
+        for (i = 0; i < num_clients; i++) {
+            poll_transport(&pfds[i + 1],
+                           lwpb_transport_socket_client_fd(clients[i].transport,
+                                                           &events),
+                           events);
+            t = lwpb_transport_socket_client_timeout(clients[i].transport);
+            if (t >= 0 && (timeout < 0 || t < timeout))
+                timeout = t;
+        }
+        if (timeout < 0 || timeout > 1000)
+            timeout = 1000;
+        if (poll(pfds, num_clients + 1, timeout) < 0)
+            return 1;
+
+        lwpb_transport_socket_server_process(server_transport,
+                                             ready_events(&pfds[0]));
+        done = 0;
+        for (i = 0; i < num_clients; i++) {
+            lwpb_transport_socket_client_process(clients[i].transport,
+                                                 ready_events(&pfds[i + 1]));
+            done += states[i].done;
+        }
+    } while ((calls < num_clients * num_calls || done < calls) &&
+             time(NULL) - start < 10);
+
+    for (i = 0; i < num_clients; i++) {
+        if (states[i].done != num_calls || states[i].result != LWPB_RPC_OK ||
+            states[i].seen != (u32_t) ((1ULL << num_calls) - 1)) {
+            LWPB_DIAG_PRINTF("client %d: done = %d, result = %d, seen = %08x\n",
+                             i, states[i].done, states[i].result, states[i].seen);
+            failed = 1;
+        }
+        lwpb_transport_socket_client_close(clients[i].transport);
+    }
+    lwpb_transport_socket_server_close(server_transport);
+    LWPB_DIAG_PRINTF("%d calls done\n", done);
+
+    return failed;
+}
+
+int main()
+{
+    num_calls = 1;
+    if (run_test(0, 0, 0, NUM_CLIENTS) != 0)
+        return 1;
+
+    // Slow handlers on a small pool, so the queue fills up and connections
+    // stall until workers complete
+    handler_delay = 2000;
+    if (run_test(0, 4, 4, NUM_CLIENTS) != 0)
+        return 1;
+
+    // Sharded server with one reactor thread per shard
+    handler_delay = 0;
+    if (run_test(4, 0, 0, NUM_CLIENTS) != 0)
+        return 1;
+
+    // Pipelined calls, answered out of order by the worker pool
+    num_calls = 16;
+    handler_delay = -1000;
+    if (run_test(0, 16, 0, 4) != 0)
+        return 1;
+
+    // Pipelined calls, batched and corked on both sides, using v1 headers
+    handler_delay = 0;
+    socket_options = LWPB_TRANSPORT_SOCKET_NODELAY | LWPB_TRANSPORT_SOCKET_BATCH |
+                     LWPB_TRANSPORT_SOCKET_CORK;
+    if (run_test(0, 0, 0, 4) != 0)
+        return 1;
+
+    // Requests larger than the initial receive buffer, handled inline and
+    // handed over to workers
+    socket_options = LWPB_TRANSPORT_SOCKET_DEFAULT_OPTIONS;
+    request_padding = 20000;
+    if (run_test(0, 0, 0, 4) != 0)
+        return 1;
+    if (run_test(0, 4, 0, 4) != 0)
+        return 1;
+
+    // Responses larger than the transport buffers, encoded into a growing
+    // buffer inline and on workers
+    request_padding = 0;
+    response_padding = 20000;
+    if (run_test(0, 0, 0, 4) != 0)
+        return 1;
+    if (run_test(0, 4, 0, 4) != 0)
+        return 1;
+    response_padding = 0;
+
+    // Hundreds of concurrent calls with their own contexts on one client
+    request_padding = 0;
+    if (run_async_test(0, NUM_ASYNC_CALLS, 0) != 0)
+        return 1;
+    if (run_async_test(8, NUM_ASYNC_CALLS, 0) != 0)
+        return 1;
+
+    // Bursts of calls sent in BATCH frames
+    if (run_async_test(0, NUM_ASYNC_CALLS, 1) != 0)
+        return 1;
+    if (run_async_test(8, NUM_ASYNC_CALLS, 1) != 0)
+        return 1;
+
+    // Few requests per connection in the worker pool, rejected or paused
+    handler_delay = 1000;
+    server_limits.max_pending = 2;
+    server_limits.policy = LWPB_TRANSPORT_SOCKET_SERVER_REJECT;
+    if (run_admission_test(4, 100, 2, 99) != 0)
+        return 1;
+    server_limits.policy = LWPB_TRANSPORT_SOCKET_SERVER_PAUSE;
+    if (run_admission_test(4, 100, 100, 100) != 0)
+        return 1;
+
+    // Rate limited to a burst of 10, rejected or paused until the rate
+    // allows more
+    handler_delay = 0;
+    server_limits.max_pending = 0;
+    server_limits.rate = 20;
+    server_limits.burst = 10;
+    server_limits.policy = LWPB_TRANSPORT_SOCKET_SERVER_REJECT;
+    if (run_admission_test(0, 100, 10, 12) != 0)
+        return 1;
+    server_limits.rate = 1000;
+    server_limits.policy = LWPB_TRANSPORT_SOCKET_SERVER_PAUSE;
+    if (run_admission_test(0, 100, 100, 100) != 0)
+        return 1;
+
+    // Responses are batched per update, so reading pauses until they are
+    // written
+    server_limits.rate = 0;
+    server_limits.max_buffered = 256;
+    socket_options |= LWPB_TRANSPORT_SOCKET_BATCH;
+    if (run_admission_test(0, NUM_ASYNC_CALLS, NUM_ASYNC_CALLS, NUM_ASYNC_CALLS) != 0)
+        return 1;
+
+    // Calls queued behind slow calls time out and are dropped by the server
+    LWPB_MEMSET(&server_limits, 0, sizeof(server_limits));
+    socket_options = LWPB_TRANSPORT_SOCKET_DEFAULT_OPTIONS;
+    handler_delay = 10000;
+    if (run_deadline_test(100, 100, 0, 5, 11) != 0)
+        return 1;
+
+    // Cancelled calls are dropped by the server, the others complete
+    if (run_deadline_test(40, 0, 2, 20, 20) != 0)
+        return 1;
+
+    // Failed calls are answered, inline and on the worker pool
+    handler_delay = 0;
+    if (run_failure_test(0, 20) != 0)
+        return 1;
+    if (run_failure_test(2, 20) != 0)
+        return 1;
+
+    // Outstanding calls fail when the server goes away
+    if (run_disconnect_test(5) != 0)
+        return 1;
+
+    // Done handlers closing the client
+    if (run_close_in_done_test(20) != 0)
+        return 1;
+
+    // Stalled connections closing while the worker queue drains
+    if (run_stall_close_test(8, 20) != 0)
+        return 1;
+
+    // Server and clients driven by the event loop of the application
+    handler_delay = 0;
+    num_calls = 16;
+    if (run_loop_test(0, 8) != 0)
+        return 1;
+    if (run_loop_test(4, 8) != 0)
+        return 1;
+
+    // Streams are suspended while the client does not read, inline and on
+    // the worker pool
+    if (run_stream_test(0, 20000, 4) != 0)
+        return 1;
+    if (run_stream_test(4, 20000, 4) != 0)
+        return 1;
+
+    // Clients and servers on io_uring, pipelined, sharded, with large
+    // requests, in batches, paused by admission control and going away
+    socket_options = LWPB_TRANSPORT_SOCKET_DEFAULT_OPTIONS |
+                     LWPB_TRANSPORT_SOCKET_URING;
+    handler_delay = 0;
+    num_calls = 16;
+    if (run_test(0, 0, 0, NUM_CLIENTS) != 0)
+        return 1;
+    if (run_test(4, 0, 0, 4) != 0)
+        return 1;
+    request_padding = 20000;
+    if (run_test(0, 4, 0, 4) != 0)
+        return 1;
+    request_padding = 0;
+    response_padding = 20000;
+    if (run_test(0, 4, 0, 4) != 0)
+        return 1;
+    response_padding = 0;
+    if (run_async_test(8, NUM_ASYNC_CALLS, 1) != 0)
+        return 1;
+    handler_delay = 1000;
+    server_limits.max_pending = 2;
+    server_limits.policy = LWPB_TRANSPORT_SOCKET_SERVER_PAUSE;
+    if (run_admission_test(4, 100, 100, 100) != 0)
+        return 1;
+    LWPB_MEMSET(&server_limits, 0, sizeof(server_limits));
+    handler_delay = 0;
+    if (run_stream_test(4, 20000, 4) != 0)
+        return 1;
+    num_calls = 16;
+    if (run_loop_test(4, 8) != 0)
+        return 1;
+    if (run_disconnect_test(5) != 0)
+        return 1;
+    if (run_close_in_done_test(20) != 0)
+        return 1;
+
+    return 0;
+}
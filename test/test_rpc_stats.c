@@ -0,0 +1,528 @@
+/** @file test_rpc_stats.c
+ *
+ * Tests the per-method RPC server statistics.
+ *
+ * Copyright 2009 Simon Kallweit
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+
+#include <lwpb/lwpb.h>
+#include <lwpb/rpc/direct.h>
+#include <lwpb/rpc/socket_client.h>
+#include <lwpb/rpc/socket_server.h>
+#include <lwpb/rpc/stats.h>
+
+#include "generated/test_rpc_pb2.h"
+
+/** Number of recording threads */
+#define NUM_THREADS 4
+
+/** Number of calls recorded by each thread */
+#define THREAD_CALLS 100000
+
+/** Number of calls through the direct transport */
+#define NUM_CALLS 200000
+
+/** Calls with ids divisible by this fail on the server */
+#define FAIL_EVERY 10
+
+/** Number of calls per round through the socket transport */
+#define SOCKET_CALLS 250
+
+/** Number of measured rounds with and without statistics */
+#define SOCKET_ROUNDS 40
+
+/** Maximum overhead of recording statistics on socket calls (percent) */
+#define MAX_OVERHEAD 5
+
+/** Number of measurements before the overhead counts as too high */
+#define SOCKET_ATTEMPTS 3
+
+/** Socket server run by its own thread */
+struct socket_server {
+    struct lwpb_transport_socket_server socket_server;
+    struct lwpb_server server;
+    lwpb_transport_t transport;
+    pthread_t thread;
+    volatile int stop;
+    int count;
+};
+
+/** Client of a socket server */
+struct socket_client {
+    struct lwpb_transport_socket_client socket_client;
+    struct lwpb_client client;
+    int done;
+};
+
+static const struct lwpb_service_desc *service_list[] = {
+    test_Search, NULL,
+};
+
+static struct lwpb_stats stats;
+
+/**
+ * Checks that a percentile is within the relative error of the histogram.
+ * @param histogram Histogram
+ * @param percentile Percentile
+ * @param expected Exact value at the percentile
+ * @return Returns 0 if the percentile is accurate enough.
+ */
+static int check_percentile(const struct lwpb_histogram *histogram,
+                            double percentile, u64_t expected)
+{
+    u64_t value = lwpb_histogram_percentile(histogram, percentile);
+
+    LWPB_DIAG_PRINTF("p%g = %llu (expected %llu)\n", percentile,
+                     (unsigned long long) value, (unsigned long long) expected);
+
+    return value < expected ||
+           value - expected > expected / LWPB_STATS_SUB_BUCKETS;
+}
+
+/**
+ * Records values 1..100000 and checks the percentiles and merging.
+ * @return Returns 0 if the histogram works as expected.
+ */
+static int test_histogram(void)
+{
+    static struct lwpb_histogram histogram;
+    static struct lwpb_histogram merged;
+    u64_t i;
+    int failed = 0;
+
+    for (i = 1; i <= 100000; i++)
+        lwpb_histogram_record(&histogram, i);
+
+    failed |= histogram.count != 100000 || histogram.max != 100000;
+    failed |= check_percentile(&histogram, 50, 50000);
+    failed |= check_percentile(&histogram, 99, 99000);
+    failed |= check_percentile(&histogram, 100, 100000);
+    failed |= lwpb_histogram_percentile(&histogram, 0) != 1;
+
+    lwpb_histogram_merge(&merged, &histogram);
+    lwpb_histogram_merge(&merged, &histogram);
+    failed |= merged.count != 200000 || merged.sum != 2 * histogram.sum;
+    failed |= check_percentile(&merged, 50, 50000);
+
+    return failed;
+}
+
+static void *record_thread(void *arg)
+{
+    int i;
+
+    for (i = 0; i < THREAD_CALLS; i++)
+        lwpb_stats_record_call(&stats, test_Search_search_by_name,
+                               i % FAIL_EVERY == 0, 10, 20, i % 100, i % 1000);
+
+    return NULL;
+}
+
+/**
+ * Records calls on several threads while taking snapshots.
+ * @return Returns 0 if no calls were lost.
+ */
+static int test_threads(void)
+{
+    static struct lwpb_method_stats snapshot;
+    pthread_t threads[NUM_THREADS];
+    u64_t last = 0;
+    int failed = 0;
+    int i;
+
+    if (lwpb_stats_init(&stats, service_list) != LWPB_ERR_OK)
+        return 1;
+
+    for (i = 0; i < NUM_THREADS; i++)
+        pthread_create(&threads[i], NULL, record_thread, NULL);
+
+    // Snapshots never go backwards while threads are recording
+    for (i = 0; i < 100; i++) {
+        lwpb_stats_snapshot(&stats, &snapshot);
+        if (snapshot.calls < last)
+            failed = 1;
+        last = snapshot.calls;
+    }
+
+    for (i = 0; i < NUM_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    lwpb_stats_snapshot(&stats, &snapshot);
+    LWPB_DIAG_PRINTF("threads: calls = %llu, errors = %llu, handler max = %llu\n",
+                     (unsigned long long) snapshot.calls,
+                     (unsigned long long) snapshot.errors,
+                     (unsigned long long) snapshot.handler.max);
+    failed |= snapshot.calls != NUM_THREADS * THREAD_CALLS;
+    failed |= snapshot.errors != NUM_THREADS * THREAD_CALLS / FAIL_EVERY;
+    failed |= snapshot.req_bytes != 10ULL * NUM_THREADS * THREAD_CALLS;
+    failed |= snapshot.res_bytes != 20ULL * NUM_THREADS * THREAD_CALLS;
+    failed |= snapshot.queue.count != NUM_THREADS * THREAD_CALLS;
+    failed |= snapshot.queue.max != 99 || snapshot.handler.max != 999;
+    failed |= snapshot.send.count != 0;
+
+    lwpb_stats_destroy(&stats);
+
+    return failed;
+}
+
+// Server handler
+
+static lwpb_err_t server_request_handler(
+    struct lwpb_server *server, const struct lwpb_method_desc *method_desc,
+    const struct lwpb_msg_desc *req_desc, void *req_buf, size_t req_len,
+    const struct lwpb_msg_desc *res_desc, void *res_buf, size_t *res_len,
+    void *arg)
+{
+    struct lwpb_encoder encoder;
+    int *count = arg;
+
+    if ((*count)++ % FAIL_EVERY == 0)
+        return LWPB_ERR_INVALID_FIELD;
+
+    lwpb_encoder_init(&encoder);
+    lwpb_encoder_start(&encoder, res_desc, res_buf, *res_len);
+    lwpb_encoder_nested_start(&encoder, test_LookupResult_person);
+    lwpb_encoder_add_string(&encoder, test_Person_name, "Simon Kallweit");
+    lwpb_encoder_add_int32(&encoder, test_Person_id, 1);
+    lwpb_encoder_nested_end(&encoder);
+    *res_len = lwpb_encoder_finish(&encoder);
+
+    return LWPB_ERR_OK;
+}
+
+/**
+ * Runs calls through the direct transport.
+ * @param transport Direct transport
+ * @param req_buf Request message
+ * @param req_len Length of request message
+ * @return Returns the time taken for the calls (ns).
+ */
+static u64_t run_calls(lwpb_transport_t transport, void *req_buf, size_t req_len)
+{
+    u8_t res_buf[256];
+    size_t res_len;
+    u64_t start;
+    int i;
+
+    start = lwpb_stats_now();
+    for (i = 0; i < NUM_CALLS; i++) {
+        res_len = sizeof(res_buf);
+        lwpb_transport_direct_invoke(transport, test_Search_search_by_name,
+                                     req_buf, req_len, res_buf, &res_len);
+    }
+
+    return lwpb_stats_now() - start;
+}
+
+/**
+ * Records calls of a server on the direct transport and compares the time
+ * taken with recording disabled.
+ * @return Returns 0 if all calls were recorded.
+ */
+static int test_server(void)
+{
+    static struct lwpb_method_stats snapshot;
+    static struct lwpb_method_stats merged;
+    struct lwpb_transport_direct transport_direct;
+    struct lwpb_server server;
+    struct lwpb_encoder encoder;
+    lwpb_transport_t transport;
+    u8_t req_buf[64];
+    size_t req_len;
+    u64_t time_off;
+    u64_t time_on;
+    int count = 0;
+    int failed = 0;
+
+    lwpb_encoder_init(&encoder);
+    lwpb_encoder_start(&encoder, test_Name, req_buf, sizeof(req_buf));
+    lwpb_encoder_add_string(&encoder, test_Name_name, "Simon Kallweit");
+    req_len = lwpb_encoder_finish(&encoder);
+
+    transport = lwpb_transport_direct_init(&transport_direct);
+    lwpb_server_init(&server, service_list, transport);
+    lwpb_server_handler(&server, server_request_handler);
+    lwpb_server_arg(&server, &count);
+
+    if (lwpb_stats_init(&stats, service_list) != LWPB_ERR_OK)
+        return 1;
+
+    time_off = run_calls(transport, req_buf, req_len);
+    lwpb_server_stats(&server, &stats);
+    time_on = run_calls(transport, req_buf, req_len);
+    LWPB_DIAG_PRINTF("%d calls: %llu ns without stats, %llu ns with stats\n",
+                     NUM_CALLS, (unsigned long long) time_off,
+                     (unsigned long long) time_on);
+
+    lwpb_stats_snapshot(&stats, &snapshot);
+    LWPB_DIAG_PRINTF("server: calls = %llu, errors = %llu, req_bytes = %llu, "
+                     "res_bytes = %llu, handler p50 = %llu ns, p99 = %llu ns\n",
+                     (unsigned long long) snapshot.calls,
+                     (unsigned long long) snapshot.errors,
+                     (unsigned long long) snapshot.req_bytes,
+                     (unsigned long long) snapshot.res_bytes,
+                     (unsigned long long) lwpb_histogram_percentile(&snapshot.handler, 50),
+                     (unsigned long long) lwpb_histogram_percentile(&snapshot.handler, 99));
+    failed |= snapshot.calls != NUM_CALLS;
+    failed |= snapshot.errors != NUM_CALLS / FAIL_EVERY;
+    failed |= snapshot.req_bytes != (u64_t) NUM_CALLS * req_len;
+    failed |= snapshot.res_bytes == 0;
+    failed |= snapshot.handler.count != NUM_CALLS;
+
+    // Merging two snapshots doubles the counts
+    lwpb_stats_merge(&merged, &snapshot, stats.num_methods);
+    lwpb_stats_merge(&merged, &snapshot, stats.num_methods);
+    failed |= merged.calls != 2 * snapshot.calls;
+    failed |= merged.handler.count != 2 * snapshot.handler.count;
+
+    lwpb_server_stats(&server, NULL);
+    lwpb_stats_destroy(&stats);
+    lwpb_transport_direct_free(transport);
+
+    return failed;
+}
+
+/**
+ * Thread updating a socket server until it is stopped.
+ * @param arg Socket server
+ * @return Returns NULL.
+ */
+static void *server_thread(void *arg)
+{
+    struct socket_server *ss = arg;
+
+    while (!ss->stop)
+        lwpb_transport_socket_server_update(ss->transport);
+
+    return NULL;
+}
+
+static lwpb_err_t client_request_handler(
+    struct lwpb_client *client, const struct lwpb_method_desc *method_desc,
+    const struct lwpb_msg_desc *msg_desc, void *buf, size_t *len, void *arg)
+{
+    struct lwpb_encoder encoder;
+
+    lwpb_encoder_init(&encoder);
+    lwpb_encoder_start(&encoder, msg_desc, buf, *len);
+    lwpb_encoder_add_string(&encoder, test_Name_name, "Simon Kallweit");
+    *len = lwpb_encoder_finish(&encoder);
+
+    return LWPB_ERR_OK;
+}
+
+static lwpb_err_t client_response_handler(
+    struct lwpb_client *client, const struct lwpb_method_desc *method_desc,
+    const struct lwpb_msg_desc *msg_desc, void *buf, size_t len, void *arg)
+{
+    return LWPB_ERR_OK;
+}
+
+static void client_call_done_handler(
+    struct lwpb_client *client, const struct lwpb_method_desc *method_desc,
+    lwpb_rpc_result_t result, void *arg)
+{
+    struct socket_client *sc = arg;
+
+    if (result == LWPB_RPC_OK || result == LWPB_RPC_FAILED)
+        sc->done++;
+}
+
+/**
+ * Starts a socket server on its own thread and connects a client to it.
+ * @param ss Socket server
+ * @param sc Client
+ * @return Returns 0 if the client is connected.
+ */
+static int start_socket_server(struct socket_server *ss,
+                               struct socket_client *sc)
+{
+    lwpb_transport_t transport;
+    u64_t start;
+
+    ss->transport = lwpb_transport_socket_server_init(&ss->socket_server);
+    lwpb_server_init(&ss->server, service_list, ss->transport);
+    lwpb_server_handler(&ss->server, server_request_handler);
+    lwpb_server_arg(&ss->server, &ss->count);
+    if (lwpb_transport_socket_server_open(ss->transport, "127.0.0.1", 0) !=
+        LWPB_ERR_OK)
+        return 1;
+    ss->stop = 0;
+    if (pthread_create(&ss->thread, NULL, server_thread, ss) != 0)
+        return 1;
+
+    transport = lwpb_transport_socket_client_init(&sc->socket_client);
+    lwpb_client_init(&sc->client, transport);
+    lwpb_client_arg(&sc->client, sc);
+    lwpb_client_handler(&sc->client, client_request_handler,
+                        client_response_handler, client_call_done_handler);
+    lwpb_client_timeout(&sc->client, 2000);
+    if (lwpb_transport_socket_client_open(transport, "127.0.0.1",
+            lwpb_transport_socket_server_port(ss->transport)) != LWPB_ERR_OK)
+        return 1;
+
+    // Wait for the HELLO exchange, so calls use the binary v2 header
+    start = lwpb_stats_now();
+    while (sc->socket_client.version != 2 &&
+           lwpb_stats_now() - start < 2000000000ULL)
+        lwpb_transport_socket_client_update(transport);
+
+    return sc->socket_client.version != 2;
+}
+
+/**
+ * Disconnects the client and stops the server thread.
+ * @param ss Socket server
+ * @param sc Client
+ */
+static void stop_socket_server(struct socket_server *ss,
+                               struct socket_client *sc)
+{
+    // Closing the connection wakes up the server thread
+    ss->stop = 1;
+    lwpb_transport_socket_client_close(sc->client.transport);
+    pthread_join(ss->thread, NULL);
+    lwpb_transport_socket_server_close(ss->transport);
+}
+
+/**
+ * Runs calls one after the other through a socket client.
+ * @param sc Client
+ * @return Returns the time taken for the calls (ns) or 0 if a call did not
+ * complete.
+ */
+static u64_t run_socket_calls(struct socket_client *sc)
+{
+    u64_t start;
+    int i;
+
+    sc->done = 0;
+    start = lwpb_stats_now();
+    for (i = 0; i < SOCKET_CALLS; i++) {
+        lwpb_client_call(&sc->client, test_Search_search_by_name);
+        lwpb_client_wait(&sc->client, &sc->client.call);
+    }
+
+    return sc->done == SOCKET_CALLS ? lwpb_stats_now() - start : 0;
+}
+
+/**
+ * Measures calls through the socket transport with and without statistics.
+ * Rounds alternate between both and the fastest round of each counts, so the
+ * comparison is not skewed by other load on the machine. Calls are made one
+ * after the other, so the server thread is idle while recording is switched
+ * between rounds.
+ * @param ss Socket server
+ * @param sc Client
+ * @param time_off Returns the time of the fastest round without statistics
+ * @param time_on Returns the time of the fastest round with statistics
+ * @return Returns 0 if all calls completed.
+ */
+static int measure_socket(struct socket_server *ss, struct socket_client *sc,
+                          u64_t *time_off, u64_t *time_on)
+{
+    u64_t t;
+    int i;
+
+    *time_off = 0;
+    *time_on = 0;
+    for (i = 0; i < SOCKET_ROUNDS; i++) {
+        lwpb_server_stats(&ss->server, NULL);
+        t = run_socket_calls(sc);
+        if (t == 0)
+            return 1;
+        if (*time_off == 0 || t < *time_off)
+            *time_off = t;
+        lwpb_server_stats(&ss->server, &stats);
+        t = run_socket_calls(sc);
+        if (t == 0)
+            return 1;
+        if (*time_on == 0 || t < *time_on)
+            *time_on = t;
+    }
+
+    return 0;
+}
+
+/**
+ * Checks that recording statistics adds less than MAX_OVERHEAD to calls
+ * through the socket transport. Timing on a loaded machine is noisy, so the
+ * measurement is repeated before the overhead counts as too high.
+ * @return Returns 0 if the overhead is low enough and all calls were
+ * recorded.
+ */
+static int test_socket(void)
+{
+    static struct socket_server ss;
+    static struct socket_client sc;
+    static struct lwpb_method_stats snapshot;
+    u64_t time_off;
+    u64_t time_on;
+    int attempts = 0;
+    int failed = 0;
+
+    if (lwpb_stats_init(&stats, service_list) != LWPB_ERR_OK)
+        return 1;
+    if (start_socket_server(&ss, &sc) != 0)
+        return 1;
+
+    // The first round warms up the connection and is not measured
+    if (run_socket_calls(&sc) == 0)
+        failed = 1;
+
+    do {
+        failed |= measure_socket(&ss, &sc, &time_off, &time_on);
+        attempts++;
+        LWPB_DIAG_PRINTF("socket: %d calls: %llu ns without stats, %llu ns "
+                         "with stats (%+.1f%%)\n", SOCKET_CALLS,
+                         (unsigned long long) time_off,
+                         (unsigned long long) time_on, time_off ?
+                         (time_on - (double) time_off) * 100 / time_off : 0);
+    } while (!failed && attempts < SOCKET_ATTEMPTS &&
+             time_on > time_off + time_off * MAX_OVERHEAD / 100);
+
+    stop_socket_server(&ss, &sc);
+    if (failed)
+        return 1;
+
+    failed |= time_on > time_off + time_off * MAX_OVERHEAD / 100;
+
+    lwpb_stats_snapshot(&stats, &snapshot);
+    failed |= snapshot.calls != (u64_t) attempts * SOCKET_ROUNDS * SOCKET_CALLS;
+    failed |= snapshot.send.count != snapshot.calls - snapshot.errors;
+
+    lwpb_stats_destroy(&stats);
+
+    return failed;
+}
+
+int main()
+{
+    if (test_histogram() != 0)
+        return 1;
+
+    if (test_threads() != 0)
+        return 1;
+
+    if (test_server() != 0)
+        return 1;
+
+    if (test_socket() != 0)
+        return 1;
+
+    return 0;
+}
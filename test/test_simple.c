@@ -21,6 +21,22 @@
 
 #include "generated/test_simple_pb2.h"
 
+static lwpb_decoder_action_t stop_field_handler(struct lwpb_decoder *decoder,
+                                                const struct lwpb_msg_desc *msg_desc,
+                                                const struct lwpb_field_desc *field_desc,
+                                                union lwpb_value *value, void *arg)
+{
+    int *fields = arg;
+    
+    (*fields)++;
+    
+    // Skip the first phone number, stop at the second one
+    if (field_desc == test_Person_phone)
+        return *fields < 5 ? LWPB_DECODER_SKIP : LWPB_DECODER_STOP;
+    
+    return LWPB_DECODER_CONTINUE;
+}
+
 int main()
 {
     char buf[4096];
@@ -29,6 +45,12 @@ int main()
     
     struct lwpb_decoder decoder;
     struct lwpb_encoder encoder;
+    struct lwpb_reader reader;
+    const struct lwpb_field_desc *field_desc;
+    union lwpb_value value;
+    int phones = 0;
+    int types = 0;
+    int fields = 0;
     
     lwpb_encoder_init(&encoder);
     lwpb_encoder_start(&encoder, test_Person, buf, sizeof(buf));
@@ -57,5 +79,43 @@ int main()
     
     LWPB_DIAG_PRINTF("ret = %d\n", ret);
     
+    // Decode only up to the second phone number
+    lwpb_decoder_init(&decoder);
+    lwpb_decoder_arg(&decoder, &fields);
+    lwpb_decoder_field_handler(&decoder, stop_field_handler);
+    ret = lwpb_decoder_decode(&decoder, test_Person, &buf, len, NULL);
+    
+    LWPB_DIAG_PRINTF("stopped: ret = %d, fields = %d\n", ret, fields);
+    
+    if (ret != LWPB_ERR_CANCEL || fields != 5)
+        return 1;
+    
+    // Read the same message with the pull reader
+    lwpb_reader_init(&reader, test_Person, buf, len);
+    while ((ret = lwpb_reader_next(&reader, &field_desc, &value)) == LWPB_ERR_OK) {
+        if (!field_desc)
+            break;
+        if (field_desc == test_Person_id)
+            LWPB_DIAG_PRINTF("reader: id = %d\n", value.int32);
+        if (field_desc == test_Person_phone) {
+            phones++;
+            // Read the type of every phone number, skip the rest
+            lwpb_reader_enter(&reader);
+            while (lwpb_reader_next(&reader, &field_desc, &value) == LWPB_ERR_OK && field_desc) {
+                if (field_desc == test_PhoneNumber_type) {
+                    LWPB_DIAG_PRINTF("reader: phone type = %d\n", value.enum_);
+                    types += value.enum_;
+                    lwpb_reader_skip(&reader);
+                }
+            }
+        }
+    }
+    
+    LWPB_DIAG_PRINTF("reader: ret = %d, phones = %d\n", ret, phones);
+    
+    if (ret != LWPB_ERR_OK || phones != 3 ||
+        types != TEST_PHONENUMBER_MOBILE + TEST_PHONENUMBER_HOME + TEST_PHONENUMBER_WORK)
+        return 1;
+    
     return 0;
 }
@@ -61,6 +61,28 @@ LWPB_STRUCT_MAP_MESSAGE(test_StructTest_nested1, struct test_struct, nested1, &t
 LWPB_STRUCT_MAP_MESSAGE(test_StructTest_nested2, struct test_struct, nested2, &test_struct_nested2_map, 8)
 LWPB_STRUCT_MAP_END
 
+struct test_struct_view {
+    struct lwpb_string_view field_string;
+    struct lwpb_bytes_view field_bytes;
+};
+
+LWPB_STRUCT_MAP_BEGIN(test_struct_view_map, test_StructTest, struct test_struct_view)
+LWPB_STRUCT_MAP_STRING_VIEW(test_StructTest_field_string, struct test_struct_view, field_string, 1)
+LWPB_STRUCT_MAP_BYTES_VIEW(test_StructTest_field_bytes, struct test_struct_view, field_bytes, 1)
+LWPB_STRUCT_MAP_END
+
+struct test_struct_lazy {
+    s32_t field_int32;
+    struct lwpb_struct_lazy nested1;
+    struct lwpb_struct_lazy nested2[8];
+};
+
+LWPB_STRUCT_MAP_BEGIN(test_struct_lazy_map, test_StructTest, struct test_struct_lazy)
+LWPB_STRUCT_MAP_INT32(test_StructTest_field_int32, struct test_struct_lazy, field_int32, 1)
+LWPB_STRUCT_MAP_MESSAGE_LAZY(test_StructTest_nested1, struct test_struct_lazy, nested1, &test_struct_nested1_map, 1)
+LWPB_STRUCT_MAP_MESSAGE_LAZY(test_StructTest_nested2, struct test_struct_lazy, nested2, &test_struct_nested2_map, 8)
+LWPB_STRUCT_MAP_END
+
 
 
 void print_buf(u8_t *buf, size_t len)
@@ -85,6 +107,12 @@ int main()
     lwpb_err_t ret;
     u8_t bytes[] = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07 };
     struct test_struct test_struct_instance;
+    struct test_struct_view test_struct_view_instance;
+    struct test_struct_lazy test_struct_lazy_instance;
+    struct test_struct_nested1 *nested1;
+    struct test_struct_nested2 *nested2;
+    u8_t arena_buf[256];
+    struct lwpb_arena arena;
     int i;
     
     struct lwpb_encoder encoder;
@@ -136,5 +164,71 @@ int main()
     for (i = 0; i < 8; i++)
         LWPB_DIAG_PRINTF("test_struct.nested2[%d].field_string = '%s'\n", i, test_struct_instance.nested2[i].field_string);
     
+    // Decode string and bytes fields as views into the buffer
+    lwpb_struct_decoder_init(&sdecoder);
+    ret = lwpb_struct_decoder_decode(&sdecoder, &test_struct_view_map, &test_struct_view_instance, buf, len, NULL);
+    
+    LWPB_DIAG_PRINTF("ret = %d\n", ret);
+    
+    LWPB_DIAG_PRINTF("test_struct_view.field_string = '%.*s'\n",
+                     (int) test_struct_view_instance.field_string.len,
+                     test_struct_view_instance.field_string.str);
+    LWPB_DIAG_PRINTF("test_struct_view.field_bytes = ");
+    print_buf((u8_t *) test_struct_view_instance.field_bytes.data, test_struct_view_instance.field_bytes.len);
+    LWPB_DIAG_PRINTF("\n");
+    
+    if (ret != LWPB_ERR_OK ||
+        test_struct_view_instance.field_string.len != 14 ||
+        memcmp(test_struct_view_instance.field_string.str, "this is a test", 14) != 0 ||
+        test_struct_view_instance.field_bytes.len != sizeof(bytes) ||
+        memcmp(test_struct_view_instance.field_bytes.data, bytes, sizeof(bytes)) != 0 ||
+        (char *) test_struct_view_instance.field_string.str < buf ||
+        (char *) test_struct_view_instance.field_string.str >= buf + len)
+        return 1;
+    
+    // Decode nested messages lazily
+    lwpb_struct_decoder_init(&sdecoder);
+    ret = lwpb_struct_decoder_decode(&sdecoder, &test_struct_lazy_map, &test_struct_lazy_instance, buf, len, NULL);
+    
+    LWPB_DIAG_PRINTF("ret = %d\n", ret);
+    
+    lwpb_arena_init(&arena, arena_buf, sizeof(arena_buf));
+    
+    if (ret != LWPB_ERR_OK ||
+        test_struct_lazy_instance.field_int32 != 12345 ||
+        test_struct_lazy_instance.nested1.value != NULL)
+        return 1;
+    
+    ret = lwpb_struct_lazy_get(&test_struct_lazy_instance.nested1, &arena, (void **) &nested1);
+    LWPB_DIAG_PRINTF("test_struct_lazy.nested1.field_int32 = %d\n", nested1->field_int32);
+    LWPB_DIAG_PRINTF("test_struct_lazy.nested1.field_int64 = %lld\n", nested1->field_int64);
+    if (ret != LWPB_ERR_OK || nested1->field_int32 != 123456 ||
+        nested1->field_int64 != 987654321)
+        return 1;
+    
+    ret = lwpb_struct_lazy_get(&test_struct_lazy_instance.nested2[5], &arena, (void **) &nested2);
+    LWPB_DIAG_PRINTF("test_struct_lazy.nested2[5].field_string = '%s'\n", nested2->field_string);
+    if (ret != LWPB_ERR_OK || strcmp(nested2->field_string, "test string 5") != 0 ||
+        test_struct_lazy_instance.nested2[4].value != NULL)
+        return 1;
+    
+    // Lazy submessages missing from the input decode to NULL
+    lwpb_encoder_init(&encoder);
+    lwpb_encoder_start(&encoder, test_StructTest, buf, sizeof(buf));
+    lwpb_encoder_add_int32(&encoder, test_StructTest_field_int32, 54321);
+    len = lwpb_encoder_finish(&encoder);
+    
+    LWPB_MEMSET(&test_struct_lazy_instance, 0, sizeof(test_struct_lazy_instance));
+    lwpb_struct_decoder_init(&sdecoder);
+    ret = lwpb_struct_decoder_decode(&sdecoder, &test_struct_lazy_map, &test_struct_lazy_instance, buf, len, NULL);
+    if (ret != LWPB_ERR_OK || test_struct_lazy_instance.field_int32 != 54321)
+        return 1;
+    
+    nested1 = (struct test_struct_nested1 *) buf;
+    ret = lwpb_struct_lazy_get(&test_struct_lazy_instance.nested1, &arena, (void **) &nested1);
+    LWPB_DIAG_PRINTF("missing test_struct_lazy.nested1 = %p\n", (void *) nested1);
+    if (ret != LWPB_ERR_OK || nested1 != NULL)
+        return 1;
+    
     return 0;
 }